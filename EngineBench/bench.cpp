@@ -0,0 +1,552 @@
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <random>
+#include <cstdlib>
+
+// Plugins for OpenGL Mathematics
+// Allows us to use mathematical transformations into our engine for any object
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+
+#include "bounds.h"
+#include "frustum_culling.h"
+#include "bvh.h"
+#include "loose_octree.h"
+#include "occlusion_culling.h"
+#include "thread_pool.h"
+
+using namespace std;
+using namespace glm;
+
+// Benchmarks of the engine's CPU side systems, the ones that run without a window or a GL context.
+//
+//     EngineBench [options]
+//
+//     --objects N  objects culled per frame, default 1000000, also the most the octree goes up to
+//     --frames N   frames every measurement averages over, default 100
+//     --threads N  worker threads, 0 (default) is one per hardware thread
+//
+// Frustum culling: the objects are spread over a cube around the camera, which turns a little every
+// frame. Spheres and boxes go through every SIMD path on one thread and on the pool, the results are
+// checked against the scalar single threaded ones.
+//
+// BVH: the same boxes in a BVH, built on one thread and on the pool, refitted with a tenth of them
+// moving every frame, and queried for the frustum, rays and box overlaps next to going through all
+// the objects.
+//
+// Loose octree: 10k, 100k and 1M spheres that all move every frame, updated and queried for the
+// frustum and for radii in the octree next to rewriting and going through all the spheres.
+//
+// Occlusion culling: the camera stands in a street of a city of box buildings. The buildings are
+// rasterized as occluders on every path and the objects in the frustum tested against them. Every
+// tenth frame the results are checked against a buffer 8 times the size, and the scalar and AVX2 depth
+// buffers against each other. An object culled that the bigger buffer sees makes the exit code 1.
+
+struct BenchOptions {
+	size_t objects = 1000000;
+	int frames = 100;
+	unsigned int threads = 0;
+};
+
+// half the side of the cube the objects are spread over, the far plane is at the same distance
+const float SCENE_EXTENT = 200.0f;
+
+static double elapsedMs(chrono::high_resolution_clock::time_point start) {
+	return chrono::duration<double, milli>(chrono::high_resolution_clock::now() - start).count();
+}
+
+static const char* simdName(CullSimd simd) {
+	return simd == CULL_SIMD_AVX2 ? "avx2" : "scalar";
+}
+
+// the view of frame i from height above the origin, a full turn over 360 frames
+static mat4 frameViewProjection(int frame, float height = 0.0f) {
+	float yaw = radians((float)frame);
+	vec3 eye(0.0f, height, 0.0f), front(cos(yaw), 0.0f, sin(yaw));
+	mat4 projection = perspective(radians(45.0f), 16.0f / 9.0f, 0.1f, SCENE_EXTENT);
+	return projection * lookAt(eye, eye + front, vec3(0.0f, 1.0f, 0.0f));
+}
+
+static Frustum frameFrustum(int frame) {
+	return ExtractFrustum(frameViewProjection(frame));
+}
+
+// times cull(frustum, visible) over the frames, checking every frame's count against expected
+template <typename Cull>
+static void benchCull(const char* bounds, const char* path, size_t objects, const BenchOptions& options,
+	const vector<size_t>& expected, const Cull& cull) {
+	vector<unsigned int> visible(objects);
+	size_t total = 0, mismatches = 0;
+	double ms = 0.0;
+	for (int frame = 0; frame < options.frames; frame++) {
+		Frustum frustum = frameFrustum(frame);
+		auto start = chrono::high_resolution_clock::now();
+		size_t count = cull(frustum, visible.data());
+		ms += elapsedMs(start);
+		total += count;
+		if (!expected.empty() && count != expected[frame])
+			mismatches++;
+	}
+	ms /= options.frames;
+	cout << "  " << left << setw(8) << bounds << setw(18) << path << right << fixed << setprecision(3)
+		<< setw(8) << ms << " ms/frame " << setprecision(1) << setw(8) << objects / ms / 1000.0 << " M objects/s "
+		<< setw(9) << total / options.frames << " visible";
+	if (mismatches)
+		cout << "  (" << mismatches << " frames differ from scalar)";
+	cout << endl;
+}
+
+// the visible count of every frame on the scalar path, what the others have to match
+template <typename Cull>
+static vector<size_t> referenceCounts(size_t objects, const BenchOptions& options, const Cull& cull) {
+	vector<unsigned int> visible(objects);
+	vector<size_t> counts;
+	for (int frame = 0; frame < options.frames; frame++)
+		counts.push_back(cull(frameFrustum(frame), visible.data()));
+	return counts;
+}
+
+// an object somewhere in the scene, 1 to 4 units across
+static BoundingSphere randomSphere(mt19937& random) {
+	uniform_real_distribution<float> position(-SCENE_EXTENT, SCENE_EXTENT), size(0.5f, 2.0f);
+	BoundingSphere sphere;
+	sphere.center = vec3(position(random), position(random), position(random));
+	sphere.radius = size(random);
+	return sphere;
+}
+
+static AABB sphereBox(const BoundingSphere& sphere) {
+	AABB box;
+	box.minimum = sphere.center - vec3(sphere.radius);
+	box.maximum = sphere.center + vec3(sphere.radius);
+	return box;
+}
+
+static void printTime(const char* what, double ms, double perSecond, const char* unit) {
+	cout << "  " << left << setw(26) << what << right << fixed << setprecision(3) << setw(10) << ms << " ms "
+		<< setprecision(0) << setw(12) << perSecond << " " << unit << "/s" << endl;
+}
+
+static void benchFrustumCulling(const BenchOptions& options, ThreadPool& pool) {
+	mt19937 random(1234);
+	CullingSpheres spheres;
+	CullingBoxes boxes;
+	spheres.Resize(options.objects);
+	boxes.Resize(options.objects);
+	for (size_t i = 0; i < options.objects; i++) {
+		BoundingSphere sphere = randomSphere(random);
+		spheres.Set(i, sphere);
+		boxes.Set(i, sphereBox(sphere));
+	}
+
+	cout << "Frustum culling, " << options.objects << " objects, " << pool.Size() + 1 << " threads" << endl;
+	const CullSimd paths[] = { CULL_SIMD_SCALAR, CULL_SIMD_AVX2 };
+	vector<size_t> sphereCounts = referenceCounts(options.objects, options, [&](const Frustum& frustum, unsigned int* visible) {
+		return CullSpheres(frustum, spheres, visible, CULL_SIMD_SCALAR);
+	});
+	vector<size_t> boxCounts = referenceCounts(options.objects, options, [&](const Frustum& frustum, unsigned int* visible) {
+		return CullBoxes(frustum, boxes, visible, CULL_SIMD_SCALAR);
+	});
+	for (CullSimd simd : paths) {
+		if (culling_detail::ResolveSimd(simd) != simd)
+			continue;
+		string single = string(simdName(simd)) + " 1 thread", parallel = string(simdName(simd)) + " pool";
+		benchCull("spheres", single.c_str(), options.objects, options, sphereCounts, [&](const Frustum& frustum, unsigned int* visible) {
+			return CullSpheres(frustum, spheres, visible, simd);
+		});
+		benchCull("spheres", parallel.c_str(), options.objects, options, sphereCounts, [&](const Frustum& frustum, unsigned int* visible) {
+			return CullSpheresParallel(frustum, spheres, visible, pool, simd);
+		});
+		benchCull("boxes", single.c_str(), options.objects, options, boxCounts, [&](const Frustum& frustum, unsigned int* visible) {
+			return CullBoxes(frustum, boxes, visible, simd);
+		});
+		benchCull("boxes", parallel.c_str(), options.objects, options, boxCounts, [&](const Frustum& frustum, unsigned int* visible) {
+			return CullBoxesParallel(frustum, boxes, visible, pool, simd);
+		});
+	}
+}
+
+static void benchBVH(const BenchOptions& options, ThreadPool& pool) {
+	mt19937 random(1234);
+	vector<AABB> boxes(options.objects);
+	CullingBoxes soa;
+	soa.Resize(options.objects);
+	BVH tree;
+	for (size_t i = 0; i < options.objects; i++) {
+		boxes[i] = sphereBox(randomSphere(random));
+		soa.Set(i, boxes[i]);
+		tree.Insert(boxes[i]);
+	}
+	cout << "BVH, " << options.objects << " objects, " << pool.Size() + 1 << " threads" << endl;
+
+	// builds take long, a few are enough
+	int builds = std::min(options.frames, 5);
+	ThreadPool* pools[] = { nullptr, &pool };
+	for (ThreadPool* buildPool : pools) {
+		double ms = 0.0;
+		for (int i = 0; i < builds; i++) {
+			tree.Build(buildPool);
+			ms += tree.stats.buildMs;
+		}
+		ms /= builds;
+		printTime(buildPool ? "build pool" : "build 1 thread", ms, options.objects / ms * 1000.0, "objects");
+	}
+	cout << "  " << tree.stats.nodes << " nodes, cost " << setprecision(1) << tree.stats.cost << endl;
+
+	// a tenth of the objects moves up to a unit a frame
+	uniform_real_distribution<float> step(-1.0f, 1.0f);
+	double refitMs = 0.0;
+	unsigned int buildsBefore = tree.stats.builds;
+	for (int frame = 0; frame < options.frames; frame++) {
+		for (size_t i = frame % 10; i < options.objects; i += 10) {
+			vec3 offset(step(random), step(random), step(random));
+			boxes[i].minimum += offset;
+			boxes[i].maximum += offset;
+			soa.Set(i, boxes[i]);
+		}
+		auto start = chrono::high_resolution_clock::now();
+		for (size_t i = frame % 10; i < options.objects; i += 10)
+			tree.Update((unsigned int)i, boxes[i]);
+		tree.Maintain(&pool);
+		refitMs += elapsedMs(start);
+	}
+	refitMs /= options.frames;
+	printTime("update and refit", refitMs, options.objects / 10 / refitMs * 1000.0, "moved objects");
+	cout << "  " << tree.stats.builds - buildsBefore << " rebuilds over " << options.frames << " frames, cost "
+		<< setprecision(1) << tree.stats.cost << endl;
+
+	double treeMs = 0.0, linearMs = 0.0;
+	size_t mismatches = 0;
+	vector<unsigned int> visible, linear(options.objects);
+	for (int frame = 0; frame < options.frames; frame++) {
+		Frustum frustum = frameFrustum(frame);
+		visible.clear();
+		auto start = chrono::high_resolution_clock::now();
+		size_t count = tree.QueryFrustum(frustum, visible);
+		treeMs += elapsedMs(start);
+		start = chrono::high_resolution_clock::now();
+		mismatches += count != CullBoxes(frustum, soa, linear.data());
+		linearMs += elapsedMs(start);
+	}
+	treeMs /= options.frames;
+	linearMs /= options.frames;
+	printTime("frustum, tree", treeMs, 1000.0 / treeMs, "queries");
+	printTime("frustum, all boxes avx2", linearMs, 1000.0 / linearMs, "queries");
+	if (mismatches)
+		cout << "  " << mismatches << " frames found a different count than going through all boxes" << endl;
+
+	// rays from the camera position in every direction, and boxes of 10 units anywhere in the scene
+	const int QUERIES = 10000, LINEAR_QUERIES = 20;
+	vector<Ray> rays(QUERIES);
+	vector<AABB> regions(QUERIES);
+	uniform_real_distribution<float> direction(-1.0f, 1.0f), position(-SCENE_EXTENT, SCENE_EXTENT);
+	for (int i = 0; i < QUERIES; i++) {
+		rays[i].direction = normalize(vec3(direction(random), direction(random), direction(random)));
+		regions[i].minimum = vec3(position(random), position(random), position(random));
+		regions[i].maximum = regions[i].minimum + vec3(10.0f);
+	}
+	auto start = chrono::high_resolution_clock::now();
+	size_t hits = 0;
+	for (const Ray& ray : rays) {
+		RayHit hit;
+		hits += tree.Raycast(ray, SCENE_EXTENT * 2.0f, hit);
+	}
+	double ms = elapsedMs(start);
+	printTime("rays, tree", ms / QUERIES, QUERIES / ms * 1000.0, "rays");
+	start = chrono::high_resolution_clock::now();
+	size_t linearHits = 0;
+	for (int i = 0; i < LINEAR_QUERIES; i++) {
+		const Ray& ray = rays[i];
+		float closest = SCENE_EXTENT * 2.0f;
+		for (const AABB& box : boxes) {
+			float enter = 0.0f, exit = closest;
+			for (int axis = 0; axis < 3; axis++) {
+				float t0 = (box.minimum[axis] - ray.origin[axis]) / ray.direction[axis];
+				float t1 = (box.maximum[axis] - ray.origin[axis]) / ray.direction[axis];
+				enter = std::max(enter, std::min(t0, t1));
+				exit = std::min(exit, std::max(t0, t1));
+			}
+			if (enter <= exit)
+				closest = enter;
+		}
+		linearHits += closest < SCENE_EXTENT * 2.0f;
+	}
+	ms = elapsedMs(start);
+	printTime("rays, all boxes", ms / LINEAR_QUERIES, LINEAR_QUERIES / ms * 1000.0, "rays");
+	cout << "  " << hits << " of " << QUERIES << " rays hit, " << linearHits << " of the first " << LINEAR_QUERIES << endl;
+
+	start = chrono::high_resolution_clock::now();
+	size_t found = 0;
+	for (const AABB& region : regions) {
+		visible.clear();
+		found += tree.QueryOverlap(region, visible);
+	}
+	ms = elapsedMs(start);
+	printTime("overlaps, tree", ms / QUERIES, QUERIES / ms * 1000.0, "queries");
+	start = chrono::high_resolution_clock::now();
+	size_t linearFound = 0;
+	for (int i = 0; i < LINEAR_QUERIES; i++) {
+		const AABB& region = regions[i];
+		for (const AABB& box : boxes)
+			linearFound += box.minimum.x <= region.maximum.x && box.maximum.x >= region.minimum.x
+				&& box.minimum.y <= region.maximum.y && box.maximum.y >= region.minimum.y
+				&& box.minimum.z <= region.maximum.z && box.maximum.z >= region.minimum.z;
+	}
+	ms = elapsedMs(start);
+	printTime("overlaps, all boxes", ms / LINEAR_QUERIES, LINEAR_QUERIES / ms * 1000.0, "queries");
+	cout << "  " << setprecision(2) << (double)found / QUERIES << " objects per overlap query, "
+		<< (double)linearFound / LINEAR_QUERIES << " over the first " << LINEAR_QUERIES << endl;
+}
+
+// objects of the octree bench bounce around inside the scene at up to a unit per frame
+static void moveSpheres(vector<BoundingSphere>& spheres, vector<vec3>& velocities) {
+	for (size_t i = 0; i < spheres.size(); i++) {
+		vec3& center = spheres[i].center;
+		center += velocities[i];
+		for (int axis = 0; axis < 3; axis++) {
+			if (center[axis] < -SCENE_EXTENT || center[axis] > SCENE_EXTENT) {
+				velocities[i][axis] = -velocities[i][axis];
+				center[axis] = glm::clamp(center[axis], -SCENE_EXTENT, SCENE_EXTENT);
+			}
+		}
+	}
+}
+
+static void benchLooseOctree(size_t objects, const BenchOptions& options, ThreadPool& pool) {
+	mt19937 random(1234);
+	uniform_real_distribution<float> speed(-1.0f, 1.0f);
+	vector<BoundingSphere> spheres(objects);
+	vector<vec3> velocities(objects);
+	vector<unsigned int> ids(objects);
+	CullingSpheres linear;
+	linear.Resize(objects);
+	// the deepest cells are about as wide as the objects
+	LooseOctree tree(vec3(0.0f), SCENE_EXTENT, 6);
+	for (size_t i = 0; i < objects; i++) {
+		spheres[i] = randomSphere(random);
+		velocities[i] = vec3(speed(random), speed(random), speed(random));
+		ids[i] = tree.Insert(spheres[i]);
+	}
+	tree.Commit();
+	cout << "Loose octree, " << objects << " moving objects, " << pool.Size() + 1 << " threads" << endl;
+
+	const int RADIUS_QUERIES = 100;
+	const float RADIUS = 10.0f;
+	uniform_real_distribution<float> position(-SCENE_EXTENT, SCENE_EXTENT);
+	double linearUpdateMs = 0.0, treeUpdateMs = 0.0, linearFrustumMs = 0.0, treeFrustumMs = 0.0;
+	double linearRadiusMs = 0.0, treeRadiusMs = 0.0;
+	size_t cellChanges = 0, mismatches = 0, found = 0;
+	vector<unsigned int> visible(objects), treeVisible;
+	for (int frame = 0; frame < options.frames; frame++) {
+		moveSpheres(spheres, velocities);
+
+		auto start = chrono::high_resolution_clock::now();
+		for (size_t i = 0; i < objects; i++)
+			linear.Set(i, spheres[i]);
+		linearUpdateMs += elapsedMs(start);
+		start = chrono::high_resolution_clock::now();
+		tree.MoveBatch(ids.data(), spheres.data(), objects, &pool);
+		cellChanges += tree.stats.cellChanges;
+		tree.Commit();
+		treeUpdateMs += elapsedMs(start);
+
+		Frustum frustum = frameFrustum(frame);
+		start = chrono::high_resolution_clock::now();
+		size_t count = CullSpheres(frustum, linear, visible.data());
+		linearFrustumMs += elapsedMs(start);
+		treeVisible.clear();
+		start = chrono::high_resolution_clock::now();
+		mismatches += tree.CullFrustum(frustum, treeVisible) != count;
+		treeFrustumMs += elapsedMs(start);
+
+		vec3 centers[RADIUS_QUERIES];
+		for (vec3& center : centers)
+			center = vec3(position(random), position(random), position(random));
+		size_t linearFound = 0;
+		start = chrono::high_resolution_clock::now();
+		for (const vec3& center : centers) {
+			for (size_t i = 0; i < objects; i++) {
+				float dx = linear.x[i] - center.x, dy = linear.y[i] - center.y, dz = linear.z[i] - center.z;
+				float reach = linear.radius[i] + RADIUS;
+				linearFound += dx * dx + dy * dy + dz * dz <= reach * reach;
+			}
+		}
+		linearRadiusMs += elapsedMs(start);
+		size_t treeFound = 0;
+		start = chrono::high_resolution_clock::now();
+		for (const vec3& center : centers) {
+			treeVisible.clear();
+			treeFound += tree.CollectRadius(center, RADIUS, treeVisible);
+		}
+		treeRadiusMs += elapsedMs(start);
+		mismatches += treeFound != linearFound;
+		found += treeFound;
+	}
+
+	int frames = options.frames, queries = options.frames * RADIUS_QUERIES;
+	printTime("update, all spheres", linearUpdateMs / frames, objects * frames / linearUpdateMs * 1000.0, "objects");
+	printTime("update, octree", treeUpdateMs / frames, objects * frames / treeUpdateMs * 1000.0, "objects");
+	cout << "  " << cellChanges / frames << " objects change cell per frame" << endl;
+	printTime("frustum, all spheres avx2", linearFrustumMs / frames, frames / linearFrustumMs * 1000.0, "queries");
+	printTime("frustum, octree", treeFrustumMs / frames, frames / treeFrustumMs * 1000.0, "queries");
+	printTime("radius, all spheres", linearRadiusMs / queries, queries / linearRadiusMs * 1000.0, "queries");
+	printTime("radius, octree", treeRadiusMs / queries, queries / treeRadiusMs * 1000.0, "queries");
+	cout << "  " << setprecision(2) << (double)found / queries << " objects per radius query" << endl;
+	if (mismatches)
+		cout << "  " << mismatches << " queries found a different count than going through all spheres" << endl;
+}
+
+// blocks of CITY_BLOCK units with streets of half that between them, most of them built on. The streets
+// along both axes through the origin are left open
+const float CITY_BLOCK = 20.0f;
+
+static vector<AABB> cityBuildings(mt19937& random) {
+	uniform_real_distribution<float> chance(0.0f, 1.0f), height(5.0f, 40.0f);
+	vector<AABB> buildings;
+	int blocks = (int)(SCENE_EXTENT / CITY_BLOCK);
+	for (int x = -blocks; x < blocks; x++) {
+		for (int z = -blocks; z < blocks; z++) {
+			if (chance(random) < 0.2f)
+				continue;
+			AABB building;
+			building.minimum = vec3((x + 0.25f) * CITY_BLOCK, 0.0f, (z + 0.25f) * CITY_BLOCK);
+			building.maximum = building.minimum + vec3(CITY_BLOCK * 0.5f, height(random), CITY_BLOCK * 0.5f);
+			buildings.push_back(building);
+		}
+	}
+	return buildings;
+}
+
+static void rasterizeCity(OcclusionCuller& culler, const vector<AABB>& buildings, const mat4& viewProjection,
+	ThreadPool* pool) {
+	culler.Begin(viewProjection);
+	for (const AABB& building : buildings)
+		culler.AddOccluder(building);
+	culler.Rasterize(pool);
+}
+
+// returns false if an object was culled that the reference buffer sees
+static bool benchOcclusion(const BenchOptions& options, ThreadPool& pool) {
+	const float EYE_HEIGHT = 2.0f;
+	mt19937 random(1234);
+	vector<AABB> buildings = cityBuildings(random);
+	// objects anywhere from the street to above the highest buildings
+	uniform_real_distribution<float> position(-SCENE_EXTENT, SCENE_EXTENT), height(0.0f, 50.0f), size(0.5f, 2.0f);
+	CullingBoxes boxes;
+	boxes.Resize(options.objects);
+	for (size_t i = 0; i < options.objects; i++) {
+		BoundingSphere sphere;
+		sphere.center = vec3(position(random), height(random), position(random));
+		sphere.radius = size(random);
+		boxes.Set(i, sphereBox(sphere));
+	}
+	cout << "Occlusion culling, " << buildings.size() << " buildings, " << options.objects << " objects, "
+		<< pool.Size() + 1 << " threads" << endl;
+
+	OcclusionCuller scalar(256, 128, CULL_SIMD_SCALAR), culler(256, 128), reference(2048, 1024, CULL_SIMD_SCALAR);
+	bool avx2 = culling_detail::ResolveSimd(CULL_SIMD_AVX2) == CULL_SIMD_AVX2;
+	double scalarMs = 0.0, singleMs = 0.0, poolMs = 0.0, testMs = 0.0, testPoolMs = 0.0;
+	size_t candidates = 0, hidden = 0, differentPixels = 0;
+	size_t checked = 0, wronglyCulled = 0, missed = 0, referenceHidden = 0;
+	vector<unsigned int> inFrustum(options.objects), visible(options.objects), visiblePool(options.objects);
+	for (int frame = 0; frame < options.frames; frame++) {
+		mat4 viewProjection = frameViewProjection(frame, EYE_HEIGHT);
+		size_t count = CullBoxes(ExtractFrustum(viewProjection), boxes, inFrustum.data());
+		candidates += count;
+
+		rasterizeCity(scalar, buildings, viewProjection, nullptr);
+		scalarMs += scalar.stats.rasterMs;
+		rasterizeCity(culler, buildings, viewProjection, nullptr);
+		singleMs += culler.stats.rasterMs;
+		rasterizeCity(culler, buildings, viewProjection, &pool);
+		poolMs += culler.stats.rasterMs;
+
+		auto start = chrono::high_resolution_clock::now();
+		size_t passed = culler.CullOccluded(boxes, inFrustum.data(), count, visible.data());
+		testMs += elapsedMs(start);
+		start = chrono::high_resolution_clock::now();
+		size_t passedPool = culler.CullOccluded(boxes, inFrustum.data(), count, visiblePool.data(), &pool);
+		testPoolMs += elapsedMs(start);
+		hidden += count - passed;
+		if (passedPool != passed || !equal(visible.begin(), visible.begin() + passed, visiblePool.begin()))
+			cout << "  frame " << frame << ": the pool found other objects than one thread" << endl;
+
+		if (frame % 10)
+			continue;
+		for (int y = 0; y < culler.Height(); y++)
+			for (int x = 0; x < culler.Width(); x++)
+				differentPixels += culler.DepthAt(x, y) != scalar.DepthAt(x, y);
+		rasterizeCity(reference, buildings, viewProjection, &pool);
+		// both lists are in the order of the frustum culling
+		size_t next = 0;
+		for (size_t i = 0; i < count; i++) {
+			unsigned int index = inFrustum[i];
+			bool kept = next < passed && visible[next] == index;
+			next += kept;
+			AABB box;
+			box.minimum = vec3(boxes.minX[index], boxes.minY[index], boxes.minZ[index]);
+			box.maximum = vec3(boxes.maxX[index], boxes.maxY[index], boxes.maxZ[index]);
+			bool referenceVisible = reference.IsVisible(box);
+			referenceHidden += !referenceVisible;
+			wronglyCulled += !kept && referenceVisible;
+			missed += kept && !referenceVisible;
+		}
+		checked += count;
+	}
+
+	int frames = options.frames;
+	double triangles = (double)culler.stats.rasterizedTriangles;
+	cout << "  " << culler.stats.occluderTriangles << " occluder triangles, " << culler.stats.rasterizedTriangles
+		<< " on screen, " << culler.stats.binnedTriangles << " in tiles" << endl;
+	printTime("rasterize scalar 1 thread", scalarMs / frames, triangles * frames / scalarMs * 1000.0, "triangles");
+	if (avx2) {
+		printTime("rasterize avx2 1 thread", singleMs / frames, triangles * frames / singleMs * 1000.0, "triangles");
+		printTime("rasterize avx2 pool", poolMs / frames, triangles * frames / poolMs * 1000.0, "triangles");
+	}
+	printTime("test 1 thread", testMs / frames, candidates / testMs * 1000.0, "objects");
+	printTime("test pool", testPoolMs / frames, candidates / testPoolMs * 1000.0, "objects");
+	cout << "  " << hidden / frames << " of " << candidates / frames << " objects in the frustum hidden per frame" << endl;
+	if (differentPixels)
+		cout << "  " << differentPixels << " pixels differ between the scalar and AVX2 depth buffers" << endl;
+	cout << "  against " << reference.Width() << "x" << reference.Height() << ": " << wronglyCulled << " of " << checked
+		<< " objects culled that it sees, " << missed << " of its " << referenceHidden << " hidden ones kept" << endl;
+	if (wronglyCulled)
+		cout << "  FAILED: the occlusion culling hid objects that are visible" << endl;
+	return wronglyCulled == 0;
+}
+
+static bool parseArgs(int argc, char** argv, BenchOptions& options) {
+	for (int i = 1; i < argc; i++) {
+		string arg = argv[i];
+		if (arg == "--objects" && i + 1 < argc)
+			options.objects = (size_t)atoll(argv[++i]);
+		else if (arg == "--frames" && i + 1 < argc)
+			options.frames = std::max(1, atoi(argv[++i]));
+		else if (arg == "--threads" && i + 1 < argc)
+			options.threads = (unsigned int)atoi(argv[++i]);
+		else {
+			cout << "Unknown option " << arg << endl;
+			return false;
+		}
+	}
+	return true;
+}
+
+int main(int argc, char** argv) {
+	BenchOptions options;
+	if (!parseArgs(argc, argv, options)) {
+		cout << "Usage: EngineBench [--objects N] [--frames N] [--threads N]" << endl;
+		return 1;
+	}
+	ThreadPool pool(options.threads);
+	benchFrustumCulling(options, pool);
+	benchBVH(options, pool);
+	const size_t octreeObjects[] = { 10000, 100000, 1000000 };
+	for (size_t objects : octreeObjects)
+		if (objects <= options.objects)
+			benchLooseOctree(objects, options, pool);
+	return benchOcclusion(options, pool) ? 0 : 1;
+}
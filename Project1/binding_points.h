@@ -0,0 +1,27 @@
+#ifndef BINDING_POINTS_H
+#define BINDING_POINTS_H
+
+// Every buffer binding point and fixed texture unit the engine's shaders use, kept in one list so no two
+// systems end up on the same one. The shaders write the numbers into their layout qualifiers, a change
+// here has to be made in the shaders named next to it as well.
+
+// uniform buffers
+const unsigned int CAMERA_DATA_BINDING = 0; // CameraData: projection and view, written once per frame by main.cpp
+
+// shader storage buffers
+const unsigned int SCENE_BUFFER_BINDING = 1; // Objects (scene_buffer.h), in every scene vertex shader
+const unsigned int TEXTURE_TABLE_BINDING = 2; // TextureTable (texture_packer.h), packed_texture.fs
+// gpu_culling.h, instance_cull.comp
+const unsigned int GPU_CULLING_INSTANCE_BINDING = 3;
+const unsigned int GPU_CULLING_MESH_BINDING = 4;
+const unsigned int GPU_CULLING_COMMAND_BINDING = 5;
+const unsigned int GPU_CULLING_COUNTER_BINDING = 6;
+const unsigned int GPU_CULLING_RETEST_BINDING = 7;
+
+// texture units, materials take them from 0 up
+// the streamed crate's texture, bound by main.cpp outside of any material. streamed_texture.fs
+const unsigned int STREAMED_TEXTURE_UNIT = 14;
+// the depth buffer and the pyramid of gpu_culling.h, hiz_init.comp and instance_cull.comp
+const unsigned int GPU_CULLING_TEXTURE_UNIT = 15;
+
+#endif
@@ -0,0 +1,85 @@
+#ifndef BOUNDS_H
+#define BOUNDS_H
+
+// Plugins for OpenGL Mathematics
+// Allows us to use mathematical transformations into our engine for any object
+#include <glm/glm.hpp>
+
+#include <vector>
+#include <algorithm>
+
+using namespace glm;
+using namespace std;
+
+// a sphere around everything the object draws, in the object's own space until transformed
+struct BoundingSphere {
+	vec3 center = vec3(0.0f);
+	float radius = 0.0f;
+};
+
+// an axis aligned box around everything the object draws, in the object's own space until transformed
+struct AABB {
+	vec3 minimum = vec3(0.0f);
+	vec3 maximum = vec3(0.0f);
+};
+
+struct Ray {
+	vec3 origin = vec3(0.0f);
+	vec3 direction = vec3(0.0f, 0.0f, -1.0f);
+};
+
+// Vertex needs a vec3 position
+template <typename Vertex>
+AABB ComputeAABB(const vector<Vertex>& vertices) {
+	AABB box;
+	if (vertices.empty())
+		return box;
+	box.minimum = box.maximum = vertices[0].position;
+	for (const Vertex& vertex : vertices) {
+		box.minimum = glm::min(box.minimum, vertex.position);
+		box.maximum = glm::max(box.maximum, vertex.position);
+	}
+	return box;
+}
+
+// centered on the box around the vertices, which is close enough to the smallest sphere for culling
+// and streaming decisions. Vertex needs a vec3 position
+template <typename Vertex>
+BoundingSphere ComputeBoundingSphere(const vector<Vertex>& vertices) {
+	BoundingSphere sphere;
+	if (vertices.empty())
+		return sphere;
+	AABB box = ComputeAABB(vertices);
+	sphere.center = (box.minimum + box.maximum) * 0.5f;
+	float radiusSquared = 0.0f;
+	for (const Vertex& vertex : vertices) {
+		vec3 d = vertex.position - sphere.center;
+		radiusSquared = std::max(radiusSquared, dot(d, d));
+	}
+	sphere.radius = sqrt(radiusSquared);
+	return sphere;
+}
+
+// the sphere in world space, scaled by the largest axis scale of the model matrix so it still contains everything
+inline BoundingSphere TransformBoundingSphere(const BoundingSphere& sphere, const mat4& model) {
+	BoundingSphere world;
+	world.center = vec3(model * vec4(sphere.center, 1.0f));
+	float scale = std::max(std::max(dot(vec3(model[0]), vec3(model[0])), dot(vec3(model[1]), vec3(model[1]))),
+		dot(vec3(model[2]), vec3(model[2])));
+	world.radius = sphere.radius * sqrt(scale);
+	return world;
+}
+
+// the world space box around the transformed box: every world axis gets the extents of the box's
+// axes projected onto it
+inline AABB TransformAABB(const AABB& box, const mat4& model) {
+	vec3 center = vec3(model * vec4((box.minimum + box.maximum) * 0.5f, 1.0f));
+	vec3 extent = (box.maximum - box.minimum) * 0.5f;
+	vec3 world = abs(vec3(model[0])) * extent.x + abs(vec3(model[1])) * extent.y + abs(vec3(model[2])) * extent.z;
+	AABB result;
+	result.minimum = center - world;
+	result.maximum = center + world;
+	return result;
+}
+
+#endif
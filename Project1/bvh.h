@@ -0,0 +1,503 @@
+#ifndef BVH_H
+#define BVH_H
+
+// Plugins for OpenGL Mathematics
+// Allows us to use mathematical transformations into our engine for any object
+#include <glm/glm.hpp>
+
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <cfloat>
+#include <climits>
+
+#include "bounds.h"
+#include "frustum_culling.h"
+#include "thread_pool.h"
+
+using namespace glm;
+using namespace std;
+
+// Bounding volume hierarchy over the world space boxes of the scene's objects, for the queries that
+// would otherwise go through every object: frustum culling, raycasts (mouse picking) and box overlaps.
+//
+// Build() splits the objects with a binned surface area heuristic: per axis the centroids go into
+// BINS bins, and the split between two bins that's cheapest to visit (area times objects on either
+// side) wins, unless a leaf is cheaper still. Nodes are stored depth first, so a node's first child
+// is the node right after it, and every node knows the node that follows its subtree. Queries walk
+// the array without a stack: a node that passes the test goes on to the next one, one that doesn't
+// jumps past its subtree. Each subtree also holds a contiguous range of the object order, so a node
+// entirely inside the frustum adds all of its objects without testing them.
+//
+// Objects that move only get a new box (Update). Refit() fixes the boxes of the leaves they're in and
+// of everything above them, children before parents as they come later in the array. A refitted tree
+// gets looser the further objects move from where they were built, so Maintain() builds it again once
+// its cost is REBUILD_RATIO times what it was after the last build, or objects were added or removed.
+// With a pool the top levels are split on the calling thread and the subtrees under them are built in
+// parallel, then copied behind each other.
+
+struct BVHStats {
+	unsigned int objects = 0;
+	unsigned int nodes = 0;
+	unsigned int builds = 0; // since the start
+	unsigned int refits = 0;
+	float cost = 0.0f; // surface area heuristic of the tree, relative to the area of the root
+	double buildMs = 0.0; // of the last build
+};
+
+struct RayHit {
+	unsigned int object = 0;
+	float distance = 0.0f;
+};
+
+class BVH {
+public:
+	BVHStats stats;
+
+	// returns the id of the object, it's part of the queries after the next Build() or Maintain()
+	unsigned int Insert(const AABB& box) {
+		unsigned int id;
+		if (!freeIDs.empty()) {
+			id = freeIDs.back();
+			freeIDs.pop_back();
+		}
+		else {
+			id = (unsigned int)boxes.size();
+			boxes.push_back(AABB());
+			alive.push_back(0);
+			dirtyFlags.push_back(0);
+			leafOf.push_back(NONE);
+		}
+		boxes[id] = box;
+		alive[id] = 1;
+		structureChanged = true;
+		return id;
+	}
+
+	// the object drops out of the queries with the next Build() or Maintain(), its id may be handed out again
+	void Remove(unsigned int id) {
+		alive[id] = 0;
+		freeIDs.push_back(id);
+		structureChanged = true;
+	}
+
+	// the object moved, the tree follows with the next Refit()
+	void Update(unsigned int id, const AABB& box) {
+		boxes[id] = box;
+		if (dirtyFlags[id])
+			return;
+		dirtyFlags[id] = 1;
+		dirty.push_back(id);
+	}
+
+	const AABB& Bounds(unsigned int id) const {
+		return boxes[id];
+	}
+
+	// call once per frame after the updates: refits, or builds again when the tree has to
+	void Maintain(ThreadPool* pool = nullptr) {
+		if (structureChanged) {
+			Build(pool);
+			return;
+		}
+		Refit();
+		if (stats.cost > builtCost * REBUILD_RATIO)
+			Build(pool);
+	}
+
+	// builds the tree over every object from scratch. Don't pass a pool from inside a pool job
+	void Build(ThreadPool* pool = nullptr) {
+		auto start = chrono::high_resolution_clock::now();
+		order.clear();
+		centroids.resize(boxes.size());
+		for (unsigned int id = 0; id < boxes.size(); id++) {
+			if (!alive[id])
+				continue;
+			order.push_back(id);
+			centroids[id] = (boxes[id].minimum + boxes[id].maximum) * 0.5f;
+		}
+
+		nodes.clear();
+		if (pool && order.size() > PARALLEL_SIZE)
+			buildParallel(*pool);
+		else if (!order.empty())
+			buildNode(nodes, 0, (unsigned int)order.size());
+		link();
+
+		for (unsigned int id : dirty)
+			dirtyFlags[id] = 0;
+		dirty.clear();
+		structureChanged = false;
+		builtCost = stats.cost = cost();
+		stats.objects = (unsigned int)order.size();
+		stats.nodes = (unsigned int)nodes.size();
+		stats.builds++;
+		stats.buildMs = chrono::duration<double, milli>(chrono::high_resolution_clock::now() - start).count();
+	}
+
+	// fits the boxes of the nodes above every object that moved since the last refit
+	void Refit() {
+		if (dirty.empty())
+			return;
+		refitNodes.clear();
+		nodeFlags.resize(nodes.size());
+		for (unsigned int id : dirty) {
+			dirtyFlags[id] = 0;
+			// an object inserted since the last build isn't in the tree yet
+			for (unsigned int node = leafOf[id]; node != NONE && !nodeFlags[node]; node = parents[node]) {
+				nodeFlags[node] = 1;
+				refitNodes.push_back(node);
+			}
+		}
+		dirty.clear();
+
+		// children come after their parents, so the highest index goes first
+		sort(refitNodes.begin(), refitNodes.end(), [](unsigned int a, unsigned int b) { return a > b; });
+		for (unsigned int index : refitNodes) {
+			Node& node = nodes[index];
+			if (node.right == 0) {
+				AABB box = rangeBounds(node.begin, node.end);
+				node.minimum = box.minimum;
+				node.maximum = box.maximum;
+			}
+			else {
+				node.minimum = glm::min(nodes[index + 1].minimum, nodes[node.right].minimum);
+				node.maximum = glm::max(nodes[index + 1].maximum, nodes[node.right].maximum);
+			}
+			nodeFlags[index] = 0;
+		}
+		stats.cost = cost();
+		stats.refits++;
+	}
+
+	// appends the objects whose box is inside or touching the frustum to visible, returns how many
+	size_t QueryFrustum(const Frustum& frustum, vector<unsigned int>& visible) const {
+		size_t first = visible.size();
+		unsigned int index = 0, count = (unsigned int)nodes.size();
+		while (index < count) {
+			const Node& node = nodes[index];
+			CullSide side = Classify(frustum, node.minimum, node.maximum);
+			if (side == CULL_OUTSIDE) {
+				index = node.skip;
+				continue;
+			}
+			if (side == CULL_INSIDE) {
+				visible.insert(visible.end(), order.begin() + node.begin, order.begin() + node.end);
+				index = node.skip;
+				continue;
+			}
+			if (node.right == 0) {
+				for (unsigned int i = node.begin; i < node.end; i++)
+					if (IsVisible(frustum, boxes[order[i]]))
+						visible.push_back(order[i]);
+			}
+			index++;
+		}
+		return visible.size() - first;
+	}
+
+	// the closest object whose box the ray hits within maxDistance. The direction needn't be normalized,
+	// distances are in units of its length
+	bool Raycast(const Ray& ray, float maxDistance, RayHit& hit) const {
+		vec3 inverse(1.0f / ray.direction.x, 1.0f / ray.direction.y, 1.0f / ray.direction.z);
+		float closest = maxDistance;
+		bool found = false;
+		unsigned int index = 0, count = (unsigned int)nodes.size();
+		float distance;
+		while (index < count) {
+			const Node& node = nodes[index];
+			if (!rayHitsBox(ray.origin, inverse, node.minimum, node.maximum, closest, distance)) {
+				index = node.skip;
+				continue;
+			}
+			if (node.right == 0) {
+				for (unsigned int i = node.begin; i < node.end; i++) {
+					const AABB& box = boxes[order[i]];
+					if (rayHitsBox(ray.origin, inverse, box.minimum, box.maximum, closest, distance)) {
+						closest = distance;
+						hit.object = order[i];
+						hit.distance = distance;
+						found = true;
+					}
+				}
+			}
+			index++;
+		}
+		return found;
+	}
+
+	// appends the objects whose box overlaps box to overlapping, returns how many
+	size_t QueryOverlap(const AABB& box, vector<unsigned int>& overlapping) const {
+		size_t first = overlapping.size();
+		unsigned int index = 0, count = (unsigned int)nodes.size();
+		while (index < count) {
+			const Node& node = nodes[index];
+			if (!overlaps(box, node.minimum, node.maximum)) {
+				index = node.skip;
+				continue;
+			}
+			if (node.right == 0) {
+				for (unsigned int i = node.begin; i < node.end; i++)
+					if (overlaps(box, boxes[order[i]].minimum, boxes[order[i]].maximum))
+						overlapping.push_back(order[i]);
+			}
+			index++;
+		}
+		return overlapping.size() - first;
+	}
+
+private:
+	static constexpr unsigned int NONE = UINT_MAX;
+	// ranges this small are always leaves, the heuristic may make leaves up to MAX_LEAF_SIZE
+	static const unsigned int LEAF_SIZE = 2;
+	static const unsigned int MAX_LEAF_SIZE = 16;
+	static const int BINS = 12;
+	// subtrees up to this many objects are built on one thread
+	static const unsigned int PARALLEL_SIZE = 4096;
+	static constexpr float REBUILD_RATIO = 1.5f;
+
+	struct Node {
+		vec3 minimum, maximum;
+		unsigned int skip; // the node after this subtree
+		unsigned int right; // the second child, 0 for a leaf. The first one is the next node
+		unsigned int begin, end; // the range of the order this subtree holds
+	};
+
+	struct Bin {
+		vec3 minimum = vec3(FLT_MAX), maximum = vec3(-FLT_MAX);
+		unsigned int count = 0;
+	};
+
+	// the top levels of a parallel build, a task is a subtree built on its own
+	struct TopNode {
+		unsigned int begin, end;
+		int left = -1, right = -1;
+		int task = -1;
+	};
+
+	vector<AABB> boxes; // by object id
+	vector<unsigned char> alive;
+	vector<unsigned int> freeIDs;
+	vector<vec3> centroids; // of the boxes at the last build, what the splits go by
+	vector<unsigned int> order; // object ids, every subtree holds a contiguous range
+	vector<Node> nodes;
+	vector<unsigned int> parents; // by node
+	vector<unsigned int> leafOf; // by object id, NONE when it isn't in the tree
+	vector<unsigned int> dirty; // moved since the last refit
+	vector<unsigned char> dirtyFlags;
+	vector<unsigned int> refitNodes;
+	vector<unsigned char> nodeFlags;
+	bool structureChanged = false;
+	float builtCost = 0.0f;
+
+	// half the surface area, the probability of a ray hitting a box scales with it
+	static float area(const vec3& minimum, const vec3& maximum) {
+		vec3 d = maximum - minimum;
+		return d.x * d.y + d.y * d.z + d.z * d.x;
+	}
+
+	static bool overlaps(const AABB& box, const vec3& minimum, const vec3& maximum) {
+		return box.minimum.x <= maximum.x && box.maximum.x >= minimum.x
+			&& box.minimum.y <= maximum.y && box.maximum.y >= minimum.y
+			&& box.minimum.z <= maximum.z && box.maximum.z >= minimum.z;
+	}
+
+	// slab test, distance is where the ray enters the box (0 when it starts inside)
+	static bool rayHitsBox(const vec3& origin, const vec3& inverse, const vec3& minimum, const vec3& maximum,
+		float maxDistance, float& distance) {
+		float enter = 0.0f, exit = maxDistance;
+		for (int axis = 0; axis < 3; axis++) {
+			float t0 = (minimum[axis] - origin[axis]) * inverse[axis];
+			float t1 = (maximum[axis] - origin[axis]) * inverse[axis];
+			enter = std::max(enter, std::min(t0, t1));
+			exit = std::min(exit, std::max(t0, t1));
+		}
+		distance = enter;
+		return enter <= exit;
+	}
+
+	AABB rangeBounds(unsigned int begin, unsigned int end) const {
+		AABB box;
+		box.minimum = vec3(FLT_MAX);
+		box.maximum = vec3(-FLT_MAX);
+		for (unsigned int i = begin; i < end; i++) {
+			box.minimum = glm::min(box.minimum, boxes[order[i]].minimum);
+			box.maximum = glm::max(box.maximum, boxes[order[i]].maximum);
+		}
+		return box;
+	}
+
+	// splits [begin, end) of the order in two and returns where the second half starts, or begin if the
+	// range is better off as a leaf. Only touches that part of the order, so ranges can split in parallel
+	unsigned int split(unsigned int begin, unsigned int end, const AABB& bounds) {
+		unsigned int count = end - begin;
+		if (count <= LEAF_SIZE)
+			return begin;
+		vec3 low(FLT_MAX), high(-FLT_MAX);
+		for (unsigned int i = begin; i < end; i++) {
+			low = glm::min(low, centroids[order[i]]);
+			high = glm::max(high, centroids[order[i]]);
+		}
+
+		float bestCost = FLT_MAX;
+		int bestAxis = -1, bestBin = 0;
+		for (int axis = 0; axis < 3; axis++) {
+			float extent = high[axis] - low[axis];
+			if (extent <= 0.0f)
+				continue;
+			float scale = BINS / extent;
+			Bin bins[BINS];
+			for (unsigned int i = begin; i < end; i++) {
+				const AABB& box = boxes[order[i]];
+				Bin& bin = bins[std::min(BINS - 1, (int)((centroids[order[i]][axis] - low[axis]) * scale))];
+				bin.minimum = glm::min(bin.minimum, box.minimum);
+				bin.maximum = glm::max(bin.maximum, box.maximum);
+				bin.count++;
+			}
+			// the right side of every split from the right, then the left sides meet them from the left
+			float rightCosts[BINS];
+			Bin side;
+			for (int b = BINS - 1; b > 0; b--) {
+				side.minimum = glm::min(side.minimum, bins[b].minimum);
+				side.maximum = glm::max(side.maximum, bins[b].maximum);
+				side.count += bins[b].count;
+				rightCosts[b] = side.count ? area(side.minimum, side.maximum) * side.count : FLT_MAX;
+			}
+			side = Bin();
+			for (int b = 0; b < BINS - 1; b++) {
+				side.minimum = glm::min(side.minimum, bins[b].minimum);
+				side.maximum = glm::max(side.maximum, bins[b].maximum);
+				side.count += bins[b].count;
+				if (side.count == 0 || rightCosts[b + 1] == FLT_MAX)
+					continue;
+				float cost = area(side.minimum, side.maximum) * side.count + rightCosts[b + 1];
+				if (cost < bestCost) {
+					bestCost = cost;
+					bestAxis = axis;
+					bestBin = b;
+				}
+			}
+		}
+
+		if (bestAxis < 0) // every centroid in the same place, any split is as good as another
+			return count > MAX_LEAF_SIZE ? begin + count / 2 : begin;
+		// visiting a node costs about as much as testing one object
+		float parentArea = std::max(area(bounds.minimum, bounds.maximum), FLT_MIN);
+		if (count <= MAX_LEAF_SIZE && 1.0f + bestCost / parentArea >= (float)count)
+			return begin;
+
+		float low0 = low[bestAxis], scale = BINS / (high[bestAxis] - low[bestAxis]);
+		unsigned int* middle = std::partition(&order[begin], &order[begin] + count, [&](unsigned int id) {
+			return std::min(BINS - 1, (int)((centroids[id][bestAxis] - low0) * scale)) <= bestBin;
+		});
+		unsigned int mid = (unsigned int)(middle - &order[0]);
+		return mid == begin || mid == end ? begin + count / 2 : mid;
+	}
+
+	// appends the subtree of [begin, end) to out depth first, returns the index of its root in out
+	unsigned int buildNode(vector<Node>& out, unsigned int begin, unsigned int end) {
+		unsigned int index = (unsigned int)out.size();
+		out.push_back(Node());
+		AABB bounds = rangeBounds(begin, end);
+		unsigned int mid = split(begin, end, bounds);
+		unsigned int right = 0;
+		if (mid != begin) {
+			buildNode(out, begin, mid);
+			right = buildNode(out, mid, end);
+		}
+		Node& node = out[index];
+		node.minimum = bounds.minimum;
+		node.maximum = bounds.maximum;
+		node.right = right;
+		node.begin = begin;
+		node.end = end;
+		node.skip = (unsigned int)out.size();
+		return index;
+	}
+
+	int splitTop(vector<TopNode>& top, vector<int>& tasks, unsigned int begin, unsigned int end) {
+		int index = (int)top.size();
+		top.push_back(TopNode());
+		top[index].begin = begin;
+		top[index].end = end;
+		unsigned int mid = end - begin > PARALLEL_SIZE ? split(begin, end, rangeBounds(begin, end)) : begin;
+		if (mid == begin) {
+			top[index].task = (int)tasks.size();
+			tasks.push_back(index);
+			return index;
+		}
+		int left = splitTop(top, tasks, begin, mid);
+		int right = splitTop(top, tasks, mid, end);
+		top[index].left = left;
+		top[index].right = right;
+		return index;
+	}
+
+	// copies the top levels and the subtrees under them into nodes, depth first
+	unsigned int emitTop(const vector<TopNode>& top, int topIndex, const vector<vector<Node>>& subtrees) {
+		const TopNode& from = top[topIndex];
+		unsigned int index = (unsigned int)nodes.size();
+		if (from.task >= 0) {
+			for (Node node : subtrees[from.task]) {
+				node.skip += index;
+				if (node.right)
+					node.right += index;
+				nodes.push_back(node);
+			}
+			return index;
+		}
+		nodes.push_back(Node());
+		emitTop(top, from.left, subtrees);
+		unsigned int right = emitTop(top, from.right, subtrees);
+		Node& node = nodes[index];
+		node.minimum = glm::min(nodes[index + 1].minimum, nodes[right].minimum);
+		node.maximum = glm::max(nodes[index + 1].maximum, nodes[right].maximum);
+		node.right = right;
+		node.begin = from.begin;
+		node.end = from.end;
+		node.skip = (unsigned int)nodes.size();
+		return index;
+	}
+
+	void buildParallel(ThreadPool& pool) {
+		vector<TopNode> top;
+		vector<int> tasks;
+		splitTop(top, tasks, 0, (unsigned int)order.size());
+		vector<vector<Node>> subtrees(tasks.size());
+		pool.ParallelFor(tasks.size(), [&](size_t first, size_t last) {
+			for (size_t t = first; t < last; t++)
+				buildNode(subtrees[t], top[tasks[t]].begin, top[tasks[t]].end);
+		});
+		emitTop(top, 0, subtrees);
+	}
+
+	// parents of every node and the leaf of every object, for the refits
+	void link() {
+		parents.assign(nodes.size(), NONE);
+		leafOf.assign(boxes.size(), NONE);
+		for (unsigned int index = 0; index < nodes.size(); index++) {
+			const Node& node = nodes[index];
+			if (node.right) {
+				parents[index + 1] = index;
+				parents[node.right] = index;
+			}
+			else {
+				for (unsigned int i = node.begin; i < node.end; i++)
+					leafOf[order[i]] = index;
+			}
+		}
+	}
+
+	// expected cost of a query that reaches the root: every node is visited with the probability of its
+	// area, leaves then test all their objects
+	float cost() const {
+		if (nodes.empty())
+			return 0.0f;
+		double sum = 0.0;
+		for (const Node& node : nodes)
+			sum += area(node.minimum, node.maximum) * (node.right ? 1.0 : 1.0 + (node.end - node.begin));
+		return (float)(sum / std::max(area(nodes[0].minimum, nodes[0].maximum), FLT_MIN));
+	}
+};
+
+#endif
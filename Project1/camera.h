@@ -5,6 +5,8 @@
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 
+#include "frustum_culling.h"
+
 using namespace glm;
 
 // Defines several possible options for camera movement. Used as abstraction to stay away from window-system specific input methods
@@ -81,6 +83,26 @@ public:
         // the up vector on the y axis (vec3(0,1,0))
     }
 
+    // the six planes of what the camera sees through the projection, for the frustum culling
+    Frustum GetFrustum(const mat4& projection)
+    {
+        return ExtractFrustum(projection * GetViewMatrix());
+    }
+
+    // the ray from the camera through a point of the window, x and y in pixels from its top left like the
+    // mouse callbacks get them. The direction is normalized, the origin is on the near plane
+    Ray ScreenRay(float x, float y, float width, float height, const mat4& projection)
+    {
+        mat4 inverseViewProjection = inverse(projection * GetViewMatrix());
+        vec2 ndc(2.0f * x / width - 1.0f, 1.0f - 2.0f * y / height);
+        vec4 nearPoint = inverseViewProjection * vec4(ndc.x, ndc.y, -1.0f, 1.0f);
+        vec4 farPoint = inverseViewProjection * vec4(ndc.x, ndc.y, 1.0f, 1.0f);
+        Ray ray;
+        ray.origin = vec3(nearPoint) / nearPoint.w;
+        ray.direction = normalize(vec3(farPoint) / farPoint.w - ray.origin);
+        return ray;
+    }
+
     // processes input received from any keyboard-like input system. Accepts input parameter in the form of camera defined ENUM (to abstract it from windowing systems)
     void ProcessKeyboard(Camera_Movement direction, float deltaTime)
     {
@@ -0,0 +1,81 @@
+#ifndef COLOR_SPACE_H
+#define COLOR_SPACE_H
+
+#include <cmath>
+#include <algorithm>
+#include <vector>
+
+// Conversions between sRGB encoded 8 bit colour and linear light.
+//
+// Averaging sRGB values directly darkens everything that gets filtered (mips, resized images),
+// because the encoding isn't linear. Filters decode to linear floats first and encode again at the end.
+
+inline float SRGBToLinear(float c) {
+	return c <= 0.04045f ? c / 12.92f : powf((c + 0.055f) / 1.055f, 2.4f);
+}
+
+inline float LinearToSRGB(float c) {
+	return c <= 0.0031308f ? c * 12.92f : 1.055f * powf(c, 1.0f / 2.4f) - 0.055f;
+}
+
+// linear value of every 8 bit sRGB code
+inline const float* SRGB8ToLinearTable() {
+	struct Table {
+		float values[256];
+		Table() {
+			for (int i = 0; i < 256; i++)
+				values[i] = SRGBToLinear(i / 255.0f);
+		}
+	};
+	static const Table table;
+	return table.values;
+}
+
+// the same for every 16 bit code, built the first time a 16 bit image needs it
+inline const float* SRGB16ToLinearTable() {
+	struct Table {
+		std::vector<float> values;
+		Table() : values(65536) {
+			for (int i = 0; i < 65536; i++)
+				values[i] = SRGBToLinear(i / 65535.0f);
+		}
+	};
+	static const Table table;
+	return table.values.data();
+}
+
+// rounds to the nearest 8 bit sRGB code. thresholds[i] is the linear value halfway (in sRGB) between
+// code i and i + 1, so the answer is the number of thresholds below the value. A table over the linear
+// range gives a code that's at most a few steps short of it (only in the darks), the loop walks the rest
+inline unsigned char LinearToSRGB8(float linear) {
+	struct Tables {
+		float thresholds[256];
+		unsigned char start[4096];
+		Tables() {
+			for (int i = 0; i < 255; i++)
+				thresholds[i] = SRGBToLinear((i + 0.5f) / 255.0f);
+			thresholds[255] = 2.0f; // never crossed
+			int code = 0;
+			for (int i = 0; i < 4096; i++) {
+				while (code < 255 && i / 4095.0f > thresholds[code])
+					code++;
+				start[i] = (unsigned char)code;
+			}
+		}
+	};
+	static const Tables tables;
+	if (!(linear > 0.0f))
+		return 0;
+	if (linear >= 1.0f)
+		return 255;
+	int code = tables.start[(int)(linear * 4095.0f)];
+	while (linear > tables.thresholds[code])
+		code++;
+	return (unsigned char)code;
+}
+
+inline unsigned char LinearToUNorm8(float value) {
+	return (unsigned char)(std::min(1.0f, std::max(0.0f, value)) * 255.0f + 0.5f);
+}
+
+#endif
@@ -0,0 +1,285 @@
+#ifndef DDS_H
+#define DDS_H
+
+#include <vector>
+#include <string>
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+
+// DDS container for textures that were cooked offline with all of their mip levels.
+//
+// Only what the cooker writes is supported: 2D textures, one array layer, block compressed
+// (BC1/BC3/BC4/BC5/BC7) or plain RGBA8. Files with the DX10 extension header are read as well as
+// the older DXT1/DXT5/ATI1/ATI2 four character codes.
+// Nothing in here touches OpenGL, the cooker uses it too.
+
+enum DDSFormat {
+	DDS_UNKNOWN,
+	DDS_RGBA8,
+	DDS_BC1,
+	DDS_BC3,
+	DDS_BC4,
+	DDS_BC5,
+	DDS_BC7
+};
+
+struct DDSLevel {
+	size_t offset = 0; // into the file data
+	size_t size = 0;
+	int width = 0, height = 0;
+};
+
+struct DDSImage {
+	DDSFormat format = DDS_UNKNOWN;
+	bool srgb = false;
+	int width = 0, height = 0;
+	std::vector<DDSLevel> levels;
+};
+
+// bytes per 4x4 block, or per pixel for RGBA8
+inline int DDSBlockBytes(DDSFormat format) {
+	switch (format) {
+	case DDS_BC1: case DDS_BC4: return 8;
+	case DDS_BC3: case DDS_BC5: case DDS_BC7: return 16;
+	case DDS_RGBA8: return 4;
+	default: return 0;
+	}
+}
+
+inline bool DDSIsCompressed(DDSFormat format) {
+	return format != DDS_RGBA8 && format != DDS_UNKNOWN;
+}
+
+// size of one mip level, compressed levels are rounded up to whole blocks
+inline size_t DDSLevelSize(DDSFormat format, int width, int height) {
+	if (!DDSIsCompressed(format))
+		return (size_t)width * height * DDSBlockBytes(format);
+	return (size_t)((width + 3) / 4) * ((height + 3) / 4) * DDSBlockBytes(format);
+}
+
+namespace dds_detail {
+	const uint32_t MAGIC = 0x20534444; // "DDS "
+	const uint32_t FLAGS_TEXTURE = 0x1 | 0x2 | 0x4 | 0x1000; // caps, height, width, pixel format
+	const uint32_t FLAG_MIPMAPCOUNT = 0x20000;
+	const uint32_t FLAG_LINEARSIZE = 0x80000;
+	const uint32_t PF_FOURCC = 0x4;
+	const uint32_t CAPS_TEXTURE = 0x1000;
+	const uint32_t CAPS_COMPLEX = 0x8;
+	const uint32_t CAPS_MIPMAP = 0x400000;
+	const uint32_t DIMENSION_TEXTURE2D = 3;
+
+	inline uint32_t FourCC(char a, char b, char c, char d) {
+		return (uint32_t)(unsigned char)a | ((uint32_t)(unsigned char)b << 8) | ((uint32_t)(unsigned char)c << 16)
+			| ((uint32_t)(unsigned char)d << 24);
+	}
+
+	// the on-disk layouts, every field is a little endian uint32
+	struct PixelFormat {
+		uint32_t size, flags, fourCC, rgbBitCount, rMask, gMask, bMask, aMask;
+	};
+
+	struct Header {
+		uint32_t size, flags, height, width, pitchOrLinearSize, depth, mipMapCount, reserved1[11];
+		PixelFormat pixelFormat;
+		uint32_t caps, caps2, caps3, caps4, reserved2;
+	};
+
+	struct HeaderDX10 {
+		uint32_t dxgiFormat, resourceDimension, miscFlag, arraySize, miscFlags2;
+	};
+
+	inline uint32_t DXGIFormat(DDSFormat format, bool srgb) {
+		switch (format) {
+		case DDS_RGBA8: return srgb ? 29 : 28;
+		case DDS_BC1: return srgb ? 72 : 71;
+		case DDS_BC3: return srgb ? 78 : 77;
+		case DDS_BC4: return 80;
+		case DDS_BC5: return 83;
+		case DDS_BC7: return srgb ? 99 : 98;
+		default: return 0;
+		}
+	}
+
+	// fopen counts as deprecated with MSVC's SDL checks, which turns the warning into an error
+	inline FILE* OpenFile(const std::string& path, const char* mode) {
+#ifdef _MSC_VER
+		FILE* file = nullptr;
+		return fopen_s(&file, path.c_str(), mode) == 0 ? file : nullptr;
+#else
+		return fopen(path.c_str(), mode);
+#endif
+	}
+
+	// fseek and ftell take a long, which is 32 bits with MSVC, and cooked files can be far past 2GB
+	inline bool SeekFile(FILE* file, uint64_t offset, int origin = SEEK_SET) {
+#ifdef _MSC_VER
+		return _fseeki64(file, (__int64)offset, origin) == 0;
+#else
+		return fseeko(file, (off_t)offset, origin) == 0;
+#endif
+	}
+
+	// leaves the file at its start, -1 on failure
+	inline int64_t FileSize(FILE* file) {
+		if (!SeekFile(file, 0, SEEK_END))
+			return -1;
+#ifdef _MSC_VER
+		int64_t size = _ftelli64(file);
+#else
+		int64_t size = ftello(file);
+#endif
+		return SeekFile(file, 0) ? size : -1;
+	}
+
+	inline DDSFormat FromDXGI(uint32_t dxgi, bool& srgb) {
+		srgb = dxgi == 29 || dxgi == 72 || dxgi == 78 || dxgi == 99;
+		switch (dxgi) {
+		case 28: case 29: return DDS_RGBA8;
+		case 71: case 72: return DDS_BC1;
+		case 77: case 78: return DDS_BC3;
+		case 80: return DDS_BC4;
+		case 83: return DDS_BC5;
+		case 98: case 99: return DDS_BC7;
+		default: return DDS_UNKNOWN;
+		}
+	}
+}
+
+// reads the headers and works out where every level is, the pixel data stays in data. When data only
+// holds the start of the file (see ReadDDSHeader), fileSize is the size of the whole file
+inline bool ParseDDS(const unsigned char* data, size_t size, DDSImage& image, size_t fileSize = 0) {
+	using namespace dds_detail;
+	uint32_t magic;
+	Header header;
+	if (size < sizeof(magic) + sizeof(header))
+		return false;
+	memcpy(&magic, data, sizeof(magic));
+	memcpy(&header, data + sizeof(magic), sizeof(header));
+	if (magic != MAGIC || header.size != sizeof(Header) || header.pixelFormat.size != sizeof(PixelFormat))
+		return false;
+
+	size_t offset = sizeof(magic) + sizeof(header);
+	image = DDSImage();
+	image.width = (int)header.width;
+	image.height = (int)header.height;
+
+	const PixelFormat& pf = header.pixelFormat;
+	if ((pf.flags & PF_FOURCC) && pf.fourCC == FourCC('D', 'X', '1', '0')) {
+		HeaderDX10 dx10;
+		if (size < offset + sizeof(dx10))
+			return false;
+		memcpy(&dx10, data + offset, sizeof(dx10));
+		offset += sizeof(dx10);
+		if (dx10.resourceDimension != DIMENSION_TEXTURE2D || dx10.arraySize > 1)
+			return false;
+		image.format = FromDXGI(dx10.dxgiFormat, image.srgb);
+	}
+	else if (pf.flags & PF_FOURCC) {
+		if (pf.fourCC == FourCC('D', 'X', 'T', '1')) image.format = DDS_BC1;
+		else if (pf.fourCC == FourCC('D', 'X', 'T', '5')) image.format = DDS_BC3;
+		else if (pf.fourCC == FourCC('A', 'T', 'I', '1') || pf.fourCC == FourCC('B', 'C', '4', 'U')) image.format = DDS_BC4;
+		else if (pf.fourCC == FourCC('A', 'T', 'I', '2') || pf.fourCC == FourCC('B', 'C', '5', 'U')) image.format = DDS_BC5;
+	}
+	else if (pf.rgbBitCount == 32 && pf.rMask == 0x000000ff && pf.gMask == 0x0000ff00 && pf.bMask == 0x00ff0000)
+		image.format = DDS_RGBA8;
+
+	if (image.format == DDS_UNKNOWN || image.width <= 0 || image.height <= 0)
+		return false;
+
+	int levelCount = (header.flags & FLAG_MIPMAPCOUNT) && header.mipMapCount > 0 ? (int)header.mipMapCount : 1;
+	int width = image.width, height = image.height;
+	for (int i = 0; i < levelCount; i++) {
+		DDSLevel level;
+		level.offset = offset;
+		level.width = width;
+		level.height = height;
+		level.size = DDSLevelSize(image.format, width, height);
+		if (offset + level.size > (fileSize ? fileSize : size))
+			return false;
+		image.levels.push_back(level);
+		offset += level.size;
+		width = width > 1 ? width / 2 : 1;
+		height = height > 1 ? height / 2 : 1;
+	}
+	return true;
+}
+
+// writes a DX10 style DDS, levels[i] holds the data of mip i, largest first
+inline bool WriteDDS(const std::string& path, DDSFormat format, bool srgb, int width, int height,
+	const std::vector<std::vector<unsigned char>>& levels) {
+	using namespace dds_detail;
+	Header header;
+	memset(&header, 0, sizeof(header));
+	header.size = sizeof(Header);
+	header.flags = FLAGS_TEXTURE | FLAG_MIPMAPCOUNT | FLAG_LINEARSIZE;
+	header.width = (uint32_t)width;
+	header.height = (uint32_t)height;
+	header.pitchOrLinearSize = (uint32_t)levels[0].size();
+	header.mipMapCount = (uint32_t)levels.size();
+	header.pixelFormat.size = sizeof(PixelFormat);
+	header.pixelFormat.flags = PF_FOURCC;
+	header.pixelFormat.fourCC = FourCC('D', 'X', '1', '0');
+	header.caps = CAPS_TEXTURE | (levels.size() > 1 ? CAPS_COMPLEX | CAPS_MIPMAP : 0);
+
+	HeaderDX10 dx10;
+	dx10.dxgiFormat = DXGIFormat(format, srgb);
+	dx10.resourceDimension = DIMENSION_TEXTURE2D;
+	dx10.miscFlag = 0;
+	dx10.arraySize = 1;
+	dx10.miscFlags2 = 0;
+
+	FILE* file = OpenFile(path, "wb");
+	if (!file)
+		return false;
+	bool ok = fwrite(&MAGIC, sizeof(MAGIC), 1, file) == 1
+		&& fwrite(&header, sizeof(header), 1, file) == 1
+		&& fwrite(&dx10, sizeof(dx10), 1, file) == 1;
+	for (size_t i = 0; ok && i < levels.size(); i++)
+		ok = fwrite(levels[i].data(), 1, levels[i].size(), file) == levels[i].size();
+	fclose(file);
+	return ok;
+}
+
+// whole file into memory, empty on failure
+inline std::vector<unsigned char> ReadFileBytes(const std::string& path) {
+	std::vector<unsigned char> bytes;
+	FILE* file = dds_detail::OpenFile(path, "rb");
+	if (!file)
+		return bytes;
+	int64_t size = dds_detail::FileSize(file);
+	if (size > 0) {
+		bytes.resize((size_t)size);
+		if (fread(bytes.data(), 1, bytes.size(), file) != bytes.size())
+			bytes.clear();
+	}
+	fclose(file);
+	return bytes;
+}
+
+// size bytes starting at offset, empty on failure
+inline std::vector<unsigned char> ReadFileRange(const std::string& path, size_t offset, size_t size) {
+	std::vector<unsigned char> bytes(size);
+	FILE* file = dds_detail::OpenFile(path, "rb");
+	if (!file)
+		return std::vector<unsigned char>();
+	if (!dds_detail::SeekFile(file, offset) || fread(bytes.data(), 1, size, file) != size)
+		bytes.clear();
+	fclose(file);
+	return bytes;
+}
+
+// only reads the headers, so the levels can be read one at a time later with ReadFileRange
+inline bool ReadDDSHeader(const std::string& path, DDSImage& image) {
+	using namespace dds_detail;
+	FILE* file = OpenFile(path, "rb");
+	if (!file)
+		return false;
+	unsigned char header[sizeof(uint32_t) + sizeof(Header) + sizeof(HeaderDX10)];
+	size_t read = fread(header, 1, sizeof(header), file);
+	int64_t size = FileSize(file);
+	fclose(file);
+	return size > 0 && ParseDDS(header, read, image, (size_t)size);
+}
+
+#endif
@@ -0,0 +1,46 @@
+#version 460 core
+out vec4 FragColor;
+uniform vec3 lightColor;
+uniform vec3 lightPos;
+uniform vec3 viewPos; // camera position in world space
+
+// where each texture packed by the TexturePacker (texture_packer.h) ended up: the layer of the array
+// and, for atlased textures, the rectangle of the page it was placed in
+struct TextureTableEntry {
+	vec4 uvTransform; // xy scale, zw offset
+	uint layer;
+};
+layout (std430, binding = 2) readonly buffer TextureTable {
+	TextureTableEntry textures[];
+};
+// the array the material binds, objects with textures in the same array are drawn together
+uniform sampler2DArray packedTextures;
+
+in vec3 FragPos;
+in vec3 Normal;
+in vec2 TexCoords;
+flat in uint textureIndex;
+
+float specularStrength = 0.65;
+
+void main()
+{
+	TextureTableEntry entry = textures[textureIndex];
+	vec2 uv = TexCoords * entry.uvTransform.xy + entry.uvTransform.zw;
+	vec3 objectColor = texture(packedTextures, vec3(uv, entry.layer)).rgb;
+
+	float ambientStrength = 0.11;
+	vec3 ambient = ambientStrength * lightColor;
+
+	vec3 norm = normalize(Normal);
+	vec3 lightDir = normalize(lightPos - FragPos);
+	float diff = max(dot(norm, lightDir), 0.0);
+	vec3 diffuse = diff * lightColor;
+
+	vec3 viewDir = normalize(viewPos - FragPos);
+	vec3 reflectDir = reflect(-lightDir, norm);
+	float spec = pow(max(dot(viewDir, reflectDir), 0.0), 32);
+	vec3 specular = specularStrength * spec * lightColor;
+
+	FragColor = vec4((ambient + diffuse) * objectColor + specular, 1.0);
+}
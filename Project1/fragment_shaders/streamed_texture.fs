@@ -0,0 +1,35 @@
+#version 460 core
+out vec4 FragColor;
+uniform vec3 lightColor;
+uniform vec3 lightPos;
+uniform vec3 viewPos; // camera position in world space
+
+// a texture the TextureManager streams (texture_manager.h), bound by main.cpp every frame since its GL
+// texture changes as levels come in and go out
+layout (binding = 14) uniform sampler2D streamedTexture;
+
+in vec3 FragPos;
+in vec3 Normal;
+in vec2 TexCoords;
+
+float specularStrength = 0.65;
+
+void main()
+{
+	vec3 objectColor = texture(streamedTexture, TexCoords).rgb;
+
+	float ambientStrength = 0.11;
+	vec3 ambient = ambientStrength * lightColor;
+
+	vec3 norm = normalize(Normal);
+	vec3 lightDir = normalize(lightPos - FragPos);
+	float diff = max(dot(norm, lightDir), 0.0);
+	vec3 diffuse = diff * lightColor;
+
+	vec3 viewDir = normalize(viewPos - FragPos);
+	vec3 reflectDir = reflect(-lightDir, norm);
+	float spec = pow(max(dot(viewDir, reflectDir), 0.0), 32);
+	vec3 specular = specularStrength * spec * lightColor;
+
+	FragColor = vec4((ambient + diffuse) * objectColor + specular, 1.0);
+}
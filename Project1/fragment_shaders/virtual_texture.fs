@@ -0,0 +1,37 @@
+#version 460 core
+out vec4 FragColor;
+
+in vec2 TexCoords;
+
+uniform sampler2D vtPhysical; // the page cache
+uniform sampler2D vtIndirection; // slot of the finest resident page, one mip level per level
+uniform vec4 vtSize; // level 0 width, height, page size, border
+uniform vec4 vtCache; // page cache size, slot size, last level
+
+float mipLevel(vec2 uv)
+{
+	vec2 texel = uv * vtSize.xy;
+	vec2 dx = dFdx(texel), dy = dFdy(texel);
+	return 0.5 * log2(max(dot(dx, dx), dot(dy, dy)));
+}
+
+void main()
+{
+	vec2 uv = clamp(TexCoords, 0.0, 1.0);
+	int level = int(clamp(floor(mipLevel(uv)), 0.0, vtCache.z));
+	ivec2 levelSize = max(ivec2(vtSize.xy) >> level, ivec2(1));
+	ivec2 pages = (levelSize + int(vtSize.z) - 1) / int(vtSize.z);
+	ivec2 page = min(ivec2(uv * vec2(levelSize) / vtSize.z), pages - 1);
+
+	// slot x, slot y and the level of the page that's actually there, which may be coarser
+	vec3 entry = texelFetch(vtIndirection, page, level).xyz * 255.0;
+	int residentLevel = int(entry.z + 0.5);
+	// every level up halves the page coordinates, like ParentPage()
+	ivec2 residentPage = page >> (residentLevel - level);
+	vec2 residentSize = vec2(max(ivec2(vtSize.xy) >> residentLevel, ivec2(1)));
+	vec2 inPage = uv * residentSize - vec2(residentPage) * vtSize.z;
+	vec2 physical = (floor(entry.xy + 0.5) * vtCache.y + vtSize.w + inPage) / vtCache.x;
+
+	// the cache has no mip levels, the page was picked for this level already
+	FragColor = textureLod(vtPhysical, physical, 0.0);
+}
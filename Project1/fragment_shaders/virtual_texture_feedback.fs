@@ -0,0 +1,29 @@
+#version 460 core
+// the page of the virtual texture every pixel needs, read back by VirtualTexture
+layout (location = 0) out uint PageID;
+
+in vec2 TexCoords;
+
+uniform vec4 vtSize; // level 0 width, height, page size, border
+uniform vec4 vtCache; // page cache size, slot size, last level
+uniform vec2 vtLevelBias; // makes up for the feedback being drawn smaller than the screen
+
+// the level hardware mipmapping would pick
+float mipLevel(vec2 uv)
+{
+	vec2 texel = uv * vtSize.xy;
+	vec2 dx = dFdx(texel), dy = dFdy(texel);
+	return 0.5 * log2(max(dot(dx, dx), dot(dy, dy)));
+}
+
+void main()
+{
+	vec2 uv = clamp(TexCoords, 0.0, 1.0);
+	int level = int(clamp(floor(mipLevel(uv) + vtLevelBias.x), 0.0, vtCache.z));
+	// pages of the level, rounded up like VirtualTextureLayout::PagesX does
+	ivec2 levelSize = max(ivec2(vtSize.xy) >> level, ivec2(1));
+	ivec2 pages = (levelSize + int(vtSize.z) - 1) / int(vtSize.z);
+	ivec2 page = min(ivec2(uv * vec2(levelSize) / vtSize.z), pages - 1);
+	// same packing as MakePageID()
+	PageID = uint(page.x) | (uint(page.y) << 12) | (uint(level) << 24);
+}
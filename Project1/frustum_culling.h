@@ -0,0 +1,397 @@
+#ifndef FRUSTUM_CULLING_H
+#define FRUSTUM_CULLING_H
+
+// Plugins for OpenGL Mathematics
+// Allows us to use mathematical transformations into our engine for any object
+#include <glm/glm.hpp>
+
+#include <vector>
+#include <algorithm>
+#include <cstring>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+#include <immintrin.h>
+#define FRUSTUM_CULLING_AVX2
+#ifdef _MSC_VER
+#include <intrin.h>
+#define FRUSTUM_CULLING_AVX2_TARGET
+#else
+#define FRUSTUM_CULLING_AVX2_TARGET __attribute__((target("avx2,fma")))
+#endif
+#endif
+
+#include "bounds.h"
+#include "thread_pool.h"
+
+using namespace glm;
+using namespace std;
+
+// Finds the objects the camera can see before anything is submitted, so whatever is off screen costs
+// a plane test and nothing else.
+//
+// The frustum is the six planes of the view-projection matrix, their normals pointing inside. Bounds
+// are kept as a structure of arrays, one array per component, so eight objects load into one AVX2
+// register per component. A sphere is outside once its center is more than its radius behind a plane,
+// a box once its corner furthest along the plane's normal is behind it; which corner that is only
+// depends on the signs of the normal, so per plane it's just a choice between the min and max arrays.
+// The indices of the visible objects are written out packed. Without AVX2 the same tests run one
+// object at a time.
+//
+// The parallel versions split the objects into blocks over a thread pool. Every block writes into its
+// own part of the output and the parts are moved together afterwards, so the order stays the same.
+
+struct Frustum {
+	vec4 planes[6]; // left, right, bottom, top, near, far. xyz is the unit normal, inside is dot + w >= 0
+};
+
+// the planes of everything the matrix maps into the clip volume, GL clip depth from -w to w
+inline Frustum ExtractFrustum(const mat4& viewProjection) {
+	// glm is column major, row i is m[0][i], m[1][i], ...
+	vec4 rows[4];
+	for (int i = 0; i < 4; i++)
+		rows[i] = vec4(viewProjection[0][i], viewProjection[1][i], viewProjection[2][i], viewProjection[3][i]);
+	Frustum frustum;
+	frustum.planes[0] = rows[3] + rows[0];
+	frustum.planes[1] = rows[3] - rows[0];
+	frustum.planes[2] = rows[3] + rows[1];
+	frustum.planes[3] = rows[3] - rows[1];
+	frustum.planes[4] = rows[3] + rows[2];
+	frustum.planes[5] = rows[3] - rows[2];
+	// unit normals make the distances real distances, which the sphere test needs
+	for (vec4& plane : frustum.planes)
+		plane = plane / length(vec3(plane));
+	return frustum;
+}
+
+inline bool IsVisible(const Frustum& frustum, const BoundingSphere& sphere) {
+	for (const vec4& plane : frustum.planes)
+		if (dot(vec3(plane), sphere.center) + plane.w < -sphere.radius)
+			return false;
+	return true;
+}
+
+inline bool IsVisible(const Frustum& frustum, const AABB& box) {
+	for (const vec4& plane : frustum.planes) {
+		vec3 corner(plane.x >= 0.0f ? box.maximum.x : box.minimum.x, plane.y >= 0.0f ? box.maximum.y : box.minimum.y,
+			plane.z >= 0.0f ? box.maximum.z : box.minimum.z);
+		if (dot(vec3(plane), corner) + plane.w < 0.0f)
+			return false;
+	}
+	return true;
+}
+
+enum CullSide {
+	CULL_OUTSIDE,
+	CULL_INTERSECTING,
+	CULL_INSIDE
+};
+
+// where a box is relative to the frustum, against the corners furthest along and furthest against every
+// plane's normal. For the nodes of spatial structures: one inside holds only visible objects
+inline CullSide Classify(const Frustum& frustum, const vec3& minimum, const vec3& maximum) {
+	CullSide side = CULL_INSIDE;
+	for (const vec4& plane : frustum.planes) {
+		vec3 furthest(plane.x >= 0.0f ? maximum.x : minimum.x, plane.y >= 0.0f ? maximum.y : minimum.y,
+			plane.z >= 0.0f ? maximum.z : minimum.z);
+		vec3 nearest(plane.x >= 0.0f ? minimum.x : maximum.x, plane.y >= 0.0f ? minimum.y : maximum.y,
+			plane.z >= 0.0f ? minimum.z : maximum.z);
+		if (dot(vec3(plane), furthest) + plane.w < 0.0f)
+			return CULL_OUTSIDE;
+		if (dot(vec3(plane), nearest) + plane.w < 0.0f)
+			side = CULL_INTERSECTING;
+	}
+	return side;
+}
+
+// world space spheres of many objects, one array per component
+struct CullingSpheres {
+	vector<float> x, y, z, radius;
+
+	size_t Size() const {
+		return radius.size();
+	}
+
+	void Resize(size_t count) {
+		x.resize(count);
+		y.resize(count);
+		z.resize(count);
+		radius.resize(count);
+	}
+
+	void Set(size_t index, const BoundingSphere& sphere) {
+		x[index] = sphere.center.x;
+		y[index] = sphere.center.y;
+		z[index] = sphere.center.z;
+		radius[index] = sphere.radius;
+	}
+
+	// returns the index of the new sphere
+	size_t Add(const BoundingSphere& sphere) {
+		Resize(Size() + 1);
+		Set(Size() - 1, sphere);
+		return Size() - 1;
+	}
+};
+
+// world space boxes of many objects, one array per component
+struct CullingBoxes {
+	vector<float> minX, minY, minZ, maxX, maxY, maxZ;
+
+	size_t Size() const {
+		return minX.size();
+	}
+
+	void Resize(size_t count) {
+		minX.resize(count);
+		minY.resize(count);
+		minZ.resize(count);
+		maxX.resize(count);
+		maxY.resize(count);
+		maxZ.resize(count);
+	}
+
+	void Set(size_t index, const AABB& box) {
+		minX[index] = box.minimum.x;
+		minY[index] = box.minimum.y;
+		minZ[index] = box.minimum.z;
+		maxX[index] = box.maximum.x;
+		maxY[index] = box.maximum.y;
+		maxZ[index] = box.maximum.z;
+	}
+
+	// returns the index of the new box
+	size_t Add(const AABB& box) {
+		Resize(Size() + 1);
+		Set(Size() - 1, box);
+		return Size() - 1;
+	}
+};
+
+enum CullSimd {
+	CULL_SIMD_AUTO,
+	CULL_SIMD_SCALAR,
+	CULL_SIMD_AVX2
+};
+
+namespace culling_detail {
+
+	// objects per block of the parallel versions
+	const size_t BLOCK = 16384;
+
+	// the arrays of a box test against one plane: the corner furthest along its normal
+	struct BoxPlane {
+		const float* x;
+		const float* y;
+		const float* z;
+	};
+
+	inline BoxPlane FurthestCorner(const CullingBoxes& boxes, const vec4& plane) {
+		BoxPlane corner;
+		corner.x = plane.x >= 0.0f ? boxes.maxX.data() : boxes.minX.data();
+		corner.y = plane.y >= 0.0f ? boxes.maxY.data() : boxes.minY.data();
+		corner.z = plane.z >= 0.0f ? boxes.maxZ.data() : boxes.minZ.data();
+		return corner;
+	}
+
+	inline size_t SpheresScalar(const Frustum& frustum, const CullingSpheres& spheres, size_t begin, size_t end,
+		unsigned int* visible) {
+		size_t count = 0;
+		for (size_t i = begin; i < end; i++) {
+			bool inside = true;
+			for (const vec4& plane : frustum.planes)
+				inside &= plane.x * spheres.x[i] + plane.y * spheres.y[i] + plane.z * spheres.z[i] + plane.w >= -spheres.radius[i];
+			visible[count] = (unsigned int)i;
+			count += inside;
+		}
+		return count;
+	}
+
+	inline size_t BoxesScalar(const Frustum& frustum, const CullingBoxes& boxes, size_t begin, size_t end,
+		unsigned int* visible) {
+		BoxPlane corners[6];
+		for (int p = 0; p < 6; p++)
+			corners[p] = FurthestCorner(boxes, frustum.planes[p]);
+		size_t count = 0;
+		for (size_t i = begin; i < end; i++) {
+			bool inside = true;
+			for (int p = 0; p < 6; p++) {
+				const vec4& plane = frustum.planes[p];
+				inside &= plane.x * corners[p].x[i] + plane.y * corners[p].y[i] + plane.z * corners[p].z[i] + plane.w >= 0.0f;
+			}
+			visible[count] = (unsigned int)i;
+			count += inside;
+		}
+		return count;
+	}
+
+#ifdef FRUSTUM_CULLING_AVX2
+	inline int LowestBit(unsigned int mask) {
+#ifdef _MSC_VER
+		unsigned long index;
+		_BitScanForward(&index, mask);
+		return (int)index;
+#else
+		return __builtin_ctz(mask);
+#endif
+	}
+
+	// appends first + the index of every set bit of the 8 bit mask
+	inline size_t WriteVisible(unsigned int mask, size_t first, unsigned int* visible) {
+		size_t count = 0;
+		while (mask) {
+			visible[count++] = (unsigned int)first + LowestBit(mask);
+			mask &= mask - 1;
+		}
+		return count;
+	}
+
+	FRUSTUM_CULLING_AVX2_TARGET
+	inline size_t SpheresAVX2(const Frustum& frustum, const CullingSpheres& spheres, size_t begin, size_t end,
+		unsigned int* visible) {
+		__m256 nx[6], ny[6], nz[6], w[6];
+		for (int p = 0; p < 6; p++) {
+			nx[p] = _mm256_set1_ps(frustum.planes[p].x);
+			ny[p] = _mm256_set1_ps(frustum.planes[p].y);
+			nz[p] = _mm256_set1_ps(frustum.planes[p].z);
+			w[p] = _mm256_set1_ps(frustum.planes[p].w);
+		}
+		const __m256 zero = _mm256_setzero_ps();
+		size_t count = 0, i = begin;
+		for (; i + 8 <= end; i += 8) {
+			__m256 x = _mm256_loadu_ps(&spheres.x[i]), y = _mm256_loadu_ps(&spheres.y[i]);
+			__m256 z = _mm256_loadu_ps(&spheres.z[i]), radius = _mm256_loadu_ps(&spheres.radius[i]);
+			__m256 inside = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+			for (int p = 0; p < 6; p++) {
+				// distance + radius >= 0, with the radius as the innermost add
+				__m256 d = _mm256_fmadd_ps(nx[p], x, _mm256_fmadd_ps(ny[p], y, _mm256_fmadd_ps(nz[p], z, _mm256_add_ps(w[p], radius))));
+				inside = _mm256_and_ps(inside, _mm256_cmp_ps(d, zero, _CMP_GE_OQ));
+			}
+			count += WriteVisible((unsigned int)_mm256_movemask_ps(inside), i, visible + count);
+		}
+		return count + SpheresScalar(frustum, spheres, i, end, visible + count);
+	}
+
+	FRUSTUM_CULLING_AVX2_TARGET
+	inline size_t BoxesAVX2(const Frustum& frustum, const CullingBoxes& boxes, size_t begin, size_t end,
+		unsigned int* visible) {
+		BoxPlane corners[6];
+		__m256 nx[6], ny[6], nz[6], w[6];
+		for (int p = 0; p < 6; p++) {
+			corners[p] = FurthestCorner(boxes, frustum.planes[p]);
+			nx[p] = _mm256_set1_ps(frustum.planes[p].x);
+			ny[p] = _mm256_set1_ps(frustum.planes[p].y);
+			nz[p] = _mm256_set1_ps(frustum.planes[p].z);
+			w[p] = _mm256_set1_ps(frustum.planes[p].w);
+		}
+		const __m256 zero = _mm256_setzero_ps();
+		size_t count = 0, i = begin;
+		for (; i + 8 <= end; i += 8) {
+			__m256 inside = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+			for (int p = 0; p < 6; p++) {
+				__m256 d = _mm256_fmadd_ps(nx[p], _mm256_loadu_ps(corners[p].x + i),
+					_mm256_fmadd_ps(ny[p], _mm256_loadu_ps(corners[p].y + i), _mm256_fmadd_ps(nz[p], _mm256_loadu_ps(corners[p].z + i), w[p])));
+				inside = _mm256_and_ps(inside, _mm256_cmp_ps(d, zero, _CMP_GE_OQ));
+			}
+			count += WriteVisible((unsigned int)_mm256_movemask_ps(inside), i, visible + count);
+		}
+		return count + BoxesScalar(frustum, boxes, i, end, visible + count);
+	}
+#endif
+
+	inline bool CpuHasAVX2() {
+#if defined(FRUSTUM_CULLING_AVX2) && defined(_MSC_VER)
+		int info[4];
+		__cpuid(info, 0);
+		if (info[0] < 7)
+			return false;
+		__cpuid(info, 1);
+		bool osSavesYmm = (info[2] & (1 << 27)) != 0; // OSXSAVE
+		bool avx = (info[2] & (1 << 28)) != 0, fma = (info[2] & (1 << 12)) != 0;
+		if (!osSavesYmm || !avx || !fma || (_xgetbv(0) & 6) != 6)
+			return false;
+		__cpuidex(info, 7, 0);
+		return (info[1] & (1 << 5)) != 0;
+#elif defined(FRUSTUM_CULLING_AVX2)
+		return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+#else
+		return false;
+#endif
+	}
+
+	// the fastest path this build and CPU can run, asking for one that isn't there falls back
+	inline CullSimd ResolveSimd(CullSimd requested) {
+		static const bool avx2 = CpuHasAVX2();
+		if (requested == CULL_SIMD_SCALAR || !avx2)
+			return CULL_SIMD_SCALAR;
+		return CULL_SIMD_AVX2;
+	}
+
+	inline size_t CullRange(const Frustum& frustum, const CullingSpheres& spheres, size_t begin, size_t end,
+		unsigned int* visible, CullSimd simd) {
+#ifdef FRUSTUM_CULLING_AVX2
+		if (simd == CULL_SIMD_AVX2)
+			return SpheresAVX2(frustum, spheres, begin, end, visible);
+#endif
+		return SpheresScalar(frustum, spheres, begin, end, visible);
+	}
+
+	inline size_t CullRange(const Frustum& frustum, const CullingBoxes& boxes, size_t begin, size_t end,
+		unsigned int* visible, CullSimd simd) {
+#ifdef FRUSTUM_CULLING_AVX2
+		if (simd == CULL_SIMD_AVX2)
+			return BoxesAVX2(frustum, boxes, begin, end, visible);
+#endif
+		return BoxesScalar(frustum, boxes, begin, end, visible);
+	}
+
+	// blocks over the pool, each packs its visible indices at its own start in visible, then they're
+	// moved down behind each other
+	template <typename Bounds>
+	inline size_t CullParallel(const Frustum& frustum, const Bounds& bounds, unsigned int* visible, ThreadPool& pool,
+		CullSimd simd) {
+		size_t objects = bounds.Size();
+		size_t blocks = (objects + BLOCK - 1) / BLOCK;
+		vector<size_t> counts(blocks);
+		pool.ParallelFor(blocks, [&](size_t first, size_t last) {
+			for (size_t b = first; b < last; b++) {
+				size_t begin = b * BLOCK;
+				counts[b] = CullRange(frustum, bounds, begin, std::min(begin + BLOCK, objects), visible + begin, simd);
+			}
+		});
+		size_t count = blocks > 0 ? counts[0] : 0;
+		for (size_t b = 1; b < blocks; b++) {
+			memmove(visible + count, visible + b * BLOCK, counts[b] * sizeof(unsigned int));
+			count += counts[b];
+		}
+		return count;
+	}
+}
+
+// writes the indices of the spheres inside or touching the frustum into visible, which needs room for
+// all of them, and returns how many there are
+inline size_t CullSpheres(const Frustum& frustum, const CullingSpheres& spheres, unsigned int* visible,
+	CullSimd simd = CULL_SIMD_AUTO) {
+	using namespace culling_detail;
+	return CullRange(frustum, spheres, 0, spheres.Size(), visible, ResolveSimd(simd));
+}
+
+inline size_t CullBoxes(const Frustum& frustum, const CullingBoxes& boxes, unsigned int* visible,
+	CullSimd simd = CULL_SIMD_AUTO) {
+	using namespace culling_detail;
+	return CullRange(frustum, boxes, 0, boxes.Size(), visible, ResolveSimd(simd));
+}
+
+// like CullSpheres(), split over the pool and the calling thread. Don't call it from inside a pool job
+inline size_t CullSpheresParallel(const Frustum& frustum, const CullingSpheres& spheres, unsigned int* visible,
+	ThreadPool& pool, CullSimd simd = CULL_SIMD_AUTO) {
+	using namespace culling_detail;
+	return CullParallel(frustum, spheres, visible, pool, ResolveSimd(simd));
+}
+
+inline size_t CullBoxesParallel(const Frustum& frustum, const CullingBoxes& boxes, unsigned int* visible,
+	ThreadPool& pool, CullSimd simd = CULL_SIMD_AUTO) {
+	using namespace culling_detail;
+	return CullParallel(frustum, boxes, visible, pool, ResolveSimd(simd));
+}
+
+#endif
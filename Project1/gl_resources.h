@@ -0,0 +1,94 @@
+#ifndef GL_RESOURCES_H
+#define GL_RESOURCES_H
+
+#include <glad/glad.h>
+
+#include <algorithm>
+
+#include "dds.h"
+
+// Resource creation through Direct State Access (OpenGL 4.5+).
+// Objects are edited by name instead of being bound first, so creating resources never
+// disturbs the bindings the state cache knows about. Buffers and textures use immutable
+// storage, their size and format can't change after creation which lets the driver skip
+// reallocation and most validation when they're used.
+
+// creates a buffer with immutable storage, flags is 0 for static data or a combination of
+// GL_DYNAMIC_STORAGE_BIT / GL_MAP_*_BIT when it needs to be updated later
+inline GLuint CreateBuffer(GLsizeiptr size, const void* data, GLbitfield flags = 0) {
+	GLuint buffer;
+	glCreateBuffers(1, &buffer);
+	glNamedBufferStorage(buffer, size, data, flags);
+	return buffer;
+}
+
+// number of mip levels in a full chain down to 1x1
+inline GLsizei MipLevelCount(GLsizei width, GLsizei height) {
+	GLsizei levels = 1;
+	GLsizei size = std::max(width, height);
+	while (size > 1) {
+		size >>= 1;
+		levels++;
+	}
+	return levels;
+}
+
+// creates a 2D texture with immutable storage, internalFormat has to be a sized format (GL_RGBA8, ...)
+inline GLuint CreateTexture2D(GLsizei width, GLsizei height, GLenum internalFormat, GLsizei levels = 1) {
+	GLuint texture;
+	glCreateTextures(GL_TEXTURE_2D, 1, &texture);
+	glTextureStorage2D(texture, levels, internalFormat, width, height);
+	return texture;
+}
+
+// creates a multisampled 2D texture with immutable storage, for render targets that get read back by
+// shaders (texelFetch on a sampler2DMS) instead of only being resolved
+inline GLuint CreateTexture2DMultisample(GLsizei samples, GLsizei width, GLsizei height, GLenum internalFormat) {
+	GLuint texture;
+	glCreateTextures(GL_TEXTURE_2D_MULTISAMPLE, 1, &texture);
+	glTextureStorage2DMultisample(texture, samples, internalFormat, width, height, GL_TRUE);
+	return texture;
+}
+
+// creates a 2D array texture with immutable storage, every layer has the same size, format and mip count
+inline GLuint CreateTexture2DArray(GLsizei width, GLsizei height, GLsizei layers, GLenum internalFormat, GLsizei levels = 1) {
+	GLuint texture;
+	glCreateTextures(GL_TEXTURE_2D_ARRAY, 1, &texture);
+	glTextureStorage3D(texture, levels, internalFormat, width, height, layers);
+	return texture;
+}
+
+// the sized GL format for data in a cooked format
+inline GLenum DDSInternalFormat(DDSFormat format, bool srgb) {
+	switch (format) {
+	case DDS_BC1: return srgb ? GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT1_EXT : GL_COMPRESSED_RGBA_S3TC_DXT1_EXT;
+	case DDS_BC3: return srgb ? GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT5_EXT : GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+	case DDS_BC4: return GL_COMPRESSED_RED_RGTC1;
+	case DDS_BC5: return GL_COMPRESSED_RG_RGTC2;
+	case DDS_BC7: return srgb ? GL_COMPRESSED_SRGB_ALPHA_BPTC_UNORM : GL_COMPRESSED_RGBA_BPTC_UNORM;
+	default: return srgb ? GL_SRGB8_ALPHA8 : GL_RGBA8;
+	}
+}
+
+inline void SetTextureSampling(GLuint texture, GLenum wrap, GLenum minFilter, GLenum magFilter) {
+	glTextureParameteri(texture, GL_TEXTURE_WRAP_S, wrap);
+	glTextureParameteri(texture, GL_TEXTURE_WRAP_T, wrap);
+	glTextureParameteri(texture, GL_TEXTURE_MIN_FILTER, minFilter);
+	glTextureParameteri(texture, GL_TEXTURE_MAG_FILTER, magFilter);
+}
+
+inline GLuint CreateVertexArray() {
+	GLuint VAO;
+	glCreateVertexArrays(1, &VAO);
+	return VAO;
+}
+
+// enables an attribute of the VAO and tells it where it is inside the vertex at the given binding point
+inline void SetVertexAttribute(GLuint VAO, GLuint attribute, GLuint binding, GLint size, GLenum type,
+	GLuint relativeOffset, GLboolean normalized = GL_FALSE) {
+	glEnableVertexArrayAttrib(VAO, attribute);
+	glVertexArrayAttribFormat(VAO, attribute, size, type, normalized, relativeOffset);
+	glVertexArrayAttribBinding(VAO, attribute, binding);
+}
+
+#endif
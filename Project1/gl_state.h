@@ -0,0 +1,287 @@
+#ifndef GL_STATE_H
+#define GL_STATE_H
+
+#include <glad/glad.h>
+
+// Tracks the OpenGL state that the engine changes the most (program, VAO, textures, buffers and
+// enable/disable toggles) so binds that wouldn't change anything never reach the driver.
+// Every bind in engine code has to go through here, otherwise the cache goes out of sync with the driver.
+//
+// Code we don't control (the ImGui OpenGL3 backend for example) changes state behind our back,
+// so after it runs call Resync() to read the real state back, or Invalidate() to just forget
+// everything and let the next binds go through unfiltered.
+
+// counters since the last ResetStats(), "skipped" means the call was filtered out
+struct GLStateStats {
+	unsigned int programBinds = 0, programSkipped = 0;
+	unsigned int vaoBinds = 0, vaoSkipped = 0;
+	unsigned int textureBinds = 0, textureSkipped = 0;
+	unsigned int activeTextureChanges = 0, activeTextureSkipped = 0;
+	unsigned int bufferBinds = 0, bufferSkipped = 0;
+	unsigned int capabilityChanges = 0, capabilitySkipped = 0;
+};
+
+class GLStateCache {
+public:
+	// highest number of texture units we keep track of, anything above is passed straight through
+	static const unsigned int MAX_TEXTURE_UNITS = 32;
+
+	GLStateStats stats;
+
+	static GLStateCache& Get() {
+		static GLStateCache instance;
+		return instance;
+	}
+
+	void UseProgram(GLuint program) {
+		if (program == this->program) {
+			stats.programSkipped++;
+			return;
+		}
+		glUseProgram(program);
+		this->program = program;
+		stats.programBinds++;
+	}
+
+	void BindVertexArray(GLuint VAO) {
+		if (VAO == this->VAO) {
+			stats.vaoSkipped++;
+			return;
+		}
+		glBindVertexArray(VAO);
+		this->VAO = VAO;
+		stats.vaoBinds++;
+	}
+
+	// unit is the index of the texture unit (0, 1, ...), not GL_TEXTURE0 + index
+	void ActiveTexture(GLuint unit) {
+		if (unit == activeUnit) {
+			stats.activeTextureSkipped++;
+			return;
+		}
+		glActiveTexture(GL_TEXTURE0 + unit);
+		activeUnit = unit;
+		stats.activeTextureChanges++;
+	}
+
+	void BindTexture(GLuint unit, GLenum target, GLuint texture) {
+		int slot = textureTargetSlot(target);
+		if (unit >= MAX_TEXTURE_UNITS || slot < 0) {
+			ActiveTexture(unit);
+			glBindTexture(target, texture);
+			stats.textureBinds++;
+			return;
+		}
+		if (textures[unit][slot] == texture) {
+			stats.textureSkipped++;
+			return;
+		}
+		ActiveTexture(unit);
+		glBindTexture(target, texture);
+		textures[unit][slot] = texture;
+		stats.textureBinds++;
+	}
+
+	// GL_ELEMENT_ARRAY_BUFFER isn't cached here since it belongs to the bound VAO
+	void BindBuffer(GLenum target, GLuint buffer) {
+		int slot = bufferTargetSlot(target);
+		if (slot < 0) {
+			glBindBuffer(target, buffer);
+			stats.bufferBinds++;
+			return;
+		}
+		if (buffers[slot] == buffer) {
+			stats.bufferSkipped++;
+			return;
+		}
+		glBindBuffer(target, buffer);
+		buffers[slot] = buffer;
+		stats.bufferBinds++;
+	}
+
+	// binds a range of the buffer to an indexed binding point (uniform blocks, storage blocks),
+	// which also replaces the generic binding of that target
+	void BindBufferRange(GLenum target, GLuint index, GLuint buffer, GLintptr offset, GLsizeiptr size) {
+		glBindBufferRange(target, index, buffer, offset, size);
+		int slot = bufferTargetSlot(target);
+		if (slot >= 0)
+			buffers[slot] = buffer;
+		stats.bufferBinds++;
+	}
+
+	void Enable(GLenum capability) { setCapability(capability, true); }
+	void Disable(GLenum capability) { setCapability(capability, false); }
+
+	void DepthMask(bool enabled) {
+		GLint value = enabled ? 1 : 0;
+		if (value == depthMask) {
+			stats.capabilitySkipped++;
+			return;
+		}
+		glDepthMask(enabled ? GL_TRUE : GL_FALSE);
+		depthMask = value;
+		stats.capabilityChanges++;
+	}
+
+	void BlendFunc(GLenum src, GLenum dst) {
+		if (src == blendSrc && dst == blendDst) {
+			stats.capabilitySkipped++;
+			return;
+		}
+		glBlendFunc(src, dst);
+		blendSrc = src;
+		blendDst = dst;
+		stats.capabilityChanges++;
+	}
+
+	// objects that get deleted are unbound by the driver, and their names can be handed out again
+	void DeleteTexture(GLuint texture) {
+		for (unsigned int i = 0; i < MAX_TEXTURE_UNITS; i++)
+			for (unsigned int j = 0; j < TEXTURE_TARGETS; j++)
+				if (textures[i][j] == texture)
+					textures[i][j] = 0;
+		glDeleteTextures(1, &texture);
+	}
+
+	void DeleteBuffer(GLuint buffer) {
+		for (unsigned int i = 0; i < BUFFER_TARGETS; i++)
+			if (buffers[i] == buffer)
+				buffers[i] = 0;
+		glDeleteBuffers(1, &buffer);
+	}
+
+	void DeleteVertexArray(GLuint VAO) {
+		if (this->VAO == VAO)
+			this->VAO = 0;
+		glDeleteVertexArrays(1, &VAO);
+	}
+
+	// forget everything we know, the next call of every kind goes to the driver
+	void Invalidate() {
+		program = UNKNOWN;
+		VAO = UNKNOWN;
+		activeUnit = UNKNOWN;
+		for (unsigned int i = 0; i < MAX_TEXTURE_UNITS; i++)
+			for (unsigned int j = 0; j < TEXTURE_TARGETS; j++)
+				textures[i][j] = UNKNOWN;
+		for (unsigned int i = 0; i < BUFFER_TARGETS; i++)
+			buffers[i] = UNKNOWN;
+		for (unsigned int i = 0; i < CAPABILITIES; i++)
+			capabilities[i] = -1;
+		depthMask = -1;
+		blendSrc = blendDst = UNKNOWN;
+	}
+
+	// reads the current state back from the driver, used after third-party code has touched it
+	void Resync() {
+		GLint value;
+		glGetIntegerv(GL_CURRENT_PROGRAM, &value);
+		program = value;
+		glGetIntegerv(GL_VERTEX_ARRAY_BINDING, &value);
+		VAO = value;
+
+		GLint units = 0;
+		glGetIntegerv(GL_MAX_COMBINED_TEXTURE_IMAGE_UNITS, &units);
+		if (units > (GLint)MAX_TEXTURE_UNITS)
+			units = MAX_TEXTURE_UNITS;
+
+		for (unsigned int i = units; i < MAX_TEXTURE_UNITS; i++)
+			for (unsigned int j = 0; j < TEXTURE_TARGETS; j++)
+				textures[i][j] = UNKNOWN;
+
+		GLint active;
+		glGetIntegerv(GL_ACTIVE_TEXTURE, &active);
+		for (GLint i = 0; i < units; i++) {
+			glActiveTexture(GL_TEXTURE0 + i);
+			for (unsigned int j = 0; j < TEXTURE_TARGETS; j++) {
+				glGetIntegerv(textureBindingQueries[j], &value);
+				textures[i][j] = value;
+			}
+		}
+		glActiveTexture(active);
+		activeUnit = active - GL_TEXTURE0;
+
+		for (unsigned int i = 0; i < BUFFER_TARGETS; i++) {
+			glGetIntegerv(bufferBindingQueries[i], &value);
+			buffers[i] = value;
+		}
+		for (unsigned int i = 0; i < CAPABILITIES; i++)
+			capabilities[i] = glIsEnabled(capabilityList[i]) ? 1 : 0;
+
+		GLboolean mask;
+		glGetBooleanv(GL_DEPTH_WRITEMASK, &mask);
+		depthMask = mask ? 1 : 0;
+		glGetIntegerv(GL_BLEND_SRC_RGB, &value);
+		blendSrc = value;
+		glGetIntegerv(GL_BLEND_DST_RGB, &value);
+		blendDst = value;
+	}
+
+	void ResetStats() {
+		stats = GLStateStats();
+	}
+
+private:
+	static const GLuint UNKNOWN = ~0u;
+	static const unsigned int TEXTURE_TARGETS = 3;
+	static const unsigned int BUFFER_TARGETS = 7;
+	static const unsigned int CAPABILITIES = 7;
+
+	const GLenum textureTargetList[TEXTURE_TARGETS] = { GL_TEXTURE_2D, GL_TEXTURE_2D_ARRAY, GL_TEXTURE_CUBE_MAP };
+	const GLenum textureBindingQueries[TEXTURE_TARGETS] = { GL_TEXTURE_BINDING_2D, GL_TEXTURE_BINDING_2D_ARRAY, GL_TEXTURE_BINDING_CUBE_MAP };
+	const GLenum bufferTargetList[BUFFER_TARGETS] = { GL_ARRAY_BUFFER, GL_UNIFORM_BUFFER, GL_SHADER_STORAGE_BUFFER,
+		GL_PIXEL_UNPACK_BUFFER, GL_DRAW_INDIRECT_BUFFER, GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER };
+	const GLenum bufferBindingQueries[BUFFER_TARGETS] = { GL_ARRAY_BUFFER_BINDING, GL_UNIFORM_BUFFER_BINDING, GL_SHADER_STORAGE_BUFFER_BINDING,
+		GL_PIXEL_UNPACK_BUFFER_BINDING, GL_DRAW_INDIRECT_BUFFER_BINDING, GL_COPY_READ_BUFFER_BINDING, GL_COPY_WRITE_BUFFER_BINDING };
+	const GLenum capabilityList[CAPABILITIES] = { GL_DEPTH_TEST, GL_BLEND, GL_CULL_FACE, GL_SCISSOR_TEST,
+		GL_STENCIL_TEST, GL_MULTISAMPLE, GL_FRAMEBUFFER_SRGB };
+
+	GLuint program;
+	GLuint VAO;
+	GLuint activeUnit;
+	GLuint textures[MAX_TEXTURE_UNITS][TEXTURE_TARGETS];
+	GLuint buffers[BUFFER_TARGETS];
+	int capabilities[CAPABILITIES]; // -1 unknown, 0 disabled, 1 enabled
+	GLint depthMask;
+	GLuint blendSrc, blendDst;
+
+	// nothing is known until the first bind, so start out invalidated
+	GLStateCache() {
+		Invalidate();
+	}
+
+	int textureTargetSlot(GLenum target) const {
+		for (unsigned int i = 0; i < TEXTURE_TARGETS; i++)
+			if (textureTargetList[i] == target)
+				return i;
+		return -1;
+	}
+
+	int bufferTargetSlot(GLenum target) const {
+		for (unsigned int i = 0; i < BUFFER_TARGETS; i++)
+			if (bufferTargetList[i] == target)
+				return i;
+		return -1;
+	}
+
+	void setCapability(GLenum capability, bool enabled) {
+		int slot = -1;
+		for (unsigned int i = 0; i < CAPABILITIES; i++)
+			if (capabilityList[i] == capability)
+				slot = i;
+
+		if (slot >= 0 && capabilities[slot] == (enabled ? 1 : 0)) {
+			stats.capabilitySkipped++;
+			return;
+		}
+		if (enabled)
+			glEnable(capability);
+		else
+			glDisable(capability);
+		if (slot >= 0)
+			capabilities[slot] = enabled ? 1 : 0;
+		stats.capabilityChanges++;
+	}
+};
+
+#endif
@@ -0,0 +1,430 @@
+#ifndef GPU_CULLING_H
+#define GPU_CULLING_H
+
+#include <glad/glad.h>
+
+// Plugins for OpenGL Mathematics
+// Allows us to use mathematical transformations into our engine for any object
+#include <glm/glm.hpp>
+
+#include <vector>
+#include <algorithm>
+
+#include "shader.h"
+#include "bounds.h"
+#include "frustum_culling.h"
+#include "gl_state.h"
+#include "gl_resources.h"
+#include "stream_buffer.h"
+#include "binding_points.h"
+
+using namespace glm;
+using namespace std;
+
+// Culling and draw submission done entirely on the GPU, for scenes with far more instances than the
+// CPU paths (frustum_culling.h, occlusion_culling.h) should touch every frame.
+//
+// Every instance is a world space box, the mesh it draws and its object id in the scene buffer. They
+// live in a storage buffer that only gets the instances which changed. A compute shader tests them and
+// appends a DrawElementsIndirectCommand for each visible one, the draw count stays on the GPU and
+// glMultiDrawElementsIndirectCount draws them all in one call. The object id goes in as the base
+// instance, gpu_culled.vs reads it from gl_BaseInstance.
+//
+// Occlusion is tested against a depth pyramid, a mip chain where each texel is the farthest depth of
+// the texels below it, in two phases:
+//   1. test against the frustum and the pyramid of last frame's depth, draw what passes. Hidden
+//      instances go on a retest list
+//   2. build a pyramid from the depth the first phase left, test the retest list against it and draw
+//      what was disoccluded since last frame
+// Anything visible is drawn by one of the phases, so objects never pop in for a frame. At the end of
+// the frame the pyramid is built once more from the final depth, for the next frame's first phase.
+//
+//     culler.CullFirstPhase(viewProjection); bind shader and VAO; culler.Draw(GPU_CULL_FIRST);
+//     culler.BuildPyramid(depth, width, height, viewProjection);
+//     culler.CullSecondPhase(); culler.Draw(GPU_CULL_SECOND);
+//     ... rest of the frame ...; culler.BuildPyramid(depth, width, height, viewProjection);
+//
+// Every instance has to be drawable with the same shader and VAO, the meshes are ranges of its
+// GL_UNSIGNED_INT index buffer. The VAO shouldn't have instanced attributes, the base instance is an
+// object id and not an offset into an instance buffer. Needs 4.6, or 4.5 with
+// ARB_indirect_parameters and ARB_shader_draw_parameters (llvmpipe, for example).
+
+// The storage buffers and the texture unit it uses are in binding_points.h.
+
+enum GPUCullPhase {
+	GPU_CULL_FIRST = 0,
+	GPU_CULL_SECOND = 1
+};
+
+// the layout glMultiDrawElementsIndirect reads
+struct DrawElementsIndirectCommand {
+	GLuint count;
+	GLuint instanceCount;
+	GLuint firstIndex;
+	GLint baseVertex;
+	GLuint baseInstance;
+};
+
+// matches the std430 layout of Instance in instance_cull.comp, a vec3 and a uint share 16 bytes
+struct GPUInstance {
+	vec3 minimum;
+	GLuint object;
+	vec3 maximum;
+	GLuint mesh;
+};
+
+struct GPUMesh {
+	GLuint indexCount;
+	GLuint firstIndex;
+	GLint baseVertex;
+	GLuint padding;
+};
+
+struct GPUCullingStats {
+	unsigned int instances = 0;
+	unsigned int dirtyInstances = 0; // changed since the last first phase
+	unsigned int uploadRanges = 0;
+	int pyramidWidth = 0;
+	int pyramidHeight = 0;
+	int pyramidLevels = 0;
+	// only filled in by ReadBackStats()
+	unsigned int firstPhaseDraws = 0;
+	unsigned int secondPhaseDraws = 0;
+	unsigned int retested = 0;
+};
+
+namespace gpu_culling_detail {
+	inline int PreviousPowerOfTwo(int size) {
+		int power = 1;
+		while (power * 2 <= size)
+			power *= 2;
+		return power;
+	}
+}
+
+class GPUCuller {
+public:
+	GPUCullingStats stats;
+
+	GPUCuller(StreamBuffer& stream, unsigned int initialCapacity = 1024)
+		: stream(stream),
+		cullShader("compute_shaders/instance_cull.comp"),
+		pyramidInitShader("compute_shaders/hiz_init.comp"),
+		pyramidInitMultisampleShader("compute_shaders/hiz_init_ms.comp"),
+		pyramidReduceShader("compute_shaders/hiz_reduce.comp") {
+		// draw counts, retest count, padding and the group counts of the second phase's dispatch
+		const GLuint counters[8] = { 0, 0, 0, 0, 0, 1, 1, 0 };
+		counterBuffer = CreateBuffer(sizeof(counters), counters);
+		createBuffers(std::max(initialCapacity, 64u));
+	}
+
+	~GPUCuller() {
+		GLStateCache& state = GLStateCache::Get();
+		state.DeleteBuffer(instanceBuffer);
+		state.DeleteBuffer(commandBuffer);
+		state.DeleteBuffer(retestBuffer);
+		state.DeleteBuffer(counterBuffer);
+		if (meshBuffer)
+			state.DeleteBuffer(meshBuffer);
+		if (pyramid)
+			state.DeleteTexture(pyramid);
+		glDeleteProgram(cullShader.ID);
+		glDeleteProgram(pyramidInitShader.ID);
+		glDeleteProgram(pyramidInitMultisampleShader.ID);
+		glDeleteProgram(pyramidReduceShader.ID);
+	}
+
+	GPUCuller(const GPUCuller&) = delete;
+	GPUCuller& operator=(const GPUCuller&) = delete;
+
+	// whether the context has everything the culler needs
+	static bool Supported() {
+		return GLAD_GL_VERSION_4_6 ||
+			(GLAD_GL_VERSION_4_5 && GLAD_GL_ARB_indirect_parameters && GLAD_GL_ARB_shader_draw_parameters);
+	}
+
+	// a range of the index buffer, returns the id instances refer to it with
+	unsigned int AddMesh(GLuint indexCount, GLuint firstIndex = 0, GLint baseVertex = 0) {
+		meshes.push_back({ indexCount, firstIndex, baseVertex, 0 });
+		meshesChanged = true;
+		return (unsigned int)meshes.size() - 1;
+	}
+
+	// adds an instance and returns its id, the id stays the same until the instance is removed
+	unsigned int Add(const AABB& bounds, unsigned int mesh, unsigned int object) {
+		unsigned int id;
+		if (!freeIDs.empty()) {
+			id = freeIDs.back();
+			freeIDs.pop_back();
+		}
+		else {
+			id = (unsigned int)instances.size();
+			instances.push_back(GPUInstance());
+			dirtyFlags.push_back(0);
+		}
+		instances[id].object = object;
+		instances[id].mesh = mesh;
+		SetBounds(id, bounds);
+		return id;
+	}
+
+	void Remove(unsigned int id) {
+		instances[id].mesh = NONE;
+		markDirty(id);
+		freeIDs.push_back(id);
+	}
+
+	void SetBounds(unsigned int id, const AABB& bounds) {
+		instances[id].minimum = bounds.minimum;
+		instances[id].maximum = bounds.maximum;
+		markDirty(id);
+	}
+
+	// uploads the changed instances, then tests every instance against the frustum and last frame's
+	// pyramid and writes the first phase's draws
+	void CullFirstPhase(const mat4& viewProjection) {
+		upload();
+
+		// zeroes both draw counts, the retest count and the second phase's group count
+		glClearNamedBufferSubData(counterBuffer, GL_R32UI, 0, 5 * sizeof(GLuint), GL_RED_INTEGER, GL_UNSIGNED_INT, nullptr);
+
+		bindBuffers();
+		cullShader.use();
+		cullShader.setUInt("phase", GPU_CULL_FIRST);
+		cullShader.setUInt("instanceCount", (unsigned int)instances.size());
+		cullShader.setUInt("commandOffset", 0);
+		Frustum frustum = ExtractFrustum(viewProjection);
+		glUniform4fv(glGetUniformLocation(cullShader.ID, "frustumPlanes"), 6, &frustum.planes[0][0]);
+		setPyramidUniforms();
+
+		GLuint groups = ((GLuint)instances.size() + CULL_GROUP_SIZE - 1) / CULL_GROUP_SIZE;
+		if (groups > 0)
+			glDispatchCompute(groups, 1, 1);
+		glMemoryBarrier(GL_COMMAND_BARRIER_BIT | GL_SHADER_STORAGE_BARRIER_BIT);
+	}
+
+	// tests the instances the first phase found hidden against the pyramid built since, one invocation
+	// each. The first phase worked out the group count, so the CPU never learns how many there are
+	void CullSecondPhase() {
+		bindBuffers();
+		cullShader.use();
+		cullShader.setUInt("phase", GPU_CULL_SECOND);
+		cullShader.setUInt("commandOffset", capacity);
+		setPyramidUniforms();
+
+		GLStateCache::Get().BindBuffer(GL_DISPATCH_INDIRECT_BUFFER, counterBuffer);
+		glDispatchComputeIndirect(4 * sizeof(GLuint));
+		glMemoryBarrier(GL_COMMAND_BARRIER_BIT);
+	}
+
+	// draws what a phase found visible, with the shader and VAO the caller bound
+	void Draw(GPUCullPhase phase, GLenum mode = GL_TRIANGLES) {
+		GLStateCache& state = GLStateCache::Get();
+		state.BindBuffer(GL_DRAW_INDIRECT_BUFFER, commandBuffer);
+		state.BindBuffer(GL_PARAMETER_BUFFER, counterBuffer);
+
+		const void* commands = (const void*)((size_t)phase * capacity * sizeof(DrawElementsIndirectCommand));
+		GLintptr drawCount = phase * sizeof(GLuint);
+		if (GLAD_GL_VERSION_4_6)
+			glMultiDrawElementsIndirectCount(mode, GL_UNSIGNED_INT, commands, drawCount, capacity, 0);
+		else
+			glMultiDrawElementsIndirectCountARB(mode, GL_UNSIGNED_INT, commands, drawCount, capacity, 0);
+		// Mesa 22 keeps taking the draw count from a bound parameter buffer for later indirect draws that
+		// don't have one
+		state.BindBuffer(GL_PARAMETER_BUFFER, 0);
+	}
+
+	// builds the pyramid from a depth texture, viewProjection is the camera it was drawn with. The first
+	// level is the biggest power of two that fits into the depth buffer, so every level below halves
+	// exactly and a texel always covers the same part of the screen as the four it was made from.
+	// A multisampled depth texture (samples > 1) is read directly, the farthest of its samples counts
+	void BuildPyramid(GLuint depthTexture, int width, int height, const mat4& viewProjection, int samples = 1) {
+		int levelWidth = gpu_culling_detail::PreviousPowerOfTwo(width);
+		int levelHeight = gpu_culling_detail::PreviousPowerOfTwo(height);
+		if (levelWidth != stats.pyramidWidth || levelHeight != stats.pyramidHeight)
+			createPyramid(levelWidth, levelHeight);
+
+		GLStateCache& state = GLStateCache::Get();
+		Shader& initShader = samples > 1 ? pyramidInitMultisampleShader : pyramidInitShader;
+		state.BindTexture(GPU_CULLING_TEXTURE_UNIT, samples > 1 ? GL_TEXTURE_2D_MULTISAMPLE : GL_TEXTURE_2D, depthTexture);
+		initShader.use();
+		initShader.setIVec2("sourceSize", width, height);
+		initShader.setIVec2("destinationSize", levelWidth, levelHeight);
+		if (samples > 1)
+			initShader.setInt("samples", samples);
+		glBindImageTexture(1, pyramid, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_R32F);
+		glDispatchCompute(groupCount(levelWidth), groupCount(levelHeight), 1);
+
+		pyramidReduceShader.use();
+		for (int level = 1; level < stats.pyramidLevels; level++) {
+			int sourceWidth = levelWidth;
+			int sourceHeight = levelHeight;
+			levelWidth = std::max(levelWidth / 2, 1);
+			levelHeight = std::max(levelHeight / 2, 1);
+
+			glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+			pyramidReduceShader.setIVec2("sourceSize", sourceWidth, sourceHeight);
+			pyramidReduceShader.setIVec2("destinationSize", levelWidth, levelHeight);
+			glBindImageTexture(0, pyramid, level - 1, GL_FALSE, 0, GL_READ_ONLY, GL_R32F);
+			glBindImageTexture(1, pyramid, level, GL_FALSE, 0, GL_WRITE_ONLY, GL_R32F);
+			glDispatchCompute(groupCount(levelWidth), groupCount(levelHeight), 1);
+		}
+		glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+
+		pyramidViewProjection = viewProjection;
+		pyramidValid = true;
+	}
+
+	// after a camera cut last frame's depth says nothing about this one, the first phase then draws
+	// everything inside the frustum
+	void InvalidatePyramid() {
+		pyramidValid = false;
+	}
+
+	GLuint Pyramid() const {
+		return pyramid;
+	}
+
+	// copies the counters of the last frame back, stalls until the GPU is done with it. For debugging
+	void ReadBackStats() {
+		GLuint counters[3];
+		glGetNamedBufferSubData(counterBuffer, 0, sizeof(counters), counters);
+		stats.firstPhaseDraws = counters[0];
+		stats.secondPhaseDraws = counters[1];
+		stats.retested = counters[2];
+	}
+
+private:
+	static constexpr GLuint NONE = 0xffffffffu;
+	static constexpr GLuint CULL_GROUP_SIZE = 64; // local_size_x of instance_cull.comp
+	static constexpr GLuint PYRAMID_GROUP_SIZE = 8; // local size of the pyramid shaders
+	// dirty ids at most this far apart get uploaded as one range
+	static constexpr unsigned int MERGE_GAP = 4;
+
+	StreamBuffer& stream;
+	Shader cullShader;
+	Shader pyramidInitShader;
+	Shader pyramidInitMultisampleShader;
+	Shader pyramidReduceShader;
+
+	GLuint instanceBuffer = 0;
+	GLuint commandBuffer = 0; // capacity commands for each phase
+	GLuint retestBuffer = 0;
+	GLuint counterBuffer = 0;
+	GLuint meshBuffer = 0;
+	unsigned int capacity = 0;
+
+	vector<GPUInstance> instances; // CPU copy, always up to date
+	vector<unsigned int> freeIDs;
+	vector<unsigned int> dirty;
+	vector<unsigned char> dirtyFlags;
+	vector<GPUMesh> meshes;
+	bool meshesChanged = false;
+
+	GLuint pyramid = 0;
+	bool pyramidValid = false;
+	mat4 pyramidViewProjection = mat4(1.0f);
+
+	void markDirty(unsigned int id) {
+		if (dirtyFlags[id])
+			return;
+		dirtyFlags[id] = 1;
+		dirty.push_back(id);
+	}
+
+	static GLuint groupCount(int size) {
+		return ((GLuint)size + PYRAMID_GROUP_SIZE - 1) / PYRAMID_GROUP_SIZE;
+	}
+
+	// sends the changed instances in contiguous ranges through the stream buffer, like SceneBuffer
+	void upload() {
+		stats.instances = (unsigned int)(instances.size() - freeIDs.size());
+		stats.dirtyInstances = (unsigned int)dirty.size();
+		stats.uploadRanges = 0;
+
+		if (instances.size() > capacity)
+			createBuffers(std::max((unsigned int)instances.size(), capacity * 2));
+
+		if (meshesChanged) {
+			if (meshBuffer)
+				GLStateCache::Get().DeleteBuffer(meshBuffer);
+			meshBuffer = CreateBuffer(meshes.size() * sizeof(GPUMesh), &meshes[0]);
+			meshesChanged = false;
+		}
+
+		if (dirty.empty())
+			return;
+		sort(dirty.begin(), dirty.end());
+		size_t i = 0;
+		while (i < dirty.size()) {
+			unsigned int first = dirty[i];
+			unsigned int last = first;
+			while (i + 1 < dirty.size() && dirty[i + 1] <= last + MERGE_GAP)
+				last = dirty[++i];
+			i++;
+
+			GLsizeiptr size = (last - first + 1) * sizeof(GPUInstance);
+			StreamAllocation allocation = stream.Upload(&instances[first], size, 16);
+			glCopyNamedBufferSubData(allocation.buffer, instanceBuffer, allocation.offset, first * sizeof(GPUInstance), size);
+			stats.uploadRanges++;
+		}
+		for (unsigned int id : dirty)
+			dirtyFlags[id] = 0;
+		dirty.clear();
+	}
+
+	// the instances are copied over on the GPU, the commands and the retest list are rewritten every frame
+	void createBuffers(unsigned int newCapacity) {
+		GLStateCache& state = GLStateCache::Get();
+		GLuint newInstances = CreateBuffer(newCapacity * sizeof(GPUInstance), nullptr, 0);
+		if (instanceBuffer) {
+			glCopyNamedBufferSubData(instanceBuffer, newInstances, 0, 0, capacity * sizeof(GPUInstance));
+			state.DeleteBuffer(instanceBuffer);
+			state.DeleteBuffer(commandBuffer);
+			state.DeleteBuffer(retestBuffer);
+		}
+		instanceBuffer = newInstances;
+		commandBuffer = CreateBuffer(2 * newCapacity * sizeof(DrawElementsIndirectCommand), nullptr, 0);
+		retestBuffer = CreateBuffer(newCapacity * sizeof(GLuint), nullptr, 0);
+		capacity = newCapacity;
+	}
+
+	void bindBuffers() {
+		GLStateCache& state = GLStateCache::Get();
+		state.BindBufferRange(GL_SHADER_STORAGE_BUFFER, GPU_CULLING_INSTANCE_BINDING, instanceBuffer, 0,
+			capacity * sizeof(GPUInstance));
+		if (meshBuffer)
+			state.BindBufferRange(GL_SHADER_STORAGE_BUFFER, GPU_CULLING_MESH_BINDING, meshBuffer, 0,
+				meshes.size() * sizeof(GPUMesh));
+		state.BindBufferRange(GL_SHADER_STORAGE_BUFFER, GPU_CULLING_COMMAND_BINDING, commandBuffer, 0,
+			2 * capacity * sizeof(DrawElementsIndirectCommand));
+		state.BindBufferRange(GL_SHADER_STORAGE_BUFFER, GPU_CULLING_COUNTER_BINDING, counterBuffer, 0,
+			8 * sizeof(GLuint));
+		state.BindBufferRange(GL_SHADER_STORAGE_BUFFER, GPU_CULLING_RETEST_BINDING, retestBuffer, 0,
+			capacity * sizeof(GLuint));
+	}
+
+	void setPyramidUniforms() {
+		cullShader.setBool("occlusion", pyramidValid);
+		cullShader.setMat4("pyramidViewProjection", pyramidViewProjection);
+		cullShader.setIVec2("pyramidSize", stats.pyramidWidth, stats.pyramidHeight);
+		cullShader.setInt("pyramidLevels", stats.pyramidLevels);
+		if (pyramid)
+			GLStateCache::Get().BindTexture(GPU_CULLING_TEXTURE_UNIT, GL_TEXTURE_2D, pyramid);
+	}
+
+	// the pyramid keeps one float per texel, nearest filtering so texelFetch can read every level
+	void createPyramid(int width, int height) {
+		if (pyramid)
+			GLStateCache::Get().DeleteTexture(pyramid);
+		stats.pyramidWidth = width;
+		stats.pyramidHeight = height;
+		stats.pyramidLevels = MipLevelCount(width, height);
+		pyramid = CreateTexture2D(width, height, GL_R32F, stats.pyramidLevels);
+		SetTextureSampling(pyramid, GL_CLAMP_TO_EDGE, GL_NEAREST_MIPMAP_NEAREST, GL_NEAREST);
+		// a new pyramid holds nothing until it's built
+		pyramidValid = false;
+	}
+};
+
+#endif
@@ -0,0 +1,277 @@
+#ifndef HDR_FORMATS_H
+#define HDR_FORMATS_H
+
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+#include <immintrin.h>
+#define HDR_FORMATS_F16C
+#ifdef _MSC_VER
+#include <intrin.h>
+#define HDR_FORMATS_F16C_TARGET
+#else
+#define HDR_FORMATS_F16C_TARGET __attribute__((target("avx,f16c")))
+#endif
+#endif
+
+// Packs float pixels (HDR images, 16 bit ones scaled to 0-1) into the small float formats the GPU
+// samples directly, instead of keeping 32 bit floats around.
+//
+// Three channel HDR images that have no negative values go into 32 bits a pixel, either R11F_G11F_B10F
+// (a float of its own per channel, 6/6/5 bits of mantissa) or RGB9_E5 (9 bits of mantissa each, one
+// shared exponent). ChooseHdrFormat() tries both on a sample of the pixels and keeps the one that loses
+// less. Everything else is stored as half floats, one per channel.
+//
+// Halves are converted with F16C, 8 floats per instruction, when the CPU has it. R11F_G11F_B10F is
+// the half with its lowest mantissa bits rounded off, so it goes through the same conversion.
+
+enum HdrPacking {
+	HDR_HALF,
+	HDR_R11G11B10F,
+	HDR_RGB9E5
+};
+
+struct HdrFormat {
+	HdrPacking packing = HDR_HALF;
+	int channels = 4;
+
+	int PixelBytes() const {
+		return packing == HDR_HALF ? channels * 2 : 4;
+	}
+};
+
+namespace hdr_detail {
+
+	const float HALF_MAX = 65504.0f;
+	// largest values of the 10 bit float (blue of R11F_G11F_B10F), which also limits the 11 bit ones
+	const float R11G11B10F_MAX = 64512.0f;
+	const float RGB9E5_MAX = 65408.0f;
+
+	inline uint32_t FloatBits(float value) {
+		uint32_t bits;
+		memcpy(&bits, &value, 4);
+		return bits;
+	}
+
+	inline float BitsFloat(uint32_t bits) {
+		float value;
+		memcpy(&value, &bits, 4);
+		return value;
+	}
+
+	// NaNs become 0, everything else is clamped to [low, high]
+	inline float Saturate(float value, float low, float high) {
+		return value == value ? std::min(high, std::max(low, value)) : 0.0f;
+	}
+
+	// round to nearest even, value already in the half range
+	inline uint16_t FloatToHalf(float value) {
+		uint32_t bits = FloatBits(value);
+		uint32_t sign = (bits >> 16) & 0x8000;
+		bits &= 0x7fffffff;
+		uint32_t half;
+		if (bits < (113u << 23)) {
+			// below 2^-14 the half is denormal: adding this lines the mantissa up with its last bit
+			const float magic = BitsFloat(126u << 23);
+			half = FloatBits(BitsFloat(bits) + magic) - FloatBits(magic);
+		}
+		else {
+			uint32_t odd = (bits >> 13) & 1;
+			bits += (uint32_t)(15 - 127) * (1u << 23) + 0xfff + odd;
+			half = bits >> 13;
+		}
+		return (uint16_t)(half | sign);
+	}
+
+	// an unsigned float of 5 exponent and mantissaBits mantissa bits, with the same bias as a half.
+	// value is already in its range, halfway cases round up
+	inline uint32_t FloatToSmallFloat(float value, int mantissaBits) {
+		uint32_t bits = FloatBits(value);
+		if (bits < (113u << 23))
+			return (uint32_t)(value * (float)(1 << (14 + mantissaBits)) + 0.5f);
+		return (bits - (112u << 23) + (1u << (22 - mantissaBits))) >> (23 - mantissaBits);
+	}
+
+	inline float SmallFloatToFloat(uint32_t code, int mantissaBits) {
+		uint32_t exponent = code >> mantissaBits, mantissa = code & ((1u << mantissaBits) - 1);
+		if (exponent == 0)
+			return mantissa * (1.0f / (float)(1 << (14 + mantissaBits)));
+		return BitsFloat(((exponent + 112) << 23) | (mantissa << (23 - mantissaBits)));
+	}
+
+	inline uint32_t PackR11G11B10F(const float* rgb) {
+		uint32_t r = FloatToSmallFloat(Saturate(rgb[0], 0.0f, R11G11B10F_MAX), 6);
+		uint32_t g = FloatToSmallFloat(Saturate(rgb[1], 0.0f, R11G11B10F_MAX), 6);
+		uint32_t b = FloatToSmallFloat(Saturate(rgb[2], 0.0f, R11G11B10F_MAX), 5);
+		return r | (g << 11) | (b << 22);
+	}
+
+	inline void UnpackR11G11B10F(uint32_t packed, float* rgb) {
+		rgb[0] = SmallFloatToFloat(packed & 0x7ff, 6);
+		rgb[1] = SmallFloatToFloat((packed >> 11) & 0x7ff, 6);
+		rgb[2] = SmallFloatToFloat(packed >> 22, 5);
+	}
+
+	// as the GL spec encodes it (EXT_texture_shared_exponent)
+	inline uint32_t PackRGB9E5(const float* rgb) {
+		float r = Saturate(rgb[0], 0.0f, RGB9E5_MAX);
+		float g = Saturate(rgb[1], 0.0f, RGB9E5_MAX);
+		float b = Saturate(rgb[2], 0.0f, RGB9E5_MAX);
+		float largest = std::max(r, std::max(g, b));
+		// floor(log2(largest)) from the exponent bits, -16 at least so tiny values share the smallest one
+		int exponent = std::max(-16, (int)(FloatBits(largest) >> 23) - 127) + 16;
+		// 1 / 2^(exponent - 15 - 9)
+		float scale = BitsFloat((uint32_t)(127 + 24 - exponent) << 23);
+		if ((int)(largest * scale + 0.5f) == 512) {
+			exponent++;
+			scale *= 0.5f;
+		}
+		uint32_t rm = (uint32_t)(r * scale + 0.5f), gm = (uint32_t)(g * scale + 0.5f), bm = (uint32_t)(b * scale + 0.5f);
+		return rm | (gm << 9) | (bm << 18) | ((uint32_t)exponent << 27);
+	}
+
+	inline void UnpackRGB9E5(uint32_t packed, float* rgb) {
+		float scale = BitsFloat((uint32_t)(127 + (int)(packed >> 27) - 24) << 23);
+		rgb[0] = (packed & 0x1ff) * scale;
+		rgb[1] = ((packed >> 9) & 0x1ff) * scale;
+		rgb[2] = ((packed >> 18) & 0x1ff) * scale;
+	}
+
+	inline bool CpuHasF16C() {
+#if defined(HDR_FORMATS_F16C) && defined(_MSC_VER)
+		int info[4];
+		__cpuid(info, 1);
+		bool osSavesYmm = (info[2] & (1 << 27)) != 0; // OSXSAVE
+		bool avx = (info[2] & (1 << 28)) != 0, f16c = (info[2] & (1 << 29)) != 0;
+		return osSavesYmm && avx && f16c && (_xgetbv(0) & 6) == 6;
+#elif defined(HDR_FORMATS_F16C)
+		return __builtin_cpu_supports("avx") && __builtin_cpu_supports("f16c");
+#else
+		return false;
+#endif
+	}
+
+	inline bool UseF16C() {
+		static const bool f16c = CpuHasF16C();
+		return f16c;
+	}
+
+#ifdef HDR_FORMATS_F16C
+	// count floats to halves, clamped to [low, high] with NaNs as 0. Rounding is an _MM_FROUND mode
+	template <int Rounding>
+	HDR_FORMATS_F16C_TARGET
+	inline void HalvesF16C(const float* in, uint16_t* out, size_t count, float low, float high) {
+		__m256 lows = _mm256_set1_ps(low), highs = _mm256_set1_ps(high);
+		size_t i = 0;
+		for (; i + 8 <= count; i += 8) {
+			__m256 v = _mm256_loadu_ps(in + i);
+			v = _mm256_and_ps(v, _mm256_cmp_ps(v, v, _CMP_ORD_Q));
+			v = _mm256_min_ps(_mm256_max_ps(v, lows), highs);
+			_mm_storeu_si128((__m128i*)(out + i), _mm256_cvtps_ph(v, Rounding));
+		}
+		if (i < count) {
+			// the last few go through a full register too
+			float last[8] = {};
+			uint16_t halves[8];
+			memcpy(last, in + i, (count - i) * sizeof(float));
+			HalvesF16C<Rounding>(last, halves, 8, low, high);
+			memcpy(out + i, halves, (count - i) * sizeof(uint16_t));
+		}
+	}
+#endif
+
+	inline void PackHalves(const float* in, size_t count, uint16_t* out) {
+#ifdef HDR_FORMATS_F16C
+		if (UseF16C()) {
+			HalvesF16C<_MM_FROUND_TO_NEAREST_INT>(in, out, count, -HALF_MAX, HALF_MAX);
+			return;
+		}
+#endif
+		for (size_t i = 0; i < count; i++)
+			out[i] = FloatToHalf(Saturate(in[i], -HALF_MAX, HALF_MAX));
+	}
+
+	inline void PackR11G11B10FPixels(const float* in, size_t count, uint32_t* out) {
+#ifdef HDR_FORMATS_F16C
+		if (UseF16C()) {
+			// truncated halves, rounding off the extra mantissa bits then rounds the original value
+			// to nearest. A row at a time keeps the halves in the cache
+			const size_t ROW = 1024;
+			uint16_t halves[ROW * 3];
+			for (size_t first = 0; first < count; first += ROW) {
+				size_t pixels = std::min(ROW, count - first);
+				HalvesF16C<_MM_FROUND_TO_ZERO>(in + first * 3, halves, pixels * 3, 0.0f, R11G11B10F_MAX);
+				for (size_t i = 0; i < pixels; i++) {
+					const uint16_t* h = &halves[i * 3];
+					uint32_t r = std::min<uint32_t>((h[0] + 0x8u) >> 4, 0x7bf);
+					uint32_t g = std::min<uint32_t>((h[1] + 0x8u) >> 4, 0x7bf);
+					uint32_t b = std::min<uint32_t>((h[2] + 0x10u) >> 5, 0x3df);
+					out[first + i] = r | (g << 11) | (b << 22);
+				}
+			}
+			return;
+		}
+#endif
+		for (size_t i = 0; i < count; i++)
+			out[i] = PackR11G11B10F(in + i * 3);
+	}
+
+	// how much a packing loses on the pixel, relative to its brightest channel
+	inline float PackingError(HdrPacking packing, const float* rgb) {
+		float decoded[3];
+		if (packing == HDR_RGB9E5)
+			UnpackRGB9E5(PackRGB9E5(rgb), decoded);
+		else
+			UnpackR11G11B10F(PackR11G11B10F(rgb), decoded);
+		float error = 0.0f;
+		for (int k = 0; k < 3; k++)
+			error += fabsf(decoded[k] - rgb[k]);
+		return error / (std::max(rgb[0], std::max(rgb[1], rgb[2])) + 1e-4f);
+	}
+}
+
+// the smallest format that keeps the range of the pixels, count pixels of channels floats each. Meant
+// for HDR data, the packed formats lose more in 0-1 than 8 bit unorm does
+inline HdrFormat ChooseHdrFormat(const float* pixels, size_t count, int channels) {
+	using namespace hdr_detail;
+	HdrFormat format;
+	format.channels = channels;
+	if (channels != 3 || count == 0)
+		return format;
+
+	// negative values (or NaNs) only fit into halves
+	for (size_t i = 0; i < count * 3; i++)
+		if (!(pixels[i] >= 0.0f))
+			return format;
+
+	// same size either way, so the one that's closer on a few thousand pixels wins
+	size_t step = std::max<size_t>(1, count / 4096);
+	double errors[2] = {};
+	for (size_t i = 0; i < count; i += step) {
+		errors[0] += PackingError(HDR_R11G11B10F, pixels + i * 3);
+		errors[1] += PackingError(HDR_RGB9E5, pixels + i * 3);
+	}
+	format.packing = errors[1] < errors[0] ? HDR_RGB9E5 : HDR_R11G11B10F;
+	return format;
+}
+
+// count pixels into out, which needs count * format.PixelBytes() bytes
+inline void PackHdrPixels(const HdrFormat& format, const float* pixels, size_t count, void* out) {
+	using namespace hdr_detail;
+	switch (format.packing) {
+	case HDR_R11G11B10F:
+		PackR11G11B10FPixels(pixels, count, (uint32_t*)out);
+		break;
+	case HDR_RGB9E5:
+		for (size_t i = 0; i < count; i++)
+			((uint32_t*)out)[i] = PackRGB9E5(pixels + i * 3);
+		break;
+	default:
+		PackHalves(pixels, count * format.channels, (uint16_t*)out);
+	}
+}
+
+#endif
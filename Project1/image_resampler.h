@@ -0,0 +1,52 @@
+#ifndef IMAGE_RESAMPLER_H
+#define IMAGE_RESAMPLER_H
+
+#include <cstring>
+#include <algorithm>
+
+#include "mip_generator.h"
+#include "thread_pool.h"
+
+// Resizes 8 bit images to any size with the kernels of the mip generator (box, triangle, Kaiser or
+// Lanczos 3), in linear light for sRGB colour and through the same SSE / AVX2 passes. Shrinking by
+// more than 2:1 goes in one pass, the kernel is stretched over all the source pixels that land on an
+// output pixel instead of halving again and again.
+//
+// The texture quality tiers are mip biases: a tier drops that many levels from the top of every
+// texture before it's uploaded, each level a quarter of the memory of the one above it.
+
+enum TextureQuality {
+	TEXTURE_QUALITY_HIGH,
+	TEXTURE_QUALITY_MEDIUM,
+	TEXTURE_QUALITY_LOW
+};
+
+// levels dropped from the top of the mip chain
+inline int QualityMipBias(TextureQuality quality) {
+	switch (quality) {
+	case TEXTURE_QUALITY_LOW: return 2;
+	case TEXTURE_QUALITY_MEDIUM: return 1;
+	default: return 0;
+	}
+}
+
+// a side of level bias of the mip chain, halved and rounded down like the mip generator does
+inline int BiasedSize(int size, int bias) {
+	return std::max(1, size >> bias);
+}
+
+// pixels (channels bytes each) filtered into out at outWidth x outHeight, which needs room for them.
+// Same settings as the mip generator, don't pass a pool from inside a pool job
+inline void ResampleImage(const unsigned char* pixels, int width, int height, int channels, unsigned char* out,
+	int outWidth, int outHeight, const MipSettings& settings = MipSettings(), ThreadPool* pool = nullptr) {
+	using namespace mip_detail;
+	if (outWidth == width && outHeight == height) {
+		memcpy(out, pixels, (size_t)width * height * channels);
+		return;
+	}
+	FloatImage image = ToFloat(pixels, width, height, channels, settings.srgb);
+	image = Resample(image, outWidth, outHeight, settings, ResolveSimd(settings.simd), pool);
+	ToPixels(image, channels, settings.srgb, out);
+}
+
+#endif
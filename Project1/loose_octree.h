@@ -0,0 +1,403 @@
+#ifndef LOOSE_OCTREE_H
+#define LOOSE_OCTREE_H
+
+// Plugins for OpenGL Mathematics
+// Allows us to use mathematical transformations into our engine for any object
+#include <glm/glm.hpp>
+
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <climits>
+
+#include "bounds.h"
+#include "frustum_culling.h"
+#include "thread_pool.h"
+
+using namespace glm;
+using namespace std;
+
+// Loose octree over the bounding spheres of objects that move every frame, where refitting a BVH
+// degrades it faster than it can be rebuilt.
+//
+// The octree is a fixed cube split depth levels deep, and every cell is loose: it holds the objects
+// whose center is in it, but reaches half a cell further on every side, so an object fits in any cell
+// at least as wide as it. An object's cell follows from its center and radius alone, the deepest level
+// whose cells are at least its diameter wide and the cell its center is in, so moving one is O(1) and
+// never looks at the other objects. Objects outside the cube stay in the root.
+//
+// The objects are kept sorted by cell, with the cells numbered depth first: a cell comes right before
+// its children, and all of a cell's subtree holds one contiguous range of the sorted objects. Their
+// spheres are packed into a CullingSpheres in that order, so queries hand out ranges of it: a cell
+// entirely inside the frustum or radius is one range of objects that all pass, one that only touches
+// it is a range the frustum culling kernels can test, and so is a whole subtree that holds only a few
+// objects. Empty subtrees are skipped from the range starts alone.
+//
+// Moves are batched: Move() or MoveBatch() only note the new sphere and work out its cell. Commit()
+// sorts the objects again with one counting sort over the cells when any of them changed, going
+// through them in the order of the last sort so the writes mostly move forward, else it only copies the
+// new spheres into place. Queries see the objects as of the last Commit().
+
+struct LooseOctreeStats {
+	unsigned int objects = 0;
+	unsigned int cells = 0;
+	unsigned int commits = 0; // that had to sort, since the start
+	unsigned int cellChanges = 0; // objects that moved to another cell before the last commit
+	double commitMs = 0.0; // of the last sort
+};
+
+// a range of Spheres() and Ids(), inside when every object in it passes the query without a test
+struct OctreeRange {
+	unsigned int begin, end;
+	bool inside;
+};
+
+class LooseOctree {
+public:
+	LooseOctreeStats stats;
+
+	// the cube the cells split is center +- halfSize. depth is clamped to MAX_DEPTH, the deepest cells
+	// should be about as wide as the objects that move the most
+	LooseOctree(const vec3& center, float halfSize, int depth = 6) {
+		this->depth = std::max(0, std::min(depth, MAX_DEPTH));
+		origin = center - vec3(halfSize);
+		for (int level = 0; level <= this->depth; level++) {
+			cellSizes[level] = halfSize * 2.0f / (float)(1 << level);
+			inverseCellSizes[level] = 1.0f / cellSizes[level];
+		}
+		// a subtree at level d holds the cell and 8 subtrees of level d + 1
+		subtreeSizes[this->depth] = 1;
+		for (int level = this->depth - 1; level >= 0; level--)
+			subtreeSizes[level] = 1 + 8 * subtreeSizes[level + 1];
+		// child c of a cell is 1 + c subtrees of the level below after it, and c has one bit per axis,
+		// so the cells skipped on the way down split into what every axis adds on its own
+		for (int level = 0; level <= this->depth; level++) {
+			for (int coordinate = 0; coordinate < (1 << level); coordinate++) {
+				unsigned int offset = 0;
+				for (int l = 1; l <= level; l++)
+					offset += ((coordinate >> (level - l)) & 1) * subtreeSizes[l];
+				axisOffsets[level][coordinate] = offset;
+			}
+		}
+		cellStarts.assign(subtreeSizes[0] + 1, 0);
+		cursors.resize(subtreeSizes[0]);
+		stats.cells = subtreeSizes[0];
+	}
+
+	// returns the id of the object, it's part of the queries after the next Commit()
+	unsigned int Insert(const BoundingSphere& sphere) {
+		unsigned int id;
+		if (!freeIDs.empty()) {
+			id = freeIDs.back();
+			freeIDs.pop_back();
+		}
+		else {
+			id = (unsigned int)objects.size();
+			objects.push_back(Object());
+		}
+		Object& object = objects[id];
+		object.sphere = sphere;
+		object.cell = cellFor(sphere);
+		object.slot = NONE;
+		inserted.push_back(id);
+		changed = true;
+		return id;
+	}
+
+	// the object drops out of the queries with the next Commit(), its id may be handed out again
+	void Remove(unsigned int id) {
+		objects[id].cell = NONE;
+		objects[id].slot = NONE;
+		freeIDs.push_back(id);
+		changed = true;
+	}
+
+	void Move(unsigned int id, const BoundingSphere& sphere) {
+		moved = true;
+		if (move(id, sphere)) {
+			stats.cellChanges++;
+			changed = true;
+		}
+	}
+
+	// moves every ids[i] to spheres[i], split over the pool. No id may be in there twice, and don't pass
+	// a pool from inside a pool job
+	void MoveBatch(const unsigned int* ids, const BoundingSphere* spheres, size_t count, ThreadPool* pool = nullptr) {
+		if (!pool || count < PARALLEL_SIZE) {
+			for (size_t i = 0; i < count; i++)
+				Move(ids[i], spheres[i]);
+			return;
+		}
+		moved = true;
+		atomic<unsigned int> changes(0);
+		pool->ParallelFor(count, [&](size_t begin, size_t end) {
+			unsigned int local = 0;
+			for (size_t i = begin; i < end; i++)
+				local += move(ids[i], spheres[i]);
+			changes += local;
+		}, PARALLEL_SIZE);
+		stats.cellChanges += changes;
+		changed |= changes > 0;
+	}
+
+	// sorts the objects by cell again if any were added, removed or changed cell since the last commit,
+	// else copies the spheres that moved into place
+	void Commit() {
+		stats.cellChanges = 0;
+		if (!changed) {
+			if (moved) {
+				for (size_t slot = 0; slot < ids.size(); slot++) {
+					prefetch(ids, slot + PREFETCH_DISTANCE);
+					packed.Set(slot, objects[ids[slot]].sphere);
+				}
+			}
+			moved = false;
+			return;
+		}
+		auto start = chrono::high_resolution_clock::now();
+		// count the objects of every cell behind it, then sum them up into where every cell starts
+		std::fill(cellStarts.begin(), cellStarts.end(), 0);
+		unsigned int count = 0;
+		for (const Object& object : objects) {
+			if (object.cell == NONE)
+				continue;
+			cellStarts[object.cell + 1]++;
+			count++;
+		}
+		for (size_t cell = 1; cell < cellStarts.size(); cell++)
+			cellStarts[cell] += cellStarts[cell - 1];
+		std::copy(cellStarts.begin(), cellStarts.end() - 1, cursors.begin());
+
+		// most objects stay in their cell, in the old order they land close behind the one before.
+		// Removed objects have no slot any more, inserted ones never had one
+		previous.swap(ids);
+		ids.resize(count);
+		packed.Resize(count);
+		for (unsigned int slot = 0; slot < previous.size(); slot++) {
+			prefetch(previous, slot + PREFETCH_DISTANCE);
+			unsigned int id = previous[slot];
+			if (objects[id].cell != NONE && objects[id].slot == slot)
+				place(id);
+		}
+		for (unsigned int id : inserted)
+			if (objects[id].cell != NONE && objects[id].slot == NONE)
+				place(id);
+		inserted.clear();
+
+		changed = moved = false;
+		stats.objects = count;
+		stats.commits++;
+		stats.commitMs = chrono::duration<double, milli>(chrono::high_resolution_clock::now() - start).count();
+	}
+
+	const BoundingSphere& Sphere(unsigned int id) const {
+		return objects[id].sphere;
+	}
+
+	// the spheres sorted by cell, what the ranges of the queries index
+	const CullingSpheres& Spheres() const {
+		return packed;
+	}
+
+	// the object id of every sphere in Spheres()
+	const vector<unsigned int>& Ids() const {
+		return ids;
+	}
+
+	// appends the ranges of the cells the frustum reaches, returns how many objects they hold
+	size_t QueryFrustum(const Frustum& frustum, vector<OctreeRange>& ranges) const {
+		size_t count = 0;
+		walk([&](const vec3& minimum, const vec3& maximum) { return Classify(frustum, minimum, maximum); },
+			[&](unsigned int begin, unsigned int end, bool inside) { count += addRange(ranges, begin, end, inside); });
+		return count;
+	}
+
+	// appends the ids of the objects whose sphere is inside or touching the frustum, returns how many
+	size_t CullFrustum(const Frustum& frustum, vector<unsigned int>& visible, CullSimd simd = CULL_SIMD_AUTO) const {
+		simd = culling_detail::ResolveSimd(simd);
+		size_t first = visible.size();
+		walk([&](const vec3& minimum, const vec3& maximum) { return Classify(frustum, minimum, maximum); },
+			[&](unsigned int begin, unsigned int end, bool inside) {
+			if (inside) {
+				visible.insert(visible.end(), ids.begin() + begin, ids.begin() + end);
+				return;
+			}
+			// the kernels write slots, which become ids in place
+			size_t at = visible.size();
+			visible.resize(at + (end - begin));
+			size_t passed = culling_detail::CullRange(frustum, packed, begin, end, visible.data() + at, simd);
+			visible.resize(at + passed);
+			for (size_t i = at; i < visible.size(); i++)
+				visible[i] = ids[visible[i]];
+		});
+		return visible.size() - first;
+	}
+
+	// appends the ranges of the cells within radius of center, returns how many objects they hold
+	size_t QueryRadius(const vec3& center, float radius, vector<OctreeRange>& ranges) const {
+		size_t count = 0;
+		walk([&](const vec3& minimum, const vec3& maximum) { return classifyRadius(center, radius, minimum, maximum); },
+			[&](unsigned int begin, unsigned int end, bool inside) { count += addRange(ranges, begin, end, inside); });
+		return count;
+	}
+
+	// appends the ids of the objects whose sphere is within radius of center, returns how many
+	size_t CollectRadius(const vec3& center, float radius, vector<unsigned int>& found) const {
+		size_t first = found.size();
+		walk([&](const vec3& minimum, const vec3& maximum) { return classifyRadius(center, radius, minimum, maximum); },
+			[&](unsigned int begin, unsigned int end, bool inside) {
+			if (inside) {
+				found.insert(found.end(), ids.begin() + begin, ids.begin() + end);
+				return;
+			}
+			for (unsigned int i = begin; i < end; i++) {
+				float dx = packed.x[i] - center.x, dy = packed.y[i] - center.y, dz = packed.z[i] - center.z;
+				float reach = packed.radius[i] + radius;
+				if (dx * dx + dy * dy + dz * dz <= reach * reach)
+					found.push_back(ids[i]);
+			}
+		});
+		return found.size() - first;
+	}
+
+private:
+	static constexpr unsigned int NONE = UINT_MAX;
+	// 8^8 cells at the deepest level would be too much memory for the range starts
+	static constexpr int MAX_DEPTH = 7;
+	// moves per job of MoveBatch()
+	static constexpr size_t PARALLEL_SIZE = 4096;
+	// subtrees with up to this many objects are tested object by object
+	static constexpr unsigned int SMALL_SUBTREE = 32;
+	// the objects are read in slot order, which is all over memory. Asking for the one this many slots
+	// ahead keeps a few misses in flight
+	static constexpr size_t PREFETCH_DISTANCE = 16;
+
+	int depth;
+	vec3 origin; // the lowest corner of the cube
+	float cellSizes[MAX_DEPTH + 1]; // by level
+	float inverseCellSizes[MAX_DEPTH + 1];
+	unsigned int axisOffsets[MAX_DEPTH + 1][1 << MAX_DEPTH]; // by level and cell coordinate
+	unsigned int subtreeSizes[MAX_DEPTH + 1]; // cells in a subtree of every level
+
+	struct Object {
+		BoundingSphere sphere; // moves land here first
+		unsigned int cell; // depth first index, NONE once removed
+		unsigned int slot; // where it is in the packed arrays, NONE before its first commit
+	};
+
+	vector<Object> objects; // by id
+	vector<unsigned int> freeIDs;
+	vector<unsigned int> inserted; // since the last sort
+	bool changed = false; // the objects need sorting again
+	bool moved = false; // spheres changed since the last commit
+
+	vector<unsigned int> cellStarts; // by cell, the first slot of its objects. One more at the end
+	vector<unsigned int> cursors;
+	vector<unsigned int> ids; // by slot
+	vector<unsigned int> previous; // ids of the last sort
+	CullingSpheres packed; // by slot
+
+	// the depth first index of the cell the sphere belongs in
+	unsigned int cellFor(const BoundingSphere& sphere) const {
+		vec3 local = sphere.center - origin;
+		float size = cellSizes[0];
+		if (local.x < 0.0f || local.y < 0.0f || local.z < 0.0f || local.x >= size || local.y >= size || local.z >= size)
+			return 0;
+		// a loose cell takes objects up to its own width across
+		int level = depth;
+		while (level > 0 && sphere.radius * 2.0f > cellSizes[level])
+			level--;
+		int last = (1 << level) - 1;
+		int x = std::min((int)(local.x * inverseCellSizes[level]), last);
+		int y = std::min((int)(local.y * inverseCellSizes[level]), last);
+		int z = std::min((int)(local.z * inverseCellSizes[level]), last);
+		const unsigned int* offsets = axisOffsets[level];
+		return level + offsets[x] + 2 * offsets[y] + 4 * offsets[z];
+	}
+
+	// returns true when the object changed cell and the objects need sorting again
+	bool move(unsigned int id, const BoundingSphere& sphere) {
+		Object& object = objects[id];
+		object.sphere = sphere;
+		unsigned int cell = cellFor(sphere);
+		if (cell == object.cell)
+			return false;
+		object.cell = cell;
+		return true;
+	}
+
+	void prefetch(const vector<unsigned int>& order, size_t slot) const {
+#ifdef FRUSTUM_CULLING_AVX2
+		if (slot < order.size())
+			_mm_prefetch((const char*)&objects[order[slot]], _MM_HINT_T0);
+#endif
+	}
+
+	void place(unsigned int id) {
+		Object& object = objects[id];
+		unsigned int slot = cursors[object.cell]++;
+		ids[slot] = id;
+		packed.Set(slot, object.sphere);
+		object.slot = slot;
+	}
+
+	static CullSide classifyRadius(const vec3& center, float radius, const vec3& minimum, const vec3& maximum) {
+		vec3 nearest = glm::min(glm::max(center, minimum), maximum) - center;
+		if (dot(nearest, nearest) > radius * radius)
+			return CULL_OUTSIDE;
+		vec3 furthest = glm::max(glm::abs(center - minimum), glm::abs(center - maximum));
+		return dot(furthest, furthest) <= radius * radius ? CULL_INSIDE : CULL_INTERSECTING;
+	}
+
+	// adds [begin, end) to the ranges, joined onto the last one when it follows right after it
+	static size_t addRange(vector<OctreeRange>& ranges, unsigned int begin, unsigned int end, bool inside) {
+		if (begin == end)
+			return 0;
+		if (!ranges.empty() && ranges.back().end == begin && ranges.back().inside == inside)
+			ranges.back().end = end;
+		else
+			ranges.push_back({ begin, end, inside });
+		return end - begin;
+	}
+
+	// calls emit(begin, end, inside) with the object ranges of the cells test(looseMinimum, looseMaximum)
+	// doesn't put outside, in depth first order
+	template <typename Test, typename Emit>
+	void walk(const Test& test, const Emit& emit) const {
+		if (!ids.empty())
+			walkCell(test, emit, 0, 0, 0, 0, 0);
+	}
+
+	template <typename Test, typename Emit>
+	void walkCell(const Test& test, const Emit& emit, unsigned int index, int level, int x, int y, int z) const {
+		unsigned int begin = cellStarts[index], end = cellStarts[index + subtreeSizes[level]];
+		if (begin == end)
+			return;
+		// the root also holds whatever is outside the cube, its objects are always tested
+		if (level > 0) {
+			float size = cellSizes[level];
+			vec3 minimum = origin + vec3((float)x, (float)y, (float)z) * size - vec3(size * 0.5f);
+			CullSide side = test(minimum, minimum + vec3(size * 2.0f));
+			if (side == CULL_OUTSIDE)
+				return;
+			if (side == CULL_INSIDE) {
+				emit(begin, end, true);
+				return;
+			}
+		}
+		// testing a few objects costs less than going down to the cells they're in
+		if (end - begin <= SMALL_SUBTREE || level == depth) {
+			emit(begin, end, false);
+			return;
+		}
+		unsigned int own = cellStarts[index + 1];
+		if (own != begin)
+			emit(begin, own, false);
+		for (int child = 0; child < 8; child++)
+			walkCell(test, emit, index + 1 + child * subtreeSizes[level + 1], level + 1,
+				x * 2 + (child & 1), y * 2 + ((child >> 1) & 1), z * 2 + ((child >> 2) & 1));
+	}
+};
+
+#endif
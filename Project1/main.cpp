@@ -12,6 +12,20 @@
 #include "shader.h"
 #include "camera.h"
 #include "mesh.h"
+#include "render_queue.h"
+#include "gl_state.h"
+#include "gl_resources.h"
+#include "stream_buffer.h"
+#include "scene_buffer.h"
+#include "frustum_culling.h"
+#include "bvh.h"
+#include "occlusion_culling.h"
+#include "gpu_culling.h"
+#include "thread_pool.h"
+#include "texture_manager.h"
+#include "texture_packer.h"
+#include "texture_streaming.h"
+#include "binding_points.h"
 
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
@@ -23,6 +37,8 @@ using namespace glm;
 
 const unsigned int SCREEN_HEIGHT = 600;
 const unsigned int SCREEN_WIDTH = 800;
+// samples of the scene's render target, the window itself isn't multisampled
+const int MSAA_SAMPLES = 4;
 
 
 // mouse positions recorded in last frame
@@ -30,6 +46,9 @@ float lastX = 400, lastY = 300;
 
 bool firstMouse = true;
 
+// set by a left click, the render loop picks the object in the middle of the window
+bool pickRequested = false;
+
 
 Camera camera(vec3(0.0f, 0.0f, 3.0f));
 
@@ -70,6 +89,13 @@ void mouse_callback(GLFWwindow* window, double xpos, double ypos) {
 
 }
 
+// a left click picks what's in the middle of the window, the cursor is captured by the camera so the
+// centre works as a crosshair
+void mouse_button_callback(GLFWwindow* window, int button, int action, int mods) {
+	if (button == GLFW_MOUSE_BUTTON_LEFT && action == GLFW_PRESS)
+		pickRequested = true;
+}
+
 // Mouse scroll callback
 void scroll_callback(GLFWwindow* window, double xoffset, double yoffset) {
 	camera.ProcessMouseScroll(yoffset);
@@ -359,7 +385,6 @@ int main() {
 	glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
 	glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 6);
 	glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
-	glfwWindowHint(GLFW_SAMPLES, 4);
 	//glfwWindowHint(GLFW_OPENGL_DEBUG_CONTEXT, true);
 	//glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
 
@@ -389,6 +414,7 @@ int main() {
 	// Register callbacks
 	glfwSetFramebufferSizeCallback(window, framebuffer_size_callback);
 	glfwSetCursorPosCallback(window, mouse_callback);
+	glfwSetMouseButtonCallback(window, mouse_button_callback);
 	glfwSetScrollCallback(window, scroll_callback);
 
 	// renders the mouse invisible when the application is in focus
@@ -407,60 +433,76 @@ int main() {
 	//-----------------------------------------------------
 	//Shader Time 
 
-	glEnable(GL_DEPTH_TEST);
+	// every bind from here on goes through the state cache so redundant ones are filtered out
+	GLStateCache& glState = GLStateCache::Get();
+
+	glState.Enable(GL_DEPTH_TEST);
 
 	//Shader ourShader("vertex_shader.vert", "fragment_shader.frag");
 	Shader lightingShader("vertex_shaders/light_cube.vs", "fragment_shaders/light_cube.fs");
 	Shader cubeShader("vertex_shaders/basic_cube.vs", "fragment_shaders/basic_cube.fs");
+	// lit like the cube, but takes the object id from draws the GPU culler made
+	Shader fieldShader("vertex_shaders/gpu_culled.vs", "fragment_shaders/light_cube.fs");
+	// samples the layer of a packed texture array the texture table says
+	Shader packedShader("vertex_shaders/packed_texture.vs", "fragment_shaders/packed_texture.fs");
+	// samples a streamed texture, the packed crates' vertex shader passes the texture coordinates on
+	Shader streamedShader("vertex_shaders/packed_texture.vs", "fragment_shaders/streamed_texture.fs");
 
 	// First, create the Vertex Buffer Objects, Vertex Array Objects, and Element Buffer Objects
 	// Vertex Buffer Objects manage the memory created on the GPU to store vertex data
 	// Vertex Array Objects works similarly but instead stores the following vertex attributes 
 	// Element Buffer Objects
+	// everything is created through Direct State Access, so nothing has to be bound to be edited
 	unsigned int VBOs[1], VAOs[1], EBOs[1];
 
 
 	// First cube with texture setup
-	glGenVertexArrays(1, VAOs); // we can also generate multiple VAOs or buffers at the same time
-	glGenBuffers(1, VBOs);
-	glGenBuffers(1, EBOs);
-
-	glBindVertexArray(VAOs[0]);
+	// immutable storage, the cube never changes after this
+	VBOs[0] = CreateBuffer(sizeof(vertices), vertices);
+	EBOs[0] = CreateBuffer(sizeof(indices), indices);
 
-	glBindBuffer(GL_ARRAY_BUFFER, VBOs[0]);
-	glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_STATIC_DRAW);
+	VAOs[0] = CreateVertexArray();
+	glVertexArrayVertexBuffer(VAOs[0], 0, VBOs[0], 0, 8 * sizeof(float));
 
-	//glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBOs[0]);
-	//glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(indices), indices, GL_STATIC_DRAW);
+	//glVertexArrayElementBuffer(VAOs[0], EBOs[0]);
 
 	// position attribute
-	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 8 * sizeof(float), (void*)0);	// Vertex attributes stay the same
-	glEnableVertexAttribArray(0);
+	SetVertexAttribute(VAOs[0], 0, 0, 3, GL_FLOAT, 0);	// Vertex attributes stay the same
 	
 	//color attribute
-	glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 8 * sizeof(float),
-		(void*)(3 * sizeof(float)));
-	glEnableVertexAttribArray(1);
+	SetVertexAttribute(VAOs[0], 1, 0, 3, GL_FLOAT, 3 * sizeof(float));
 	/*
 	// texture attribute
-	glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 5 * sizeof(float),
-		(void*)(3 * sizeof(float)));
-	glEnableVertexAttribArray(1);
+	SetVertexAttribute(VAOs[0], 1, 0, 2, GL_FLOAT, 3 * sizeof(float));
 	*/
 	// light cube setup (separate VAO just to make it more understandable)
 
-	unsigned int lightVAO;
-
-	glGenVertexArrays(1, &lightVAO);
-	glBindVertexArray(lightVAO);
+	unsigned int lightVAO = CreateVertexArray();
 
-	// It's only necessary to bind to the container's VBO data
-	glBindBuffer(GL_ARRAY_BUFFER, VBOs[0]);
-	//glBufferData(GL_ARRAY_BUFFER, sizeof(cubeVertices), cubeVertices, GL_STATIC_DRAW);
+	// It's only necessary to attach the container's VBO data
+	glVertexArrayVertexBuffer(lightVAO, 0, VBOs[0], 0, 8 * sizeof(float));
 
 	// light cube vertex attribute
-	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 8 * sizeof(float), (void*)0);	// Vertex attributes stay the same
-	glEnableVertexAttribArray(0);
+	SetVertexAttribute(lightVAO, 0, 0, 3, GL_FLOAT, 0);	// Vertex attributes stay the same
+
+	// the field of cubes is drawn with indirect indexed draws, so it gets an index buffer that just
+	// counts through the 36 vertices, and no instance attribute
+	unsigned int fieldIndices[36];
+	for (unsigned int i = 0; i < 36; i++)
+		fieldIndices[i] = i;
+	unsigned int fieldEBO = CreateBuffer(sizeof(fieldIndices), fieldIndices);
+	unsigned int fieldVAO = CreateVertexArray();
+	glVertexArrayVertexBuffer(fieldVAO, 0, VBOs[0], 0, 8 * sizeof(float));
+	glVertexArrayElementBuffer(fieldVAO, fieldEBO);
+	SetVertexAttribute(fieldVAO, 0, 0, 3, GL_FLOAT, 0);
+	SetVertexAttribute(fieldVAO, 1, 0, 3, GL_FLOAT, 3 * sizeof(float));
+
+	// the crates with packed textures need the texture coordinates as well
+	unsigned int packedVAO = CreateVertexArray();
+	glVertexArrayVertexBuffer(packedVAO, 0, VBOs[0], 0, 8 * sizeof(float));
+	SetVertexAttribute(packedVAO, 0, 0, 3, GL_FLOAT, 0);
+	SetVertexAttribute(packedVAO, 1, 0, 3, GL_FLOAT, 3 * sizeof(float));
+	SetVertexAttribute(packedVAO, 2, 0, 2, GL_FLOAT, 6 * sizeof(float));
 
 
 
@@ -469,52 +511,116 @@ int main() {
 	//-----------------------------------------------------
 	//Texture Time 
 
-	stbi_set_flip_vertically_on_load(true);
-
-	unsigned int texture, texture2;
-	glGenTextures(1, &texture);
-	glActiveTexture(GL_TEXTURE0); // activates the texture unit first
-	glBindTexture(GL_TEXTURE_2D, texture);
-	// set the texture wrapping/filtering options (on currently bound texture)
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-	// load and generate the texture
-	int width, height, nrChannels;
-	unsigned char* data = stbi_load("container.jpg", &width, &height, &nrChannels, 0);
-
-	if (data) {
-		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, data);
-		glGenerateMipmap(GL_TEXTURE_2D);
+	// worker threads for anything that can run off the main thread, like decoding images
+	ThreadPool workers;
+
+	// textures are decoded on the workers and uploaded a bit every frame, until then
+	// the handles resolve to a placeholder
+	TextureManager textures(workers);
+	// past this the least recently used textures get evicted or lose their top mips
+	textures.SetBudget(256 * 1024 * 1024);
+	// JPEGs show a preview at 1/8 of their size while the full image decodes
+	textures.SetPreviewScale(3);
+	TextureHandle texture = textures.Load("container.jpg", GL_REPEAT, GL_NEAREST, GL_NEAREST);
+	TextureHandle texture2 = textures.Load("lighthouse.png", GL_REPEAT, GL_NEAREST, GL_NEAREST);
+
+	glState.Enable(GL_MULTISAMPLE);
+
+	// per-frame data (camera matrices, instance data) is written into a persistently mapped ring buffer
+	// with room for 3 frames in flight
+	StreamBuffer frameData(1024 * 1024, 3);
+
+	// transforms of every object, kept on the GPU and only re-uploaded when they change
+	SceneBuffer scene(frameData);
+	unsigned int cubeObject = scene.Add(mat4(1.0f));
+	unsigned int lampObject = scene.Add(mat4(1.0f));
+
+	// world space boxes of the objects in a BVH, which finds the visible ones every frame so only
+	// those are submitted, and what a click picks
+	AABB cubeBox; // the cube's vertices go from -0.5 to 0.5 on every axis
+	cubeBox.minimum = vec3(-0.5f);
+	cubeBox.maximum = vec3(0.5f);
+	BVH sceneTree;
+	unsigned int cubeProxy = sceneTree.Insert(cubeBox);
+	unsigned int lampProxy = sceneTree.Insert(cubeBox);
+	vector<unsigned int> visibleObjects;
+	// the cube is drawn into a small depth buffer on the CPU every frame, the lamp isn't submitted
+	// while it's behind it
+	OcclusionCuller occlusion;
+
+	// all draws go through the render queue so they get sorted and batched every frame
+	RenderQueue renderQueue(frameData, scene);
+
+	// a row of crates with small checkered textures, the tiling ones become layers of one array and
+	// the clamped ones share an atlas page. Every crate's material only binds the array, so the render
+	// queue draws each array's crates with one instanced draw
+	TexturePacker packer(512, 64);
+	const vec3 crateColors[8] = {
+		vec3(1.0f, 0.2f, 0.2f), vec3(0.2f, 1.0f, 0.2f), vec3(0.2f, 0.2f, 1.0f), vec3(1.0f, 1.0f, 0.2f),
+		vec3(0.2f, 1.0f, 1.0f), vec3(1.0f, 0.2f, 1.0f), vec3(1.0f, 1.0f, 1.0f), vec3(1.0f, 0.6f, 0.2f)
+	};
+	vector<unsigned char> crateTexture(32 * 32 * 4);
+	for (int i = 0; i < 8; i++) {
+		for (int y = 0; y < 32; y++)
+			for (int x = 0; x < 32; x++) {
+				float shade = ((x / 8 + y / 8) % 2) ? 1.0f : 0.6f;
+				unsigned char* pixel = &crateTexture[(y * 32 + x) * 4];
+				for (int c = 0; c < 3; c++)
+					pixel[c] = (unsigned char)(crateColors[i][c] * shade * 255.0f);
+				pixel[3] = 255;
+			}
+		packer.Add(crateTexture.data(), 32, 32, i < 4);
 	}
-	else {
-		std::cout << "Failed to load texture" << std::endl;
+	packer.Build(&workers);
+	vector<unsigned int> crateObjects, crateMaterials;
+	for (unsigned int i = 0; i < 8; i++) {
+		mat4 crateModel = translate(mat4(1.0f), vec3(-2.8f + i * 0.8f, -1.5f, 1.0f));
+		crateModel = scale(crateModel, vec3(0.5f));
+		// the scene buffer's material index is the crate's entry in the texture table
+		crateObjects.push_back(scene.Add(crateModel, i));
+		Material crateMaterial;
+		crateMaterial.textures = { packer.Get(i).array };
+		crateMaterial.samplers = { "packedTextures" };
+		crateMaterial.targets = { GL_TEXTURE_2D_ARRAY };
+		crateMaterials.push_back(renderQueue.RegisterMaterial(crateMaterial));
 	}
 
-
-	glGenTextures(1, &texture2);
-	glActiveTexture(GL_TEXTURE1); // activates the texture unit first
-	glBindTexture(GL_TEXTURE_2D, texture2);
-
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-
-	data = stbi_load("lighthouse.png", &width, &height, &nrChannels, 0);
-
-	if (data) {
-		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, data);
-		glGenerateMipmap(GL_TEXTURE_2D);
-	}
-	else {
-		std::cout << "Failed to load texture" << std::endl;
+	// a crate with a cooked texture that's streamed: only the levels up to 64x64 are read at first, the
+	// finer ones come in once the crate is close enough to need them and go again when it isn't
+	TextureHandle streamedTexture = textures.LoadStreamed("container.dds");
+	vector<Vertex> crateVertices(36);
+	vector<unsigned int> crateIndices(36);
+	for (unsigned int i = 0; i < 36; i++) {
+		crateVertices[i].position = vec3(vertices[i * 8], vertices[i * 8 + 1], vertices[i * 8 + 2]);
+		crateVertices[i].normal = vec3(vertices[i * 8 + 3], vertices[i * 8 + 4], vertices[i * 8 + 5]);
+		crateVertices[i].texCoords = vec2(vertices[i * 8 + 6], vertices[i * 8 + 7]);
+		crateIndices[i] = i;
 	}
-	// frees up data from the texture
-	stbi_image_free(data);
-
-	glEnable(GL_MULTISAMPLE);
+	float crateUVDensity = ComputeUVDensity(crateVertices, crateIndices);
+	mat4 streamedModel = translate(mat4(1.0f), vec3(2.5f, 0.0f, -1.0f));
+	unsigned int streamedObject = scene.Add(streamedModel);
+	BoundingSphere streamedBounds = TransformBoundingSphere(ComputeBoundingSphere(crateVertices), streamedModel);
+
+	// a block of small cubes behind the cube, culled and drawn by the GPU without the CPU looking at
+	// any of them. The front layers hide most of the ones behind
+	GPUCuller gpuCuller(frameData);
+	unsigned int fieldMesh = gpuCuller.AddMesh(36);
+	for (int layer = 0; layer < 4; layer++)
+		for (int y = 0; y < 16; y++)
+			for (int x = 0; x < 16; x++) {
+				mat4 fieldModel = translate(mat4(1.0f), vec3(-3.75f + x * 0.5f, -3.75f + y * 0.5f, -3.0f - layer * 1.5f));
+				fieldModel = scale(fieldModel, vec3(0.4f));
+				gpuCuller.Add(TransformAABB(cubeBox, fieldModel), fieldMesh, scene.Add(fieldModel));
+			}
+	// the scene is drawn into multisampled textures and the colour resolved into the window at the end
+	// of the frame. The window's depth buffer can't be read by a shader, this one is read by the pyramid
+	// shaders, which take the farthest of its samples. Created in the loop at the framebuffer's size
+	int sceneWidth = 0;
+	int sceneHeight = 0;
+	unsigned int sceneColor = 0;
+	unsigned int sceneDepth = 0;
+	unsigned int sceneFramebuffer;
+	glCreateFramebuffers(1, &sceneFramebuffer);
 
 	//glUniform1i(glGetUniformLocation(ourShader.ID, "texture1"), 0);
 	//ourShader.setInt("texture1", 0);
@@ -529,6 +635,36 @@ int main() {
 			deltaTime = currentFrame - lastFrame;
 			lastFrame = currentFrame;
 
+			// a minimized window has no framebuffer to draw into
+			int framebufferWidth, framebufferHeight;
+			glfwGetFramebufferSize(window, &framebufferWidth, &framebufferHeight);
+			if (framebufferWidth == 0 || framebufferHeight == 0) {
+				glfwWaitEvents();
+				continue;
+			}
+			if (framebufferWidth != sceneWidth || framebufferHeight != sceneHeight) {
+				if (sceneColor) {
+					glState.DeleteTexture(sceneColor);
+					glState.DeleteTexture(sceneDepth);
+				}
+				sceneWidth = framebufferWidth;
+				sceneHeight = framebufferHeight;
+				sceneColor = CreateTexture2DMultisample(MSAA_SAMPLES, sceneWidth, sceneHeight, GL_RGBA8);
+				sceneDepth = CreateTexture2DMultisample(MSAA_SAMPLES, sceneWidth, sceneHeight, GL_DEPTH24_STENCIL8);
+				glNamedFramebufferTexture(sceneFramebuffer, GL_COLOR_ATTACHMENT0, sceneColor, 0);
+				glNamedFramebufferTexture(sceneFramebuffer, GL_DEPTH_STENCIL_ATTACHMENT, sceneDepth, 0);
+			}
+			glBindFramebuffer(GL_FRAMEBUFFER, sceneFramebuffer);
+
+			glState.ResetStats();
+			// waits (only if the GPU is behind) until this frame's part of the ring buffer is free again
+			frameData.BeginFrame();
+
+			// spend at most 2ms per frame uploading textures that finished decoding
+			textures.Update(2.0);
+			glState.BindTexture(0, GL_TEXTURE_2D, textures.Get(texture));
+			glState.BindTexture(1, GL_TEXTURE_2D, textures.Get(texture2));
+
 			// clears the colorbuffer
 			glClearColor(0.5f, 0.5f, 0.8f, 1.0f);
 			glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
@@ -542,36 +678,102 @@ int main() {
 			lightingShader.setVec3("viewPos", camera.position);
 
 
+			packedShader.use();
+			packedShader.setVec3("lightColor", 1.0f, 1.0f, 1.0f);
+			packedShader.setVec3("lightPos", lightPos);
+			packedShader.setVec3("viewPos", camera.position);
+
+			streamedShader.use();
+			streamedShader.setVec3("lightColor", 1.0f, 1.0f, 1.0f);
+			streamedShader.setVec3("lightPos", lightPos);
+			streamedShader.setVec3("viewPos", camera.position);
+
 			// view/projection transformations
-			mat4 projection = perspective(radians(camera.zoom), (float)SCREEN_WIDTH / (float)SCREEN_HEIGHT, 0.1f, 100.0f);
+			mat4 projection = perspective(radians(camera.zoom), (float)sceneWidth / (float)sceneHeight, 0.1f, 100.0f);
 			mat4 view = camera.GetViewMatrix();
-			lightingShader.setMat4("projection", projection);
-			lightingShader.setMat4("view", view);
 
-			// world transformation
-			mat4 model = mat4(1.0f);
-			lightingShader.setMat4("model", model);
-
-			// render the cube
-			glBindVertexArray(VAOs[0]);
-			glDrawArrays(GL_TRIANGLES, 0, 36);
+			// every scene shader reads these from the CameraData uniform block
+			mat4 cameraData[2] = { projection, view };
+			StreamAllocation cameraBlock = frameData.Upload(cameraData, sizeof(cameraData));
+			glState.BindBufferRange(GL_UNIFORM_BUFFER, CAMERA_DATA_BINDING, cameraBlock.buffer, cameraBlock.offset, cameraBlock.size);
 
+			renderQueue.Begin(view, 100.0f);
 
-			// also draw the lamp object
+			// the lamp object
 			int rotateRadius = -2;
-			cubeShader.use();
-			cubeShader.setMat4("projection", projection);
-			cubeShader.setMat4("view", view);
-			model = mat4(1.0f);
+			mat4 model = mat4(1.0f);
 			lightPos = vec3(rotateRadius * sin(glfwGetTime()), 1.0f, rotateRadius * cos(glfwGetTime()));
 			model = translate(model, lightPos);
 			
 			model = rotate(model,radians(45.0f), lightPos);
 			model = scale(model, vec3(0.5f)); // a smaller cube
-			cubeShader.setMat4("model", model);
-
-			glBindVertexArray(lightVAO);
-			glDrawArrays(GL_TRIANGLES, 0, 36);
+			scene.SetTransform(lampObject, model);
+			// the lamp's leaf is refitted, the tree is built again on the workers once it got too loose
+			AABB lampBox = TransformAABB(cubeBox, model);
+			sceneTree.Update(lampProxy, lampBox);
+			sceneTree.Maintain(&workers);
+
+			if (pickRequested) {
+				pickRequested = false;
+				RayHit hit;
+				Ray pickRay = camera.ScreenRay(sceneWidth / 2.0f, sceneHeight / 2.0f, (float)sceneWidth, (float)sceneHeight, projection);
+				if (sceneTree.Raycast(pickRay, 100.0f, hit))
+					cout << "Picked the " << (hit.object == cubeProxy ? "cube" : "lamp") << " at a distance of " << hit.distance << endl;
+			}
+
+			// the cube never moves so its transform was only uploaded once
+			visibleObjects.clear();
+			sceneTree.QueryFrustum(camera.GetFrustum(projection), visibleObjects);
+			// one box is quicker to rasterize on this thread than to hand to the workers
+			occlusion.Begin(projection * view);
+			occlusion.AddOccluder(cubeBox);
+			occlusion.Rasterize();
+			for (unsigned int proxy : visibleObjects) {
+				if (proxy == cubeProxy)
+					renderQueue.Submit(lightingShader, VAOs[0], 36, cubeObject);
+				else if (occlusion.IsVisible(lampBox))
+					renderQueue.Submit(cubeShader, lightVAO, 36, lampObject);
+			}
+			packer.BindTable();
+			for (size_t i = 0; i < crateObjects.size(); i++)
+				renderQueue.Submit(packedShader, packedVAO, 36, crateObjects[i], crateMaterials[i]);
+			// the level the streamed crate needs from here, loaded by one of the next Update()s. Its GL texture
+			// changes whenever levels come or go, so it's bound here instead of through a material
+			textures.RequestFootprint(streamedTexture, streamedBounds, crateUVDensity, MakeStreamingView(camera, sceneHeight));
+			glState.BindTexture(STREAMED_TEXTURE_UNIT, GL_TEXTURE_2D, textures.Get(streamedTexture));
+			renderQueue.Submit(streamedShader, packedVAO, 36, streamedObject);
+
+			// only the lamp changed, so only its transform goes to the GPU
+			scene.Upload();
+			renderQueue.Flush();
+
+			// the field: what last frame's depth doesn't hide is drawn first, the depth pyramid is built
+			// from that (and the cube), and the rest is tested again against it
+			mat4 viewProjection = projection * view;
+			gpuCuller.CullFirstPhase(viewProjection);
+			fieldShader.use();
+			fieldShader.setVec3("objectColor", 0.31f, 0.5f, 1.0f);
+			fieldShader.setVec3("lightColor", 1.0f, 1.0f, 1.0f);
+			fieldShader.setVec3("lightPos", lightPos);
+			fieldShader.setVec3("viewPos", camera.position);
+			glState.BindVertexArray(fieldVAO);
+			gpuCuller.Draw(GPU_CULL_FIRST);
+
+			gpuCuller.BuildPyramid(sceneDepth, sceneWidth, sceneHeight, viewProjection, MSAA_SAMPLES);
+			gpuCuller.CullSecondPhase();
+			fieldShader.use();
+			glState.BindVertexArray(fieldVAO);
+			gpuCuller.Draw(GPU_CULL_SECOND);
+
+			// the finished frame's depth is what the next frame's first phase tests against
+			gpuCuller.BuildPyramid(sceneDepth, sceneWidth, sceneHeight, viewProjection, MSAA_SAMPLES);
+
+			// averages the samples into the window
+			glBlitNamedFramebuffer(sceneFramebuffer, 0, 0, 0, sceneWidth, sceneHeight, 0, 0, sceneWidth, sceneHeight,
+				GL_COLOR_BUFFER_BIT, GL_NEAREST);
+
+			// fence behind everything that reads this frame's ring buffer region
+			frameData.EndFrame();
 
 			// check and call events and swap the buffers
 			glfwSwapBuffers(window);
@@ -582,9 +784,17 @@ int main() {
 	// optional: de-allocate all resources once they've outlived their purpose:
 	// ------------------------------------------------------------------------
 	//cleanup(VAOs, VBOs, EBOs);
-	glDeleteVertexArrays(1, VAOs);
-	glDeleteBuffers(1, VBOs);
-	glDeleteBuffers(1, EBOs);
+	glState.DeleteVertexArray(VAOs[0]);
+	glState.DeleteBuffer(VBOs[0]);
+	glState.DeleteBuffer(EBOs[0]);
+	glState.DeleteVertexArray(fieldVAO);
+	glState.DeleteBuffer(fieldEBO);
+	glState.DeleteVertexArray(packedVAO);
+	glDeleteFramebuffers(1, &sceneFramebuffer);
+	if (sceneColor) {
+		glState.DeleteTexture(sceneColor);
+		glState.DeleteTexture(sceneDepth);
+	}
 
 	glfwTerminate();
 	return 0;
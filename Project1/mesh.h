@@ -13,6 +13,13 @@
 #include <vector>
 #include <string>
 
+#include "shader.h"
+#include "gl_state.h"
+#include "gl_resources.h"
+#include "render_queue.h"
+#include "bounds.h"
+#include "texture_streaming.h"
+
 using namespace glm;
 using namespace std;
 
@@ -25,6 +32,7 @@ struct Vertex {
 struct Texture {
 	unsigned int id;
 	string type; // can be diffuse, specular, normal, etc.
+	GLenum target = GL_TEXTURE_2D; // GL_TEXTURE_2D_ARRAY for textures packed by the TexturePacker
 };
 
 class Mesh {
@@ -34,6 +42,11 @@ class Mesh {
 		vector<unsigned int> indices;
 		vector<Texture>	textures;
 		unsigned int VAO;
+		// in object space, with the UV density they tell the texture streaming which mips the mesh needs
+		BoundingSphere bounds;
+		float uvDensity;
+		// in object space too, TransformAABB() it with the model matrix for the frustum culling
+		AABB box;
 
 		// constructor
 		Mesh(vector<Vertex> vertices, vector<unsigned int> indices,
@@ -41,6 +54,9 @@ class Mesh {
 			this->vertices = vertices;
 			this->indices = indices;
 			this->textures = textures;
+			bounds = ComputeBoundingSphere(vertices);
+			box = ComputeAABB(vertices);
+			uvDensity = ComputeUVDensity(vertices, indices);
 			setupMesh();
 		}
 
@@ -52,7 +68,6 @@ class Mesh {
 
 
 			for (unsigned int i = 0; i < textures.size(); i++) {
-				glActiveTexture(GL_TEXTURE0 + i); // Active proper texture unit before binding
 				// retrieve texture number (diffuse or specular)
 				string number;
 				string name = textures[i].type;
@@ -68,65 +83,73 @@ class Mesh {
 
 				// Now set the sampler to the correct texture unit
 				shader.setInt(("material." + name + number).c_str(), i);
-				// and finally bind the texture
-				glBindTexture(GL_TEXTURE_2D, textures[i].id);
+				// and finally bind the texture, the state cache activates the proper texture unit first
+				GLStateCache::Get().BindTexture(i, textures[i].target, textures[i].id);
 			}
 
-			// sets active texture unit before binding
-			glActiveTexture(GL_TEXTURE0);
-
-
-			// draw mesh
-			glBindVertexArray(VAO);
+			// draw mesh, the VAO is left bound since the state cache skips rebinding it next time
+			GLStateCache::Get().BindVertexArray(VAO);
 			glDrawElements(GL_TRIANGLES, indices.size(), GL_UNSIGNED_INT, 0);
-			glBindVertexArray(0);
+		}
+
+		// records the mesh into the render queue instead of drawing it right away, meshes sharing
+		// the same material end up in one instanced draw
+		void Submit(RenderQueue& queue, Shader& shader, unsigned int object, RenderPass pass = PASS_OPAQUE) {
+			if (material == 0 && !textures.empty()) {
+				Material mat;
+				unsigned int diffuseCount = 1;
+				unsigned int specularCount = 1;
+				unsigned int normalCount = 1;
+				for (unsigned int i = 0; i < textures.size(); i++) {
+					string number;
+					string name = textures[i].type;
+					if (name == "texture_diffuse")
+						number = to_string(diffuseCount++);
+					else if (name == "texture_specular")
+						number = to_string(specularCount++);
+					else if (name == "texture_normal")
+						number = to_string(normalCount++);
+					mat.textures.push_back(textures[i].id);
+					mat.samplers.push_back("material." + name + number);
+					mat.targets.push_back(textures[i].target);
+				}
+				material = queue.RegisterMaterial(mat);
+			}
+			queue.Submit(shader, VAO, (GLsizei)indices.size(), object, material, true, pass);
 		}
 	private:
+		// material id in the render queue, registered on the first submit
+		unsigned int material = 0;
 		// render data
 		unsigned int VBO, EBO;
 		// render the mesh
 		void setupMesh() {
-			// create buffers/arrays
-			glGenVertexArrays(1, &VAO); // Creates 1 Vertex Array Object 
-			// stores the state of all the vertex attribute pointers (VBOs) and determines 
-			// how the vertex data is stored in the GPU memory
-
-			glGenBuffers(1, &VBO); // Creates 1 Vertex Buffer Object
+			// creates 1 Vertex Buffer Object with immutable storage and fills it right away
 			// stores vertex data (pos, colors, normals, texcoords, etc.) in GPU memory to 
 			// reduce CPU-GPU data transfer AND improve performance
+			VBO = CreateBuffer(vertices.size() * sizeof(Vertex), &vertices[0]);
 
-			glGenBuffers(1, &EBO); // Creates 1 Element Buffer Object
+			// creates 1 Element Buffer Object
 			// stores indices of vertices in GPU memory to reduce duplication of vertex data
 			// (e.g. a vertex can be used in multiple triangles or cubes)
+			EBO = CreateBuffer(indices.size() * sizeof(unsigned int), &indices[0]);
 
-			// bind the Vertex Array Object first, then bind and set vertex buffer(s) and attribute pointer(s).
-			glBindVertexArray(VAO);
-			glBindBuffer(GL_ARRAY_BUFFER, VBO);
-
-			// fill buffer
-			glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(Vertex),
-				&vertices[0], GL_STATIC_DRAW);
-
-			// now bind the Element Buffer Object
-			glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
-			glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() *
-				sizeof(unsigned int), &indices[0], GL_STATIC_DRAW);
+			// creates 1 Vertex Array Object
+			// stores the state of all the vertex attribute pointers (VBOs) and determines 
+			// how the vertex data is stored in the GPU memory
+			// nothing gets bound here, the VAO is edited directly through its name (Direct State Access)
+			VAO = CreateVertexArray();
+			glVertexArrayVertexBuffer(VAO, 0, VBO, 0, sizeof(Vertex));
+			glVertexArrayElementBuffer(VAO, EBO);
 
 			// vertex positions
-			glEnableVertexAttribArray(0);
-			glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex),
-				(void*)0);
+			SetVertexAttribute(VAO, 0, 0, 3, GL_FLOAT, 0);
 
 			// vertex normals
-			glEnableVertexAttribArray(1);
-			glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex),
-				(void*)offsetof(Vertex, normal));
+			SetVertexAttribute(VAO, 1, 0, 3, GL_FLOAT, offsetof(Vertex, normal));
 
 			// vertex texture coords
-			glEnableVertexAttribArray(2);
-			glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex),
-				(void*)offsetof(Vertex, texCoords));
-			glBindVertexArray(0);
+			SetVertexAttribute(VAO, 2, 0, 2, GL_FLOAT, offsetof(Vertex, texCoords));
 		}
 };
 
@@ -0,0 +1,530 @@
+#ifndef MIP_GENERATOR_H
+#define MIP_GENERATOR_H
+
+#include <vector>
+#include <cmath>
+#include <algorithm>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+#include <immintrin.h>
+#define MIP_GENERATOR_SSE
+#ifdef _MSC_VER
+#include <intrin.h>
+// MSVC emits AVX instructions for the intrinsics without any flags
+#define MIP_GENERATOR_AVX2_TARGET
+#else
+#define MIP_GENERATOR_AVX2_TARGET __attribute__((target("avx2,fma")))
+#endif
+#endif
+
+#include "color_space.h"
+#include "thread_pool.h"
+
+// Builds full mip chains on the CPU, so textures can be cooked with their mips instead of relying on
+// glGenerateMipmap (a driver dependent box filter that runs on the GPU at load time).
+//
+// Every level is filtered from the one above it in linear light: 8 bit input is decoded to floats
+// (sRGB colour through a table), each level is a separable 2:1 resample with a Kaiser windowed sinc,
+// Lanczos 3, triangle or box kernel, and only the output levels are encoded back to 8 bits. The float chain
+// keeps rounding errors from adding up level after level. 16 bit and float (HDR) images take the same
+// path through GenerateFloatMipTail(), which hands the levels out as floats for the caller to pack.
+//
+// Pixels are always processed as four floats. The vertical pass streams whole rows, 8 floats per
+// AVX2 instruction; the horizontal pass gathers taps per pixel, one pixel per SSE register or two
+// per AVX2 register. AVX2 is picked at runtime when the CPU has it.
+
+enum MipFilter {
+	MIP_FILTER_BOX,
+	MIP_FILTER_KAISER,
+	MIP_FILTER_LANCZOS,
+	MIP_FILTER_TRIANGLE
+};
+
+enum MipSimd {
+	MIP_SIMD_AUTO,
+	MIP_SIMD_SCALAR,
+	MIP_SIMD_SSE,
+	MIP_SIMD_AVX2
+};
+
+struct MipSettings {
+	MipFilter filter = MIP_FILTER_KAISER;
+	bool srgb = true; // colour channels hold sRGB values, filter them in linear light
+	bool wrap = true; // tiling texture, the kernel wraps around the edges instead of clamping
+	MipSimd simd = MIP_SIMD_AUTO;
+	bool hdr = false; // values aren't limited to 1, only the ringing below 0 is clamped
+};
+
+struct MipLevel {
+	int width = 0, height = 0;
+	std::vector<unsigned char> pixels; // same channel count as the input
+};
+
+namespace mip_detail {
+
+	const float PI = 3.14159265358979f;
+
+	// pixels as four linear floats each
+	struct FloatImage {
+		int width = 0, height = 0;
+		std::vector<float> data;
+	};
+
+	// for every output pixel, taps source indices and their weights
+	struct FilterTable {
+		int taps = 0;
+		std::vector<int> indices;
+		std::vector<float> weights;
+	};
+
+	inline float Sinc(float x) {
+		x *= PI;
+		return fabsf(x) < 1e-5f ? 1.0f : sinf(x) / x;
+	}
+
+	// modified Bessel function of the first kind, order 0, for the Kaiser window
+	inline double BesselI0(double x) {
+		double sum = 1.0, term = 1.0;
+		for (int k = 1; k < 32; k++) {
+			term *= (x / (2.0 * k)) * (x / (2.0 * k));
+			sum += term;
+			if (term < sum * 1e-12)
+				break;
+		}
+		return sum;
+	}
+
+	inline float FilterRadius(MipFilter filter) {
+		switch (filter) {
+		case MIP_FILTER_BOX: return 0.5f;
+		case MIP_FILTER_LANCZOS: return 3.0f;
+		case MIP_FILTER_TRIANGLE: return 1.0f;
+		default: return 3.0f;
+		}
+	}
+
+	// x is in destination pixels
+	inline float FilterWeight(MipFilter filter, float x) {
+		x = fabsf(x);
+		switch (filter) {
+		case MIP_FILTER_BOX:
+			return x <= 0.5f ? 1.0f : 0.0f;
+		case MIP_FILTER_LANCZOS:
+			return x < 3.0f ? Sinc(x) * Sinc(x / 3.0f) : 0.0f;
+		case MIP_FILTER_TRIANGLE:
+			return x < 1.0f ? 1.0f - x : 0.0f;
+		default: {
+			// Kaiser window with alpha 4 over a width of 3, sharper than Lanczos with less ringing
+			const float width = 3.0f, alpha = 4.0f;
+			if (x >= width)
+				return 0.0f;
+			float t = x / width;
+			return Sinc(x) * (float)(BesselI0(alpha * sqrt(1.0 - t * t)) / BesselI0(alpha));
+		}
+		}
+	}
+
+	inline FilterTable BuildFilterTable(MipFilter filter, int sourceSize, int destinationSize, bool wrap) {
+		FilterTable table;
+		float scale = (float)sourceSize / destinationSize;
+		// shrinking stretches the kernel over destination pixels, enlarging keeps it in source pixels
+		float kernelScale = std::max(1.0f, scale);
+		float support = FilterRadius(filter) * kernelScale;
+		table.taps = (int)ceilf(support * 2.0f) + 1;
+		table.indices.assign((size_t)destinationSize * table.taps, 0);
+		table.weights.assign((size_t)destinationSize * table.taps, 0.0f);
+
+		for (int d = 0; d < destinationSize; d++) {
+			// pixel centers are at +0.5
+			float center = (d + 0.5f) * scale - 0.5f;
+			int first = (int)ceilf(center - support);
+			int* indices = &table.indices[(size_t)d * table.taps];
+			float* weights = &table.weights[(size_t)d * table.taps];
+
+			float sum = 0.0f;
+			for (int t = 0; t < table.taps; t++) {
+				int s = first + t;
+				weights[t] = FilterWeight(filter, (s - center) / kernelScale);
+				indices[t] = wrap ? ((s % sourceSize) + sourceSize) % sourceSize : std::min(std::max(s, 0), sourceSize - 1);
+				sum += weights[t];
+			}
+			if (sum == 0.0f) {
+				// can only happen for a box on an exact boundary, take the nearest pixel
+				indices[0] = std::min(std::max((int)(center + 0.5f), 0), sourceSize - 1);
+				weights[0] = sum = 1.0f;
+			}
+			for (int t = 0; t < table.taps; t++)
+				weights[t] /= sum;
+		}
+		return table;
+	}
+
+	// ---- vertical pass: destination row y is a weighted sum of whole source rows ----
+
+	inline void VerticalScalar(const float* const* rows, const float* weights, int taps, float* out, int count) {
+		for (int i = 0; i < count; i++) {
+			float sum = 0.0f;
+			for (int t = 0; t < taps; t++)
+				sum += rows[t][i] * weights[t];
+			out[i] = sum;
+		}
+	}
+
+#ifdef MIP_GENERATOR_SSE
+	inline void VerticalSSE(const float* const* rows, const float* weights, int taps, float* out, int count) {
+		int i = 0;
+		for (; i + 4 <= count; i += 4) {
+			__m128 sum = _mm_setzero_ps();
+			for (int t = 0; t < taps; t++)
+				sum = _mm_add_ps(sum, _mm_mul_ps(_mm_loadu_ps(rows[t] + i), _mm_set1_ps(weights[t])));
+			_mm_storeu_ps(out + i, sum);
+		}
+		for (; i < count; i++) {
+			float sum = 0.0f;
+			for (int t = 0; t < taps; t++)
+				sum += rows[t][i] * weights[t];
+			out[i] = sum;
+		}
+	}
+
+	MIP_GENERATOR_AVX2_TARGET
+	inline void VerticalAVX2(const float* const* rows, const float* weights, int taps, float* out, int count) {
+		int i = 0;
+		for (; i + 8 <= count; i += 8) {
+			__m256 sum = _mm256_setzero_ps();
+			for (int t = 0; t < taps; t++)
+				sum = _mm256_fmadd_ps(_mm256_loadu_ps(rows[t] + i), _mm256_set1_ps(weights[t]), sum);
+			_mm256_storeu_ps(out + i, sum);
+		}
+		for (; i < count; i++) {
+			float sum = 0.0f;
+			for (int t = 0; t < taps; t++)
+				sum += rows[t][i] * weights[t];
+			out[i] = sum;
+		}
+	}
+#endif
+
+	// ---- horizontal pass: every destination pixel gathers its own taps from one row ----
+
+	inline void HorizontalScalar(const float* row, const FilterTable& table, float* out, int width) {
+		for (int x = 0; x < width; x++) {
+			const int* indices = &table.indices[(size_t)x * table.taps];
+			const float* weights = &table.weights[(size_t)x * table.taps];
+			float sum[4] = {};
+			for (int t = 0; t < table.taps; t++)
+				for (int k = 0; k < 4; k++)
+					sum[k] += row[indices[t] * 4 + k] * weights[t];
+			for (int k = 0; k < 4; k++)
+				out[x * 4 + k] = sum[k];
+		}
+	}
+
+#ifdef MIP_GENERATOR_SSE
+	inline void HorizontalSSE(const float* row, const FilterTable& table, float* out, int width) {
+		for (int x = 0; x < width; x++) {
+			const int* indices = &table.indices[(size_t)x * table.taps];
+			const float* weights = &table.weights[(size_t)x * table.taps];
+			__m128 sum = _mm_setzero_ps();
+			for (int t = 0; t < table.taps; t++)
+				sum = _mm_add_ps(sum, _mm_mul_ps(_mm_loadu_ps(row + indices[t] * 4), _mm_set1_ps(weights[t])));
+			_mm_storeu_ps(out + x * 4, sum);
+		}
+	}
+
+	MIP_GENERATOR_AVX2_TARGET
+	inline void HorizontalAVX2(const float* row, const FilterTable& table, float* out, int width) {
+		int x = 0;
+		// two destination pixels per register, each half gathers from its own taps
+		for (; x + 2 <= width; x += 2) {
+			const int* i0 = &table.indices[(size_t)x * table.taps];
+			const int* i1 = i0 + table.taps;
+			const float* w0 = &table.weights[(size_t)x * table.taps];
+			const float* w1 = w0 + table.taps;
+			__m256 sum = _mm256_setzero_ps();
+			for (int t = 0; t < table.taps; t++) {
+				__m256 pixels = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(row + i0[t] * 4)),
+					_mm_loadu_ps(row + i1[t] * 4), 1);
+				__m256 weight = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_set1_ps(w0[t])), _mm_set1_ps(w1[t]), 1);
+				sum = _mm256_fmadd_ps(pixels, weight, sum);
+			}
+			_mm256_storeu_ps(out + x * 4, sum);
+		}
+		for (; x < width; x++) {
+			const int* indices = &table.indices[(size_t)x * table.taps];
+			const float* weights = &table.weights[(size_t)x * table.taps];
+			__m128 sum = _mm_setzero_ps();
+			for (int t = 0; t < table.taps; t++)
+				sum = _mm_add_ps(sum, _mm_mul_ps(_mm_loadu_ps(row + indices[t] * 4), _mm_set1_ps(weights[t])));
+			_mm_storeu_ps(out + x * 4, sum);
+		}
+	}
+#endif
+
+	inline bool CpuHasAVX2() {
+#if defined(MIP_GENERATOR_SSE) && defined(_MSC_VER)
+		int info[4];
+		__cpuid(info, 0);
+		if (info[0] < 7)
+			return false;
+		__cpuid(info, 1);
+		bool osSavesYmm = (info[2] & (1 << 27)) != 0; // OSXSAVE
+		bool avx = (info[2] & (1 << 28)) != 0, fma = (info[2] & (1 << 12)) != 0;
+		if (!osSavesYmm || !avx || !fma || (_xgetbv(0) & 6) != 6)
+			return false;
+		__cpuidex(info, 7, 0);
+		return (info[1] & (1 << 5)) != 0;
+#elif defined(MIP_GENERATOR_SSE)
+		return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+#else
+		return false;
+#endif
+	}
+
+	// the fastest path this build and CPU can run, asking for one that isn't there falls back
+	inline MipSimd ResolveSimd(MipSimd requested) {
+#ifdef MIP_GENERATOR_SSE
+		static const bool avx2 = CpuHasAVX2();
+		if (requested == MIP_SIMD_AUTO)
+			return avx2 ? MIP_SIMD_AVX2 : MIP_SIMD_SSE;
+		if (requested == MIP_SIMD_AVX2 && !avx2)
+			return MIP_SIMD_SSE;
+		return requested;
+#else
+		(void)requested;
+		return MIP_SIMD_SCALAR;
+#endif
+	}
+
+	// splits rows over the pool, or runs them here without one
+	template <typename Body>
+	inline void ForRows(ThreadPool* pool, int rows, const Body& body) {
+		if (pool)
+			pool->ParallelFor(rows, [&](size_t begin, size_t end) { body((int)begin, (int)end); }, 8);
+		else
+			body(0, rows);
+	}
+
+	// source filtered to width x height, any ratio either way
+	inline FloatImage Resample(const FloatImage& source, int width, int height, const MipSettings& settings, MipSimd simd,
+		ThreadPool* pool) {
+		FloatImage result;
+		result.width = width;
+		result.height = height;
+		result.data.resize((size_t)result.width * result.height * 4);
+
+		FilterTable vertical = BuildFilterTable(settings.filter, source.height, result.height, settings.wrap);
+		FilterTable horizontal = BuildFilterTable(settings.filter, source.width, result.width, settings.wrap);
+
+		// vertical first, it works on whole rows and cuts down the rows the horizontal pass has to gather from
+		std::vector<float> columns((size_t)source.width * result.height * 4);
+		int rowFloats = source.width * 4;
+		ForRows(pool, result.height, [&](int begin, int end) {
+			std::vector<const float*> rows(vertical.taps);
+			for (int y = begin; y < end; y++) {
+				for (int t = 0; t < vertical.taps; t++)
+					rows[t] = &source.data[(size_t)vertical.indices[(size_t)y * vertical.taps + t] * rowFloats];
+				const float* weights = &vertical.weights[(size_t)y * vertical.taps];
+				float* out = &columns[(size_t)y * rowFloats];
+#ifdef MIP_GENERATOR_SSE
+				if (simd == MIP_SIMD_AVX2)
+					VerticalAVX2(rows.data(), weights, vertical.taps, out, rowFloats);
+				else if (simd == MIP_SIMD_SSE)
+					VerticalSSE(rows.data(), weights, vertical.taps, out, rowFloats);
+				else
+#endif
+					VerticalScalar(rows.data(), weights, vertical.taps, out, rowFloats);
+			}
+		});
+
+		ForRows(pool, result.height, [&](int begin, int end) {
+			for (int y = begin; y < end; y++) {
+				const float* row = &columns[(size_t)y * rowFloats];
+				float* out = &result.data[(size_t)y * result.width * 4];
+#ifdef MIP_GENERATOR_SSE
+				if (simd == MIP_SIMD_AVX2)
+					HorizontalAVX2(row, horizontal, out, result.width);
+				else if (simd == MIP_SIMD_SSE)
+					HorizontalSSE(row, horizontal, out, result.width);
+				else
+#endif
+					HorizontalScalar(row, horizontal, out, result.width);
+				// sinc kernels ring past the input range, clamp so it doesn't build up down the chain
+				float high = settings.hdr ? HUGE_VALF : 1.0f;
+				for (int i = 0; i < result.width * 4; i++)
+					out[i] = std::min(high, std::max(0.0f, out[i]));
+			}
+		});
+		return result;
+	}
+
+	inline FloatImage Downsample(const FloatImage& source, const MipSettings& settings, MipSimd simd, ThreadPool* pool) {
+		return Resample(source, std::max(1, source.width / 2), std::max(1, source.height / 2), settings, simd, pool);
+	}
+
+	// only RGB of 3 and 4 channel images is colour, everything else is filtered as is
+	inline bool IsColorChannel(int channel, int channels, bool srgb) {
+		return srgb && channels >= 3 && channel < 3;
+	}
+
+	inline FloatImage ToFloat(const unsigned char* pixels, int width, int height, int channels, bool srgb) {
+		// a lookup per channel either way, so colour and data channels take the same path
+		float unorm[256];
+		for (int i = 0; i < 256; i++)
+			unorm[i] = i / 255.0f;
+		const float* tables[4];
+		for (int k = 0; k < 4; k++)
+			tables[k] = IsColorChannel(k, channels, srgb) ? SRGB8ToLinearTable() : unorm;
+
+		FloatImage image;
+		image.width = width;
+		image.height = height;
+		image.data.resize((size_t)width * height * 4);
+		for (size_t i = 0; i < (size_t)width * height; i++) {
+			float* out = &image.data[i * 4];
+			out[0] = out[1] = out[2] = 0.0f;
+			out[3] = 1.0f;
+			for (int k = 0; k < channels; k++)
+				out[k] = tables[k][pixels[i * channels + k]];
+		}
+		return image;
+	}
+
+	// 16 bit pixels, the colour channels go through a table of every sRGB code too
+	inline FloatImage ToFloat(const unsigned short* pixels, int width, int height, int channels, bool srgb) {
+		const float* linear = srgb ? SRGB16ToLinearTable() : nullptr;
+		FloatImage image;
+		image.width = width;
+		image.height = height;
+		image.data.resize((size_t)width * height * 4);
+		for (size_t i = 0; i < (size_t)width * height; i++) {
+			float* out = &image.data[i * 4];
+			out[0] = out[1] = out[2] = 0.0f;
+			out[3] = 1.0f;
+			for (int k = 0; k < channels; k++) {
+				unsigned short v = pixels[i * channels + k];
+				out[k] = IsColorChannel(k, channels, srgb) ? linear[v] : v / 65535.0f;
+			}
+		}
+		return image;
+	}
+
+	// float pixels, HDR images are linear already
+	inline FloatImage ToFloat(const float* pixels, int width, int height, int channels, bool srgb) {
+		FloatImage image;
+		image.width = width;
+		image.height = height;
+		image.data.resize((size_t)width * height * 4);
+		for (size_t i = 0; i < (size_t)width * height; i++) {
+			float* out = &image.data[i * 4];
+			out[0] = out[1] = out[2] = 0.0f;
+			out[3] = 1.0f;
+			for (int k = 0; k < channels; k++) {
+				float v = pixels[i * channels + k];
+				out[k] = IsColorChannel(k, channels, srgb) ? SRGBToLinear(v) : v;
+			}
+		}
+		return image;
+	}
+
+	// channels floats a pixel, sRGB encoded again where the input was
+	inline void ToFloatPixels(const FloatImage& image, int channels, bool srgb, float* out) {
+		bool color[4];
+		for (int k = 0; k < 4; k++)
+			color[k] = IsColorChannel(k, channels, srgb);
+		for (size_t i = 0; i < (size_t)image.width * image.height; i++) {
+			for (int k = 0; k < channels; k++) {
+				float v = image.data[i * 4 + k];
+				out[i * channels + k] = color[k] ? LinearToSRGB(v) : v;
+			}
+		}
+	}
+
+	inline void ToPixels(const FloatImage& image, int channels, bool srgb, unsigned char* out) {
+		bool color[4];
+		for (int k = 0; k < 4; k++)
+			color[k] = IsColorChannel(k, channels, srgb);
+		for (size_t i = 0; i < (size_t)image.width * image.height; i++) {
+			for (int k = 0; k < channels; k++) {
+				float v = image.data[i * 4 + k];
+				out[i * channels + k] = color[k] ? LinearToSRGB8(v) : LinearToUNorm8(v);
+			}
+		}
+	}
+
+	inline MipLevel ToLevel(const FloatImage& image, int channels, bool srgb) {
+		MipLevel level;
+		level.width = image.width;
+		level.height = image.height;
+		level.pixels.resize((size_t)image.width * image.height * channels);
+		ToPixels(image, channels, srgb, level.pixels.data());
+		return level;
+	}
+}
+
+// every level down to 1x1, level 0 is a copy of the input. With a pool each pass is split by rows,
+// don't pass one from inside a pool job
+inline std::vector<MipLevel> GenerateMips(const unsigned char* pixels, int width, int height, int channels,
+	const MipSettings& settings = MipSettings(), ThreadPool* pool = nullptr) {
+	using namespace mip_detail;
+	MipSimd simd = ResolveSimd(settings.simd);
+
+	std::vector<MipLevel> levels(1);
+	levels[0].width = width;
+	levels[0].height = height;
+	levels[0].pixels.assign(pixels, pixels + (size_t)width * height * channels);
+
+	FloatImage current = ToFloat(pixels, width, height, channels, settings.srgb);
+	while (current.width > 1 || current.height > 1) {
+		current = Downsample(current, settings, simd, pool);
+		levels.push_back(ToLevel(current, channels, settings.srgb));
+	}
+	return levels;
+}
+
+// bytes of all levels below level 0, packed one after the other
+inline size_t MipTailBytes(int width, int height, int channels) {
+	size_t bytes = 0;
+	while (width > 1 || height > 1) {
+		width = std::max(1, width / 2);
+		height = std::max(1, height / 2);
+		bytes += (size_t)width * height * channels;
+	}
+	return bytes;
+}
+
+// like GenerateMips(), for level 0 that's already where it has to go: the levels below it are
+// written one after the other into out, which needs MipTailBytes() of room
+inline void GenerateMipTail(const unsigned char* pixels, int width, int height, int channels, unsigned char* out,
+	const MipSettings& settings = MipSettings(), ThreadPool* pool = nullptr) {
+	using namespace mip_detail;
+	MipSimd simd = ResolveSimd(settings.simd);
+
+	FloatImage current = ToFloat(pixels, width, height, channels, settings.srgb);
+	while (current.width > 1 || current.height > 1) {
+		current = Downsample(current, settings, simd, pool);
+		ToPixels(current, channels, settings.srgb, out);
+		out += (size_t)current.width * current.height * channels;
+	}
+}
+
+// like GenerateMipTail(), for 16 bit or float pixels: store(levelPixels, width, height) is called for
+// every level below level 0, finest first, with channels floats a pixel. 16 bit levels come out
+// scaled to 0-1. Set settings.hdr for images that go past 1
+template <typename Pixel, typename Store>
+inline void GenerateFloatMipTail(const Pixel* pixels, int width, int height, int channels, const Store& store,
+	const MipSettings& settings = MipSettings(), ThreadPool* pool = nullptr) {
+	using namespace mip_detail;
+	MipSimd simd = ResolveSimd(settings.simd);
+
+	FloatImage current = ToFloat(pixels, width, height, channels, settings.srgb);
+	std::vector<float> level;
+	while (current.width > 1 || current.height > 1) {
+		current = Downsample(current, settings, simd, pool);
+		level.resize((size_t)current.width * current.height * channels);
+		ToFloatPixels(current, channels, settings.srgb, level.data());
+		store(level.data(), current.width, current.height);
+	}
+}
+
+#endif
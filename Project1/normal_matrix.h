@@ -0,0 +1,108 @@
+#ifndef NORMAL_MATRIX_H
+#define NORMAL_MATRIX_H
+
+// Plugins for OpenGL Mathematics
+// Allows us to use mathematical transformations into our engine for any object
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+#include <glm/gtc/type_ptr.hpp>
+
+#include <cmath>
+#include <cstddef>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE__)
+#include <xmmintrin.h>
+#define NORMAL_MATRIX_SSE
+#endif
+
+using namespace glm;
+
+// Normal matrices, transpose(inverse(mat3(model))), computed on the CPU once per object instead of
+// once per vertex in the shader.
+//
+// The inverse transpose of a 3x3 matrix with columns a, b, c is
+//     [ b x c, c x a, a x b ] / dot(a, b x c)
+// so no general inverse is needed. When the model only rotates, translates and scales the same on
+// every axis, the normal matrix is just the upper 3x3 divided by the squared scale.
+
+// true when the columns are perpendicular and equally long, squaredScale receives their squared length
+inline bool IsUniformScale(const mat4& model, float& squaredScale) {
+	vec3 a = vec3(model[0]), b = vec3(model[1]), c = vec3(model[2]);
+	float la = dot(a, a), lb = dot(b, b), lc = dot(c, c);
+	float tolerance = 1e-5f * la;
+	squaredScale = la;
+	return fabs(la - lb) <= tolerance && fabs(la - lc) <= tolerance
+		&& fabs(dot(a, b)) <= tolerance && fabs(dot(b, c)) <= tolerance && fabs(dot(a, c)) <= tolerance;
+}
+
+// writes the three columns of the normal matrix (w = 0, the std430 layout of a mat3)
+inline void ComputeNormalMatrix(const mat4& model, vec4* normal) {
+	vec3 a = vec3(model[0]), b = vec3(model[1]), c = vec3(model[2]);
+
+	float squaredScale;
+	if (IsUniformScale(model, squaredScale)) {
+		float inverseScale = 1.0f / squaredScale;
+		normal[0] = vec4(a * inverseScale, 0.0f);
+		normal[1] = vec4(b * inverseScale, 0.0f);
+		normal[2] = vec4(c * inverseScale, 0.0f);
+		return;
+	}
+
+	vec3 bc = cross(b, c), ca = cross(c, a), ab = cross(a, b);
+	float inverseDet = 1.0f / dot(a, bc);
+	normal[0] = vec4(bc * inverseDet, 0.0f);
+	normal[1] = vec4(ca * inverseDet, 0.0f);
+	normal[2] = vec4(ab * inverseDet, 0.0f);
+}
+
+// batch version, normals[i] receives the normal matrix of *models[i]. Four matrices at a time are
+// transposed into x/y/z registers so every SSE instruction works on four objects at once
+inline void ComputeNormalMatrices(const mat4* const* models, vec4* const* normals, size_t count) {
+	size_t i = 0;
+#ifdef NORMAL_MATRIX_SSE
+	for (; i + 4 <= count; i += 4) {
+		// after the transpose, c[k][0] holds the x of column k of all four matrices, c[k][1] the y and so on
+		__m128 c[3][4];
+		for (int k = 0; k < 3; k++) {
+			c[k][0] = _mm_loadu_ps(&(*models[i + 0])[k][0]);
+			c[k][1] = _mm_loadu_ps(&(*models[i + 1])[k][0]);
+			c[k][2] = _mm_loadu_ps(&(*models[i + 2])[k][0]);
+			c[k][3] = _mm_loadu_ps(&(*models[i + 3])[k][0]);
+			_MM_TRANSPOSE4_PS(c[k][0], c[k][1], c[k][2], c[k][3]);
+		}
+		const __m128* a = c[0];
+		const __m128* b = c[1];
+		const __m128* d = c[2];
+
+		// n0 = b x c, n1 = c x a, n2 = a x b
+		__m128 n[3][4];
+		n[0][0] = _mm_sub_ps(_mm_mul_ps(b[1], d[2]), _mm_mul_ps(b[2], d[1]));
+		n[0][1] = _mm_sub_ps(_mm_mul_ps(b[2], d[0]), _mm_mul_ps(b[0], d[2]));
+		n[0][2] = _mm_sub_ps(_mm_mul_ps(b[0], d[1]), _mm_mul_ps(b[1], d[0]));
+		n[1][0] = _mm_sub_ps(_mm_mul_ps(d[1], a[2]), _mm_mul_ps(d[2], a[1]));
+		n[1][1] = _mm_sub_ps(_mm_mul_ps(d[2], a[0]), _mm_mul_ps(d[0], a[2]));
+		n[1][2] = _mm_sub_ps(_mm_mul_ps(d[0], a[1]), _mm_mul_ps(d[1], a[0]));
+		n[2][0] = _mm_sub_ps(_mm_mul_ps(a[1], b[2]), _mm_mul_ps(a[2], b[1]));
+		n[2][1] = _mm_sub_ps(_mm_mul_ps(a[2], b[0]), _mm_mul_ps(a[0], b[2]));
+		n[2][2] = _mm_sub_ps(_mm_mul_ps(a[0], b[1]), _mm_mul_ps(a[1], b[0]));
+
+		__m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(a[0], n[0][0]), _mm_mul_ps(a[1], n[0][1])), _mm_mul_ps(a[2], n[0][2]));
+		__m128 inverseDet = _mm_div_ps(_mm_set1_ps(1.0f), det);
+
+		// scale, then transpose back so each register is one column of one matrix with w = 0
+		for (int k = 0; k < 3; k++) {
+			n[k][0] = _mm_mul_ps(n[k][0], inverseDet);
+			n[k][1] = _mm_mul_ps(n[k][1], inverseDet);
+			n[k][2] = _mm_mul_ps(n[k][2], inverseDet);
+			n[k][3] = _mm_setzero_ps();
+			_MM_TRANSPOSE4_PS(n[k][0], n[k][1], n[k][2], n[k][3]);
+			for (int m = 0; m < 4; m++)
+				_mm_storeu_ps(&normals[i + m][k][0], n[k][m]);
+		}
+	}
+#endif
+	for (; i < count; i++)
+		ComputeNormalMatrix(*models[i], normals[i]);
+}
+
+#endif
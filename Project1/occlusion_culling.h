@@ -0,0 +1,389 @@
+#ifndef OCCLUSION_CULLING_H
+#define OCCLUSION_CULLING_H
+
+// Plugins for OpenGL Mathematics
+// Allows us to use mathematical transformations into our engine for any object
+#include <glm/glm.hpp>
+
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cfloat>
+#include <cstring>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+#include <immintrin.h>
+#define OCCLUSION_CULLING_AVX2
+#ifdef _MSC_VER
+#define OCCLUSION_CULLING_AVX2_TARGET
+#else
+// without fma, so the compiler can't fuse the edge functions and round them differently from the scalar path
+#define OCCLUSION_CULLING_AVX2_TARGET __attribute__((target("avx2")))
+#endif
+#endif
+
+#include "bounds.h"
+#include "frustum_culling.h"
+#include "thread_pool.h"
+
+using namespace glm;
+using namespace std;
+
+// Finds the objects hidden behind big occluders (buildings, walls, terrain) on the CPU, so they're never
+// submitted and nothing has to wait for the GPU to find out.
+//
+// A few selected occluders, simple meshes or boxes, are drawn into a small depth buffer every frame.
+// Triangles are clipped against the near plane, set up as three edge functions and a depth plane in
+// screen space, and binned into tiles of TILE_SIZE x TILE_SIZE pixels. The tiles are rasterized
+// independently over a thread pool: each row of a tile is one AVX2 register of pixels, the edge
+// functions give a coverage mask, and the depth plane is written through it wherever it's nearer. Every
+// tile then keeps its furthest depth, the coarse level of the hierarchy.
+//
+// An object is tested with the screen rectangle and nearest depth of its box. A tile whose furthest
+// depth is nearer than the box hides all of it, only the others are looked at pixel by pixel. The
+// rasterization is inner-conservative: a pixel is only written when the triangle covers all of it, with
+// the farthest depth the triangle has over it, so a gap in the occluders never hides anything behind
+// it. Pixels along the shared edges inside an occluder stay empty in exchange. A box that touches the
+// near plane or leaves the screen is always visible.
+//
+// Depth is z/w mapped to 0 (near) to 1 (far), so it interpolates linearly across the screen. Rows go
+// bottom to top like the framebuffer.
+
+struct OcclusionStats {
+	unsigned int occluderTriangles = 0; // added since Begin()
+	unsigned int rasterizedTriangles = 0; // left after clipping and dropping the ones that cover no whole pixel
+	unsigned int binnedTriangles = 0; // counted once per tile they touch
+	double rasterMs = 0.0; // of the last Rasterize()
+};
+
+class OcclusionCuller {
+public:
+	static const int TILE_SIZE = 8;
+
+	OcclusionStats stats;
+
+	// width and height are rounded up to whole tiles. The buffer only needs to be big enough that the
+	// gaps between occluders that matter are a few pixels wide
+	OcclusionCuller(int width = 256, int height = 128, CullSimd simd = CULL_SIMD_AUTO) {
+		tilesX = std::max(1, (width + TILE_SIZE - 1) / TILE_SIZE);
+		tilesY = std::max(1, (height + TILE_SIZE - 1) / TILE_SIZE);
+		this->width = tilesX * TILE_SIZE;
+		this->height = tilesY * TILE_SIZE;
+		this->simd = culling_detail::ResolveSimd(simd);
+		depth.assign((size_t)this->width * this->height, 1.0f);
+		tileDepths.assign((size_t)tilesX * tilesY, 1.0f);
+		bins.resize((size_t)tilesX * tilesY);
+	}
+
+	int Width() const {
+		return width;
+	}
+
+	int Height() const {
+		return height;
+	}
+
+	// depth of the occluders at a pixel, 1 where there are none
+	float DepthAt(int x, int y) const {
+		int tile = (y / TILE_SIZE) * tilesX + x / TILE_SIZE;
+		return depth[(size_t)tile * TILE_PIXELS + (y % TILE_SIZE) * TILE_SIZE + x % TILE_SIZE];
+	}
+
+	// starts a frame seen through viewProjection, dropping the occluders of the last one
+	void Begin(const mat4& viewProjection) {
+		this->viewProjection = viewProjection;
+		clipVertices.clear();
+		stats.occluderTriangles = 0;
+	}
+
+	// indexCount / 3 triangles of model space vertices. Occluders should be closed or two sided, which
+	// way the triangles wind doesn't matter
+	void AddOccluder(const vec3* vertices, const unsigned int* indices, size_t indexCount, const mat4& model) {
+		mat4 toClip = viewProjection * model;
+		for (size_t i = 0; i + 2 < indexCount; i += 3)
+			for (int corner = 0; corner < 3; corner++)
+				clipVertices.push_back(toClip * vec4(vertices[indices[i + corner]], 1.0f));
+		stats.occluderTriangles += (unsigned int)(indexCount / 3);
+	}
+
+	// a world space box, for buildings and the like
+	void AddOccluder(const AABB& box) {
+		static const unsigned int BOX_INDICES[36] = {
+			0, 1, 3, 0, 3, 2, 4, 6, 7, 4, 7, 5, // -x, +x
+			0, 4, 5, 0, 5, 1, 2, 3, 7, 2, 7, 6, // -y, +y
+			0, 2, 6, 0, 6, 4, 1, 5, 7, 1, 7, 3 // -z, +z
+		};
+		vec3 corners[8];
+		for (int corner = 0; corner < 8; corner++)
+			corners[corner] = vec3(corner & 4 ? box.maximum.x : box.minimum.x, corner & 2 ? box.maximum.y : box.minimum.y,
+				corner & 1 ? box.maximum.z : box.minimum.z);
+		AddOccluder(corners, BOX_INDICES, 36, mat4(1.0f));
+	}
+
+	// draws the occluders added since Begin(), the tiles are split over the pool. Don't pass a pool
+	// from inside a pool job
+	void Rasterize(ThreadPool* pool = nullptr) {
+		auto start = chrono::high_resolution_clock::now();
+		setupTriangles();
+		for (vector<unsigned int>& bin : bins)
+			bin.clear();
+		stats.binnedTriangles = 0;
+		for (unsigned int t = 0; t < triangles.size(); t++) {
+			const Triangle& triangle = triangles[t];
+			for (int ty = triangle.minY / TILE_SIZE; ty <= triangle.maxY / TILE_SIZE; ty++)
+				for (int tx = triangle.minX / TILE_SIZE; tx <= triangle.maxX / TILE_SIZE; tx++)
+					bins[(size_t)ty * tilesX + tx].push_back(t);
+			stats.binnedTriangles += (unsigned int)(((triangle.maxY / TILE_SIZE) - (triangle.minY / TILE_SIZE) + 1)
+				* ((triangle.maxX / TILE_SIZE) - (triangle.minX / TILE_SIZE) + 1));
+		}
+
+		size_t tiles = bins.size();
+		if (pool)
+			pool->ParallelFor(tiles, [this](size_t first, size_t last) { rasterizeTiles(first, last); }, TILES_PER_JOB);
+		else
+			rasterizeTiles(0, tiles);
+		stats.rasterizedTriangles = (unsigned int)triangles.size();
+		stats.rasterMs = chrono::duration<double, milli>(chrono::high_resolution_clock::now() - start).count();
+	}
+
+	// false when the box is entirely behind the occluders drawn by the last Rasterize()
+	bool IsVisible(const AABB& box) const {
+		// the corners are the one at the minimum plus any of the three edges
+		vec4 base = viewProjection * vec4(box.minimum, 1.0f);
+		vec3 size = box.maximum - box.minimum;
+		vec4 edges[3] = { viewProjection[0] * size.x, viewProjection[1] * size.y, viewProjection[2] * size.z };
+		float minX = FLT_MAX, minY = FLT_MAX, maxX = -FLT_MAX, maxY = -FLT_MAX, nearest = FLT_MAX;
+		for (int corner = 0; corner < 8; corner++) {
+			vec4 clip = base;
+			for (int axis = 0; axis < 3; axis++)
+				if (corner & (1 << axis))
+					clip = clip + edges[axis];
+			if (clip.w <= MIN_W)
+				return true;
+			float inverseW = 1.0f / clip.w;
+			float x = (clip.x * inverseW * 0.5f + 0.5f) * width, y = (clip.y * inverseW * 0.5f + 0.5f) * height;
+			minX = std::min(minX, x);
+			maxX = std::max(maxX, x);
+			minY = std::min(minY, y);
+			maxY = std::max(maxY, y);
+			nearest = std::min(nearest, clip.z * inverseW * 0.5f + 0.5f);
+		}
+		if (maxX < 0.0f || maxY < 0.0f || minX > (float)width || minY > (float)height)
+			return true;
+
+		// every pixel the rectangle reaches into
+		int x0 = std::max(0, (int)std::floor(minX)), y0 = std::max(0, (int)std::floor(minY));
+		int x1 = std::min(width - 1, std::max(x0, (int)std::ceil(maxX) - 1));
+		int y1 = std::min(height - 1, std::max(y0, (int)std::ceil(maxY) - 1));
+		for (int ty = y0 / TILE_SIZE; ty <= y1 / TILE_SIZE; ty++) {
+			for (int tx = x0 / TILE_SIZE; tx <= x1 / TILE_SIZE; tx++) {
+				size_t tile = (size_t)ty * tilesX + tx;
+				if (tileDepths[tile] < nearest)
+					continue;
+				const float* pixels = &depth[tile * TILE_PIXELS];
+				int rowBegin = std::max(y0 - ty * TILE_SIZE, 0), rowEnd = std::min(y1 - ty * TILE_SIZE, TILE_SIZE - 1);
+				int columnBegin = std::max(x0 - tx * TILE_SIZE, 0), columnEnd = std::min(x1 - tx * TILE_SIZE, TILE_SIZE - 1);
+				for (int row = rowBegin; row <= rowEnd; row++)
+					for (int column = columnBegin; column <= columnEnd; column++)
+						if (pixels[row * TILE_SIZE + column] >= nearest)
+							return true;
+			}
+		}
+		return false;
+	}
+
+	// writes the candidates (indices into boxes) that aren't hidden into visible and returns how many
+	// there are. visible may be candidates, the pool splits them into blocks
+	size_t CullOccluded(const CullingBoxes& boxes, const unsigned int* candidates, size_t count, unsigned int* visible,
+		ThreadPool* pool = nullptr) const {
+		if (!pool || count <= TEST_BLOCK)
+			return testRange(boxes, candidates, 0, count, visible);
+		size_t blocks = (count + TEST_BLOCK - 1) / TEST_BLOCK;
+		vector<size_t> counts(blocks);
+		pool->ParallelFor(blocks, [&](size_t first, size_t last) {
+			for (size_t b = first; b < last; b++) {
+				size_t begin = b * TEST_BLOCK;
+				counts[b] = testRange(boxes, candidates, begin, std::min(begin + TEST_BLOCK, count), visible + begin);
+			}
+		});
+		size_t passed = counts[0];
+		for (size_t b = 1; b < blocks; b++) {
+			memmove(visible + passed, visible + b * TEST_BLOCK, counts[b] * sizeof(unsigned int));
+			passed += counts[b];
+		}
+		return passed;
+	}
+
+private:
+	static const int TILE_PIXELS = TILE_SIZE * TILE_SIZE;
+	static const size_t TILES_PER_JOB = 8;
+	static const size_t TEST_BLOCK = 4096;
+	// clip w of the near plane and anything closer to the camera than it, not worth projecting
+	static constexpr float MIN_W = 1e-5f;
+
+	// screen space, pixel centers at + 0.5. Both are evaluated at pixel centers, already moved to the
+	// corner of the pixel that is least inside and farthest away
+	struct Triangle {
+		float edgeA[3], edgeB[3], edgeC[3]; // a * x + b * y + c >= 0 when the whole pixel is inside
+		float depthA, depthB, depthC; // depth = a * x + b * y + c
+		int minX, minY, maxX, maxY; // pixels that can be inside completely, on the screen
+	};
+
+	int width, height, tilesX, tilesY;
+	CullSimd simd;
+	mat4 viewProjection = mat4(1.0f);
+	vector<vec4> clipVertices; // three per triangle
+	vector<Triangle> triangles;
+	vector<vector<unsigned int>> bins; // triangles touching every tile
+	vector<float> depth; // tile after tile, TILE_PIXELS each, rows bottom to top inside a tile
+	vector<float> tileDepths; // the furthest depth of every tile
+
+	// clips every triangle against the near plane (z >= -w) and sets up what's left on the screen
+	void setupTriangles() {
+		triangles.clear();
+		for (size_t i = 0; i + 2 < clipVertices.size(); i += 3) {
+			const vec4* v = &clipVertices[i];
+			float d[3] = { v[0].z + v[0].w, v[1].z + v[1].w, v[2].z + v[2].w };
+			if (d[0] >= 0.0f && d[1] >= 0.0f && d[2] >= 0.0f) {
+				setupTriangle(v[0], v[1], v[2]);
+				continue;
+			}
+			// Sutherland-Hodgman against one plane, a triangle becomes at most a quad
+			vec4 polygon[4];
+			int count = 0;
+			for (int corner = 0; corner < 3; corner++) {
+				int next = (corner + 1) % 3;
+				if (d[corner] >= 0.0f)
+					polygon[count++] = v[corner];
+				if ((d[corner] >= 0.0f) != (d[next] >= 0.0f))
+					polygon[count++] = v[corner] + (v[next] - v[corner]) * (d[corner] / (d[corner] - d[next]));
+			}
+			for (int corner = 2; corner < count; corner++)
+				setupTriangle(polygon[0], polygon[corner - 1], polygon[corner]);
+		}
+	}
+
+	void setupTriangle(const vec4& a, const vec4& b, const vec4& c) {
+		const vec4* clip[3] = { &a, &b, &c };
+		float x[3], y[3], z[3];
+		for (int i = 0; i < 3; i++) {
+			if (clip[i]->w <= MIN_W)
+				return;
+			float inverseW = 1.0f / clip[i]->w;
+			x[i] = (clip[i]->x * inverseW * 0.5f + 0.5f) * width;
+			y[i] = (clip[i]->y * inverseW * 0.5f + 0.5f) * height;
+			z[i] = clip[i]->z * inverseW * 0.5f + 0.5f;
+		}
+		float area = (x[1] - x[0]) * (y[2] - y[0]) - (x[2] - x[0]) * (y[1] - y[0]);
+		if (std::fabs(area) < 1e-8f)
+			return;
+
+		Triangle triangle;
+		// pixels inside the bounds of the corners
+		triangle.minX = std::max(0, (int)std::ceil(std::min({ x[0], x[1], x[2] })));
+		triangle.minY = std::max(0, (int)std::ceil(std::min({ y[0], y[1], y[2] })));
+		triangle.maxX = std::min(width - 1, (int)std::floor(std::max({ x[0], x[1], x[2] })) - 1);
+		triangle.maxY = std::min(height - 1, (int)std::floor(std::max({ y[0], y[1], y[2] })) - 1);
+		if (triangle.minX > triangle.maxX || triangle.minY > triangle.maxY)
+			return;
+
+		// edge i runs from corner i to the next one, flipped for clockwise triangles so inside is positive.
+		// Half a pixel inwards, the center is inside when the corner of the pixel nearest the edge is
+		float sign = area > 0.0f ? 1.0f : -1.0f;
+		for (int i = 0; i < 3; i++) {
+			int next = (i + 1) % 3;
+			triangle.edgeA[i] = sign * (y[i] - y[next]);
+			triangle.edgeB[i] = sign * (x[next] - x[i]);
+			triangle.edgeC[i] = -(triangle.edgeA[i] * x[i] + triangle.edgeB[i] * y[i])
+				- 0.5f * (std::fabs(triangle.edgeA[i]) + std::fabs(triangle.edgeB[i]));
+		}
+		// and half a pixel further away, the depth at the center is the farthest one over the pixel
+		triangle.depthA = ((z[1] - z[0]) * (y[2] - y[0]) - (z[2] - z[0]) * (y[1] - y[0])) / area;
+		triangle.depthB = ((z[2] - z[0]) * (x[1] - x[0]) - (z[1] - z[0]) * (x[2] - x[0])) / area;
+		triangle.depthC = z[0] - triangle.depthA * x[0] - triangle.depthB * y[0]
+			+ 0.5f * (std::fabs(triangle.depthA) + std::fabs(triangle.depthB));
+		triangles.push_back(triangle);
+	}
+
+	void rasterizeTiles(size_t first, size_t last) {
+		for (size_t tile = first; tile < last; tile++) {
+			float* pixels = &depth[tile * TILE_PIXELS];
+			std::fill(pixels, pixels + TILE_PIXELS, 1.0f);
+			int x0 = (int)(tile % tilesX) * TILE_SIZE, y0 = (int)(tile / tilesX) * TILE_SIZE;
+			for (unsigned int t : bins[tile]) {
+				const Triangle& triangle = triangles[t];
+				int rowBegin = std::max(triangle.minY - y0, 0), rowEnd = std::min(triangle.maxY - y0, TILE_SIZE - 1);
+#ifdef OCCLUSION_CULLING_AVX2
+				if (simd == CULL_SIMD_AVX2) {
+					rasterizeAVX2(triangle, x0, y0, rowBegin, rowEnd, pixels);
+					continue;
+				}
+#endif
+				rasterizeScalar(triangle, x0, y0, rowBegin, rowEnd, pixels);
+			}
+			tileDepths[tile] = *std::max_element(pixels, pixels + TILE_PIXELS);
+		}
+	}
+
+	static void rasterizeScalar(const Triangle& triangle, int x0, int y0, int rowBegin, int rowEnd, float* pixels) {
+		for (int row = rowBegin; row <= rowEnd; row++) {
+			float y = (float)(y0 + row) + 0.5f;
+			float rowEdges[3];
+			for (int i = 0; i < 3; i++)
+				rowEdges[i] = triangle.edgeB[i] * y + triangle.edgeC[i];
+			float rowDepth = triangle.depthB * y + triangle.depthC;
+			float* out = pixels + row * TILE_SIZE;
+			for (int column = 0; column < TILE_SIZE; column++) {
+				float x = (float)(x0 + column) + 0.5f;
+				if (triangle.edgeA[0] * x + rowEdges[0] >= 0.0f && triangle.edgeA[1] * x + rowEdges[1] >= 0.0f
+					&& triangle.edgeA[2] * x + rowEdges[2] >= 0.0f)
+					out[column] = std::min(out[column], triangle.depthA * x + rowDepth);
+			}
+		}
+	}
+
+#ifdef OCCLUSION_CULLING_AVX2
+	OCCLUSION_CULLING_AVX2_TARGET
+	static void rasterizeAVX2(const Triangle& triangle, int x0, int y0, int rowBegin, int rowEnd, float* pixels) {
+		static_assert(TILE_SIZE == 8, "a row of a tile is one AVX2 register");
+		__m256 x = _mm256_add_ps(_mm256_set1_ps((float)x0 + 0.5f), _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7));
+		// the parts of the edges and the depth that only change along a row
+		__m256 columnEdges[3];
+		for (int i = 0; i < 3; i++)
+			columnEdges[i] = _mm256_mul_ps(_mm256_set1_ps(triangle.edgeA[i]), x);
+		__m256 columnDepth = _mm256_mul_ps(_mm256_set1_ps(triangle.depthA), x);
+		const __m256 zero = _mm256_setzero_ps();
+		for (int row = rowBegin; row <= rowEnd; row++) {
+			float y = (float)(y0 + row) + 0.5f;
+			__m256 inside = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+			for (int i = 0; i < 3; i++) {
+				__m256 edge = _mm256_add_ps(columnEdges[i], _mm256_set1_ps(triangle.edgeB[i] * y + triangle.edgeC[i]));
+				inside = _mm256_and_ps(inside, _mm256_cmp_ps(edge, zero, _CMP_GE_OQ));
+			}
+			if (_mm256_testz_ps(inside, inside))
+				continue;
+			__m256 z = _mm256_add_ps(columnDepth, _mm256_set1_ps(triangle.depthB * y + triangle.depthC));
+			float* out = pixels + row * TILE_SIZE;
+			__m256 current = _mm256_loadu_ps(out);
+			_mm256_storeu_ps(out, _mm256_blendv_ps(current, _mm256_min_ps(current, z), inside));
+		}
+	}
+#endif
+
+	size_t testRange(const CullingBoxes& boxes, const unsigned int* candidates, size_t begin, size_t end,
+		unsigned int* visible) const {
+		size_t count = 0;
+		for (size_t i = begin; i < end; i++) {
+			unsigned int index = candidates[i];
+			AABB box;
+			box.minimum = vec3(boxes.minX[index], boxes.minY[index], boxes.minZ[index]);
+			box.maximum = vec3(boxes.maxX[index], boxes.maxY[index], boxes.maxZ[index]);
+			if (IsVisible(box))
+				visible[count++] = index;
+		}
+		return count;
+	}
+};
+
+#endif
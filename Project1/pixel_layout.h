@@ -0,0 +1,92 @@
+#ifndef PIXEL_LAYOUT_H
+#define PIXEL_LAYOUT_H
+
+#include <glad/glad.h>
+
+#include <cstddef>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+#include <emmintrin.h>
+#define PIXEL_LAYOUT_SSE2
+#endif
+
+// Picks the layout 8 bit images are uploaded in, so the driver can copy their rows as they are.
+//
+// One and two channel images stay R8 and RG8, SetGreySwizzle() makes them sample as grey and grey + alpha
+// like they would as RGBA. GPUs have no 3 byte texel, an RGB8 upload makes the
+// driver repack every row, so RGB images are decoded with a fourth (opaque) channel into RGBA8;
+// stb_image adds it while decoding. Some drivers only take RGBA8 uploads without swizzling when
+// they come as BGRA, PIXEL_ORDER_BGRA swaps red and blue on the CPU for them (SSE2, 4 pixels a go).
+
+enum PixelOrder {
+	PIXEL_ORDER_RGBA,
+	PIXEL_ORDER_BGRA
+};
+
+struct PixelLayout {
+	int channels = 4; // to decode, the bytes of a pixel
+	GLenum internalFormat = GL_RGBA8, pixelFormat = GL_RGBA, pixelType = GL_UNSIGNED_BYTE;
+	bool swizzle = false; // red and blue swapped after decoding
+};
+
+inline PixelLayout NegotiatePixelLayout(int sourceChannels, PixelOrder order = PIXEL_ORDER_RGBA) {
+	PixelLayout layout;
+	switch (sourceChannels) {
+	case 1:
+		layout.channels = 1;
+		layout.internalFormat = GL_R8;
+		layout.pixelFormat = GL_RED;
+		return layout;
+	case 2:
+		layout.channels = 2;
+		layout.internalFormat = GL_RG8;
+		layout.pixelFormat = GL_RG;
+		return layout;
+	default:
+		if (order == PIXEL_ORDER_BGRA) {
+			layout.pixelFormat = GL_BGRA;
+			layout.pixelType = GL_UNSIGNED_INT_8_8_8_8_REV;
+			layout.swizzle = true;
+		}
+		return layout;
+	}
+}
+
+// a texture of a grey image in one or two channel format returns (grey, grey, grey, 1) or
+// (grey, grey, grey, alpha) instead of (grey, 0, 0, 1) or (grey, alpha, 0, 1). Other formats are left alone
+inline void SetGreySwizzle(GLuint texture, GLenum internalFormat) {
+	static const GLint grey[4] = { GL_RED, GL_RED, GL_RED, GL_ONE };
+	static const GLint greyAlpha[4] = { GL_RED, GL_RED, GL_RED, GL_GREEN };
+	switch (internalFormat) {
+	case GL_R8: case GL_R16F: case GL_R32F:
+		glTextureParameteriv(texture, GL_TEXTURE_SWIZZLE_RGBA, grey);
+		break;
+	case GL_RG8: case GL_RG16F: case GL_RG32F:
+		glTextureParameteriv(texture, GL_TEXTURE_SWIZZLE_RGBA, greyAlpha);
+		break;
+	}
+}
+
+// swaps red and blue of count RGBA pixels in place, either way round
+inline void SwizzleRedBlue(unsigned char* pixels, size_t count) {
+	size_t i = 0;
+#ifdef PIXEL_LAYOUT_SSE2
+	// a pixel per 32 bit lane: green and alpha stay, red and blue trade places
+	const __m128i keep = _mm_set1_epi32((int)0xff00ff00u), low = _mm_set1_epi32(0xff);
+	for (; i + 4 <= count; i += 4) {
+		__m128i v = _mm_loadu_si128((const __m128i*)(pixels + i * 4));
+		__m128i red = _mm_slli_epi32(_mm_and_si128(v, low), 16);
+		__m128i blue = _mm_and_si128(_mm_srli_epi32(v, 16), low);
+		v = _mm_or_si128(_mm_and_si128(v, keep), _mm_or_si128(red, blue));
+		_mm_storeu_si128((__m128i*)(pixels + i * 4), v);
+	}
+#endif
+	for (; i < count; i++) {
+		unsigned char* p = pixels + i * 4;
+		unsigned char red = p[0];
+		p[0] = p[2];
+		p[2] = red;
+	}
+}
+
+#endif
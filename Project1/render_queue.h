@@ -0,0 +1,336 @@
+#ifndef RENDER_QUEUE_H
+#define RENDER_QUEUE_H
+
+#include <glad/glad.h>
+
+// Plugins for OpenGL Mathematics
+// Allows us to use mathematical transformations into our engine for any object
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+#include <glm/gtc/type_ptr.hpp>
+
+#include <vector>
+#include <string>
+#include <unordered_map>
+#include <cstdint>
+
+#include "shader.h"
+#include "gl_state.h"
+#include "gl_resources.h"
+#include "stream_buffer.h"
+#include "scene_buffer.h"
+
+using namespace glm;
+using namespace std;
+
+// Draws are recorded into the queue during the frame and only issued when Flush() is called.
+// Every packet gets a 64 bit sort key so that draws sharing a shader, material and VAO end up
+// next to each other, which lets us merge them into a single instanced draw call.
+//
+// opaque key:      | pass (2) | shader (10) | material (12) | VAO (12) | depth (28) |
+// transparent key: | pass (2) | inverted depth (28) | shader (10) | material (12) | VAO (12) |
+//
+// opaque draws are sorted by state first and then front-to-back so early-Z can reject hidden fragments,
+// transparent draws are sorted back-to-front first since blending depends on the order.
+
+enum RenderPass {
+	PASS_OPAQUE = 0,
+	PASS_TRANSPARENT = 1
+};
+
+// the object id of each instance is fed to the vertex shader through attribute location 3,
+// the shader looks up its transform in the scene buffer. Locations 0-2 are used by the mesh itself
+const unsigned int INSTANCE_OBJECT_LOCATION = 3;
+// vertex buffer binding point the instance buffer is attached to, binding 0 holds the mesh vertices
+const unsigned int INSTANCE_BINDING = 1;
+
+// a set of textures and the sampler uniform each one is bound to. targets can be left empty when
+// every texture is a GL_TEXTURE_2D
+struct Material {
+	vector<unsigned int> textures;
+	vector<string> samplers;
+	vector<GLenum> targets;
+
+	GLenum target(unsigned int i) const {
+		return i < targets.size() ? targets[i] : GL_TEXTURE_2D;
+	}
+
+	bool operator==(const Material& other) const {
+		if (textures != other.textures || samplers != other.samplers)
+			return false;
+		for (unsigned int i = 0; i < textures.size(); i++)
+			if (target(i) != other.target(i))
+				return false;
+		return true;
+	}
+};
+
+struct DrawPacket {
+	uint64_t sortKey;
+	Shader* shader;
+	unsigned int material; // 0 means no textures need to be bound
+	unsigned int VAO;
+	GLenum primitive;
+	GLsizei count; // number of vertices (or indices when indexed)
+	bool indexed;
+	RenderPass pass;
+	unsigned int object; // id in the scene buffer
+};
+
+// counters for the last flushed frame
+struct RenderQueueStats {
+	unsigned int packets = 0;
+	unsigned int drawCalls = 0;
+	unsigned int shaderChanges = 0;
+	unsigned int materialChanges = 0;
+	unsigned int textureBinds = 0;
+	unsigned int vaoChanges = 0;
+};
+
+class RenderQueue {
+public:
+	RenderQueueStats stats;
+
+	// instance data is written straight into the per-frame stream buffer, transforms come from the scene buffer
+	RenderQueue(StreamBuffer& stream, SceneBuffer& scene) : stream(stream), scene(scene) {
+		materials.push_back(Material()); // material 0 is the empty material
+	}
+
+	// registers a material and returns the id used when submitting draws. Materials that bind the same
+	// textures get the same id, so draws of objects using different layers of a packed texture array
+	// (see texture_packer.h) still end up in one instanced draw
+	unsigned int RegisterMaterial(const Material& material) {
+		for (unsigned int i = 1; i < materials.size(); i++)
+			if (materials[i] == material)
+				return i;
+		materials.push_back(material);
+		return (unsigned int)materials.size() - 1;
+	}
+
+	// needs to be called at the start of every frame so we know where the camera is for depth sorting
+	void Begin(const mat4& view, float farPlane) {
+		this->view = view;
+		this->farPlane = farPlane;
+		packets.clear();
+	}
+
+	void Submit(Shader& shader, unsigned int VAO, GLsizei count, unsigned int object,
+		unsigned int material = 0, bool indexed = false, RenderPass pass = PASS_OPAQUE, GLenum primitive = GL_TRIANGLES) {
+		DrawPacket packet;
+		packet.shader = &shader;
+		packet.material = material;
+		packet.VAO = VAO;
+		packet.primitive = primitive;
+		packet.count = count;
+		packet.indexed = indexed;
+		packet.pass = pass;
+		packet.object = object;
+
+		// view space depth of the object's origin, the camera looks down -z
+		float depth = -(view * scene.GetTransform(object)[3]).z / farPlane;
+		packet.sortKey = makeSortKey(pass, compactID(shaderIDs, shader.ID, 10), compactID(materialIDs, material, 12),
+			compactID(vaoIDs, VAO, 12), depth);
+
+		packets.push_back(packet);
+	}
+
+	// sorts everything that was submitted this frame and issues the draws
+	void Flush() {
+		stats = RenderQueueStats();
+		stats.packets = (unsigned int)packets.size();
+		if (packets.empty())
+			return;
+
+		radixSort();
+
+		// every packet is one instance, so the instance data of the whole frame is known up front.
+		// The allocation is aligned to a whole instance which lets baseInstance point into it directly
+		StreamAllocation allocation = stream.Allocate(packets.size() * sizeof(GLuint), sizeof(GLuint));
+		GLuint* instances = (GLuint*)allocation.data;
+		GLuint firstInstance = (GLuint)(allocation.offset / sizeof(GLuint));
+		if (allocation.buffer != instanceBuffer)
+			attachInstanceBuffer(allocation.buffer);
+
+		// split the sorted packets into batches and write their object ids next to each other
+		batches.clear();
+		GLuint written = 0;
+		for (size_t i = 0; i < sorted.size();) {
+			const DrawPacket& first = packets[sorted[i].index];
+			Batch batch;
+			batch.packet = sorted[i].index;
+			batch.baseInstance = firstInstance + written;
+
+			size_t j = i;
+			while (j < sorted.size() && canMerge(first, packets[sorted[j].index])) {
+				instances[written++] = packets[sorted[j].index].object;
+				j++;
+			}
+			batch.instanceCount = (GLsizei)(j - i);
+			batches.push_back(batch);
+			i = j;
+		}
+
+		GLStateCache& state = GLStateCache::Get();
+
+		Shader* currentShader = nullptr;
+		unsigned int currentMaterial = ~0u;
+		unsigned int currentVAO = ~0u;
+		RenderPass currentPass = PASS_OPAQUE;
+
+		for (const Batch& batch : batches) {
+			const DrawPacket& packet = packets[batch.packet];
+
+			if (packet.pass != currentPass) {
+				// transparent objects are blended on top and shouldn't hide each other
+				state.Enable(GL_BLEND);
+				state.BlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+				state.DepthMask(false);
+				currentPass = packet.pass;
+			}
+			if (packet.shader != currentShader) {
+				packet.shader->use();
+				currentShader = packet.shader;
+				currentMaterial = ~0u; // sampler uniforms belong to the program
+				stats.shaderChanges++;
+			}
+			if (packet.material != currentMaterial) {
+				bindMaterial(*packet.shader, materials[packet.material]);
+				currentMaterial = packet.material;
+				stats.materialChanges++;
+			}
+			if (packet.VAO != currentVAO) {
+				state.BindVertexArray(packet.VAO);
+				setupInstanceAttributes(packet.VAO);
+				currentVAO = packet.VAO;
+				stats.vaoChanges++;
+			}
+
+			if (packet.indexed)
+				glDrawElementsInstancedBaseInstance(packet.primitive, packet.count, GL_UNSIGNED_INT, 0,
+					batch.instanceCount, batch.baseInstance);
+			else
+				glDrawArraysInstancedBaseInstance(packet.primitive, 0, packet.count,
+					batch.instanceCount, batch.baseInstance);
+			stats.drawCalls++;
+		}
+
+		if (currentPass == PASS_TRANSPARENT) {
+			state.Disable(GL_BLEND);
+			state.DepthMask(true);
+		}
+	}
+
+private:
+	struct SortEntry {
+		uint64_t key;
+		uint32_t index;
+	};
+
+	struct Batch {
+		uint32_t packet; // first packet of the batch, the others only differ in their object
+		GLuint baseInstance;
+		GLsizei instanceCount;
+	};
+
+	vector<DrawPacket> packets;
+	vector<SortEntry> sorted, scratch;
+	vector<Batch> batches;
+	vector<Material> materials;
+
+	// GL names can be any number so they get remapped to small indices that fit in the sort key
+	unordered_map<unsigned int, unsigned int> shaderIDs, materialIDs, vaoIDs;
+	// VAOs that already have the instance attributes pointing at our buffer
+	unordered_map<unsigned int, bool> instancedVAOs;
+
+	StreamBuffer& stream;
+	SceneBuffer& scene;
+	// the buffer the instance attributes of every known VAO point at
+	unsigned int instanceBuffer = 0;
+	mat4 view = mat4(1.0f);
+	float farPlane = 100.0f;
+
+	static unsigned int compactID(unordered_map<unsigned int, unsigned int>& ids, unsigned int id, unsigned int bits) {
+		auto it = ids.find(id);
+		if (it == ids.end())
+			it = ids.emplace(id, (unsigned int)ids.size()).first;
+		// if we ever run out of bits the ids only alias in the sort order, batching still compares the real values
+		return it->second & ((1u << bits) - 1);
+	}
+
+	static uint64_t makeSortKey(RenderPass pass, uint64_t shader, uint64_t material, uint64_t VAO, float depth) {
+		const uint64_t depthMax = (1ull << 28) - 1;
+		if (depth < 0.0f) depth = 0.0f;
+		if (depth > 1.0f) depth = 1.0f;
+		uint64_t quantized = (uint64_t)(depth * depthMax);
+
+		if (pass == PASS_OPAQUE)
+			return ((uint64_t)pass << 62) | (shader << 52) | (material << 40) | (VAO << 28) | quantized;
+		// far away transparent objects have to be drawn first
+		return ((uint64_t)pass << 62) | ((depthMax - quantized) << 34) | (shader << 24) | (material << 12) | VAO;
+	}
+
+	static bool canMerge(const DrawPacket& a, const DrawPacket& b) {
+		return a.shader == b.shader && a.material == b.material && a.VAO == b.VAO && a.count == b.count
+			&& a.indexed == b.indexed && a.primitive == b.primitive && a.pass == b.pass;
+	}
+
+	// least significant digit radix sort, 8 bits per pass
+	void radixSort() {
+		sorted.resize(packets.size());
+		scratch.resize(packets.size());
+		for (uint32_t i = 0; i < packets.size(); i++)
+			sorted[i] = { packets[i].sortKey, i };
+
+		for (int shift = 0; shift < 64; shift += 8) {
+			size_t counts[256] = {};
+			for (const SortEntry& entry : sorted)
+				counts[(entry.key >> shift) & 0xFF]++;
+
+			// every key has the same byte here so this pass wouldn't move anything
+			if (counts[(sorted[0].key >> shift) & 0xFF] == sorted.size())
+				continue;
+
+			size_t offset = 0;
+			for (int i = 0; i < 256; i++) {
+				size_t count = counts[i];
+				counts[i] = offset;
+				offset += count;
+			}
+			for (const SortEntry& entry : sorted)
+				scratch[counts[(entry.key >> shift) & 0xFF]++] = entry;
+			sorted.swap(scratch);
+		}
+	}
+
+	void bindMaterial(Shader& shader, const Material& material) {
+		for (unsigned int i = 0; i < material.textures.size(); i++) {
+			shader.setInt(material.samplers[i], i);
+			GLStateCache::Get().BindTexture(i, material.target(i), material.textures[i]);
+		}
+		stats.textureBinds += (unsigned int)material.textures.size();
+	}
+
+	// the stream buffer only changes when it had to grow, then every VAO we've set up gets pointed at the new one
+	void attachInstanceBuffer(unsigned int buffer) {
+		instanceBuffer = buffer;
+		for (auto& entry : instancedVAOs)
+			glVertexArrayVertexBuffer(entry.first, INSTANCE_BINDING, instanceBuffer, 0, sizeof(GLuint));
+	}
+
+	// points attribute location 3 of the VAO at the instance buffer, only done the first time we see a VAO
+	void setupInstanceAttributes(unsigned int VAO) {
+		if (instancedVAOs[VAO])
+			return;
+		instancedVAOs[VAO] = true;
+
+		glVertexArrayVertexBuffer(VAO, INSTANCE_BINDING, instanceBuffer, 0, sizeof(GLuint));
+		// advance once per instance instead of once per vertex
+		glVertexArrayBindingDivisor(VAO, INSTANCE_BINDING, 1);
+		// integer attribute, it must not be converted to float
+		glEnableVertexArrayAttrib(VAO, INSTANCE_OBJECT_LOCATION);
+		glVertexArrayAttribIFormat(VAO, INSTANCE_OBJECT_LOCATION, 1, GL_UNSIGNED_INT, 0);
+		glVertexArrayAttribBinding(VAO, INSTANCE_OBJECT_LOCATION, INSTANCE_BINDING);
+	}
+};
+
+#endif
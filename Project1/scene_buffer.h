@@ -0,0 +1,169 @@
+#ifndef SCENE_BUFFER_H
+#define SCENE_BUFFER_H
+
+#include <glad/glad.h>
+
+// Plugins for OpenGL Mathematics
+// Allows us to use mathematical transformations into our engine for any object
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+#include <glm/gtc/type_ptr.hpp>
+
+#include <vector>
+#include <algorithm>
+
+#include "gl_state.h"
+#include "gl_resources.h"
+#include "stream_buffer.h"
+#include "normal_matrix.h"
+#include "binding_points.h"
+
+using namespace glm;
+using namespace std;
+
+// Retained copy of every object's transform on the GPU, stored in a shader storage buffer
+// that the vertex shaders index with the object id they get per instance.
+//
+// Only objects that changed since the last Upload() are sent again: the dirty ids are sorted,
+// merged into contiguous ranges, copied into the stream buffer and then copied on the GPU into
+// the storage buffer. An object that never moves costs nothing after its first frame.
+
+// matches the std430 layout of ObjectData in the shaders, a mat3 takes three vec4 columns
+struct ObjectData {
+	mat4 model;
+	vec4 normalMatrix[3];
+	unsigned int materialIndex;
+	unsigned int padding[3];
+};
+
+struct SceneBufferStats {
+	unsigned int dirtyObjects = 0; // objects changed since the last upload
+	unsigned int uploadRanges = 0; // contiguous copies issued by the last upload
+	size_t uploadBytes = 0;
+};
+
+class SceneBuffer {
+public:
+	SceneBufferStats stats;
+
+	SceneBuffer(StreamBuffer& stream, unsigned int initialCapacity = 1024) : stream(stream) {
+		createBuffer(initialCapacity);
+	}
+
+	// adds an object and returns its id, the id stays the same until the object is removed
+	unsigned int Add(const mat4& model, unsigned int materialIndex = 0) {
+		unsigned int id;
+		if (!freeIDs.empty()) {
+			id = freeIDs.back();
+			freeIDs.pop_back();
+		}
+		else {
+			id = (unsigned int)objects.size();
+			objects.push_back(ObjectData());
+			dirtyFlags.push_back(0);
+		}
+		objects[id].materialIndex = materialIndex;
+		SetTransform(id, model);
+		return id;
+	}
+
+	void Remove(unsigned int id) {
+		freeIDs.push_back(id);
+	}
+
+	void SetTransform(unsigned int id, const mat4& model) {
+		// the normal matrix is only worked out in Upload(), all dirty objects in one batch
+		objects[id].model = model;
+		markDirty(id);
+	}
+
+	void SetMaterial(unsigned int id, unsigned int materialIndex) {
+		objects[id].materialIndex = materialIndex;
+		markDirty(id);
+	}
+
+	const mat4& GetTransform(unsigned int id) const {
+		return objects[id].model;
+	}
+
+	// sends every dirty range to the GPU and binds the storage buffer, call once per frame before drawing
+	void Upload() {
+		stats = SceneBufferStats();
+		stats.dirtyObjects = (unsigned int)dirty.size();
+
+		if (objects.size() > capacity)
+			createBuffer(std::max((unsigned int)objects.size(), capacity * 2));
+
+		if (!dirty.empty()) {
+			sort(dirty.begin(), dirty.end());
+
+			// the normal matrix keeps normals perpendicular to the surface under non-uniform scaling
+			normalInputs.clear();
+			normalOutputs.clear();
+			for (unsigned int id : dirty) {
+				normalInputs.push_back(&objects[id].model);
+				normalOutputs.push_back(objects[id].normalMatrix);
+			}
+			ComputeNormalMatrices(&normalInputs[0], &normalOutputs[0], dirty.size());
+
+			size_t i = 0;
+			while (i < dirty.size()) {
+				unsigned int first = dirty[i];
+				unsigned int last = first;
+				// small gaps are cheaper to upload along with the range than to issue another copy
+				while (i + 1 < dirty.size() && dirty[i + 1] <= last + MERGE_GAP)
+					last = dirty[++i];
+				i++;
+
+				GLsizeiptr size = (last - first + 1) * sizeof(ObjectData);
+				StreamAllocation allocation = stream.Upload(&objects[first], size, 16);
+				glCopyNamedBufferSubData(allocation.buffer, buffer, allocation.offset, first * sizeof(ObjectData), size);
+
+				stats.uploadRanges++;
+				stats.uploadBytes += size;
+			}
+
+			for (unsigned int id : dirty)
+				dirtyFlags[id] = 0;
+			dirty.clear();
+		}
+
+		GLStateCache::Get().BindBufferRange(GL_SHADER_STORAGE_BUFFER, SCENE_BUFFER_BINDING, buffer, 0,
+			capacity * sizeof(ObjectData));
+	}
+
+private:
+	// dirty ids at most this far apart get uploaded as one range
+	static const unsigned int MERGE_GAP = 4;
+
+	StreamBuffer& stream;
+	GLuint buffer = 0;
+	unsigned int capacity = 0;
+
+	vector<ObjectData> objects; // CPU copy, always up to date
+	vector<unsigned int> freeIDs;
+	vector<unsigned int> dirty;
+	vector<unsigned char> dirtyFlags; // so an object that changes twice in a frame is only listed once
+	vector<const mat4*> normalInputs;
+	vector<vec4*> normalOutputs;
+
+	void markDirty(unsigned int id) {
+		if (dirtyFlags[id])
+			return;
+		dirtyFlags[id] = 1;
+		dirty.push_back(id);
+	}
+
+	// immutable storage can't grow, so a bigger buffer is created and the old contents are copied over on the GPU
+	void createBuffer(unsigned int newCapacity) {
+		GLuint newBuffer = CreateBuffer(newCapacity * sizeof(ObjectData), nullptr, 0);
+		if (buffer) {
+			glCopyNamedBufferSubData(buffer, newBuffer, 0, 0, capacity * sizeof(ObjectData));
+			GLStateCache::Get().DeleteBuffer(buffer);
+		}
+		buffer = newBuffer;
+		capacity = newCapacity;
+	}
+};
+
+#endif
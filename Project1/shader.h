@@ -12,6 +12,8 @@
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/type_ptr.hpp>
 
+#include "gl_state.h"
+
 
 using namespace glm;
 
@@ -100,9 +102,54 @@ public:
 		glDeleteShader(fragmentShader);
 	}
 
+	// a compute program, run with glDispatchCompute after use()
+	explicit Shader(const char* computePath)
+	{
+		std::string computeCode;
+		std::ifstream cShaderFile;
+		cShaderFile.exceptions(std::ifstream::failbit | std::ifstream::badbit);
+		try
+		{
+			cShaderFile.open(computePath);
+			std::stringstream cShaderStream;
+			cShaderStream << cShaderFile.rdbuf();
+			computeCode = cShaderStream.str();
+		}
+		catch (std::ifstream::failure& e) {
+			std::cout << "ERROR::SHADER::FILE_NOT_SUCCESSFULLY_READ " << computePath << std::endl;
+		}
+		const char* cShaderCode = computeCode.c_str();
+		int success;
+		char infoLog[512];
+
+		unsigned int computeShader = glCreateShader(GL_COMPUTE_SHADER);
+		glShaderSource(computeShader, 1, &cShaderCode, NULL);
+		glCompileShader(computeShader);
+		glGetShaderiv(computeShader, GL_COMPILE_STATUS, &success);
+		if (!success)
+		{
+			glGetShaderInfoLog(computeShader, 512, NULL, infoLog);
+			std::cout << "ERROR::SHADER::COMPUTE::COMPILATION_FAILED " << computePath << "\n" <<
+				infoLog << std::endl;
+		}
+
+		ID = glCreateProgram();
+		glAttachShader(ID, computeShader);
+		glLinkProgram(ID);
+		glGetProgramiv(ID, GL_LINK_STATUS, &success);
+		if (!success)
+		{
+			glGetProgramInfoLog(ID, 512, NULL, infoLog);
+			std::cout << "ERROR::SHADER::PROGRAM::LINKING_FAILED " << computePath << "\n" <<
+				infoLog << std::endl;
+		}
+
+		glDeleteShader(computeShader);
+	}
+
 	//void use();
 	void use() {
-		glUseProgram(ID);
+		GLStateCache::Get().UseProgram(ID);
 	}
 	//void setBool(const std::string& name, bool value) const;
 	void setBool(const std::string& name, bool value) const{
@@ -112,6 +159,14 @@ public:
 	void setInt(const std::string& name, int value) const{
 		glUniform1i(glGetUniformLocation(ID, name.c_str()), value);
 	}
+	void setUInt(const std::string& name, unsigned int value) const
+	{
+		glUniform1ui(glGetUniformLocation(ID, name.c_str()), value);
+	}
+	void setIVec2(const std::string& name, int x, int y) const
+	{
+		glUniform2i(glGetUniformLocation(ID, name.c_str()), x, y);
+	}
 	//void setFloat(const std::string& name, float value) const;
 	void setFloat(const std::string& name, float value) const{
 		glUniform1i(glGetUniformLocation(ID, name.c_str()), value);
@@ -270,6 +270,21 @@ RECENT REVISION HISTORY:
 // (at least this is true for iOS and Android). Therefore, the NEON support is
 // toggled by a build flag: define STBI_NEON to get NEON loops.
 //
+// The IDCT and YCbCr->RGB kernels also have AVX2 versions, which are compiled
+// whatever the target and picked at run time on CPUs that support AVX2. They
+// give bit-identical results to the SSE2 ones. The RGB to RGBA expansion of
+// formats that convert after decoding (BMP, TGA, PNM, ...) uses AVX2 as well.
+// Define STBI_NO_AVX2 to leave them out.
+//
+// Baseline JPEGs with restart markers can be decoded on several threads, one
+// run of restart intervals each, when they're loaded from memory and a
+// parallel-for was handed to stbi_set_jpeg_parallel_for().
+//
+// PNG inflate decodes most of the stream with a 64-bit bit buffer refilled
+// 8 bytes at a time and lookup tables that resolve a whole literal pair,
+// length or distance code per probe, on little-endian x86/x64 and ARM64.
+// The row unfiltering uses SSE2 for the up filter and for pixels of 3 or 4 bytes.
+//
 // If for some reason you do not want to use any of SIMD code, or if
 // you have issues compiling it, you can disable it entirely by
 // defining STBI_NO_SIMD.
@@ -423,6 +438,11 @@ typedef struct
 STBIDEF stbi_uc *stbi_load_from_memory   (stbi_uc           const *buffer, int len   , int *x, int *y, int *channels_in_file, int desired_channels);
 STBIDEF stbi_uc *stbi_load_from_callbacks(stbi_io_callbacks const *clbk  , void *user, int *x, int *y, int *channels_in_file, int desired_channels);
 
+// decodes into out, which holds out_size bytes, instead of a buffer of its own. Size it with
+// stbi_info_from_memory(). JPEGs and 8-bit PNGs without a palette are written there directly,
+// other images are decoded as usual and copied. Returns out, or NULL on failure
+STBIDEF stbi_uc *stbi_load_from_memory_into(stbi_uc const *buffer, int len, stbi_uc *out, size_t out_size, int *x, int *y, int *channels_in_file, int desired_channels);
+
 #ifndef STBI_NO_STDIO
 STBIDEF stbi_uc *stbi_load            (char const *filename, int *x, int *y, int *channels_in_file, int desired_channels);
 STBIDEF stbi_uc *stbi_load_from_file  (FILE *f, int *x, int *y, int *channels_in_file, int desired_channels);
@@ -524,6 +544,24 @@ STBIDEF void stbi_set_unpremultiply_on_load_thread(int flag_true_if_should_unpre
 STBIDEF void stbi_convert_iphone_png_to_rgb_thread(int flag_true_if_should_convert);
 STBIDEF void stbi_set_flip_vertically_on_load_thread(int flag_true_if_should_flip);
 
+// baseline JPEGs with restart markers that are loaded from memory can have their restart
+// intervals decoded on several threads. func has to call body(context, i) for every i in
+// [0, count), on any threads, and return once all of them are done. NULL (the default)
+// decodes everything on the calling thread
+typedef void stbi_parallel_for_func(void *user, int count, void (*body)(void *context, int index), void *context);
+STBIDEF void stbi_set_jpeg_parallel_for(stbi_parallel_for_func *func, void *user);
+
+// the fast inflate loop and the SIMD PNG unfiltering are on by default, turning them off
+// decodes with the plain code paths, which is only useful to compare the two
+STBIDEF void stbi_set_png_fast_decode(int flag_true_if_fast);
+
+// JPEGs decode at 1/(1<<scale_shift) of their size, for scale_shift 1, 2 or 3, by running a
+// smaller IDCT on the low frequencies of every block. That's far cheaper than decoding the whole
+// image and shrinking it. stbi_info() reports the reduced size as well, other formats aren't
+// affected. 0 (the default) decodes at full size. The _thread version is like the flip one above
+STBIDEF void stbi_set_jpeg_scale(int scale_shift);
+STBIDEF void stbi_set_jpeg_scale_thread(int scale_shift);
+
 // ZLIB client - used by PNG, available for other purposes
 
 STBIDEF char *stbi_zlib_decode_malloc_guesssize(const char *buffer, int len, int initial_size, int *outlen);
@@ -643,12 +681,14 @@ typedef unsigned short stbi__uint16;
 typedef   signed short stbi__int16;
 typedef unsigned int   stbi__uint32;
 typedef   signed int   stbi__int32;
+typedef unsigned long long stbi__uint64;
 #else
 #include <stdint.h>
 typedef uint16_t stbi__uint16;
 typedef int16_t  stbi__int16;
 typedef uint32_t stbi__uint32;
 typedef int32_t  stbi__int32;
+typedef uint64_t stbi__uint64;
 #endif
 
 // should produce compiler error if size is wrong
@@ -774,6 +814,39 @@ static int stbi__sse2_available(void)
 #endif
 #endif
 
+// AVX2 versions of the JPEG kernels. they're compiled for AVX2 whatever the build targets
+// and only picked at runtime when the CPU (and the OS) supports it. #define STBI_NO_AVX2
+// to leave them out
+#if defined(STBI_SSE2) && !defined(STBI_NO_AVX2) && !defined(STBI_NO_JPEG) && \
+   ((defined(_MSC_VER) && _MSC_VER >= 1700) || defined(__clang__) || \
+    (defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))))
+#define STBI_AVX2
+#include <immintrin.h>
+
+#ifdef _MSC_VER
+#define STBI__AVX2_TARGET
+static int stbi__avx2_available(void)
+{
+   int info[4];
+   __cpuid(info,0);
+   if (info[0] < 7) return 0;
+   // the OS has to save the ymm registers too: OSXSAVE and AVX set, XCR0 has SSE and AVX state
+   __cpuid(info,1);
+   if ((info[2] & ((1 << 27) | (1 << 28))) != ((1 << 27) | (1 << 28))) return 0;
+   if ((_xgetbv(0) & 6) != 6) return 0;
+   __cpuidex(info,7,0);
+   return (info[1] >> 5) & 1;
+}
+#else
+#define STBI__AVX2_TARGET __attribute__((target("avx2")))
+static int stbi__avx2_available(void)
+{
+   // checks the OS support as well
+   return __builtin_cpu_supports("avx2");
+}
+#endif
+#endif
+
 // ARM NEON
 #if defined(STBI_NO_SIMD) && defined(STBI_NEON)
 #undef STBI_NEON
@@ -817,6 +890,10 @@ typedef struct
 
    stbi_uc *img_buffer, *img_buffer_end;
    stbi_uc *img_buffer_original, *img_buffer_original_end;
+
+   // caller's buffer for the final image, see stbi_load_from_memory_into()
+   stbi_uc *dest;
+   size_t dest_size;
 } stbi__context;
 
 
@@ -830,6 +907,8 @@ static void stbi__start_mem(stbi__context *s, stbi_uc const *buffer, int len)
    s->callback_already_read = 0;
    s->img_buffer = s->img_buffer_original = (stbi_uc *) buffer;
    s->img_buffer_end = s->img_buffer_original_end = (stbi_uc *) buffer+len;
+   s->dest = NULL;
+   s->dest_size = 0;
 }
 
 // initialize a callback-based context
@@ -843,6 +922,15 @@ static void stbi__start_callbacks(stbi__context *s, stbi_io_callbacks *c, void *
    s->img_buffer = s->img_buffer_original = s->buffer_start;
    stbi__refill_buffer(s);
    s->img_buffer_original_end = s->img_buffer_end;
+   s->dest = NULL;
+   s->dest_size = 0;
+}
+
+// the caller's buffer when a decoder's final image of size bytes fits in it, else NULL.
+// Decoders that use it must not free or replace it afterwards
+static stbi_uc *stbi__dest(stbi__context *s, size_t size)
+{
+   return s->dest && size <= s->dest_size ? s->dest : NULL;
 }
 
 #ifndef STBI_NO_STDIO
@@ -1112,12 +1200,34 @@ static stbi_uc *stbi__hdr_to_ldr(float   *data, int x, int y, int comp);
 #endif
 
 static int stbi__vertically_flip_on_load_global = 0;
+static int stbi__png_fast_decode = 1;
 
 STBIDEF void stbi_set_flip_vertically_on_load(int flag_true_if_should_flip)
 {
    stbi__vertically_flip_on_load_global = flag_true_if_should_flip;
 }
 
+static stbi_parallel_for_func *stbi__jpeg_parallel_for_func = NULL;
+static void *stbi__jpeg_parallel_for_user = NULL;
+
+STBIDEF void stbi_set_jpeg_parallel_for(stbi_parallel_for_func *func, void *user)
+{
+   stbi__jpeg_parallel_for_func = func;
+   stbi__jpeg_parallel_for_user = user;
+}
+
+STBIDEF void stbi_set_png_fast_decode(int flag_true_if_fast)
+{
+   stbi__png_fast_decode = flag_true_if_fast;
+}
+
+static int stbi__jpeg_scale_global = 0;
+
+STBIDEF void stbi_set_jpeg_scale(int scale_shift)
+{
+   stbi__jpeg_scale_global = scale_shift < 0 ? 0 : scale_shift > 3 ? 3 : scale_shift;
+}
+
 #ifndef STBI_THREAD_LOCAL
 #define stbi__vertically_flip_on_load  stbi__vertically_flip_on_load_global
 #else
@@ -1134,6 +1244,22 @@ STBIDEF void stbi_set_flip_vertically_on_load_thread(int flag_true_if_should_fli
                                          : stbi__vertically_flip_on_load_global)
 #endif // STBI_THREAD_LOCAL
 
+#ifndef STBI_THREAD_LOCAL
+#define stbi__jpeg_scale  stbi__jpeg_scale_global
+#else
+static STBI_THREAD_LOCAL int stbi__jpeg_scale_local, stbi__jpeg_scale_set;
+
+STBIDEF void stbi_set_jpeg_scale_thread(int scale_shift)
+{
+   stbi__jpeg_scale_local = scale_shift < 0 ? 0 : scale_shift > 3 ? 3 : scale_shift;
+   stbi__jpeg_scale_set = 1;
+}
+
+#define stbi__jpeg_scale  (stbi__jpeg_scale_set         \
+                            ? stbi__jpeg_scale_local    \
+                            : stbi__jpeg_scale_global)
+#endif // STBI_THREAD_LOCAL
+
 static void *stbi__load_main(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi__result_info *ri, int bpc)
 {
    memset(ri, 0, sizeof(*ri)); // make sure it's initialized if we add new fields
@@ -1433,6 +1559,29 @@ STBIDEF stbi_uc *stbi_load_from_memory(stbi_uc const *buffer, int len, int *x, i
    return stbi__load_and_postprocess_8bit(&s,x,y,comp,req_comp);
 }
 
+STBIDEF stbi_uc *stbi_load_from_memory_into(stbi_uc const *buffer, int len, stbi_uc *out, size_t out_size, int *x, int *y, int *comp, int req_comp)
+{
+   stbi__context s;
+   stbi_uc *result;
+   size_t size;
+   stbi__start_mem(&s,buffer,len);
+   s.dest = out;
+   s.dest_size = out_size;
+   result = stbi__load_and_postprocess_8bit(&s,x,y,comp,req_comp);
+   if (result == NULL || result == out)
+      return result;
+
+   // the decoder made a buffer of its own
+   size = (size_t) *x * *y * (req_comp ? req_comp : *comp);
+   if (size > out_size) {
+      STBI_FREE(result);
+      return stbi__errpuc("too large", "Output buffer too small");
+   }
+   memcpy(out, result, size);
+   STBI_FREE(result);
+   return out;
+}
+
 STBIDEF stbi_uc *stbi_load_from_callbacks(stbi_io_callbacks const *clbk, void *user, int *x, int *y, int *comp, int req_comp)
 {
    stbi__context s;
@@ -1752,9 +1901,30 @@ static stbi_uc stbi__compute_y(int r, int g, int b)
 #if defined(STBI_NO_PNG) && defined(STBI_NO_BMP) && defined(STBI_NO_PSD) && defined(STBI_NO_TGA) && defined(STBI_NO_GIF) && defined(STBI_NO_PIC) && defined(STBI_NO_PNM)
 // nothing
 #else
+#ifdef STBI_AVX2
+// RGB to RGBA for stbi__convert_format, 8 pixels per iteration. Returns how many pixels it did,
+// it leaves the last few so it never reads past the end of src
+STBI__AVX2_TARGET
+static int stbi__rgb_to_rgba_avx2(stbi_uc *dest, stbi_uc const *src, int count)
+{
+   __m256i shuffle = _mm256_setr_epi8(0,1,2,-1, 3,4,5,-1, 6,7,8,-1, 9,10,11,-1,
+                                      0,1,2,-1, 3,4,5,-1, 6,7,8,-1, 9,10,11,-1);
+   __m256i alpha = _mm256_set1_epi32((int) 0xff000000u);
+   int i = 0;
+   // each half loads 16 bytes for the 12 it uses
+   for (; i + 10 <= count; i += 8) {
+      __m128i lo = _mm_loadu_si128((__m128i const *) (src + i*3));
+      __m128i hi = _mm_loadu_si128((__m128i const *) (src + i*3 + 12));
+      __m256i rgb = _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+      _mm256_storeu_si256((__m256i *) (dest + i*4), _mm256_or_si256(_mm256_shuffle_epi8(rgb, shuffle), alpha));
+   }
+   return i;
+}
+#endif
+
 static unsigned char *stbi__convert_format(unsigned char *data, int img_n, int req_comp, unsigned int x, unsigned int y)
 {
-   int i,j;
+   int i,j,skip=0,rgb_to_rgba_simd=0;
    unsigned char *good;
 
    if (req_comp == img_n) return data;
@@ -1766,12 +1936,25 @@ static unsigned char *stbi__convert_format(unsigned char *data, int img_n, int r
       return stbi__errpuc("outofmem", "Out of memory");
    }
 
+   #ifdef STBI_AVX2
+   rgb_to_rgba_simd = img_n == 3 && req_comp == 4 && stbi__avx2_available();
+   #endif
+
    for (j=0; j < (int) y; ++j) {
       unsigned char *src  = data + j * x * img_n   ;
       unsigned char *dest = good + j * x * req_comp;
 
+      // the kernel does most of the row, the scalar loop below the rest
+      #ifdef STBI_AVX2
+      if (rgb_to_rgba_simd) {
+         skip = stbi__rgb_to_rgba_avx2(dest, src, (int) x);
+         src += skip * 3;
+         dest += skip * 4;
+      }
+      #endif
+
       #define STBI__COMBO(a,b)  ((a)*8+(b))
-      #define STBI__CASE(a,b)   case STBI__COMBO(a,b): for(i=x-1; i >= 0; --i, src += a, dest += b)
+      #define STBI__CASE(a,b)   case STBI__COMBO(a,b): for(i=x-1-skip; i >= 0; --i, src += a, dest += b)
       // convert source image with img_n components to one with req_comp components;
       // avoid switch per pixel, so use switch per scanline and massive macros
       switch (STBI__COMBO(img_n, req_comp)) {
@@ -1990,6 +2173,7 @@ typedef struct
    int            jfif;
    int            app14_color_transform; // Adobe APP14 tag
    int            rgb;
+   int            scale_shift; // decoding at 1/(1<<scale_shift) of the size, see stbi_set_jpeg_scale()
 
    int scan_n, order[4];
    int restart_interval, todo;
@@ -2523,6 +2707,69 @@ static void stbi__idct_block(stbi_uc *out, int out_stride, short data[64])
    }
 }
 
+// reduced IDCTs for scaled decode: an n-point IDCT of the n*n lowest frequencies of the block
+// gives the block at 1/(8/n) of its size, close to what box filtering the full IDCT would give.
+// Both passes use C(u)/2 * cos((2x+1)u*pi/2n) scaled by 1<<11; the first pass keeps 3 bits
+// of precision, which is as much as fits in 32 bits for any dequantized coefficients
+static const short stbi__idct_table_4[16] = {
+   724,  946,  724,  392,
+   724,  392, -724, -946,
+   724, -392, -724,  946,
+   724, -946,  724, -392,
+};
+
+static const short stbi__idct_table_2[4] = {
+   724,  724,
+   724, -724,
+};
+
+static void stbi__idct_reduced(stbi_uc *out, int out_stride, short data[64], const short *table, int n)
+{
+   int i,j,k, val[16];
+   // flat blocks are common and only need the dc term
+   for (j=0; j < n; ++j)
+      for (i=0; i < n; ++i)
+         if ((i|j) && data[j*8+i]) goto ac;
+   for (j=0; j < n; ++j, out += out_stride)
+      memset(out, stbi__clamp(((data[0] + 4) >> 3) + 128), n);
+   return;
+ac:
+   // columns: val[y*n+u] is column u evaluated at row y
+   for (i=0; i < n; ++i) {
+      for (j=0; j < n; ++j) {
+         int t = 0;
+         for (k=0; k < n; ++k)
+            t += table[j*n+k] * data[k*8+i];
+         val[j*n+i] = (t + 128) >> 8;
+      }
+   }
+   for (j=0; j < n; ++j, out += out_stride) {
+      for (i=0; i < n; ++i) {
+         int t = 0;
+         for (k=0; k < n; ++k)
+            t += table[i*n+k] * val[j*n+k];
+         out[i] = stbi__clamp(((t + (1 << 13)) >> 14) + 128);
+      }
+   }
+}
+
+static void stbi__idct_block_4x4(stbi_uc *out, int out_stride, short data[64])
+{
+   stbi__idct_reduced(out, out_stride, data, stbi__idct_table_4, 4);
+}
+
+static void stbi__idct_block_2x2(stbi_uc *out, int out_stride, short data[64])
+{
+   stbi__idct_reduced(out, out_stride, data, stbi__idct_table_2, 2);
+}
+
+// just the dc term, which is 8 times the block's average
+static void stbi__idct_block_1x1(stbi_uc *out, int out_stride, short data[64])
+{
+   STBI_NOTUSED(out_stride);
+   out[0] = stbi__clamp(((data[0] + 4) >> 3) + 128);
+}
+
 #ifdef STBI_SSE2
 // sse2 integer IDCT. not the fastest possible implementation but it
 // produces bit-identical results to the generic C version so it's
@@ -2704,6 +2951,172 @@ static void stbi__idct_simd(stbi_uc *out, int out_stride, short data[64])
 
 #endif // STBI_SSE2
 
+#ifdef STBI_AVX2
+// avx2 integer IDCT. the rows stay 8 x 16-bit like in the sse2 version, but the
+// 32-bit math of a whole row happens in one register instead of two halves, which
+// roughly halves the work of each pass. bit-identical to the generic C version.
+STBI__AVX2_TARGET static void stbi__idct_avx2(stbi_uc *out, int out_stride, short data[64])
+{
+   __m128i row0, row1, row2, row3, row4, row5, row6, row7;
+   __m128i tmp;
+
+   // dot product constant: even elems=x, odd elems=y
+   #define dct_const(x,y)  _mm256_set1_epi32((int) (((unsigned int) (y) << 16) | ((x) & 0xffff)))
+
+   // out(0) = c0[even]*x + c0[odd]*y   (c0, x, y 16-bit, out 32-bit)
+   // out(1) = c1[even]*x + c1[odd]*y
+   #define dct_rot(out0,out1, x,y,c0,c1) \
+      __m256i c0##xy = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_unpacklo_epi16((x),(y))), \
+                                               _mm_unpackhi_epi16((x),(y)), 1); \
+      __m256i out0 = _mm256_madd_epi16(c0##xy, c0); \
+      __m256i out1 = _mm256_madd_epi16(c0##xy, c1)
+
+   // out = in << 12  (in 16-bit, out 32-bit)
+   #define dct_widen(out, in) \
+      __m256i out = _mm256_slli_epi32(_mm256_cvtepi16_epi32(in), 12)
+
+   // butterfly a/b, add bias, then shift by "s" and pack
+   #define dct_bfly32o(out0, out1, a,b,bias,s) \
+      { \
+         __m256i abiased = _mm256_add_epi32(a, bias); \
+         __m256i sum = _mm256_srai_epi32(_mm256_add_epi32(abiased, b), s); \
+         __m256i dif = _mm256_srai_epi32(_mm256_sub_epi32(abiased, b), s); \
+         /* packs works per 128-bit lane: s0-3 d0-3 | s4-7 d4-7, put the halves back in order */ \
+         __m256i packed = _mm256_permute4x64_epi64(_mm256_packs_epi32(sum, dif), 0xd8); \
+         out0 = _mm256_castsi256_si128(packed); \
+         out1 = _mm256_extracti128_si256(packed, 1); \
+      }
+
+   // 8-bit interleave step (for transposes)
+   #define dct_interleave8(a, b) \
+      tmp = a; \
+      a = _mm_unpacklo_epi8(a, b); \
+      b = _mm_unpackhi_epi8(tmp, b)
+
+   // 16-bit interleave step (for transposes)
+   #define dct_interleave16(a, b) \
+      tmp = a; \
+      a = _mm_unpacklo_epi16(a, b); \
+      b = _mm_unpackhi_epi16(tmp, b)
+
+   #define dct_pass(bias,shift) \
+      { \
+         /* even part */ \
+         dct_rot(t2e,t3e, row2,row6, rot0_0,rot0_1); \
+         __m128i sum04 = _mm_add_epi16(row0, row4); \
+         __m128i dif04 = _mm_sub_epi16(row0, row4); \
+         dct_widen(t0e, sum04); \
+         dct_widen(t1e, dif04); \
+         __m256i x0 = _mm256_add_epi32(t0e, t3e); \
+         __m256i x3 = _mm256_sub_epi32(t0e, t3e); \
+         __m256i x1 = _mm256_add_epi32(t1e, t2e); \
+         __m256i x2 = _mm256_sub_epi32(t1e, t2e); \
+         /* odd part */ \
+         dct_rot(y0o,y2o, row7,row3, rot2_0,rot2_1); \
+         dct_rot(y1o,y3o, row5,row1, rot3_0,rot3_1); \
+         __m128i sum17 = _mm_add_epi16(row1, row7); \
+         __m128i sum35 = _mm_add_epi16(row3, row5); \
+         dct_rot(y4o,y5o, sum17,sum35, rot1_0,rot1_1); \
+         __m256i x4 = _mm256_add_epi32(y0o, y4o); \
+         __m256i x5 = _mm256_add_epi32(y1o, y5o); \
+         __m256i x6 = _mm256_add_epi32(y2o, y5o); \
+         __m256i x7 = _mm256_add_epi32(y3o, y4o); \
+         dct_bfly32o(row0,row7, x0,x7,bias,shift); \
+         dct_bfly32o(row1,row6, x1,x6,bias,shift); \
+         dct_bfly32o(row2,row5, x2,x5,bias,shift); \
+         dct_bfly32o(row3,row4, x3,x4,bias,shift); \
+      }
+
+   __m256i rot0_0 = dct_const(stbi__f2f(0.5411961f), stbi__f2f(0.5411961f) + stbi__f2f(-1.847759065f));
+   __m256i rot0_1 = dct_const(stbi__f2f(0.5411961f) + stbi__f2f( 0.765366865f), stbi__f2f(0.5411961f));
+   __m256i rot1_0 = dct_const(stbi__f2f(1.175875602f) + stbi__f2f(-0.899976223f), stbi__f2f(1.175875602f));
+   __m256i rot1_1 = dct_const(stbi__f2f(1.175875602f), stbi__f2f(1.175875602f) + stbi__f2f(-2.562915447f));
+   __m256i rot2_0 = dct_const(stbi__f2f(-1.961570560f) + stbi__f2f( 0.298631336f), stbi__f2f(-1.961570560f));
+   __m256i rot2_1 = dct_const(stbi__f2f(-1.961570560f), stbi__f2f(-1.961570560f) + stbi__f2f( 3.072711026f));
+   __m256i rot3_0 = dct_const(stbi__f2f(-0.390180644f) + stbi__f2f( 2.053119869f), stbi__f2f(-0.390180644f));
+   __m256i rot3_1 = dct_const(stbi__f2f(-0.390180644f), stbi__f2f(-0.390180644f) + stbi__f2f( 1.501321110f));
+
+   // rounding biases in column/row passes, see stbi__idct_block for explanation.
+   __m256i bias_0 = _mm256_set1_epi32(512);
+   __m256i bias_1 = _mm256_set1_epi32(65536 + (128<<17));
+
+   // load
+   row0 = _mm_load_si128((const __m128i *) (data + 0*8));
+   row1 = _mm_load_si128((const __m128i *) (data + 1*8));
+   row2 = _mm_load_si128((const __m128i *) (data + 2*8));
+   row3 = _mm_load_si128((const __m128i *) (data + 3*8));
+   row4 = _mm_load_si128((const __m128i *) (data + 4*8));
+   row5 = _mm_load_si128((const __m128i *) (data + 5*8));
+   row6 = _mm_load_si128((const __m128i *) (data + 6*8));
+   row7 = _mm_load_si128((const __m128i *) (data + 7*8));
+
+   // column pass
+   dct_pass(bias_0, 10);
+
+   {
+      // 16bit 8x8 transpose pass 1
+      dct_interleave16(row0, row4);
+      dct_interleave16(row1, row5);
+      dct_interleave16(row2, row6);
+      dct_interleave16(row3, row7);
+
+      // transpose pass 2
+      dct_interleave16(row0, row2);
+      dct_interleave16(row1, row3);
+      dct_interleave16(row4, row6);
+      dct_interleave16(row5, row7);
+
+      // transpose pass 3
+      dct_interleave16(row0, row1);
+      dct_interleave16(row2, row3);
+      dct_interleave16(row4, row5);
+      dct_interleave16(row6, row7);
+   }
+
+   // row pass
+   dct_pass(bias_1, 17);
+
+   {
+      // pack
+      __m128i p0 = _mm_packus_epi16(row0, row1); // a0a1a2a3...a7b0b1b2b3...b7
+      __m128i p1 = _mm_packus_epi16(row2, row3);
+      __m128i p2 = _mm_packus_epi16(row4, row5);
+      __m128i p3 = _mm_packus_epi16(row6, row7);
+
+      // 8bit 8x8 transpose pass 1
+      dct_interleave8(p0, p2); // a0e0a1e1...
+      dct_interleave8(p1, p3); // c0g0c1g1...
+
+      // transpose pass 2
+      dct_interleave8(p0, p1); // a0c0e0g0...
+      dct_interleave8(p2, p3); // b0d0f0h0...
+
+      // transpose pass 3
+      dct_interleave8(p0, p2); // a0b0c0d0...
+      dct_interleave8(p1, p3); // a4b4c4d4...
+
+      // store
+      _mm_storel_epi64((__m128i *) out, p0); out += out_stride;
+      _mm_storel_epi64((__m128i *) out, _mm_shuffle_epi32(p0, 0x4e)); out += out_stride;
+      _mm_storel_epi64((__m128i *) out, p2); out += out_stride;
+      _mm_storel_epi64((__m128i *) out, _mm_shuffle_epi32(p2, 0x4e)); out += out_stride;
+      _mm_storel_epi64((__m128i *) out, p1); out += out_stride;
+      _mm_storel_epi64((__m128i *) out, _mm_shuffle_epi32(p1, 0x4e)); out += out_stride;
+      _mm_storel_epi64((__m128i *) out, p3); out += out_stride;
+      _mm_storel_epi64((__m128i *) out, _mm_shuffle_epi32(p3, 0x4e));
+   }
+
+#undef dct_const
+#undef dct_rot
+#undef dct_widen
+#undef dct_bfly32o
+#undef dct_interleave8
+#undef dct_interleave16
+#undef dct_pass
+}
+
+#endif // STBI_AVX2
+
 #ifdef STBI_NEON
 
 // NEON integer IDCT. should produce bit-identical
@@ -2964,7 +3377,7 @@ static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
             for (i=0; i < w; ++i) {
                int ha = z->img_comp[n].ha;
                if (!stbi__jpeg_decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
-               z->idct_block_kernel(z->img_comp[n].data+z->img_comp[n].w2*j*8+i*8, z->img_comp[n].w2, data);
+               z->idct_block_kernel(z->img_comp[n].data+(z->img_comp[n].w2*j+i)*(8>>z->scale_shift), z->img_comp[n].w2, data);
                // every data block is an MCU, so countdown the restart interval
                if (--z->todo <= 0) {
                   if (z->code_bits < 24) stbi__grow_buffer_unsafe(z);
@@ -2988,8 +3401,8 @@ static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
                   // by the basic H and V specified for the component
                   for (y=0; y < z->img_comp[n].v; ++y) {
                      for (x=0; x < z->img_comp[n].h; ++x) {
-                        int x2 = (i*z->img_comp[n].h + x)*8;
-                        int y2 = (j*z->img_comp[n].v + y)*8;
+                        int x2 = (i*z->img_comp[n].h + x)*(8>>z->scale_shift);
+                        int y2 = (j*z->img_comp[n].v + y)*(8>>z->scale_shift);
                         int ha = z->img_comp[n].ha;
                         if (!stbi__jpeg_decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
                         z->idct_block_kernel(z->img_comp[n].data+z->img_comp[n].w2*y2+x2, z->img_comp[n].w2, data);
@@ -3089,7 +3502,7 @@ static void stbi__jpeg_finish(stbi__jpeg *z)
             for (i=0; i < w; ++i) {
                short *data = z->img_comp[n].coeff + 64 * (i + j * z->img_comp[n].coeff_w);
                stbi__jpeg_dequantize(data, z->dequant[z->img_comp[n].tq]);
-               z->idct_block_kernel(z->img_comp[n].data+z->img_comp[n].w2*j*8+i*8, z->img_comp[n].w2, data);
+               z->idct_block_kernel(z->img_comp[n].data+(z->img_comp[n].w2*j+i)*(8>>z->scale_shift), z->img_comp[n].w2, data);
             }
          }
       }
@@ -3328,9 +3741,10 @@ static int stbi__process_frame_header(stbi__jpeg *z, int scan)
       // discard the extra data until colorspace conversion
       //
       // img_mcu_x, img_mcu_y: <=17 bits; comp[i].h and .v are <=4 (checked earlier)
-      // so these muls can't overflow with 32-bit ints (which we require)
-      z->img_comp[i].w2 = z->img_mcu_x * z->img_comp[i].h * 8;
-      z->img_comp[i].h2 = z->img_mcu_y * z->img_comp[i].v * 8;
+      // so these muls can't overflow with 32-bit ints (which we require).
+      // a scaled decode gets blocks of 8>>scale_shift pixels out of the idct
+      z->img_comp[i].w2 = z->img_mcu_x * z->img_comp[i].h * (8 >> z->scale_shift);
+      z->img_comp[i].h2 = z->img_mcu_y * z->img_comp[i].v * (8 >> z->scale_shift);
       z->img_comp[i].coeff = 0;
       z->img_comp[i].raw_coeff = 0;
       z->img_comp[i].linebuf = NULL;
@@ -3340,10 +3754,9 @@ static int stbi__process_frame_header(stbi__jpeg *z, int scan)
       // align blocks for idct using mmx/sse
       z->img_comp[i].data = (stbi_uc*) (((size_t) z->img_comp[i].raw_data + 15) & ~15);
       if (z->progressive) {
-         // w2, h2 are multiples of 8 (see above)
-         z->img_comp[i].coeff_w = z->img_comp[i].w2 / 8;
-         z->img_comp[i].coeff_h = z->img_comp[i].h2 / 8;
-         z->img_comp[i].raw_coeff = stbi__malloc_mad3(z->img_comp[i].w2, z->img_comp[i].h2, sizeof(short), 15);
+         z->img_comp[i].coeff_w = z->img_mcu_x * z->img_comp[i].h;
+         z->img_comp[i].coeff_h = z->img_mcu_y * z->img_comp[i].v;
+         z->img_comp[i].raw_coeff = stbi__malloc_mad3(z->img_comp[i].coeff_w * 8, z->img_comp[i].coeff_h * 8, sizeof(short), 15);
          if (z->img_comp[i].raw_coeff == NULL)
             return stbi__free_jpeg_components(z, i+1, stbi__err("outofmem", "Out of memory"));
          z->img_comp[i].coeff = (short*) (((size_t) z->img_comp[i].raw_coeff + 15) & ~15);
@@ -3408,10 +3821,142 @@ static stbi_uc stbi__skip_jpeg_junk_at_end(stbi__jpeg *j)
    return STBI__MARKER_none;
 }
 
+// restart intervals decoded in parallel, see stbi_set_jpeg_parallel_for()
+
+// decodes count MCUs of a baseline scan starting with MCU first, with no restart marker in between
+static int stbi__jpeg_decode_mcus(stbi__jpeg *z, int first, int count)
+{
+   STBI_SIMD_ALIGN(short, data[64]);
+   int m;
+   for (m = first; m < first + count; ++m) {
+      if (z->scan_n == 1) {
+         // non-interleaved, every block is an MCU
+         int n = z->order[0];
+         int w = (z->img_comp[n].x+7) >> 3;
+         int i = m % w, j = m / w;
+         int ha = z->img_comp[n].ha;
+         if (!stbi__jpeg_decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
+         z->idct_block_kernel(z->img_comp[n].data+(z->img_comp[n].w2*j+i)*(8>>z->scale_shift), z->img_comp[n].w2, data);
+      } else {
+         int i = m % z->img_mcu_x, j = m / z->img_mcu_x;
+         int k,x,y;
+         for (k=0; k < z->scan_n; ++k) {
+            int n = z->order[k];
+            for (y=0; y < z->img_comp[n].v; ++y) {
+               for (x=0; x < z->img_comp[n].h; ++x) {
+                  int x2 = (i*z->img_comp[n].h + x)*(8>>z->scale_shift);
+                  int y2 = (j*z->img_comp[n].v + y)*(8>>z->scale_shift);
+                  int ha = z->img_comp[n].ha;
+                  if (!stbi__jpeg_decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
+                  z->idct_block_kernel(z->img_comp[n].data+z->img_comp[n].w2*y2+x2, z->img_comp[n].w2, data);
+               }
+            }
+         }
+      }
+   }
+   return 1;
+}
+
+typedef struct
+{
+   stbi__jpeg *z;
+   stbi_uc **starts; // where every interval starts, plus where the scan ends
+   int intervals, mcus, tasks;
+   int *failed; // per task
+} stbi__jpeg_parallel;
+
+// one task decodes a run of intervals with its own copy of the decoder state
+static void stbi__jpeg_decode_intervals(void *context, int task)
+{
+   stbi__jpeg_parallel *p = (stbi__jpeg_parallel *) context;
+   int first = task * p->intervals / p->tasks;
+   int last = (task+1) * p->intervals / p->tasks;
+   stbi__context s;
+   stbi__jpeg *z = (stbi__jpeg *) stbi__malloc(sizeof(stbi__jpeg));
+   int i;
+   if (!z) { p->failed[task] = 1; return; }
+   memcpy(z, p->z, sizeof(stbi__jpeg));
+   z->s = &s;
+   for (i = first; i < last; ++i) {
+      int mcu = i * z->restart_interval;
+      int count = p->mcus - mcu < z->restart_interval ? p->mcus - mcu : z->restart_interval;
+      // the interval's data followed by the marker that ends it, like the serial decoder sees it
+      stbi__start_mem(&s, p->starts[i], (int) (p->starts[i+1] - p->starts[i]));
+      stbi__jpeg_reset(z);
+      if (!stbi__jpeg_decode_mcus(z, mcu, count)) { p->failed[task] = 1; break; }
+   }
+   STBI_FREE(z);
+}
+
+// decodes a baseline scan with restart markers through the parallel for, when one is set
+// and the whole file is in memory. returns -1 when the scan has to be decoded serially,
+// nothing was consumed then
+static int stbi__parse_entropy_coded_data_parallel(stbi__jpeg *z)
+{
+   stbi__jpeg_parallel p;
+   stbi_uc *c, *end = z->s->img_buffer_end;
+   int mcus, expected, found, tasks, i, ok = 1;
+
+   if (!stbi__jpeg_parallel_for_func || z->progressive || z->restart_interval <= 0 || z->s->read_from_callbacks)
+      return -1;
+   if (z->scan_n == 1) {
+      int n = z->order[0];
+      mcus = ((z->img_comp[n].x+7) >> 3) * ((z->img_comp[n].y+7) >> 3);
+   } else
+      mcus = z->img_mcu_x * z->img_mcu_y;
+   expected = (mcus + z->restart_interval - 1) / z->restart_interval;
+   if (expected < 2)
+      return -1;
+
+   p.starts = (stbi_uc **) stbi__malloc_mad2(expected+1, sizeof(stbi_uc *), 0);
+   if (!p.starts) return -1;
+
+   // find the restart markers. they come in sequence RST0..RST7, anything else ends the scan
+   p.starts[0] = z->s->img_buffer;
+   found = 1;
+   c = z->s->img_buffer;
+   while (c + 1 < end) {
+      if (c[0] != 0xff || c[1] == 0x00) { c += (c[0] == 0xff) ? 2 : 1; continue; }
+      if (c[1] == 0xff) { ++c; continue; }
+      if (!STBI__RESTART(c[1])) break;
+      if (found == expected || c[1] - 0xd0 != (found-1) % 8) { found = -1; break; }
+      p.starts[found++] = c + 2;
+      c += 2;
+   }
+   // the last interval ends with the marker after the scan, which has to be there
+   if (found != expected || c + 1 >= end) {
+      STBI_FREE(p.starts);
+      return -1;
+   }
+   p.starts[expected] = c + 2;
+
+   tasks = expected < 64 ? expected : 64;
+   p.z = z;
+   p.intervals = expected;
+   p.mcus = mcus;
+   p.tasks = tasks;
+   p.failed = (int *) stbi__malloc_mad2(tasks, sizeof(int), 0);
+   if (!p.failed) { STBI_FREE(p.starts); return -1; }
+   memset(p.failed, 0, tasks * sizeof(int));
+
+   stbi__jpeg_parallel_for_func(stbi__jpeg_parallel_for_user, tasks, stbi__jpeg_decode_intervals, &p);
+
+   for (i=0; i < tasks; ++i)
+      if (p.failed[i]) ok = 0;
+   STBI_FREE(p.failed);
+   STBI_FREE(p.starts);
+   if (!ok) return stbi__err("bad huffman code","Corrupt JPEG");
+
+   // carry on after the marker that ended the scan
+   z->marker = c[1];
+   z->s->img_buffer = c + 2;
+   return 1;
+}
+
 // decode image to YCbCr format
 static int stbi__decode_jpeg_image(stbi__jpeg *j)
 {
-   int m;
+   int m, r;
    for (m = 0; m < 4; m++) {
       j->img_comp[m].raw_data = NULL;
       j->img_comp[m].raw_coeff = NULL;
@@ -3422,7 +3967,9 @@ static int stbi__decode_jpeg_image(stbi__jpeg *j)
    while (!stbi__EOI(m)) {
       if (stbi__SOS(m)) {
          if (!stbi__process_scan_header(j)) return 0;
-         if (!stbi__parse_entropy_coded_data(j)) return 0;
+         r = stbi__parse_entropy_coded_data_parallel(j);
+         if (r == 0) return 0;
+         if (r < 0 && !stbi__parse_entropy_coded_data(j)) return 0;
          if (j->marker == STBI__MARKER_none ) {
          j->marker = stbi__skip_jpeg_junk_at_end(j);
             // if we reach eof without hitting a marker, stbi__get_marker() below will fail and we'll eventually return 0
@@ -3817,6 +4364,72 @@ static void stbi__YCbCr_to_RGB_simd(stbi_uc *out, stbi_uc const *y, stbi_uc cons
 }
 #endif
 
+#ifdef STBI_AVX2
+// the sse2 version on 16 pixels at a time, the rest of the row is left to it
+STBI__AVX2_TARGET static void stbi__YCbCr_to_RGB_avx2(stbi_uc *out, stbi_uc const *y, stbi_uc const *pcb, stbi_uc const *pcr, int count, int step)
+{
+   int i = 0;
+
+   if (step == 4) {
+      __m128i signflip  = _mm_set1_epi8(-0x80);
+      __m256i cr_const0 = _mm256_set1_epi16(   (short) ( 1.40200f*4096.0f+0.5f));
+      __m256i cr_const1 = _mm256_set1_epi16( - (short) ( 0.71414f*4096.0f+0.5f));
+      __m256i cb_const0 = _mm256_set1_epi16( - (short) ( 0.34414f*4096.0f+0.5f));
+      __m256i cb_const1 = _mm256_set1_epi16(   (short) ( 1.77200f*4096.0f+0.5f));
+      __m256i y_bias = _mm256_set1_epi16(128);
+      __m256i xw = _mm256_set1_epi16(255); // alpha channel
+
+      for (; i+15 < count; i += 16) {
+         // load
+         __m128i y_bytes = _mm_loadu_si128((__m128i *) (y+i));
+         __m128i cr_bytes = _mm_loadu_si128((__m128i *) (pcr+i));
+         __m128i cb_bytes = _mm_loadu_si128((__m128i *) (pcb+i));
+         __m128i cr_biased = _mm_xor_si128(cr_bytes, signflip); // -128
+         __m128i cb_biased = _mm_xor_si128(cb_bytes, signflip); // -128
+
+         // widen to short with the byte in the high half, the same values the sse2 unpacks give
+         __m256i yw  = _mm256_or_si256(_mm256_slli_epi16(_mm256_cvtepu8_epi16(y_bytes), 8), y_bias);
+         __m256i crw = _mm256_slli_epi16(_mm256_cvtepu8_epi16(cr_biased), 8);
+         __m256i cbw = _mm256_slli_epi16(_mm256_cvtepu8_epi16(cb_biased), 8);
+
+         // color transform
+         __m256i yws = _mm256_srli_epi16(yw, 4);
+         __m256i cr0 = _mm256_mulhi_epi16(cr_const0, crw);
+         __m256i cb0 = _mm256_mulhi_epi16(cb_const0, cbw);
+         __m256i cb1 = _mm256_mulhi_epi16(cbw, cb_const1);
+         __m256i cr1 = _mm256_mulhi_epi16(crw, cr_const1);
+         __m256i rws = _mm256_add_epi16(cr0, yws);
+         __m256i gwt = _mm256_add_epi16(cb0, yws);
+         __m256i bws = _mm256_add_epi16(yws, cb1);
+         __m256i gws = _mm256_add_epi16(gwt, cr1);
+
+         // descale
+         __m256i rw = _mm256_srai_epi16(rws, 4);
+         __m256i bw = _mm256_srai_epi16(bws, 4);
+         __m256i gw = _mm256_srai_epi16(gws, 4);
+
+         // back to byte, set up for transpose. everything works per 128-bit lane from here,
+         // the low lane ends up with pixels 0-7 and the high lane with 8-15
+         __m256i brb = _mm256_packus_epi16(rw, bw);
+         __m256i gxb = _mm256_packus_epi16(gw, xw);
+
+         // transpose to interleave channels
+         __m256i t0 = _mm256_unpacklo_epi8(brb, gxb);
+         __m256i t1 = _mm256_unpackhi_epi8(brb, gxb);
+         __m256i o0 = _mm256_unpacklo_epi16(t0, t1);
+         __m256i o1 = _mm256_unpackhi_epi16(t0, t1);
+
+         // store, putting the lanes back in pixel order
+         _mm256_storeu_si256((__m256i *) (out + 0), _mm256_permute2x128_si256(o0, o1, 0x20));
+         _mm256_storeu_si256((__m256i *) (out + 32), _mm256_permute2x128_si256(o0, o1, 0x31));
+         out += 64;
+      }
+   }
+
+   stbi__YCbCr_to_RGB_simd(out, y+i, pcb+i, pcr+i, count-i, step);
+}
+#endif
+
 // set up the kernels
 static void stbi__setup_jpeg(stbi__jpeg *j)
 {
@@ -3832,11 +4445,29 @@ static void stbi__setup_jpeg(stbi__jpeg *j)
    }
 #endif
 
+#ifdef STBI_AVX2
+   if (stbi__avx2_available()) {
+      j->idct_block_kernel = stbi__idct_avx2;
+      j->YCbCr_to_RGB_kernel = stbi__YCbCr_to_RGB_avx2;
+   }
+#endif
+
 #ifdef STBI_NEON
    j->idct_block_kernel = stbi__idct_simd;
    j->YCbCr_to_RGB_kernel = stbi__YCbCr_to_RGB_simd;
    j->resample_row_hv_2_kernel = stbi__resample_row_hv_2_simd;
 #endif
+
+   j->scale_shift = stbi__jpeg_scale;
+   if (j->scale_shift == 1) j->idct_block_kernel = stbi__idct_block_4x4;
+   if (j->scale_shift == 2) j->idct_block_kernel = stbi__idct_block_2x2;
+   if (j->scale_shift == 3) j->idct_block_kernel = stbi__idct_block_1x1;
+}
+
+// the size a scaled decode comes out at, rounding up so partial blocks keep their pixels
+static stbi__uint32 stbi__jpeg_scaled(stbi__uint32 size, int scale_shift)
+{
+   return (size + (1u << scale_shift) - 1) >> scale_shift;
 }
 
 // clean up the temporary component buffers
@@ -3873,6 +4504,16 @@ static stbi_uc *load_jpeg_image(stbi__jpeg *z, int *out_x, int *out_y, int *comp
    // load a jpeg image from whichever source, but leave in YCbCr format
    if (!stbi__decode_jpeg_image(z)) { stbi__cleanup_jpeg(z); return NULL; }
 
+   // the component planes came out scaled, from here on the image is the scaled size
+   if (z->scale_shift) {
+      z->s->img_x = stbi__jpeg_scaled(z->s->img_x, z->scale_shift);
+      z->s->img_y = stbi__jpeg_scaled(z->s->img_y, z->scale_shift);
+      for (n=0; n < z->s->img_n; ++n) {
+         z->img_comp[n].x = stbi__jpeg_scaled(z->img_comp[n].x, z->scale_shift);
+         z->img_comp[n].y = stbi__jpeg_scaled(z->img_comp[n].y, z->scale_shift);
+      }
+   }
+
    // determine actual number of components to generate
    n = req_comp ? req_comp : z->s->img_n >= 3 ? 3 : 1;
 
@@ -3891,7 +4532,7 @@ static stbi_uc *load_jpeg_image(stbi__jpeg *z, int *out_x, int *out_y, int *comp
    {
       int k;
       unsigned int i,j;
-      stbi_uc *output;
+      stbi_uc *output, *last_row = NULL;
       stbi_uc *coutput[4] = { NULL, NULL, NULL, NULL };
 
       stbi__resample res_comp[4];
@@ -3919,12 +4560,22 @@ static stbi_uc *load_jpeg_image(stbi__jpeg *z, int *out_x, int *out_y, int *comp
       }
 
       // can't error after this so, this is safe
-      output = (stbi_uc *) stbi__malloc_mad3(n, z->s->img_x, z->s->img_y, 1);
+      output = stbi__dest(z->s, (size_t) n * z->s->img_x * z->s->img_y);
+      if (output && (n == 3 || (n < 3 && z->s->img_n == 4))) {
+         // 3 channel rows are written 4 bytes a pixel, and the grey loops of CMYK and YCCK
+         // always write a second byte, so both end one byte past their row. There's no room for
+         // that after the caller's buffer, so its last row goes through last_row
+         last_row = (stbi_uc *) stbi__malloc(n * z->s->img_x + 1);
+         if (!last_row) output = NULL;
+      }
+      if (!output)
+         output = (stbi_uc *) stbi__malloc_mad3(n, z->s->img_x, z->s->img_y, 1);
       if (!output) { stbi__cleanup_jpeg(z); return stbi__errpuc("outofmem", "Out of memory"); }
 
       // now go ahead and resample
       for (j=0; j < z->s->img_y; ++j) {
          stbi_uc *out = output + n * z->s->img_x * j;
+         if (last_row && j == z->s->img_y-1) out = last_row;
          for (k=0; k < decode_n; ++k) {
             stbi__resample *r = &res_comp[k];
             int y_bot = r->ystep >= (r->vs >> 1);
@@ -4017,6 +4668,10 @@ static stbi_uc *load_jpeg_image(stbi__jpeg *z, int *out_x, int *out_y, int *comp
             }
          }
       }
+      if (last_row) {
+         memcpy(output + n * z->s->img_x * (z->s->img_y-1), last_row, n * z->s->img_x);
+         STBI_FREE(last_row);
+      }
       stbi__cleanup_jpeg(z);
       *out_x = z->s->img_x;
       *out_y = z->s->img_y;
@@ -4059,8 +4714,8 @@ static int stbi__jpeg_info_raw(stbi__jpeg *j, int *x, int *y, int *comp)
       stbi__rewind( j->s );
       return 0;
    }
-   if (x) *x = j->s->img_x;
-   if (y) *y = j->s->img_y;
+   if (x) *x = stbi__jpeg_scaled(j->s->img_x, j->scale_shift);
+   if (y) *y = stbi__jpeg_scaled(j->s->img_y, j->scale_shift);
    if (comp) *comp = j->s->img_n >= 3 ? 3 : 1;
    return 1;
 }
@@ -4072,6 +4727,7 @@ static int stbi__jpeg_info(stbi__context *s, int *x, int *y, int *comp)
    if (!j) return stbi__err("outofmem", "Out of memory");
    memset(j, 0, sizeof(stbi__jpeg));
    j->s = s;
+   j->scale_shift = stbi__jpeg_scale;
    result = stbi__jpeg_info_raw(j, x, y, comp);
    STBI_FREE(j);
    return result;
@@ -4092,6 +4748,12 @@ static int stbi__jpeg_info(stbi__context *s, int *x, int *y, int *comp)
 #define STBI__ZFAST_MASK  ((1 << STBI__ZFAST_BITS) - 1)
 #define STBI__ZNSYMS 288 // number of symbols in literal/length alphabet
 
+// the fast inflate loop keeps 64 bits of input in a register and refills it with unaligned
+// 8-byte little-endian loads
+#if !defined(STBI_NO_ZFAST64) && (defined(STBI__X64_TARGET) || defined(STBI__X86_TARGET) || defined(__aarch64__) || defined(_M_ARM64))
+#define STBI__ZFAST64
+#endif
+
 // zlib-style huffman encoding
 // (jpegs packs from left, zlib from right, so can't share code)
 typedef struct
@@ -4168,6 +4830,26 @@ static int stbi__zbuild_huffman(stbi__zhuffman *z, const stbi_uc *sizelist, int
    return 1;
 }
 
+#ifdef STBI__ZFAST64
+// tables of the fast inflate loop, indexed by the next bits of input. An entry resolves a whole
+// code: its value (a literal, two literals, or the base of a length or distance) in bits 0-15,
+// the bits it takes in 16-20, the extra bits that follow in 21-24 and what it is in 25-27.
+// Kind 0 is a code longer than the table, which goes through the slow decode
+#define STBI__ZFAST64_LEN_BITS   11
+#define STBI__ZFAST64_DIST_BITS  10
+#define STBI__ZFAST64_SLOW   0
+#define STBI__ZFAST64_LIT    1
+#define STBI__ZFAST64_LIT2   2
+#define STBI__ZFAST64_LEN    3
+#define STBI__ZFAST64_EOB    4
+#define STBI__ZFAST64_DIST   5
+#define STBI__ZFAST64_BAD    6
+#define stbi__zfast64_value(e)   ((int) ((e) & 0xffff))
+#define stbi__zfast64_size(e)    ((int) (((e) >> 16) & 31))
+#define stbi__zfast64_extra(e)   ((int) (((e) >> 21) & 15))
+#define stbi__zfast64_kind(e)    ((int) ((e) >> 25))
+#endif
+
 // zlib-from-memory implementation for PNG reading
 //    because PNG allows splitting the zlib stream arbitrarily,
 //    and it's annoying structurally to have PNG call ZLIB call PNG,
@@ -4187,6 +4869,10 @@ typedef struct
    int   z_expandable;
 
    stbi__zhuffman z_length, z_distance;
+#ifdef STBI__ZFAST64
+   stbi__uint32 z_fastlen[1 << STBI__ZFAST64_LEN_BITS];
+   stbi__uint32 z_fastdist[1 << STBI__ZFAST64_DIST_BITS];
+#endif
 } stbi__zbuf;
 
 stbi_inline static int stbi__zeof(stbi__zbuf *z)
@@ -4221,12 +4907,13 @@ stbi_inline static unsigned int stbi__zreceive(stbi__zbuf *z, int n)
    return k;
 }
 
-static int stbi__zhuffman_decode_slowpath(stbi__zbuf *a, stbi__zhuffman *z)
+// symbol of a code longer than the fast table, code holding the next 16 bits of input
+static int stbi__zhuffman_slow_symbol(stbi__zhuffman *z, int code, int *size)
 {
    int b,s,k;
    // not resolved by fast table, so compute it the slow way
    // use jpeg approach, which requires MSbits at top
-   k = stbi__bit_reverse(a->code_buffer, 16);
+   k = stbi__bit_reverse(code & 0xffff, 16);
    for (s=STBI__ZFAST_BITS+1; ; ++s)
       if (k < z->maxcode[s])
          break;
@@ -4235,9 +4922,18 @@ static int stbi__zhuffman_decode_slowpath(stbi__zbuf *a, stbi__zhuffman *z)
    b = (k >> (16-s)) - z->firstcode[s] + z->firstsymbol[s];
    if (b >= STBI__ZNSYMS) return -1; // some data was corrupt somewhere!
    if (z->size[b] != s) return -1;  // was originally an assert, but report failure instead.
+   *size = s;
+   return z->value[b];
+}
+
+static int stbi__zhuffman_decode_slowpath(stbi__zbuf *a, stbi__zhuffman *z)
+{
+   int b,s;
+   b = stbi__zhuffman_slow_symbol(z, (int) a->code_buffer, &s);
+   if (b < 0) return -1;
    a->code_buffer >>= s;
    a->num_bits -= s;
-   return z->value[b];
+   return b;
 }
 
 stbi_inline static int stbi__zhuffman_decode(stbi__zbuf *a, stbi__zhuffman *z)
@@ -4306,11 +5002,191 @@ static const int stbi__zdist_base[32] = { 1,2,3,4,5,7,9,13,17,25,33,49,65,97,129
 static const int stbi__zdist_extra[32] =
 { 0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13};
 
+#ifdef STBI__ZFAST64
+static stbi__uint32 stbi__zfast64_litlen_entry(int sym, int size)
+{
+   if (sym < 256) return (stbi__uint32) sym | (size << 16) | (STBI__ZFAST64_LIT << 25);
+   if (sym == 256) return (stbi__uint32) (size << 16) | (STBI__ZFAST64_EOB << 25);
+   if (sym >= 286) return (stbi__uint32) STBI__ZFAST64_BAD << 25; // per DEFLATE, length codes 286 and 287 must not appear
+   sym -= 257;
+   return (stbi__uint32) stbi__zlength_base[sym] | (size << 16) | (stbi__zlength_extra[sym] << 21) | (STBI__ZFAST64_LEN << 25);
+}
+
+static stbi__uint32 stbi__zfast64_dist_entry(int sym, int size)
+{
+   if (sym >= 30) return (stbi__uint32) STBI__ZFAST64_BAD << 25; // per DEFLATE, distance codes 30 and 31 must not appear
+   return (stbi__uint32) stbi__zdist_base[sym] | (size << 16) | (stbi__zdist_extra[sym] << 21) | (STBI__ZFAST64_DIST << 25);
+}
+
+// fills a fast table from the code lengths the huffman table was built from, which
+// stbi__zbuild_huffman already checked
+static void stbi__zfast64_build(stbi__uint32 *table, int bits, const stbi_uc *sizelist, int num, int is_dist)
+{
+   int i, j, code, next_code[16], sizes[17];
+   int n = 1 << bits;
+   memset(table, 0, n * sizeof(table[0]));
+   memset(sizes, 0, sizeof(sizes));
+   for (i=0; i < num; ++i)
+      ++sizes[sizelist[i]];
+   sizes[0] = 0;
+   code = 0;
+   for (i=1; i < 16; ++i) {
+      next_code[i] = code;
+      code = (code + sizes[i]) << 1;
+   }
+   for (i=0; i < num; ++i) {
+      int s = sizelist[i];
+      if (s) {
+         int c = next_code[s]++;
+         if (s <= bits) {
+            stbi__uint32 e = is_dist ? stbi__zfast64_dist_entry(i, s) : stbi__zfast64_litlen_entry(i, s);
+            for (j = stbi__bit_reverse(c, s); j < n; j += 1 << s)
+               table[j] = e;
+         }
+      }
+   }
+   if (is_dist) return;
+   // a literal whose remaining bits hold a whole second literal becomes a pair. Going down
+   // means the entry for the remaining bits (a lower index) is still a single literal
+   for (j = n-1; j >= 0; --j) {
+      stbi__uint32 e = table[j], e2;
+      int s = stbi__zfast64_size(e);
+      if (stbi__zfast64_kind(e) != STBI__ZFAST64_LIT) continue;
+      e2 = table[j >> s];
+      if (stbi__zfast64_kind(e2) != STBI__ZFAST64_LIT || stbi__zfast64_size(e2) > bits - s) continue;
+      table[j] = (stbi__uint32) (stbi__zfast64_value(e) | (stbi__zfast64_value(e2) << 8))
+               | ((s + stbi__zfast64_size(e2)) << 16) | (STBI__ZFAST64_LIT2 << 25);
+   }
+}
+
+static void stbi__zfast64_build_tables(stbi__zbuf *a, const stbi_uc *lengths, int hlit, const stbi_uc *distances, int hdist)
+{
+   stbi__zfast64_build(a->z_fastlen, STBI__ZFAST64_LEN_BITS, lengths, hlit, 0);
+   stbi__zfast64_build(a->z_fastdist, STBI__ZFAST64_DIST_BITS, distances, hdist, 1);
+}
+
+stbi_inline static stbi__uint64 stbi__zfast64_load(const stbi_uc *p)
+{
+   stbi__uint64 v;
+   memcpy(&v, p, sizeof(v));
+   return v;
+}
+
+// decodes until the end of the block or until the input or the output get too close to
+// their end for the loop's unchecked loads and stores, and leaves the rest of the block to
+// the careful loop. returns 1 at the end of the block, 0 on an error, -1 to carry on
+static int stbi__parse_huffman_block_fast(stbi__zbuf *a, char **pzout)
+{
+   stbi_uc *in = a->zbuffer;
+   char *zout = *pzout;
+   stbi__uint64 bits = a->code_buffer;
+   int nbits = a->num_bits;
+   int result = -1;
+
+   // a refill never reads past the input, and one code with its extra bits (48 bits at most
+   // for a length and its distance) never needs a second one. The output keeps room for the
+   // longest match and the 8-byte copies overshooting it
+   while (a->zbuffer_end - in >= 8 && a->zout_end - zout >= 258 + 8) {
+      stbi__uint32 e;
+      int s;
+      bits |= stbi__zfast64_load(in) << nbits;
+      in += (63 - nbits) >> 3;
+      nbits |= 56;
+
+      e = a->z_fastlen[bits & ((1 << STBI__ZFAST64_LEN_BITS) - 1)];
+      if (stbi__zfast64_kind(e) == STBI__ZFAST64_SLOW) {
+         int sym = stbi__zhuffman_slow_symbol(&a->z_length, (int) bits, &s);
+         if (sym < 0) { result = stbi__err("bad huffman code","Corrupt PNG"); break; }
+         e = stbi__zfast64_litlen_entry(sym, s);
+      }
+      s = stbi__zfast64_size(e);
+      bits >>= s;
+      nbits -= s;
+
+      switch (stbi__zfast64_kind(e)) {
+         case STBI__ZFAST64_LIT:
+            *zout++ = (char) stbi__zfast64_value(e);
+            break;
+         case STBI__ZFAST64_LIT2:
+            zout[0] = (char) (e & 255);
+            zout[1] = (char) ((e >> 8) & 255);
+            zout += 2;
+            break;
+         case STBI__ZFAST64_LEN: {
+            stbi_uc *p;
+            char *end;
+            int len, dist, extra = stbi__zfast64_extra(e);
+            len = stbi__zfast64_value(e) + (int) (bits & ((1 << extra) - 1));
+            bits >>= extra;
+            nbits -= extra;
+
+            e = a->z_fastdist[bits & ((1 << STBI__ZFAST64_DIST_BITS) - 1)];
+            if (stbi__zfast64_kind(e) == STBI__ZFAST64_SLOW) {
+               int sym = stbi__zhuffman_slow_symbol(&a->z_distance, (int) bits, &s);
+               if (sym < 0) { result = stbi__err("bad huffman code","Corrupt PNG"); goto done; }
+               e = stbi__zfast64_dist_entry(sym, s);
+            }
+            if (stbi__zfast64_kind(e) != STBI__ZFAST64_DIST) { result = stbi__err("bad huffman code","Corrupt PNG"); goto done; }
+            s = stbi__zfast64_size(e);
+            extra = stbi__zfast64_extra(e);
+            bits >>= s;
+            dist = stbi__zfast64_value(e) + (int) (bits & ((1 << extra) - 1));
+            bits >>= extra;
+            nbits -= s + extra;
+
+            if (zout - a->zout_start < dist) { result = stbi__err("bad dist","Corrupt PNG"); goto done; }
+            p = (stbi_uc *) (zout - dist);
+            end = zout + len;
+            if (dist >= 8) {
+               // 8 bytes apart or more, every 8-byte copy only reads bytes already written
+               do {
+                  memcpy(zout, p, 8);
+                  zout += 8;
+                  p += 8;
+               } while (zout < end);
+            } else if (dist == 1) { // run of one byte; common in images.
+               memset(zout, *p, len);
+            } else {
+               do *zout++ = *p++; while (zout < end);
+            }
+            zout = end;
+            break;
+         }
+         case STBI__ZFAST64_EOB:
+            result = 1;
+            goto done;
+         default:
+            result = stbi__err("bad huffman code","Corrupt PNG");
+            goto done;
+      }
+   }
+done:
+   // give back the whole bytes that were loaded but not used
+   in -= nbits >> 3;
+   nbits &= 7;
+   a->zbuffer = in;
+   a->code_buffer = (stbi__uint32) (bits & ((1u << nbits) - 1));
+   a->num_bits = nbits;
+   *pzout = zout;
+   return result;
+}
+#endif
+
 static int stbi__parse_huffman_block(stbi__zbuf *a)
 {
    char *zout = a->zout;
    for(;;) {
-      int z = stbi__zhuffman_decode(a, &a->z_length);
+      int z;
+#ifdef STBI__ZFAST64
+      if (stbi__png_fast_decode && !a->hit_zeof_once && a->zbuffer_end - a->zbuffer >= 8 && a->zout_end - zout >= 258 + 8) {
+         int r = stbi__parse_huffman_block_fast(a, &zout);
+         if (r >= 0) {
+            a->zout = zout;
+            return r;
+         }
+      }
+#endif
+      z = stbi__zhuffman_decode(a, &a->z_length);
       if (z < 256) {
          if (z < 0) return stbi__err("bad huffman code","Corrupt PNG"); // error in huffman codes
          if (zout >= a->zout_end) {
@@ -4403,6 +5279,9 @@ static int stbi__compute_huffman_codes(stbi__zbuf *a)
    if (n != ntot) return stbi__err("bad codelengths","Corrupt PNG");
    if (!stbi__zbuild_huffman(&a->z_length, lencodes, hlit)) return 0;
    if (!stbi__zbuild_huffman(&a->z_distance, lencodes+hlit, hdist)) return 0;
+#ifdef STBI__ZFAST64
+   stbi__zfast64_build_tables(a, lencodes, hlit, lencodes+hlit, hdist);
+#endif
    return 1;
 }
 
@@ -4498,6 +5377,9 @@ static int stbi__parse_zlib(stbi__zbuf *a, int parse_header)
             // use fixed code lengths
             if (!stbi__zbuild_huffman(&a->z_length  , stbi__zdefault_length  , STBI__ZNSYMS)) return 0;
             if (!stbi__zbuild_huffman(&a->z_distance, stbi__zdefault_distance,  32)) return 0;
+#ifdef STBI__ZFAST64
+            stbi__zfast64_build_tables(a, stbi__zdefault_length, STBI__ZNSYMS, stbi__zdefault_distance, 32);
+#endif
          } else {
             if (!stbi__compute_huffman_codes(a)) return 0;
          }
@@ -4631,6 +5513,7 @@ typedef struct
 {
    stbi__context *s;
    stbi_uc *idata, *expanded, *out;
+   stbi_uc *dest; // where the final image goes when out is written there, or NULL
    int depth;
 } stbi__png;
 
@@ -4667,6 +5550,106 @@ static int stbi__paeth(int a, int b, int c)
    return t1;
 }
 
+#ifdef STBI_SSE2
+// the sub, avg and paeth filters depend on the pixel to the left, so like libpng this goes
+// one pixel at a time with the pixel held in the low lanes of a register. n is a constant
+// wherever these get inlined, so the loads and stores turn into single moves
+stbi_inline static __m128i stbi__png_load_pixel(const stbi_uc *p, int n)
+{
+   int v = 0;
+   memcpy(&v, p, n);
+   return _mm_cvtsi32_si128(v);
+}
+
+stbi_inline static void stbi__png_store_pixel(stbi_uc *p, __m128i v, int n)
+{
+   int x = _mm_cvtsi128_si32(v);
+   memcpy(p, &x, n);
+}
+
+// unfilters the pixels of bpp bytes in [k, end), moving n bytes per pixel. a is the pixel to
+// the left and c the one above it, paeth keeps them as 16-bit lanes to work out its distances
+stbi_inline static void stbi__png_unfilter_run_sse2(stbi_uc *cur, const stbi_uc *raw, const stbi_uc *prior, int filter, int k, int end, int bpp, int n, __m128i *left, __m128i *upper_left)
+{
+   __m128i zero = _mm_setzero_si128();
+   __m128i ones = _mm_set1_epi8(1);
+   __m128i a = *left, b, c = *upper_left;
+   switch (filter) {
+   case STBI__F_sub:
+      for (; k < end; k += bpp) {
+         a = _mm_add_epi8(a, stbi__png_load_pixel(raw+k, n));
+         stbi__png_store_pixel(cur+k, a, n);
+      }
+      break;
+   case STBI__F_avg:
+      for (; k < end; k += bpp) {
+         // (a+b)>>1 is the average rounded up, less the bit it rounded up by
+         b = stbi__png_load_pixel(prior+k, n);
+         b = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), ones));
+         a = _mm_add_epi8(b, stbi__png_load_pixel(raw+k, n));
+         stbi__png_store_pixel(cur+k, a, n);
+      }
+      break;
+   case STBI__F_avg_first:
+      for (; k < end; k += bpp) {
+         b = _mm_sub_epi8(_mm_avg_epu8(a, zero), _mm_and_si128(a, ones));
+         a = _mm_add_epi8(b, stbi__png_load_pixel(raw+k, n));
+         stbi__png_store_pixel(cur+k, a, n);
+      }
+      break;
+   case STBI__F_paeth:
+      // same formulation as stbi__paeth, staying in 16-bit lanes keeps the chain through a short
+      for (; k < end; k += bpp) {
+         __m128i thresh, lo, hi, t0, t1, m, x;
+         b = _mm_unpacklo_epi8(stbi__png_load_pixel(prior+k, n), zero);
+         thresh = _mm_sub_epi16(_mm_add_epi16(c, _mm_add_epi16(c, c)), _mm_add_epi16(a, b));
+         lo = _mm_min_epi16(a, b);
+         hi = _mm_max_epi16(a, b);
+         m = _mm_cmpgt_epi16(hi, thresh);
+         t0 = _mm_or_si128(_mm_and_si128(m, c), _mm_andnot_si128(m, lo));
+         m = _mm_cmpgt_epi16(thresh, lo);
+         t1 = _mm_or_si128(_mm_and_si128(m, t0), _mm_andnot_si128(m, hi));
+         x = _mm_unpacklo_epi8(stbi__png_load_pixel(raw+k, n), zero);
+         a = _mm_and_si128(_mm_add_epi16(t1, x), _mm_set1_epi16(255));
+         stbi__png_store_pixel(cur+k, _mm_packus_epi16(a, zero), n);
+         c = b;
+      }
+      break;
+   }
+   *left = a;
+   *upper_left = c;
+}
+
+// unfilters a row with SSE2, returns 0 for the rows it leaves to the scalar code
+static int stbi__png_unfilter_sse2(stbi_uc *cur, const stbi_uc *raw, const stbi_uc *prior, int filter, int nk, int filter_bytes)
+{
+   int k;
+   if (filter == STBI__F_up) {
+      for (k = 0; k + 16 <= nk; k += 16) {
+         __m128i r = _mm_loadu_si128((const __m128i *) (raw + k));
+         __m128i p = _mm_loadu_si128((const __m128i *) (prior + k));
+         _mm_storeu_si128((__m128i *) (cur + k), _mm_add_epi8(r, p));
+      }
+      for (; k < nk; ++k)
+         cur[k] = STBI__BYTECAST(raw[k] + prior[k]);
+      return 1;
+   }
+   if (filter == STBI__F_none) return 0;
+   if (filter_bytes == 3) {
+      // 4-byte moves for all but the last pixel, the extra byte belongs to the next pixel
+      // and is written over by it
+      __m128i a = _mm_setzero_si128(), c = _mm_setzero_si128();
+      stbi__png_unfilter_run_sse2(cur, raw, prior, filter, 0, nk-3, 3, 4, &a, &c);
+      stbi__png_unfilter_run_sse2(cur, raw, prior, filter, nk-3, nk, 3, 3, &a, &c);
+   } else if (filter_bytes == 4) {
+      __m128i a = _mm_setzero_si128(), c = _mm_setzero_si128();
+      stbi__png_unfilter_run_sse2(cur, raw, prior, filter, 0, nk, 4, 4, &a, &c);
+   } else
+      return 0;
+   return 1;
+}
+#endif
+
 static const stbi_uc stbi__depth_scale_table[9] = { 0, 0xff, 0x55, 0, 0x11, 0,0,0, 0x01 };
 
 // adds an extra all-255 alpha channel
@@ -4703,13 +5686,18 @@ static int stbi__create_png_image_raw(stbi__png *a, stbi_uc *raw, stbi__uint32 r
    int all_ok = 1;
    int k;
    int img_n = s->img_n; // copy it into a local for later
+#ifdef STBI_SSE2
+   int simd = stbi__png_fast_decode && stbi__sse2_available();
+#endif
 
    int output_bytes = out_n*bytes;
    int filter_bytes = img_n*bytes;
    int width = x;
 
    STBI_ASSERT(out_n == s->img_n || out_n == s->img_n+1);
-   a->out = (stbi_uc *) stbi__malloc_mad3(x, y, output_bytes, 0); // extra bytes to write off the end into
+   a->out = a->dest;
+   if (!a->out)
+      a->out = (stbi_uc *) stbi__malloc_mad3(x, y, output_bytes, 0); // extra bytes to write off the end into
    if (!a->out) return stbi__err("outofmem", "Out of memory");
 
    // note: error exits here don't need to clean up a->out individually,
@@ -4752,6 +5740,9 @@ static int stbi__create_png_image_raw(stbi__png *a, stbi_uc *raw, stbi__uint32 r
       if (j == 0) filter = first_row_filter[filter];
 
       // perform actual filtering
+#ifdef STBI_SSE2
+      if (!simd || !stbi__png_unfilter_sse2(cur, raw, prior, filter, nk, filter_bytes))
+#endif
       switch (filter) {
       case STBI__F_none:
          memcpy(cur, raw, nk);
@@ -4862,13 +5853,16 @@ static int stbi__create_png_image(stbi__png *a, stbi_uc *image_data, stbi__uint3
 {
    int bytes = (depth == 16 ? 2 : 1);
    int out_bytes = out_n * bytes;
-   stbi_uc *final;
+   stbi_uc *final, *dest = a->dest;
    int p;
    if (!interlaced)
       return stbi__create_png_image_raw(a, image_data, image_data_len, out_n, a->s->img_x, a->s->img_y, depth, color);
 
-   // de-interlacing
-   final = (stbi_uc *) stbi__malloc_mad3(a->s->img_x, a->s->img_y, out_bytes, 0);
+   // de-interlacing, the passes get buffers of their own
+   a->dest = NULL;
+   final = dest;
+   if (!final)
+      final = (stbi_uc *) stbi__malloc_mad3(a->s->img_x, a->s->img_y, out_bytes, 0);
    if (!final) return stbi__err("outofmem", "Out of memory");
    for (p=0; p < 7; ++p) {
       int xorig[] = { 0,4,0,2,0,1,0 };
@@ -4882,7 +5876,7 @@ static int stbi__create_png_image(stbi__png *a, stbi_uc *image_data, stbi__uint3
       if (x && y) {
          stbi__uint32 img_len = ((((a->s->img_n * x * depth) + 7) >> 3) + 1) * y;
          if (!stbi__create_png_image_raw(a, image_data, image_data_len, out_n, x, y, depth, color)) {
-            STBI_FREE(final);
+            if (final != dest) STBI_FREE(final);
             return 0;
          }
          for (j=0; j < y; ++j) {
@@ -4899,6 +5893,7 @@ static int stbi__create_png_image(stbi__png *a, stbi_uc *image_data, stbi__uint3
       }
    }
    a->out = final;
+   a->dest = dest;
 
    return 1;
 }
@@ -5087,6 +6082,7 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
    z->expanded = NULL;
    z->idata = NULL;
    z->out = NULL;
+   z->dest = NULL;
 
    if (!stbi__check_png_header(s)) return 0;
 
@@ -5211,6 +6207,9 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
                s->img_out_n = s->img_n+1;
             else
                s->img_out_n = s->img_n;
+            // straight into the caller's buffer unless a palette, 16 bits or req_comp still convert it
+            if (!pal_img_n && z->depth != 16 && (req_comp == 0 || req_comp == s->img_out_n))
+               z->dest = stbi__dest(s, (size_t) s->img_x * s->img_y * s->img_out_n);
             if (!stbi__create_png_image(z, z->expanded, raw_len, s->img_out_n, z->depth, color, interlace)) return 0;
             if (has_trans) {
                if (z->depth == 16) {
@@ -5285,7 +6284,8 @@ static void *stbi__do_png(stbi__png *p, int *x, int *y, int *n, int req_comp, st
       *y = p->s->img_y;
       if (n) *n = p->s->img_n;
    }
-   STBI_FREE(p->out);      p->out      = NULL;
+   if (p->out != p->dest) STBI_FREE(p->out);
+   p->out      = NULL;
    STBI_FREE(p->expanded); p->expanded = NULL;
    STBI_FREE(p->idata);    p->idata    = NULL;
 
@@ -0,0 +1,167 @@
+#ifndef STREAM_BUFFER_H
+#define STREAM_BUFFER_H
+
+#include <glad/glad.h>
+
+#include <vector>
+#include <chrono>
+#include <cstring>
+#include <algorithm>
+
+#include "gl_state.h"
+#include "gl_resources.h"
+
+// Ring buffer for data that only lives for one frame (transient uniforms, instance data, debug geometry).
+// The whole buffer stays mapped for its lifetime (GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT), so filling it
+// is a plain memcpy and nothing is ever re-specified with glBufferData.
+//
+// The buffer is split into one region per frame in flight. At the end of a frame a fence is placed behind
+// its draws, and before a region gets reused we wait on that fence so the CPU never overwrites data
+// the GPU is still reading.
+
+struct StreamAllocation {
+	void* data = nullptr; // where to write, stays valid until the region comes around again
+	GLuint buffer = 0;
+	GLintptr offset = 0; // offset into buffer, use this when binding
+	GLsizeiptr size = 0;
+};
+
+struct StreamBufferStats {
+	unsigned int fenceWaits = 0; // times BeginFrame actually had to block on the GPU
+	double fenceWaitMs = 0.0; // total time spent blocked
+	size_t frameBytes = 0; // bytes handed out in the current frame
+	size_t peakFrameBytes = 0;
+	unsigned int grows = 0; // times a frame didn't fit and a bigger buffer was created
+	size_t regionBytes = 0; // size of one frame's region, grows with the buffer
+};
+
+class StreamBuffer {
+public:
+	StreamBufferStats stats;
+
+	StreamBuffer(GLsizeiptr frameSize, unsigned int framesInFlight = 3)
+		: framesInFlight(framesInFlight), fences(framesInFlight, nullptr) {
+		glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &uniformAlignment);
+		createBuffer(frameSize);
+	}
+
+	// waits until the region we're about to write into isn't used by the GPU anymore
+	void BeginFrame() {
+		frameIndex = frameCount % framesInFlight;
+		head = 0;
+		stats.frameBytes = 0;
+
+		GLsync& fence = fences[frameIndex];
+		if (fence) {
+			// a zero timeout just checks, anything else means we're actually stalling
+			GLenum result = glClientWaitSync(fence, 0, 0);
+			if (result == GL_TIMEOUT_EXPIRED) {
+				auto start = std::chrono::high_resolution_clock::now();
+				stats.fenceWaits++;
+				while (result == GL_TIMEOUT_EXPIRED)
+					result = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000);
+				auto end = std::chrono::high_resolution_clock::now();
+				stats.fenceWaitMs += std::chrono::duration<double, std::milli>(end - start).count();
+			}
+			glDeleteSync(fence);
+			fence = nullptr;
+		}
+
+		// buffers replaced by a bigger one can go once every frame that used them is done
+		for (size_t i = 0; i < retired.size();) {
+			if (retired[i].lastFrame + framesInFlight <= frameCount) {
+				glUnmapNamedBuffer(retired[i].buffer);
+				GLStateCache::Get().DeleteBuffer(retired[i].buffer);
+				retired.erase(retired.begin() + i);
+			}
+			else
+				i++;
+		}
+	}
+
+	// marks the end of everything that reads this frame's region
+	void EndFrame() {
+		fences[frameIndex] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		frameCount++;
+	}
+
+	// hands out size bytes of this frame's region, alignment 0 means uniform buffer offset alignment
+	StreamAllocation Allocate(GLsizeiptr size, GLsizeiptr alignment = 0) {
+		if (alignment == 0)
+			alignment = uniformAlignment;
+		GLsizeiptr offset = (head + alignment - 1) / alignment * alignment;
+
+		if (offset + size > frameSize) {
+			// this frame doesn't fit, switch to a bigger buffer. The old one stays mapped until the frames
+			// still using it have finished, so allocations made earlier this frame stay valid
+			retired.push_back({ buffer, frameCount });
+			stats.grows++;
+			createBuffer(std::max(frameSize * 2, size * 2));
+			offset = 0;
+		}
+
+		StreamAllocation allocation;
+		allocation.buffer = buffer;
+		allocation.offset = frameIndex * frameSize + offset;
+		allocation.size = size;
+		allocation.data = mapped + allocation.offset;
+
+		head = offset + size;
+		stats.frameBytes += size;
+		if (stats.frameBytes > stats.peakFrameBytes)
+			stats.peakFrameBytes = stats.frameBytes;
+		return allocation;
+	}
+
+	// bytes that still fit into this frame's region without growing the buffer
+	GLsizeiptr Remaining(GLsizeiptr alignment = 0) const {
+		if (alignment == 0)
+			alignment = uniformAlignment;
+		GLsizeiptr offset = (head + alignment - 1) / alignment * alignment;
+		return offset < frameSize ? frameSize - offset : 0;
+	}
+
+	// allocates and copies in one go
+	StreamAllocation Upload(const void* data, GLsizeiptr size, GLsizeiptr alignment = 0) {
+		StreamAllocation allocation = Allocate(size, alignment);
+		memcpy(allocation.data, data, size);
+		return allocation;
+	}
+
+private:
+	struct RetiredBuffer {
+		GLuint buffer;
+		unsigned long long lastFrame;
+	};
+
+	GLuint buffer = 0;
+	char* mapped = nullptr;
+	GLsizeiptr frameSize = 0;
+	GLsizeiptr head = 0;
+	GLint uniformAlignment = 256;
+
+	unsigned int framesInFlight;
+	unsigned int frameIndex = 0;
+	unsigned long long frameCount = 0;
+	std::vector<GLsync> fences;
+	std::vector<RetiredBuffer> retired;
+
+	void createBuffer(GLsizeiptr size) {
+		// keep every region aligned so offsets inside them only depend on the requested alignment
+		frameSize = (size + 255) / 256 * 256;
+		stats.regionBytes = frameSize;
+		const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+		buffer = CreateBuffer(frameSize * framesInFlight, nullptr, flags);
+		mapped = (char*)glMapNamedBufferRange(buffer, 0, frameSize * framesInFlight, flags);
+
+		// a fresh buffer isn't used by the GPU yet, the old fences belong to the retired buffer
+		for (GLsync& fence : fences) {
+			if (fence) {
+				glDeleteSync(fence);
+				fence = nullptr;
+			}
+		}
+	}
+};
+
+#endif
@@ -0,0 +1,1043 @@
+#ifndef TEXTURE_MANAGER_H
+#define TEXTURE_MANAGER_H
+
+#include <glad/glad.h>
+
+#include <vector>
+#include <deque>
+#include <string>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <iostream>
+#include <algorithm>
+#include <iterator>
+#include <climits>
+
+#include "stb_image.h"
+#include "dds.h"
+#include "mip_generator.h"
+#include "hdr_formats.h"
+#include "pixel_layout.h"
+#include "image_resampler.h"
+#include "texture_residency.h"
+#include "texture_streaming.h"
+#include "gl_state.h"
+#include "gl_resources.h"
+#include "stream_buffer.h"
+#include "thread_pool.h"
+
+using namespace std;
+
+// Loads textures without blocking the render loop.
+//
+// Load() returns a handle right away and queues the file to be read on the worker threads. Images
+// stb_image decodes don't go through a heap buffer: a worker reads the size from the header, the GL
+// thread maps a pixel unpack buffer with room for the image and its mips, and another worker decodes
+// straight into it and builds the mip chain behind level 0 with the CPU mip generator. Update() then
+// uploads the levels from that buffer, which the driver copies without the CPU touching the pixels again.
+// Every frame Update() takes what the workers finished and uploads it on the GL thread, stopping once
+// its time budget for the frame is used up. Cooked files go through a persistently mapped staging
+// buffer instead, big ones a few rows at a time over several frames.
+// Files ending in .dds were cooked offline by the TextureCooker: they already hold every mip level,
+// usually block compressed, so they're uploaded level by level as they are. Either way the GPU never
+// has to generate mips.
+// Until a texture is resident, Get() returns a small grey placeholder so it can be drawn right away.
+// With previews on (SetPreviewScale) JPEGs are decoded a second time at a fraction of their size first,
+// through the reduced IDCT of stb_image, and Get() returns that preview until the full texture is in.
+// SetQuality() picks a tier (image_resampler.h) that drops the top mips of every texture loaded from then
+// on. JPEGs decode at a reduced size through the same reduced IDCT, other images are decoded as they are
+// and resampled down into the decode buffer, cooked textures skip their first levels. EstimateBytes()
+// tells what the textures loaded so far would take at each tier.
+// 8 bit images are decoded in the layout pixel_layout.h picks for their channel count, RGB ones get an
+// opaque alpha so every upload can be copied by the driver as it is. Grey and grey + alpha textures, 8 bit
+// or float, get a swizzle so they sample like colour textures.
+// HDR (.hdr) and 16 bit images are decoded to floats and mipped in float. HDR images are packed into
+// half floats, R11F_G11F_B10F or RGB9_E5, whichever is smallest for their range (see hdr_formats.h),
+// 16 bit ones always into half floats since the packed formats are coarser than 8 bits in 0-1.
+//
+// With a budget set (SetBudget) the texture residency keeps the GPU memory of all textures under it:
+// textures that weren't drawn lately are evicted and load again the next time Get() asks for them,
+// textures in use lose their top mips instead and get them back once there's room.
+//
+// LoadStreamed() textures only read the small levels of their cooked file up front. Every frame the
+// objects using them ask for the level they need (RequestFootprint), and the finer levels are read
+// and uploaded coarsest first on their own. The texture is reallocated with room for them and
+// GL_TEXTURE_BASE_LEVEL keeps the sampler on the levels that are already there. Levels nobody asked
+// for in a while are dropped again, so the memory follows what's actually visible.
+
+typedef unsigned int TextureHandle;
+
+struct TextureManagerStats {
+	unsigned int pending = 0; // still being decoded or uploaded
+	unsigned int resident = 0;
+	unsigned int failed = 0;
+	unsigned int evicted = 0; // since the start
+	unsigned int streamedIn = 0; // levels, since the start
+	unsigned int streamedOut = 0;
+	unsigned int previews = 0; // since the start
+	size_t uploadedBytes = 0; // during the last Update()
+	double updateMs = 0.0; // time spent in the last Update()
+};
+
+class TextureManager {
+public:
+	TextureManagerStats stats;
+
+	TextureManager(ThreadPool& pool, GLsizeiptr stagingSize = 4 * 1024 * 1024)
+		: pool(pool), staging(stagingSize, 3) {
+		const unsigned char grey[4] = { 128, 128, 128, 255 };
+		placeholder = CreateTexture2D(1, 1, GL_RGBA8);
+		glTextureSubImage2D(placeholder, 0, 0, 0, 1, 1, GL_RGBA, GL_UNSIGNED_BYTE, grey);
+	}
+
+	~TextureManager() {
+		// decode jobs write into this object, let the ones already running finish
+		while (decoding.load() > 0)
+			this_thread::yield();
+	}
+
+	// starts loading the file and returns a handle for it right away. flip only applies to images decoded
+	// here, cooked textures were flipped by the cooker
+	TextureHandle Load(const string& path, GLenum wrap = GL_REPEAT, GLenum minFilter = GL_LINEAR_MIPMAP_LINEAR,
+		GLenum magFilter = GL_LINEAR, bool flip = true) {
+		TextureHandle handle = (TextureHandle)entries.size();
+		TextureEntry entry;
+		entry.path = path;
+		entry.wrap = wrap;
+		entry.minFilter = minFilter;
+		entry.magFilter = magFilter;
+		entry.flip = flip;
+		entries.push_back(entry);
+		startLoad(handle);
+		return handle;
+	}
+
+	// like Load(), but only the levels up to STREAM_TAIL_SIZE are read to begin with, the others are
+	// streamed in as they're requested. Needs a cooked texture, anything else is loaded as a whole
+	TextureHandle LoadStreamed(const string& path, GLenum wrap = GL_REPEAT, GLenum minFilter = GL_LINEAR_MIPMAP_LINEAR,
+		GLenum magFilter = GL_LINEAR) {
+		if (!isCooked(path))
+			return Load(path, wrap, minFilter, magFilter);
+		TextureHandle handle = (TextureHandle)entries.size();
+		TextureEntry entry;
+		entry.path = path;
+		entry.wrap = wrap;
+		entry.minFilter = minFilter;
+		entry.magFilter = magFilter;
+		entry.streamed = true;
+		entries.push_back(entry);
+		startLoad(handle);
+		return handle;
+	}
+
+	// GPU memory all textures together may use, 0 for no limit
+	void SetBudget(size_t bytes) {
+		residency.SetBudget(bytes);
+	}
+
+	// textures loaded from now on drop the top mips of the tier, the ones already loaded keep their size
+	// until they're loaded again
+	void SetQuality(TextureQuality quality) {
+		mipBias = QualityMipBias(quality);
+	}
+
+	// GPU memory the textures loaded so far would take at the tier, each with all of its levels. Streamed
+	// textures count in full too, though they only keep the levels that are in view
+	size_t EstimateBytes(TextureQuality quality) const {
+		int bias = QualityMipBias(quality);
+		size_t bytes = 0;
+		for (const TextureEntry& entry : entries) {
+			if (entry.fullWidth == 0)
+				continue;
+			int width = BiasedSize(entry.fullWidth, bias), height = BiasedSize(entry.fullHeight, bias);
+			int levels = entry.levelCount > 1 ? MipLevelCount(width, height) : 1;
+			for (int i = 0; i < levels; i++) {
+				int w = BiasedSize(width, i), h = BiasedSize(height, i);
+				bytes += entry.texelBytes ? (size_t)w * h * entry.texelBytes : DDSLevelSize(entry.dds.format, w, h);
+			}
+		}
+		return bytes;
+	}
+
+	// JPEGs loaded from now on first show a preview decoded at 1/(1<<scaleShift) of their full size
+	// (after the quality tier) while the full one loads, 0 turns the previews off
+	void SetPreviewScale(int scaleShift) {
+		previewScale = std::min(std::max(scaleShift, 0), 3);
+	}
+
+	// the order 8 bit colour images are uploaded in from now on, BGRA for drivers that swizzle RGBA
+	void SetPixelOrder(PixelOrder order) {
+		pixelOrder = order;
+	}
+
+	const TextureResidencyStats& ResidencyStats() const {
+		return residency.stats;
+	}
+
+	// the GL texture to bind, the placeholder while it isn't resident yet. Counts as a use of the texture,
+	// an evicted one starts loading again
+	GLuint Get(TextureHandle handle) {
+		TextureEntry& entry = entries[handle];
+		if (entry.resident) {
+			residency.Touch(handle);
+			return entry.texture;
+		}
+		if (!entry.loading && !entry.failed)
+			startLoad(handle);
+		return entry.preview ? entry.preview : placeholder;
+	}
+
+	bool IsResident(TextureHandle handle) const {
+		return entries[handle].resident;
+	}
+
+	// asks for a streamed texture to have level (of its full chain) and everything below it, the finest
+	// level asked for between two Update() calls wins
+	void RequestLevel(TextureHandle handle, int level) {
+		TextureEntry& entry = entries[handle];
+		entry.requestedLevel = std::min(entry.requestedLevel, std::max(level, 0));
+		residency.Touch(handle);
+	}
+
+	// requests the level an object needs from the view, worldBounds being its bounding sphere in world space
+	// and uvDensity the UV units per world unit of its mesh. Ignored until the texture's header was read
+	void RequestFootprint(TextureHandle handle, const BoundingSphere& worldBounds, float uvDensity, const StreamingView& view) {
+		const TextureEntry& entry = entries[handle];
+		if (!entry.streamed || entry.levelCount == 0)
+			return;
+		RequestLevel(handle, DesiredMipLevel(entry.width, entry.height, entry.levelCount, uvDensity, worldBounds, view));
+	}
+
+	// uploads decoded images until budgetMs is used up, call once per frame on the GL thread
+	void Update(double budgetMs) {
+		auto start = chrono::high_resolution_clock::now();
+		stats.uploadedBytes = 0;
+		residency.NextFrame();
+
+		mapDecodeBuffers();
+
+		{
+			lock_guard<mutex> lock(decodedMutex);
+			for (DecodedImage& image : decoded) {
+				if (image.preview && image.levelOffsets.empty()) {
+					// the full decode reports it if the file is broken
+					releaseBuffer(image);
+					continue;
+				}
+				if (image.levelOffsets.empty() && image.file.empty()) {
+					cout << "Failed to load texture " << entries[image.handle].path << endl;
+					releaseBuffer(image);
+					dropPreview(entries[image.handle]);
+					entries[image.handle].loading = false;
+					entries[image.handle].failed = true;
+					restoringBytes -= entries[image.handle].restoringBytes;
+					entries[image.handle].restoringBytes = 0;
+					stats.pending--;
+					stats.failed++;
+					continue;
+				}
+				UploadJob job;
+				job.image = std::move(image);
+				uploads.push_back(std::move(job));
+			}
+			decoded.clear();
+		}
+
+		if (uploads.empty()) {
+			enforceBudget();
+			updateStreaming();
+			stats.updateMs = elapsedMs(start);
+			return;
+		}
+
+		GLStateCache& state = GLStateCache::Get();
+		staging.BeginFrame();
+		// rows are tightly packed, R8, RG8 and half float rows aren't always a multiple of 4 bytes
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+
+		while (!uploads.empty() && elapsedMs(start) < budgetMs) {
+			UploadJob& job = uploads.front();
+			DecodedImage& image = job.image;
+			TextureEntry& entry = entries[image.handle];
+
+			bool cooked = !image.file.empty();
+
+			// a stream goes into the texture in use, which the budget can evict before any of its
+			// levels are uploaded or between two of them
+			if (image.streamIn && !entry.resident) {
+				finishJob(entry);
+				continue;
+			}
+
+			if (!job.started) {
+				// the decode buffer is done with on the CPU, the GL can read from it once it's unmapped
+				if (image.buffer && glUnmapNamedBuffer(image.buffer) == GL_FALSE) {
+					// its contents were lost (the display mode changed or similar), decode the file again.
+					// A preview isn't worth it, the full image is on its way
+					TextureHandle handle = image.handle;
+					if (image.preview) {
+						finishPreview();
+						continue;
+					}
+					finishJob(entry);
+					startLoad(handle);
+					continue;
+				}
+				job.started = true;
+				// coarsest level first, so a streamed texture can use every level as soon as it's there
+				job.level = image.endLevel - 1;
+				if (image.streamIn) {
+					// room for the new levels, the sampler stays on the old ones until they're uploaded
+					reallocate(image.handle, image.firstLevel);
+				}
+				else if (image.preview) {
+					// a texture of its own that doesn't touch the entry
+					job.texture = CreateTexture2D(image.width, image.height, image.format, levelCount(image));
+					SetTextureSampling(job.texture, entry.wrap, entry.minFilter, entry.magFilter);
+					SetGreySwizzle(job.texture, image.format);
+				}
+				else {
+					if (cooked) {
+						entry.format = cookedFormat(image.dds);
+						entry.width = image.dds.width;
+						entry.height = image.dds.height;
+						entry.dds = image.dds;
+						entry.texelBytes = 0;
+					}
+					else {
+						entry.format = image.format;
+						entry.width = image.width;
+						entry.height = image.height;
+						entry.texelBytes = image.pixelBytes == 6 ? 8 : image.pixelBytes;
+					}
+					entry.fullWidth = image.fullWidth;
+					entry.fullHeight = image.fullHeight;
+					entry.levelCount = levelCount(image);
+					job.texture = CreateTexture2D(std::max(1, entry.width >> image.firstLevel),
+						std::max(1, entry.height >> image.firstLevel), entry.format, entry.levelCount - image.firstLevel);
+					SetTextureSampling(job.texture, entry.wrap, entry.minFilter, entry.magFilter);
+					SetGreySwizzle(job.texture, entry.format);
+				}
+			}
+
+			// a stream goes straight into the texture in use, which the residency may have shrunk meanwhile
+			GLuint texture = image.streamIn ? entry.texture : job.texture;
+			int firstLevel = image.streamIn ? entry.firstLevel : image.firstLevel;
+			if (job.level < firstLevel) {
+				finishJob(entry);
+				continue;
+			}
+
+			LevelSource level = levelSource(image, job.level);
+			int rows;
+			GLintptr offset;
+			if (image.buffer) {
+				// the level is already in a pixel unpack buffer of its own, all of it goes at once
+				rows = level.rows - job.rowsUploaded;
+				offset = level.offset + job.rowsUploaded * level.rowBytes;
+				state.BindBuffer(GL_PIXEL_UNPACK_BUFFER, image.buffer);
+			}
+			else {
+				// copy as many rows as still fit into this frame's part of the staging buffer
+				rows = std::min<int>(level.rows - job.rowsUploaded, (int)(staging.Remaining(4) / level.rowBytes));
+				if (rows <= 0)
+					break;
+				StreamAllocation allocation = staging.Upload(level.data + job.rowsUploaded * level.rowBytes,
+					rows * level.rowBytes, 4);
+				offset = allocation.offset;
+				state.BindBuffer(GL_PIXEL_UNPACK_BUFFER, allocation.buffer);
+			}
+
+			// with a pixel unpack buffer bound the pointer argument is an offset into it
+			int y = job.rowsUploaded * level.rowHeight;
+			int height = std::min(rows * level.rowHeight, level.height - y);
+			if (cooked && DDSIsCompressed(image.dds.format))
+				glCompressedTextureSubImage2D(texture, job.level - firstLevel, 0, y, level.width, height, cookedFormat(image.dds),
+					(GLsizei)(rows * level.rowBytes), (void*)offset);
+			else
+				glTextureSubImage2D(texture, job.level - firstLevel, 0, y, level.width, height, level.pixelFormat,
+					level.pixelType, (void*)offset);
+			job.rowsUploaded += rows;
+			stats.uploadedBytes += rows * level.rowBytes;
+
+			if (job.rowsUploaded < level.rows)
+				continue;
+			if (image.streamIn) {
+				// the new level can be sampled from now on
+				entry.baseLevel = job.level;
+				glTextureParameteri(texture, GL_TEXTURE_BASE_LEVEL, job.level - firstLevel);
+				stats.streamedIn++;
+			}
+			job.level--;
+			job.rowsUploaded = 0;
+			if (job.level >= image.firstLevel)
+				continue;
+
+			if (image.streamIn) {
+				finishJob(entry);
+				continue;
+			}
+
+			if (image.preview) {
+				// the full texture may have made it first, then the preview is of no use
+				if (entry.loading && !entry.resident) {
+					dropPreview(entry);
+					entry.preview = job.texture;
+					stats.previews++;
+				}
+				else
+					GLStateCache::Get().DeleteTexture(job.texture);
+				finishPreview();
+				continue;
+			}
+
+			// a texture that lost its top mips keeps being drawn until its full copy is uploaded
+			if (entry.resident) {
+				GLStateCache::Get().DeleteTexture(entry.texture);
+				stats.resident--;
+			}
+			restoringBytes -= entry.restoringBytes;
+			entry.restoringBytes = 0;
+			vector<size_t> levelBytes;
+			for (int i = 0; i < entry.levelCount; i++) {
+				if (cooked)
+					levelBytes.push_back(image.dds.levels[i].size);
+				else // drivers pad RGB16F texels to 8 bytes
+					levelBytes.push_back((size_t)std::max(1, entry.width >> i) * std::max(1, entry.height >> i) * entry.texelBytes);
+			}
+			residency.Track(image.handle, levelBytes, entry.width, entry.height);
+			residency.SetFirstLevel(image.handle, image.firstLevel);
+
+			dropPreview(entry);
+			entry.texture = job.texture;
+			entry.firstLevel = entry.baseLevel = image.firstLevel;
+			entry.resident = true;
+			stats.resident++;
+			finishJob(entry);
+		}
+
+		// client memory uploads elsewhere would read from the PBO if it stayed bound
+		state.BindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+		staging.EndFrame();
+		enforceBudget();
+		updateStreaming();
+		stats.updateMs = elapsedMs(start);
+	}
+
+private:
+	// streamed textures always keep the levels up to this size on the larger side
+	static const int STREAM_TAIL_SIZE = 64;
+	// levels a streamed texture didn't need for this many frames in a row are dropped
+	static const int STREAM_OUT_FRAMES = 120;
+	// decode buffers mapped at the same time, one is always allowed so bigger images still load
+	static const size_t MAX_MAPPED_BYTES = 256 * 1024 * 1024;
+
+	struct TextureEntry {
+		string path;
+		GLuint texture = 0;
+		GLuint preview = 0; // shown while the texture isn't resident
+		bool resident = false;
+		bool loading = false; // being decoded or uploaded
+		bool failed = false;
+		bool flip = true;
+		bool streamed = false;
+		GLenum wrap, minFilter, magFilter;
+		// of the full chain, known once the first upload starts
+		GLenum format = GL_RGBA8;
+		int width = 0, height = 0;
+		int levelCount = 0;
+		// of the image before the quality tier dropped levels, and its texel size (0 for cooked textures)
+		int fullWidth = 0, fullHeight = 0;
+		int texelBytes = 0;
+		DDSImage dds; // where the levels of a cooked texture are in its file
+		// level 0 of the GL texture is firstLevel of the full chain, levels from baseLevel on hold data
+		int firstLevel = 0;
+		int baseLevel = 0;
+		int requestedLevel = INT_MAX; // finest level asked for since the last update
+		int unneededFrames = 0;
+		size_t restoringBytes = 0; // while its full resolution is being loaded again
+	};
+
+	// an image whose header was read, waiting for a buffer to be decoded into
+	struct SizedImage {
+		TextureHandle handle = 0;
+		vector<unsigned char> file;
+		int width = 0, height = 0, channels = 0;
+		bool flip = true;
+		bool mipmapped = true;
+		MipSettings mipSettings;
+		int scale = 0; // stb_image's JPEG scale shift, the size above already has it applied
+		int bias = 0; // levels left to drop after decoding, the size above has them dropped too
+		int fullWidth = 0, fullHeight = 0; // before either, to within the rounding of the reduced decode
+		PixelLayout layout; // of 8 bit images, channels above is the count it decodes to
+		int bits = 8; // per channel, 16 bit images and 32 for float (HDR) ones go through hdr_formats.h
+		bool preview = false;
+	};
+
+	struct DecodedImage {
+		TextureHandle handle = 0;
+		// an image decoded by stb_image into a mapped pixel unpack buffer, its levels one after the other
+		GLuint buffer = 0;
+		size_t bufferBytes = 0;
+		vector<size_t> levelOffsets; // empty if it couldn't be decoded
+		int width = 0, height = 0, channels = 0;
+		int fullWidth = 0, fullHeight = 0; // before the quality tier dropped levels
+		// how its pixels are stored
+		GLenum format = GL_RGBA8, pixelFormat = GL_RGBA, pixelType = GL_UNSIGNED_BYTE;
+		int pixelBytes = 4;
+		vector<unsigned char> file; // a cooked texture, or the part of it from fileOffset on
+		size_t fileOffset = 0;
+		DDSImage dds;
+		// levels of the full chain this holds
+		int firstLevel = 0;
+		int endLevel = 0;
+		bool streamIn = false; // finer levels for a texture that's already resident
+		bool preview = false; // a small version to show until the image itself is decoded
+	};
+
+	struct UploadJob {
+		DecodedImage image;
+		GLuint texture = 0;
+		bool started = false;
+		int level = 0;
+		int rowsUploaded = 0; // of the current level, in units of LevelSource::rowHeight pixel rows
+	};
+
+	// where the data of one level comes from. Compressed levels go in rows of 4x4 blocks
+	struct LevelSource {
+		const unsigned char* data; // nullptr when it's at offset in the image's own buffer
+		size_t offset;
+		int width, height;
+		int rowHeight; // pixel rows per row of data
+		int rows;
+		size_t rowBytes;
+		GLenum pixelFormat, pixelType;
+	};
+
+	ThreadPool& pool;
+	StreamBuffer staging;
+	GLuint placeholder;
+	TextureResidency residency;
+	size_t restoringBytes = 0; // what the full resolution copies being loaded will add
+	size_t mappedBytes = 0; // of the decode buffers
+	int mipBias = 0;
+	int previewScale = 0;
+	PixelOrder pixelOrder = PIXEL_ORDER_RGBA;
+
+	vector<TextureEntry> entries; // indexed by handle, only touched on the GL thread
+	deque<UploadJob> uploads;
+
+	// filled by the workers
+	mutex decodedMutex;
+	vector<SizedImage> sized;
+	vector<DecodedImage> decoded;
+	atomic<int> decoding{ 0 };
+
+	static double elapsedMs(chrono::high_resolution_clock::time_point start) {
+		return chrono::duration<double, milli>(chrono::high_resolution_clock::now() - start).count();
+	}
+
+	void finishJob(TextureEntry& entry) {
+		releaseBuffer(uploads.front().image);
+		entry.loading = false;
+		uploads.pop_front();
+		stats.pending--;
+	}
+
+	// a preview's job doesn't count as the texture loading
+	void finishPreview() {
+		releaseBuffer(uploads.front().image);
+		uploads.pop_front();
+	}
+
+	void dropPreview(TextureEntry& entry) {
+		if (!entry.preview)
+			return;
+		GLStateCache::Get().DeleteTexture(entry.preview);
+		entry.preview = 0;
+	}
+
+	// the GL keeps the buffer alive until the uploads from it are done
+	void releaseBuffer(DecodedImage& image) {
+		if (!image.buffer)
+			return;
+		GLStateCache::Get().DeleteBuffer(image.buffer);
+		mappedBytes -= image.bufferBytes;
+		image.buffer = 0;
+	}
+
+	// the first level a streamed texture starts with
+	static int tailLevel(const DDSImage& dds) {
+		int level = 0;
+		while (level + 1 < (int)dds.levels.size()
+			&& std::max(dds.levels[level].width, dds.levels[level].height) > STREAM_TAIL_SIZE)
+			level++;
+		return level;
+	}
+
+	// reads levels [firstLevel, endLevel) of a cooked file
+	static void readLevels(const string& path, DecodedImage& image, int firstLevel, int endLevel) {
+		const DDSLevel& last = image.dds.levels[endLevel - 1];
+		image.fileOffset = image.dds.levels[firstLevel].offset;
+		image.file = ReadFileRange(path, image.fileOffset, last.offset + last.size - image.fileOffset);
+		image.firstLevel = firstLevel;
+		image.endLevel = endLevel;
+	}
+
+	void submitDecoded(DecodedImage& image) {
+		lock_guard<mutex> lock(decodedMutex);
+		decoded.push_back(std::move(image));
+	}
+
+	// maps a buffer for every image whose size is known and has a worker decode into it. The flip and
+	// the mip generator read level 0 back, so the buffer asks for cached client memory to be mapped
+	void mapDecodeBuffers() {
+		vector<SizedImage> ready;
+		{
+			lock_guard<mutex> lock(decodedMutex);
+			size_t count = 0, bytes = mappedBytes;
+			while (count < sized.size() && (bytes == 0 || bytes + decodeBufferBytes(sized[count]) <= MAX_MAPPED_BYTES))
+				bytes += decodeBufferBytes(sized[count++]);
+			ready.assign(make_move_iterator(sized.begin()), make_move_iterator(sized.begin() + count));
+			sized.erase(sized.begin(), sized.begin() + count);
+		}
+
+		for (SizedImage& header : ready) {
+			DecodedImage image;
+			image.handle = header.handle;
+			image.width = header.width;
+			image.height = header.height;
+			image.channels = header.channels;
+			image.fullWidth = header.fullWidth;
+			image.fullHeight = header.fullHeight;
+			image.preview = header.preview;
+			image.bufferBytes = decodeBufferBytes(header);
+			GLbitfield flags = GL_MAP_READ_BIT | GL_MAP_WRITE_BIT;
+			image.buffer = CreateBuffer((GLsizeiptr)image.bufferBytes, nullptr, flags | GL_CLIENT_STORAGE_BIT);
+			unsigned char* pixels = (unsigned char*)glMapNamedBufferRange(image.buffer, 0, (GLsizeiptr)image.bufferBytes, flags);
+			mappedBytes += image.bufferBytes;
+			if (!pixels) {
+				submitDecoded(image);
+				continue;
+			}
+
+			decoding++;
+			pool.Submit([this, header = std::move(header), image = std::move(image), pixels]() mutable {
+				// the flip flag and the scale are per thread, so workers don't interfere with each other
+				stbi_set_flip_vertically_on_load_thread(header.flip);
+				stbi_set_jpeg_scale_thread(header.scale);
+				int width = header.width, height = header.height;
+				size_t levelBytes = (size_t)header.width * header.height * header.channels;
+				image.format = header.layout.internalFormat;
+				image.pixelFormat = header.layout.pixelFormat;
+				image.pixelType = header.layout.pixelType;
+				image.pixelBytes = header.channels;
+				if (header.bits != 8)
+					decodeFloat(header, image, pixels);
+				else if (decodeLevel0(header, pixels)) {
+					image.levelOffsets.push_back(0);
+					if (header.mipmapped) {
+						// already on a worker, so the generator runs single threaded here
+						MipSettings settings = header.mipSettings;
+						settings.srgb = header.channels >= 3;
+						GenerateMipTail(pixels, width, height, header.channels, pixels + levelBytes, settings);
+						for (int w = width, h = height; w > 1 || h > 1;) {
+							w = std::max(1, w / 2);
+							h = std::max(1, h / 2);
+							image.levelOffsets.push_back(levelBytes);
+							levelBytes += (size_t)w * h * header.channels;
+						}
+					}
+					// the mip generator doesn't care about the order, colour channels are filtered alike
+					if (header.layout.swizzle)
+						SwizzleRedBlue(pixels, levelBytes / 4);
+				}
+				image.endLevel = levelCount(image);
+				submitDecoded(image);
+				decoding--;
+			});
+		}
+	}
+
+	// decodes an 8 bit image into pixels at the size of the header. With levels left to drop it's decoded on
+	// the heap and resampled down into the buffer, in one pass however many levels that is
+	static bool decodeLevel0(const SizedImage& header, unsigned char* pixels) {
+		int width, height, channels;
+		if (header.bias == 0)
+			return stbi_load_from_memory_into(header.file.data(), (int)header.file.size(), pixels,
+				(size_t)header.width * header.height * header.channels, &width, &height, &channels, header.channels) != nullptr;
+		unsigned char* full = stbi_load_from_memory(header.file.data(), (int)header.file.size(), &width, &height, &channels,
+			header.channels);
+		if (!full)
+			return false;
+		// the buffer was sized from the header
+		bool sized = BiasedSize(width, header.bias) == header.width && BiasedSize(height, header.bias) == header.height;
+		if (sized) {
+			MipSettings settings = header.mipSettings;
+			settings.srgb = header.channels >= 3;
+			ResampleImage(full, width, height, header.channels, pixels, header.width, header.height, settings);
+		}
+		stbi_image_free(full);
+		return sized;
+	}
+
+	// 16 bit and float images decode on the heap and are packed into the buffer, halves at the most
+	static size_t decodeBufferBytes(const SizedImage& image) {
+		int pixelBytes = image.bits == 8 ? image.channels : image.channels * 2;
+		size_t bytes = (size_t)image.width * image.height * pixelBytes;
+		if (image.mipmapped)
+			bytes += MipTailBytes(image.width, image.height, pixelBytes);
+		return bytes;
+	}
+
+	// decodes a 16 bit or HDR image to floats, picks the format for them and packs level 0 and the mips
+	// into out one after the other. Levels the quality tier drops are only filtered on the way down.
+	// Leaves the level offsets empty if the image can't be decoded
+	static void decodeFloat(const SizedImage& header, DecodedImage& image, unsigned char* out) {
+		int width, height, channels;
+		unsigned short* pixels16 = nullptr;
+		float* pixelsFloat = nullptr;
+		vector<float> level0;
+		if (header.bits == 16) {
+			pixels16 = stbi_load_16_from_memory(header.file.data(), (int)header.file.size(), &width, &height, &channels,
+				header.channels);
+			if (!pixels16)
+				return;
+			level0.resize((size_t)width * height * header.channels);
+			for (size_t i = 0; i < level0.size(); i++)
+				level0[i] = pixels16[i] * (1.0f / 65535.0f);
+		}
+		else {
+			pixelsFloat = stbi_loadf_from_memory(header.file.data(), (int)header.file.size(), &width, &height, &channels,
+				header.channels);
+			if (!pixelsFloat)
+				return;
+		}
+		const float* pixels = pixelsFloat ? pixelsFloat : level0.data();
+		// the buffer was sized from the header
+		if (BiasedSize(width, header.bias) != header.width || BiasedSize(height, header.bias) != header.height) {
+			stbi_image_free(pixels16);
+			stbi_image_free(pixelsFloat);
+			return;
+		}
+
+		// a 16 bit image is there for its precision, and R11F_G11F_B10F or RGB9_E5 keep 5 to 9 bits of
+		// mantissa, so only HDR images get packed
+		HdrFormat format;
+		format.channels = header.channels;
+		if (header.bits == 32)
+			format = ChooseHdrFormat(pixels, (size_t)width * height, header.channels);
+		image.format = hdrInternalFormat(format);
+		image.pixelFormat = pixelFormat(header.channels);
+		image.pixelType = format.packing == HDR_R11G11B10F ? GL_UNSIGNED_INT_10F_11F_11F_REV
+			: format.packing == HDR_RGB9E5 ? GL_UNSIGNED_INT_5_9_9_9_REV : GL_HALF_FLOAT;
+		image.pixelBytes = format.PixelBytes();
+
+		size_t offset = 0;
+		int level = 0;
+		auto store = [&](const float* levelPixels, int levelWidth, int levelHeight) {
+			if (level++ < header.bias || (!header.mipmapped && !image.levelOffsets.empty()))
+				return;
+			image.levelOffsets.push_back(offset);
+			PackHdrPixels(format, levelPixels, (size_t)levelWidth * levelHeight, out + offset);
+			offset += (size_t)levelWidth * levelHeight * format.PixelBytes();
+		};
+		store(pixels, width, height);
+		if (header.mipmapped || header.bias > 0) {
+			// HDR images are linear, 16 bit colour is sRGB like 8 bit colour
+			MipSettings settings = header.mipSettings;
+			settings.srgb = header.bits == 16 && header.channels >= 3;
+			settings.hdr = header.bits == 32;
+			if (pixels16)
+				GenerateFloatMipTail(pixels16, width, height, header.channels, store, settings);
+			else
+				GenerateFloatMipTail(pixelsFloat, width, height, header.channels, store, settings);
+		}
+		stbi_image_free(pixels16);
+		stbi_image_free(pixelsFloat);
+	}
+
+	// queues the file of the entry to be decoded on the workers
+	void startLoad(TextureHandle handle) {
+		TextureEntry& entry = entries[handle];
+		entry.loading = true;
+		stats.pending++;
+
+		decoding++;
+		// mips are filtered in linear light for colour images, and wrap around for tiling textures
+		MipSettings mipSettings;
+		mipSettings.wrap = entry.wrap == GL_REPEAT || entry.wrap == GL_MIRRORED_REPEAT;
+		bool mipmapped = entry.minFilter != GL_NEAREST && entry.minFilter != GL_LINEAR;
+		string path = entry.path;
+		bool flip = entry.flip;
+		bool streamed = entry.streamed;
+		int bias = mipBias;
+		PixelOrder order = pixelOrder;
+		// a texture that's resident at a lower resolution already looks better than a preview would
+		int preview = entry.resident ? 0 : previewScale;
+		pool.Submit([this, handle, path, flip, mipSettings, mipmapped, streamed, bias, preview, order]() {
+			DecodedImage image;
+			image.handle = handle;
+			if (streamed) {
+				// only the headers and the small levels, the rest comes when it's needed
+				if (ReadDDSHeader(path, image.dds))
+					readLevels(path, image, tailLevel(image.dds), (int)image.dds.levels.size());
+				image.fullWidth = image.dds.width;
+				image.fullHeight = image.dds.height;
+			}
+			else if (isCooked(path)) {
+				image.file = ReadFileBytes(path);
+				if (!ParseDDS(image.file.data(), image.file.size(), image.dds))
+					image.file.clear();
+				image.fullWidth = image.dds.width;
+				image.fullHeight = image.dds.height;
+				dropTopLevels(image.dds, bias);
+			}
+			else {
+				// only the header for now, the GL thread maps a buffer of the right size to decode into
+				SizedImage header;
+				header.handle = handle;
+				header.file = ReadFileBytes(path);
+				header.flip = flip;
+				header.mipmapped = mipmapped;
+				header.mipSettings = mipSettings;
+				// JPEGs drop up to 3 levels in the IDCT already
+				header.scale = isJpeg(header.file) ? std::min(bias, 3) : 0;
+				header.bias = bias - header.scale;
+				if (readSize(header, order)) {
+					// the preview goes first, so it's usually decoded and uploaded before the image itself
+					SizedImage small;
+					bool previewed = false;
+					if (preview > 0 && isJpeg(header.file) && header.scale < 3) {
+						small = header;
+						small.scale = std::min(header.scale + preview, 3);
+						small.preview = true;
+						previewed = readSize(small, order);
+					}
+					lock_guard<mutex> lock(decodedMutex);
+					if (previewed)
+						sized.push_back(std::move(small));
+					sized.push_back(std::move(header));
+					decoding--;
+					return;
+				}
+			}
+			if (!streamed)
+				image.endLevel = levelCount(image);
+			submitDecoded(image);
+			decoding--;
+		});
+	}
+
+	// reads the levels from firstLevel up to the ones the streamed texture already has on a worker
+	void startStream(TextureHandle handle, int firstLevel) {
+		TextureEntry& entry = entries[handle];
+		entry.loading = true;
+		stats.pending++;
+
+		decoding++;
+		string path = entry.path;
+		DDSImage dds = entry.dds;
+		int endLevel = entry.firstLevel;
+		pool.Submit([this, handle, path, dds, firstLevel, endLevel]() {
+			DecodedImage image;
+			image.handle = handle;
+			image.dds = dds;
+			image.streamIn = true;
+			readLevels(path, image, firstLevel, endLevel);
+			submitDecoded(image);
+			decoding--;
+		});
+	}
+
+	// carries out what the residency decided, then reloads degraded textures that fit again
+	void enforceBudget() {
+		for (const ResidencyAction& action : residency.Enforce()) {
+			TextureEntry& entry = entries[action.handle];
+			if (action.type == RESIDENCY_DROP_LEVEL) {
+				reallocate(action.handle, residency.FirstLevel(action.handle));
+				continue;
+			}
+			GLStateCache::Get().DeleteTexture(entry.texture);
+			entry.texture = 0;
+			entry.resident = false;
+			stats.resident--;
+			stats.evicted++;
+		}
+
+		// streamed textures get their levels back through the streaming instead
+		for (TextureHandle handle : residency.RestoreCandidates(restoringBytes)) {
+			if (entries[handle].loading || entries[handle].streamed)
+				continue;
+			entries[handle].restoringBytes = residency.FullBytes(handle) - residency.Bytes(handle);
+			restoringBytes += entries[handle].restoringBytes;
+			startLoad(handle);
+		}
+	}
+
+	// moves every streamed texture towards the level requested since the last update
+	void updateStreaming() {
+		for (TextureHandle handle = 0; handle < entries.size(); handle++) {
+			TextureEntry& entry = entries[handle];
+			if (!entry.streamed)
+				continue;
+			int requested = entry.requestedLevel;
+			entry.requestedLevel = INT_MAX;
+			if (!entry.resident || entry.loading || entry.failed)
+				continue;
+
+			// a texture nobody asked for isn't visible, it only needs its tail. Nothing finer than the
+			// quality tier allows is streamed in
+			int desired = std::min(std::max(requested, mipBias), tailLevel(entry.dds));
+			if (desired < entry.firstLevel) {
+				entry.unneededFrames = 0;
+				// as many of the missing levels as the budget has room for, the finest ones go first if it doesn't
+				int level = entry.firstLevel;
+				size_t extra = 0;
+				while (level > desired && residency.Fits(extra + entry.dds.levels[level - 1].size))
+					extra += entry.dds.levels[--level].size;
+				if (level < entry.firstLevel)
+					startStream(handle, level);
+			}
+			else if (desired > entry.firstLevel) {
+				if (++entry.unneededFrames < STREAM_OUT_FRAMES)
+					continue;
+				stats.streamedOut += desired - entry.firstLevel;
+				reallocate(handle, desired);
+				entry.unneededFrames = 0;
+			}
+			else
+				entry.unneededFrames = 0;
+		}
+	}
+
+	// replaces the texture with one whose level 0 is firstLevel of the full chain. The levels both have in
+	// common are copied on the GPU, new finer levels are left for the streaming to fill in
+	void reallocate(TextureHandle handle, int firstLevel) {
+		TextureEntry& entry = entries[handle];
+		int baseLevel = std::max(firstLevel, entry.baseLevel);
+		int width = std::max(1, entry.width >> firstLevel), height = std::max(1, entry.height >> firstLevel);
+
+		GLuint texture = CreateTexture2D(width, height, entry.format, entry.levelCount - firstLevel);
+		SetTextureSampling(texture, entry.wrap, entry.minFilter, entry.magFilter);
+		SetGreySwizzle(texture, entry.format);
+		for (int level = baseLevel; level < entry.levelCount; level++)
+			glCopyImageSubData(entry.texture, GL_TEXTURE_2D, level - entry.firstLevel, 0, 0, 0,
+				texture, GL_TEXTURE_2D, level - firstLevel, 0, 0, 0,
+				std::max(1, entry.width >> level), std::max(1, entry.height >> level), 1);
+		// the sampler must not reach the levels that don't hold anything yet
+		if (baseLevel > firstLevel)
+			glTextureParameteri(texture, GL_TEXTURE_BASE_LEVEL, baseLevel - firstLevel);
+
+		GLStateCache::Get().DeleteTexture(entry.texture);
+		entry.texture = texture;
+		entry.firstLevel = firstLevel;
+		entry.baseLevel = baseLevel;
+		residency.SetFirstLevel(handle, firstLevel);
+	}
+
+	// the size the image ends up at, after stb_image's scaling and the levels dropped behind it
+	static bool readSize(SizedImage& image, PixelOrder order) {
+		stbi_set_jpeg_scale_thread(image.scale);
+		if (image.file.empty() || !stbi_info_from_memory(image.file.data(), (int)image.file.size(),
+			&image.width, &image.height, &image.channels))
+			return false;
+		image.fullWidth = image.width << image.scale;
+		image.fullHeight = image.height << image.scale;
+		// a small image keeps its 1x1 level at least
+		image.bias = std::min(image.bias, MipLevelCount(image.width, image.height) - 1);
+		image.width = BiasedSize(image.width, image.bias);
+		image.height = BiasedSize(image.height, image.bias);
+		if (stbi_is_hdr_from_memory(image.file.data(), (int)image.file.size()))
+			image.bits = 32;
+		else if (stbi_is_16_bit_from_memory(image.file.data(), (int)image.file.size()))
+			image.bits = 16;
+		else {
+			image.layout = NegotiatePixelLayout(image.channels, order);
+			image.channels = image.layout.channels;
+		}
+		return true;
+	}
+
+	// the only format stb_image can decode at a reduced size
+	static bool isJpeg(const vector<unsigned char>& file) {
+		return file.size() >= 2 && file[0] == 0xff && file[1] == 0xd8;
+	}
+
+	// drops the first levels of a cooked texture for the quality tier, its smallest level stays
+	static void dropTopLevels(DDSImage& dds, int count) {
+		count = std::min(count, (int)dds.levels.size() - 1);
+		if (count <= 0)
+			return;
+		dds.levels.erase(dds.levels.begin(), dds.levels.begin() + count);
+		dds.width = dds.levels[0].width;
+		dds.height = dds.levels[0].height;
+	}
+
+	static bool isCooked(const string& path) {
+		return path.size() >= 4 && path.compare(path.size() - 4, 4, ".dds") == 0;
+	}
+
+	static int levelCount(const DecodedImage& image) {
+		return image.file.empty() ? (int)image.levelOffsets.size() : (int)image.dds.levels.size();
+	}
+
+	static LevelSource levelSource(const DecodedImage& image, int index) {
+		LevelSource source;
+		if (image.file.empty()) {
+			source.data = nullptr;
+			source.offset = image.levelOffsets[index];
+			source.width = std::max(1, image.width >> index);
+			source.height = std::max(1, image.height >> index);
+			source.rowHeight = 1;
+			source.rows = source.height;
+			source.rowBytes = (size_t)source.width * image.pixelBytes;
+			source.pixelFormat = image.pixelFormat;
+			source.pixelType = image.pixelType;
+			return source;
+		}
+		const DDSLevel& level = image.dds.levels[index];
+		bool compressed = DDSIsCompressed(image.dds.format);
+		source.data = image.file.data() + (level.offset - image.fileOffset);
+		source.offset = 0;
+		source.width = level.width;
+		source.height = level.height;
+		source.rowHeight = compressed ? 4 : 1;
+		source.rows = (level.height + source.rowHeight - 1) / source.rowHeight;
+		source.rowBytes = level.size / source.rows;
+		source.pixelFormat = GL_RGBA;
+		source.pixelType = GL_UNSIGNED_BYTE;
+		return source;
+	}
+
+	static GLenum cookedFormat(const DDSImage& dds) {
+		return DDSInternalFormat(dds.format, dds.srgb);
+	}
+
+	static GLenum hdrInternalFormat(const HdrFormat& format) {
+		if (format.packing == HDR_R11G11B10F)
+			return GL_R11F_G11F_B10F;
+		if (format.packing == HDR_RGB9E5)
+			return GL_RGB9_E5;
+		switch (format.channels) {
+		case 1: return GL_R16F;
+		case 2: return GL_RG16F;
+		case 3: return GL_RGB16F;
+		default: return GL_RGBA16F;
+		}
+	}
+
+	static GLenum pixelFormat(int channels) {
+		switch (channels) {
+		case 1: return GL_RED;
+		case 2: return GL_RG;
+		case 3: return GL_RGB;
+		default: return GL_RGBA;
+		}
+	}
+};
+
+#endif
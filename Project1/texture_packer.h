@@ -0,0 +1,302 @@
+#ifndef TEXTURE_PACKER_H
+#define TEXTURE_PACKER_H
+
+#include <glad/glad.h>
+
+// Plugins for OpenGL Mathematics
+// Allows us to use mathematical transformations into our engine for any object
+#include <glm/glm.hpp>
+
+#include <vector>
+#include <map>
+#include <tuple>
+#include <algorithm>
+#include <cstring>
+
+// the rect packer imgui uses for its font atlas, compiled into this translation unit as well
+#ifndef STB_RECT_PACK_IMPLEMENTATION
+#define STBRP_STATIC
+#define STB_RECT_PACK_IMPLEMENTATION
+#endif
+#include "imgui/imstb_rectpack.h"
+
+#include "mip_generator.h"
+#include "gl_state.h"
+#include "gl_resources.h"
+#include "thread_pool.h"
+#include "binding_points.h"
+
+using namespace glm;
+using namespace std;
+
+// Packs many small textures into a few GL_TEXTURE_2D_ARRAY textures, so draws with different
+// materials don't need different textures bound.
+//
+// Textures with the same size, colour space and wrapping become layers of one array. Small textures
+// that don't tile are packed into atlas pages with the rect packer instead, and the pages become the
+// layers of another array. Every packed texture ends up as (array, layer, UV transform); the shaders
+// find the layer and transform in the texture table through the object's material index, like
+// packed_texture.vs/fs do:
+//
+//     layout (std430, binding = 2) readonly buffer TextureTable {
+//         TextureTableEntry textures[]; // { vec4 uvTransform; uint layer; }
+//     };
+//     TextureTableEntry t = textures[objects[objectIndex].materialIndex];
+//     vec4 color = texture(packedTextures, vec3(uv * t.uvTransform.xy + t.uvTransform.zw, t.layer));
+//
+// The material of an object binds the array its texture is in, so the render queue sees one material
+// per array instead of one per texture and merges the draws of everything in it.
+//
+// Atlas entries are placed on a grid of ATLAS_ALIGNMENT pixels with a gutter of repeated edge pixels
+// around them. The pages get ATLAS_MIP_LEVELS levels built with a box filter, which never mixes
+// neighbouring entries since they start on whole texels in every level, and the gutter is still one
+// texel wide in the smallest level so bilinear filtering doesn't bleed either.
+
+// where a texture ended up
+struct PackedTexture {
+	GLuint array = 0;
+	unsigned int layer = 0;
+	vec4 uvTransform = vec4(1.0f, 1.0f, 0.0f, 0.0f); // xy scale, zw offset
+	bool atlased = false;
+};
+
+// matches the std430 layout of TextureTableEntry in the shaders
+struct TextureTableEntry {
+	vec4 uvTransform;
+	unsigned int layer;
+	unsigned int padding[3];
+};
+
+struct TexturePackerStats {
+	unsigned int textures = 0;
+	unsigned int arrays = 0; // GL textures created
+	unsigned int atlasPages = 0;
+	unsigned int atlasedTextures = 0;
+};
+
+class TexturePacker {
+public:
+	TexturePackerStats stats;
+
+	// textures up to maxAtlasedSize on both sides go into atlas pages of atlasSize x atlasSize. It's
+	// clamped so the biggest entry with its gutter, rounded up to the grid, still fits on an empty page
+	TexturePacker(int atlasSize = 2048, int maxAtlasedSize = 256)
+		: atlasSize(atlasSize),
+		maxAtlasedSize(std::min(maxAtlasedSize, atlasSize / ATLAS_ALIGNMENT * ATLAS_ALIGNMENT - 2 * ATLAS_GUTTER)) {
+	}
+
+	~TexturePacker() {
+		for (GLuint array : arrays)
+			GLStateCache::Get().DeleteTexture(array);
+		if (table)
+			GLStateCache::Get().DeleteBuffer(table);
+	}
+
+	// copies an RGBA8 image and returns its index in the texture table. Tiling textures wrap
+	// around and never go into an atlas
+	unsigned int Add(const unsigned char* rgba, int width, int height, bool tiling = true, bool srgb = true) {
+		Source source;
+		source.width = width;
+		source.height = height;
+		source.tiling = tiling;
+		source.srgb = srgb;
+		source.pixels.assign(rgba, rgba + (size_t)width * height * 4);
+		sources.push_back(std::move(source));
+		return (unsigned int)sources.size() - 1;
+	}
+
+	// packs everything added since the last build, builds the mips and uploads the arrays and the
+	// texture table. The source pixels are released afterwards
+	void Build(ThreadPool* pool = nullptr) {
+		for (GLuint array : arrays)
+			GLStateCache::Get().DeleteTexture(array);
+		arrays.clear();
+		stats = TexturePackerStats();
+		stats.textures = (unsigned int)sources.size();
+		packed.assign(sources.size(), PackedTexture());
+
+		// same size, colour space and wrapping share an array, small clamped textures share atlas pages
+		map<tuple<int, int, bool, bool>, vector<unsigned int>> layerGroups;
+		vector<unsigned int> atlasGroups[2];
+		for (unsigned int i = 0; i < sources.size(); i++) {
+			const Source& source = sources[i];
+			if (!source.tiling && source.width <= maxAtlasedSize && source.height <= maxAtlasedSize)
+				atlasGroups[source.srgb].push_back(i);
+			else
+				layerGroups[make_tuple(source.width, source.height, source.srgb, source.tiling)].push_back(i);
+		}
+
+		GLStateCache::Get().BindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		for (auto& group : layerGroups)
+			buildLayers(group.second, pool);
+		for (int srgb = 0; srgb < 2; srgb++)
+			if (!atlasGroups[srgb].empty())
+				buildAtlas(atlasGroups[srgb], srgb != 0, pool);
+
+		vector<TextureTableEntry> entries(packed.size());
+		for (size_t i = 0; i < packed.size(); i++) {
+			entries[i].uvTransform = packed[i].uvTransform;
+			entries[i].layer = packed[i].layer;
+		}
+		if (table)
+			GLStateCache::Get().DeleteBuffer(table);
+		table = entries.empty() ? 0 : CreateBuffer(entries.size() * sizeof(TextureTableEntry), entries.data());
+
+		stats.arrays = (unsigned int)arrays.size();
+		sources.clear();
+	}
+
+	const PackedTexture& Get(unsigned int index) const {
+		return packed[index];
+	}
+
+	// binds the texture table storage block, call before drawing anything that samples packed textures
+	void BindTable() const {
+		if (table)
+			GLStateCache::Get().BindBufferRange(GL_SHADER_STORAGE_BUFFER, TEXTURE_TABLE_BINDING, table, 0,
+				packed.size() * sizeof(TextureTableEntry));
+	}
+
+private:
+	// atlas entries start on multiples of this, so they line up with whole texels down to the last atlas level
+	static const int ATLAS_MIP_LEVELS = 4;
+	static const int ATLAS_ALIGNMENT = 1 << (ATLAS_MIP_LEVELS - 1);
+	// repeated edge pixels around every atlas entry, one texel in the last level
+	static const int ATLAS_GUTTER = ATLAS_ALIGNMENT;
+
+	struct Source {
+		int width = 0, height = 0;
+		bool tiling = true;
+		bool srgb = true;
+		vector<unsigned char> pixels;
+	};
+
+	int atlasSize;
+	int maxAtlasedSize;
+	vector<Source> sources;
+	vector<PackedTexture> packed;
+	vector<GLuint> arrays;
+	GLuint table = 0;
+
+	static int alignUp(int value, int alignment) {
+		return (value + alignment - 1) / alignment * alignment;
+	}
+
+	// builds the mips of one layer and uploads at most levels of them
+	static void uploadLayer(GLuint array, int layer, GLsizei levels, const unsigned char* rgba, int width, int height,
+		const MipSettings& settings, ThreadPool* pool) {
+		vector<MipLevel> mips = GenerateMips(rgba, width, height, 4, settings, pool);
+		for (GLsizei level = 0; level < levels && level < (GLsizei)mips.size(); level++)
+			glTextureSubImage3D(array, level, 0, 0, layer, mips[level].width, mips[level].height, 1,
+				GL_RGBA, GL_UNSIGNED_BYTE, mips[level].pixels.data());
+	}
+
+	void buildLayers(const vector<unsigned int>& group, ThreadPool* pool) {
+		const Source& first = sources[group[0]];
+		GLsizei levels = MipLevelCount(first.width, first.height);
+		GLuint array = CreateTexture2DArray(first.width, first.height, (GLsizei)group.size(),
+			first.srgb ? GL_SRGB8_ALPHA8 : GL_RGBA8, levels);
+		GLenum wrap = first.tiling ? GL_REPEAT : GL_CLAMP_TO_EDGE;
+		SetTextureSampling(array, wrap, GL_LINEAR_MIPMAP_LINEAR, GL_LINEAR);
+		arrays.push_back(array);
+
+		MipSettings settings;
+		settings.srgb = first.srgb;
+		settings.wrap = first.tiling;
+		for (unsigned int layer = 0; layer < group.size(); layer++) {
+			const Source& source = sources[group[layer]];
+			uploadLayer(array, layer, levels, source.pixels.data(), source.width, source.height, settings, pool);
+			PackedTexture& texture = packed[group[layer]];
+			texture.array = array;
+			texture.layer = layer;
+		}
+	}
+
+	void buildAtlas(const vector<unsigned int>& group, bool srgb, ThreadPool* pool) {
+		// gutter on both sides, rounded up to the grid so every rect starts on it
+		vector<stbrp_rect> remaining(group.size());
+		for (size_t i = 0; i < group.size(); i++) {
+			remaining[i].id = (int)group[i];
+			remaining[i].w = alignUp(sources[group[i]].width + 2 * ATLAS_GUTTER, ATLAS_ALIGNMENT);
+			remaining[i].h = alignUp(sources[group[i]].height + 2 * ATLAS_GUTTER, ATLAS_ALIGNMENT);
+		}
+
+		// fill one page after the other until every rect has a place
+		vector<vector<stbrp_rect>> pages;
+		vector<stbrp_node> nodes(atlasSize);
+		while (!remaining.empty()) {
+			stbrp_context context;
+			stbrp_init_target(&context, atlasSize, atlasSize, nodes.data(), (int)nodes.size());
+			stbrp_pack_rects(&context, remaining.data(), (int)remaining.size());
+
+			vector<stbrp_rect> page, rest;
+			for (const stbrp_rect& rect : remaining)
+				(rect.was_packed ? page : rest).push_back(rect);
+			// nothing fits on an empty page, another one wouldn't help. The constructor's clamp should
+			// prevent this, but if it happens the rest become array layers like the big textures
+			if (page.empty()) {
+				buildLeftovers(rest, pool);
+				break;
+			}
+			pages.push_back(page);
+			remaining.swap(rest);
+		}
+		if (pages.empty())
+			return;
+
+		GLuint array = CreateTexture2DArray(atlasSize, atlasSize, (GLsizei)pages.size(), srgb ? GL_SRGB8_ALPHA8 : GL_RGBA8,
+			ATLAS_MIP_LEVELS);
+		SetTextureSampling(array, GL_CLAMP_TO_EDGE, GL_LINEAR_MIPMAP_LINEAR, GL_LINEAR);
+		arrays.push_back(array);
+
+		MipSettings settings;
+		settings.filter = MIP_FILTER_BOX;
+		settings.srgb = srgb;
+		settings.wrap = false;
+		vector<unsigned char> pixels((size_t)atlasSize * atlasSize * 4);
+		for (unsigned int layer = 0; layer < pages.size(); layer++) {
+			fill(pixels.begin(), pixels.end(), (unsigned char)0);
+			for (const stbrp_rect& rect : pages[layer]) {
+				const Source& source = sources[rect.id];
+				int x0 = rect.x + ATLAS_GUTTER, y0 = rect.y + ATLAS_GUTTER;
+				blitWithGutter(source, pixels.data(), x0, y0);
+
+				PackedTexture& texture = packed[rect.id];
+				texture.array = array;
+				texture.layer = layer;
+				texture.atlased = true;
+				texture.uvTransform = vec4((float)source.width / atlasSize, (float)source.height / atlasSize,
+					(float)x0 / atlasSize, (float)y0 / atlasSize);
+			}
+			uploadLayer(array, layer, ATLAS_MIP_LEVELS, pixels.data(), atlasSize, atlasSize, settings, pool);
+		}
+		stats.atlasPages += (unsigned int)pages.size();
+		for (const vector<stbrp_rect>& page : pages)
+			stats.atlasedTextures += (unsigned int)page.size();
+	}
+
+	// the rects the atlas couldn't place, grouped by size into arrays of their own
+	void buildLeftovers(const vector<stbrp_rect>& rects, ThreadPool* pool) {
+		map<pair<int, int>, vector<unsigned int>> groups;
+		for (const stbrp_rect& rect : rects)
+			groups[make_pair(sources[rect.id].width, sources[rect.id].height)].push_back((unsigned int)rect.id);
+		for (auto& group : groups)
+			buildLayers(group.second, pool);
+	}
+
+	// copies the source to (x0, y0) of the page and repeats its edge pixels into the gutter around it
+	void blitWithGutter(const Source& source, unsigned char* page, int x0, int y0) const {
+		for (int y = -ATLAS_GUTTER; y < source.height + ATLAS_GUTTER; y++) {
+			int sy = std::min(std::max(y, 0), source.height - 1);
+			const unsigned char* row = &source.pixels[(size_t)sy * source.width * 4];
+			unsigned char* out = page + ((size_t)(y0 + y) * atlasSize + x0) * 4;
+			memcpy(out, row, (size_t)source.width * 4);
+			for (int x = 1; x <= ATLAS_GUTTER; x++) {
+				memcpy(out - x * 4, row, 4);
+				memcpy(out + (source.width - 1 + x) * 4, row + (source.width - 1) * 4, 4);
+			}
+		}
+	}
+};
+
+#endif
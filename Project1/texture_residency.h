@@ -0,0 +1,237 @@
+#ifndef TEXTURE_RESIDENCY_H
+#define TEXTURE_RESIDENCY_H
+
+#include <vector>
+#include <cstddef>
+#include <algorithm>
+
+using namespace std;
+
+// Keeps the GPU memory used by textures under a budget.
+//
+// Every resident texture is tracked with the size of each of its mip levels. When they add up to more
+// than the budget, the least recently used textures are given up first: textures that weren't used
+// in the last few frames are evicted completely and loaded again the next time they're asked for.
+// If that isn't enough, the textures still in use lose their top mip level instead, one level at a
+// time, which halves their resolution but keeps them drawable. Evicting something that's needed again
+// next frame would only make it thrash. Once there's room again they get their full resolution back.
+//
+// This only makes the decisions, the TextureManager owns the GL textures and carries them out.
+
+enum ResidencyActionType {
+	RESIDENCY_EVICT,
+	RESIDENCY_DROP_LEVEL
+};
+
+struct ResidencyAction {
+	unsigned int handle;
+	ResidencyActionType type;
+};
+
+struct TextureResidencyStats {
+	size_t residentBytes = 0;
+	size_t budgetBytes = 0;
+	unsigned int evicted = 0; // during the last Enforce()
+	unsigned int droppedLevels = 0; // during the last Enforce()
+	unsigned int degraded = 0; // resident textures missing their top levels
+};
+
+class TextureResidency {
+public:
+	TextureResidencyStats stats;
+
+	// a budget of 0 means there's no limit
+	explicit TextureResidency(size_t budgetBytes = 0) : budget(budgetBytes) {
+		stats.budgetBytes = budgetBytes;
+	}
+
+	void SetBudget(size_t budgetBytes) {
+		budget = budgetBytes;
+		stats.budgetBytes = budgetBytes;
+	}
+
+	size_t Budget() const {
+		return budget;
+	}
+
+	// the texture is resident with all the levels in levelBytes (level 0 first), width and height are level 0's
+	void Track(unsigned int handle, const vector<size_t>& levelBytes, int width, int height) {
+		if (handle >= records.size())
+			records.resize(handle + 1);
+		Untrack(handle);
+		Record& record = records[handle];
+		record.tracked = true;
+		record.levelBytes = levelBytes;
+		record.firstLevel = 0;
+		record.width = width;
+		record.height = height;
+		record.lastUsed = frame;
+		stats.residentBytes += bytes(record);
+	}
+
+	void Untrack(unsigned int handle) {
+		if (handle >= records.size() || !records[handle].tracked)
+			return;
+		Record& record = records[handle];
+		stats.residentBytes -= bytes(record);
+		if (record.firstLevel > 0)
+			stats.degraded--;
+		record.tracked = false;
+		record.firstLevel = 0;
+	}
+
+	// the texture now starts at level (streamed in or out), its lower levels stay as they are
+	void SetFirstLevel(unsigned int handle, int level) {
+		if (handle >= records.size() || !records[handle].tracked)
+			return;
+		Record& record = records[handle];
+		stats.residentBytes -= bytes(record);
+		stats.degraded += (level > 0) - (record.firstLevel > 0);
+		record.firstLevel = level;
+		stats.residentBytes += bytes(record);
+	}
+
+	// whether extraBytes more would still leave some room in the budget
+	bool Fits(size_t extraBytes) const {
+		return budget == 0 || stats.residentBytes + extraBytes <= budget - budget / 8;
+	}
+
+	// marks the texture as used this frame
+	void Touch(unsigned int handle) {
+		if (handle < records.size())
+			records[handle].lastUsed = frame;
+	}
+
+	void NextFrame() {
+		frame++;
+	}
+
+	// the first level of the full chain the texture still has
+	int FirstLevel(unsigned int handle) const {
+		return handle < records.size() ? records[handle].firstLevel : 0;
+	}
+
+	size_t Bytes(unsigned int handle) const {
+		return handle < records.size() && records[handle].tracked ? bytes(records[handle]) : 0;
+	}
+
+	size_t FullBytes(unsigned int handle) const {
+		if (handle >= records.size() || !records[handle].tracked)
+			return 0;
+		size_t total = 0;
+		for (size_t size : records[handle].levelBytes)
+			total += size;
+		return total;
+	}
+
+	// decides what has to go to get under the budget, in the order it should happen. The records are
+	// already updated, evicted textures are untracked and dropped levels are gone from FirstLevel()
+	const vector<ResidencyAction>& Enforce() {
+		actions.clear();
+		stats.evicted = 0;
+		stats.droppedLevels = 0;
+		if (budget == 0 || stats.residentBytes <= budget)
+			return actions;
+
+		order.clear();
+		for (unsigned int i = 0; i < records.size(); i++)
+			if (records[i].tracked)
+				order.push_back(i);
+		sort(order.begin(), order.end(), [this](unsigned int a, unsigned int b) {
+			return records[a].lastUsed < records[b].lastUsed;
+		});
+
+		// textures nobody used lately go completely, oldest first
+		for (unsigned int handle : order) {
+			if (stats.residentBytes <= budget || isRecent(records[handle]))
+				break;
+			Untrack(handle);
+			actions.push_back({ handle, RESIDENCY_EVICT });
+			stats.evicted++;
+		}
+
+		// the rest is in use, so they lose resolution instead, a level at a time starting with the least recently used
+		bool dropped = true;
+		while (stats.residentBytes > budget && dropped) {
+			dropped = false;
+			for (unsigned int handle : order) {
+				if (stats.residentBytes <= budget)
+					break;
+				Record& record = records[handle];
+				if (!record.tracked || !canDrop(record))
+					continue;
+				stats.residentBytes -= record.levelBytes[record.firstLevel];
+				if (record.firstLevel == 0)
+					stats.degraded++;
+				record.firstLevel++;
+				actions.push_back({ handle, RESIDENCY_DROP_LEVEL });
+				stats.droppedLevels++;
+				dropped = true;
+			}
+		}
+		return actions;
+	}
+
+	// degraded textures in use whose full chain fits in the budget again, most recently used first.
+	// pendingBytes is what restores already in flight will add
+	vector<unsigned int> RestoreCandidates(size_t pendingBytes) const {
+		vector<unsigned int> candidates;
+		for (unsigned int i = 0; i < records.size(); i++)
+			if (records[i].tracked && records[i].firstLevel > 0 && isRecent(records[i]))
+				candidates.push_back(i);
+		sort(candidates.begin(), candidates.end(), [this](unsigned int a, unsigned int b) {
+			return records[a].lastUsed > records[b].lastUsed;
+		});
+
+		// some headroom, so a texture that gets loaded next doesn't push the restored ones right back down
+		size_t limit = budget == 0 ? (size_t)-1 : budget - budget / 8;
+		size_t total = stats.residentBytes + pendingBytes;
+		vector<unsigned int> fitting;
+		for (unsigned int handle : candidates) {
+			size_t extra = FullBytes(handle) - Bytes(handle);
+			if (total + extra > limit)
+				continue;
+			total += extra;
+			fitting.push_back(handle);
+		}
+		return fitting;
+	}
+
+private:
+	// textures used within this many frames count as in use
+	static const unsigned int RECENT_FRAMES = 2;
+	// levels aren't dropped below this size on the larger side
+	static const int MIN_LEVEL_SIZE = 64;
+
+	struct Record {
+		bool tracked = false;
+		vector<size_t> levelBytes;
+		int firstLevel = 0;
+		int width = 0, height = 0;
+		unsigned long long lastUsed = 0;
+	};
+
+	size_t budget;
+	unsigned long long frame = 0;
+	vector<Record> records; // indexed by handle
+	vector<unsigned int> order;
+	vector<ResidencyAction> actions;
+
+	static size_t bytes(const Record& record) {
+		size_t total = 0;
+		for (size_t i = record.firstLevel; i < record.levelBytes.size(); i++)
+			total += record.levelBytes[i];
+		return total;
+	}
+
+	bool isRecent(const Record& record) const {
+		return frame - record.lastUsed < RECENT_FRAMES;
+	}
+
+	static bool canDrop(const Record& record) {
+		int size = std::max(record.width, record.height) >> (record.firstLevel + 1);
+		return record.firstLevel + 1 < (int)record.levelBytes.size() && size >= MIN_LEVEL_SIZE;
+	}
+};
+
+#endif
@@ -0,0 +1,72 @@
+#ifndef TEXTURE_STREAMING_H
+#define TEXTURE_STREAMING_H
+
+// Plugins for OpenGL Mathematics
+// Allows us to use mathematical transformations into our engine for any object
+#include <glm/glm.hpp>
+
+#include <vector>
+#include <cmath>
+#include <algorithm>
+
+#include "camera.h"
+#include "bounds.h"
+
+using namespace glm;
+using namespace std;
+
+// Works out which mip level of a texture an object needs from how big it can appear on screen.
+//
+// The texels per world unit come from the mesh's UV density (UV units per world unit) times the
+// texture size, the pixels per world unit from the camera's distance to the closest point of the
+// object's bounds and its vertical field of view. Every level halves the texel rate, so the level
+// that maps about one texel to one pixel is log2 of their ratio. The TextureManager streams in
+// what's requested, see RequestFootprint().
+
+// what the streaming needs to know about the camera
+struct StreamingView {
+	vec3 position = vec3(0.0f);
+	float fovY = radians(45.0f);
+	int screenHeight = 600;
+};
+
+inline StreamingView MakeStreamingView(const Camera& camera, int screenHeight) {
+	StreamingView view;
+	view.position = camera.position;
+	view.fovY = radians(camera.zoom);
+	view.screenHeight = screenHeight;
+	return view;
+}
+
+// square root of the UV area over the world area of all triangles, so how many UV units one unit of
+// surface covers on average. Vertex needs a vec3 position and vec2 texCoords
+template <typename Vertex>
+float ComputeUVDensity(const vector<Vertex>& vertices, const vector<unsigned int>& indices) {
+	double worldArea = 0.0, uvArea = 0.0;
+	for (size_t i = 0; i + 2 < indices.size(); i += 3) {
+		const Vertex& a = vertices[indices[i]];
+		const Vertex& b = vertices[indices[i + 1]];
+		const Vertex& c = vertices[indices[i + 2]];
+		worldArea += 0.5 * length(cross(b.position - a.position, c.position - a.position));
+		vec2 u = b.texCoords - a.texCoords, v = c.texCoords - a.texCoords;
+		uvArea += 0.5 * fabs(u.x * v.y - u.y * v.x);
+	}
+	return worldArea > 0.0 ? (float)sqrt(uvArea / worldArea) : 0.0f;
+}
+
+// the finest level the object needs, worldBounds being its bounding sphere in world space
+inline int DesiredMipLevel(int textureWidth, int textureHeight, int levelCount, float uvDensity,
+	const BoundingSphere& worldBounds, const StreamingView& view) {
+	// inside the bounds (or right at them) the full resolution can be needed
+	const float minDistance = 0.1f;
+	float distance = std::max(length(worldBounds.center - view.position) - worldBounds.radius, minDistance);
+
+	float pixelsPerUnit = view.screenHeight / (2.0f * distance * tanf(view.fovY * 0.5f));
+	float texelsPerUnit = uvDensity * std::max(textureWidth, textureHeight);
+	if (texelsPerUnit <= 0.0f)
+		return levelCount - 1;
+	int level = (int)floorf(log2f(texelsPerUnit / pixelsPerUnit));
+	return std::min(std::max(level, 0), levelCount - 1);
+}
+
+#endif
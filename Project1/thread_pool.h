@@ -0,0 +1,120 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+#include <algorithm>
+#include <memory>
+
+// Fixed set of worker threads pulling jobs from a shared queue. Jobs must not touch OpenGL,
+// the context only belongs to the main thread.
+
+class ThreadPool {
+public:
+	// 0 threads means one per hardware thread, minus the main thread
+	ThreadPool(unsigned int threadCount = 0) {
+		if (threadCount == 0) {
+			unsigned int hardware = std::thread::hardware_concurrency();
+			threadCount = hardware > 1 ? hardware - 1 : 1;
+		}
+		for (unsigned int i = 0; i < threadCount; i++)
+			workers.emplace_back([this] { workerLoop(); });
+	}
+
+	~ThreadPool() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		wake.notify_all();
+		for (std::thread& worker : workers)
+			worker.join();
+	}
+
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	unsigned int Size() const {
+		return (unsigned int)workers.size();
+	}
+
+	// runs the job on some worker later on, returns right away
+	void Submit(std::function<void()> job) {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			jobs.push_back(std::move(job));
+		}
+		wake.notify_one();
+	}
+
+	// splits [0, count) into chunks, runs body(begin, end) on each and waits for all of them.
+	// The calling thread works on chunks too, so this must not be called from inside a job
+	void ParallelFor(size_t count, const std::function<void(size_t, size_t)>& body, size_t minChunk = 1) {
+		if (count == 0)
+			return;
+		size_t chunks = std::min<size_t>((count + minChunk - 1) / minChunk, (size_t)(workers.size() + 1) * 4);
+		size_t chunkSize = (count + chunks - 1) / chunks;
+		chunks = (count + chunkSize - 1) / chunkSize;
+
+		// helpers can be dequeued after every chunk is already done and we've returned,
+		// so the shared counters have to outlive this call. They never touch body in that case
+		struct Progress {
+			std::atomic<size_t> next{ 0 };
+			std::atomic<size_t> done{ 0 };
+			std::mutex mutex;
+			std::condition_variable finished;
+		};
+		std::shared_ptr<Progress> progress = std::make_shared<Progress>();
+		const std::function<void(size_t, size_t)>* work = &body;
+
+		auto run = [progress, work, chunks, chunkSize, count]() {
+			size_t chunk;
+			while ((chunk = progress->next.fetch_add(1)) < chunks) {
+				size_t begin = chunk * chunkSize;
+				(*work)(begin, std::min(begin + chunkSize, count));
+				if (progress->done.fetch_add(1) + 1 == chunks) {
+					std::lock_guard<std::mutex> lock(progress->mutex);
+					progress->finished.notify_all();
+				}
+			}
+		};
+
+		// one helper per worker at most, whoever is free picks up the remaining chunks
+		size_t helpers = std::min<size_t>(workers.size(), chunks - 1);
+		for (size_t i = 0; i < helpers; i++)
+			Submit(run);
+		run();
+
+		std::unique_lock<std::mutex> lock(progress->mutex);
+		progress->finished.wait(lock, [&] { return progress->done.load() == chunks; });
+	}
+
+private:
+	std::vector<std::thread> workers;
+	std::deque<std::function<void()>> jobs;
+	std::mutex mutex;
+	std::condition_variable wake;
+	bool stopping = false;
+
+	void workerLoop() {
+		for (;;) {
+			std::function<void()> job;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				wake.wait(lock, [this] { return stopping || !jobs.empty(); });
+				if (stopping && jobs.empty())
+					return;
+				job = std::move(jobs.front());
+				jobs.pop_front();
+			}
+			job();
+		}
+	}
+};
+
+#endif
@@ -1,11 +1,25 @@
-#version 330 core
+#version 460 core
 layout (location = 0) in vec3 aPos;
 
-uniform mat4 model;
-uniform mat4 view;
-uniform mat4 projection;
+// filled per instance by the render queue
+layout (location = 3) in uint objectIndex;
+// written once per frame into the stream buffer
+layout (std140, binding = 0) uniform CameraData {
+	mat4 projection;
+	mat4 view;
+};
+// every object's transforms live in the scene buffer, indexed by the object id of the instance
+struct ObjectData {
+	mat4 model;
+	mat3 normalMatrix;
+	uint materialIndex;
+};
+layout (std430, binding = 1) readonly buffer Objects {
+	ObjectData objects[];
+};
 
 void main()
 {
+	mat4 model = objects[objectIndex].model;
 	gl_Position = projection * view * model * vec4(aPos, 1.0);
 }
\ No newline at end of file
@@ -0,0 +1,34 @@
+#version 450 core
+// gl_BaseInstance is core from 4.60, the extension lets this run on 4.50 drivers as well
+#extension GL_ARB_shader_draw_parameters : require
+layout (location = 0) in vec3 aPos;
+layout(location = 1) in vec3 aNormal;
+// written once per frame into the stream buffer
+layout (std140, binding = 0) uniform CameraData {
+	mat4 projection;
+	mat4 view;
+};
+// every object's transforms live in the scene buffer. Draws made by the GPU culler (gpu_culling.h)
+// have no instance buffer, the object id comes in as the base instance of the draw command
+struct ObjectData {
+	mat4 model;
+	mat3 normalMatrix;
+	uint materialIndex;
+};
+layout (std430, binding = 1) readonly buffer Objects {
+	ObjectData objects[];
+};
+
+
+out vec3 FragPos;
+out vec3 Normal;
+
+
+void main()
+{
+	uint objectIndex = uint(gl_BaseInstanceARB);
+	mat4 model = objects[objectIndex].model;
+	gl_Position = projection * view * model * vec4(aPos, 1.0);
+	FragPos = vec3(model * vec4(aPos, 1.0));
+	Normal = objects[objectIndex].normalMatrix * aNormal;
+}
@@ -1,9 +1,22 @@
-#version 330 core
+#version 460 core
 layout (location = 0) in vec3 aPos;
 layout(location = 1) in vec3 aNormal;
-uniform mat4 model;
-uniform mat4 view;
-uniform mat4 projection;
+// filled per instance by the render queue
+layout (location = 3) in uint objectIndex;
+// written once per frame into the stream buffer
+layout (std140, binding = 0) uniform CameraData {
+	mat4 projection;
+	mat4 view;
+};
+// every object's transforms live in the scene buffer, indexed by the object id of the instance
+struct ObjectData {
+	mat4 model;
+	mat3 normalMatrix;
+	uint materialIndex;
+};
+layout (std430, binding = 1) readonly buffer Objects {
+	ObjectData objects[];
+};
 
 
 out vec3 FragPos;
@@ -12,9 +25,11 @@ out vec3 Normal;
 
  void main()
  {
+	mat4 model = objects[objectIndex].model;
 	gl_Position = projection * view * model * vec4(aPos, 1.0);
 	FragPos = vec3(model * vec4(aPos, 1.0));
 
-	// this will generate a normal matrix so that we can transform the normals even in non-uniform scaling
-	Normal = mat3(transpose(inverse(model))) * aNormal;
+	// the normal matrix transforms the normals even in non-uniform scaling, it's computed
+	// once per object on the CPU instead of inverting the model matrix for every vertex
+	Normal = objects[objectIndex].normalMatrix * aNormal;
  }
@@ -0,0 +1,36 @@
+#version 460 core
+layout (location = 0) in vec3 aPos;
+layout (location = 1) in vec3 aNormal;
+layout (location = 2) in vec2 aTexCoords;
+// filled per instance by the render queue
+layout (location = 3) in uint objectIndex;
+// written once per frame into the stream buffer
+layout (std140, binding = 0) uniform CameraData {
+	mat4 projection;
+	mat4 view;
+};
+// every object's transforms live in the scene buffer, indexed by the object id of the instance
+struct ObjectData {
+	mat4 model;
+	mat3 normalMatrix;
+	uint materialIndex;
+};
+layout (std430, binding = 1) readonly buffer Objects {
+	ObjectData objects[];
+};
+
+out vec3 FragPos;
+out vec3 Normal;
+out vec2 TexCoords;
+// the object's materialIndex is its entry in the texture table
+flat out uint textureIndex;
+
+void main()
+{
+	mat4 model = objects[objectIndex].model;
+	gl_Position = projection * view * model * vec4(aPos, 1.0);
+	FragPos = vec3(model * vec4(aPos, 1.0));
+	Normal = objects[objectIndex].normalMatrix * aNormal;
+	TexCoords = aTexCoords;
+	textureIndex = objects[objectIndex].materialIndex;
+}
@@ -0,0 +1,30 @@
+#version 460 core
+layout (location = 0) in vec3 aPos;
+layout (location = 2) in vec2 aTexCoords;
+
+// filled per instance by the render queue
+layout (location = 3) in uint objectIndex;
+// written once per frame into the stream buffer
+layout (std140, binding = 0) uniform CameraData {
+	mat4 projection;
+	mat4 view;
+};
+// every object's transforms live in the scene buffer, indexed by the object id of the instance
+struct ObjectData {
+	mat4 model;
+	mat3 normalMatrix;
+	uint materialIndex;
+};
+layout (std430, binding = 1) readonly buffer Objects {
+	ObjectData objects[];
+};
+
+// used by both the feedback pass and the shading pass
+out vec2 TexCoords;
+
+void main()
+{
+	mat4 model = objects[objectIndex].model;
+	TexCoords = aTexCoords;
+	gl_Position = projection * view * model * vec4(aPos, 1.0);
+}
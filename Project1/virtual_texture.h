@@ -0,0 +1,389 @@
+#ifndef VIRTUAL_TEXTURE_H
+#define VIRTUAL_TEXTURE_H
+
+#include <glad/glad.h>
+
+#include <vector>
+#include <string>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <iostream>
+#include <algorithm>
+
+#include "shader.h"
+#include "virtual_texture_file.h"
+#include "virtual_texture_pages.h"
+#include "gl_state.h"
+#include "gl_resources.h"
+#include "thread_pool.h"
+
+using namespace std;
+
+// Sparse virtual texturing: a texture far bigger than what's resident, of which only the pages that
+// are actually visible are kept in memory.
+//
+// The pages of every level live in a .vt file cooked by the TextureCooker (--virtual). What's resident
+// sits in the physical page cache, one texture with a grid of page slots. The indirection texture has
+// a texel for every page of every level (one mip level of it per level of the virtual texture) and
+// tells the shader in which slot to find it, or the closest coarser page that is resident.
+//
+// Every frame the scene is drawn once more with the feedback shader, at a fraction of the screen
+// resolution, into an integer target holding the page id each pixel would like to sample. That's read
+// back asynchronously through a pixel pack buffer and handed to the page manager a frame or two
+// later. The pages it asks for are read from the file on the worker threads and copied into their
+// slots by Update().
+//
+//     vt.BeginFeedback(feedbackShader); draw the scene; vt.EndFeedback();
+//     vt.Update(); vt.Bind(shader, 0, 1); draw the scene
+//
+// virtual_texture.fs samples through it, virtual_texture_feedback.fs writes the feedback.
+
+struct VirtualTextureStats {
+	unsigned int readbacks = 0; // feedback frames processed, since the start
+	unsigned int skippedReadbacks = 0; // feedback passes that found every readback buffer still busy
+	unsigned int tilesUploaded = 0; // during the last Update()
+	unsigned int failedTiles = 0; // since the start
+	size_t uploadedBytes = 0; // during the last Update()
+};
+
+class VirtualTexture {
+public:
+	VirtualTextureStats stats;
+
+	// the page cache has cacheSlots x cacheSlots pages, the feedback is drawn at 1 / FEEDBACK_SCALE of the screen
+	VirtualTexture(ThreadPool& pool, int screenWidth, int screenHeight, int cacheSlots = 16)
+		: pool(pool), screenWidth(screenWidth), screenHeight(screenHeight), cacheSlots(cacheSlots) {
+		createFeedback();
+	}
+
+	~VirtualTexture() {
+		// tile reads write into this object, let the ones already running finish
+		while (reading.load() > 0)
+			this_thread::yield();
+
+		GLStateCache& state = GLStateCache::Get();
+		for (Readback& readback : readbacks) {
+			if (readback.fence)
+				glDeleteSync(readback.fence);
+			glUnmapNamedBuffer(readback.buffer);
+			state.DeleteBuffer(readback.buffer);
+		}
+		glDeleteFramebuffers(1, &feedbackFramebuffer);
+		glDeleteRenderbuffers(2, feedbackRenderbuffers);
+		if (physical)
+			state.DeleteTexture(physical);
+		if (indirection)
+			state.DeleteTexture(indirection);
+	}
+
+	VirtualTexture(const VirtualTexture&) = delete;
+	VirtualTexture& operator=(const VirtualTexture&) = delete;
+
+	// opens a .vt file and creates the page cache and indirection texture for it
+	bool Open(const string& path) {
+		// reads still running use the file that's about to be replaced
+		while (reading.load() > 0)
+			this_thread::yield();
+		{
+			lock_guard<mutex> lock(loadedMutex);
+			loaded.clear();
+		}
+		GLStateCache& state = GLStateCache::Get();
+		if (physical)
+			state.DeleteTexture(physical);
+		if (indirection)
+			state.DeleteTexture(indirection);
+		physical = indirection = 0;
+
+		file.reset(new VirtualTextureFile());
+		if (!file->Open(path)) {
+			cout << "Failed to open virtual texture " << path << endl;
+			file.reset();
+			return false;
+		}
+		const VirtualTextureLayout& layout = file->layout;
+		if (cacheSlots < 1 || cacheSlots > VT_MAX_CACHE_SLOTS) {
+			cout << "A virtual texture cache can't have " << cacheSlots << " slots per side, at most " << VT_MAX_CACHE_SLOTS << endl;
+			file.reset();
+			return false;
+		}
+		// compressed tiles are copied in whole blocks, so the slots have to start on one
+		if (DDSIsCompressed(file->format) && layout.PaddedSize() % 4 != 0) {
+			cout << "Virtual texture " << path << " has tiles that aren't a multiple of 4 texels" << endl;
+			file.reset();
+			return false;
+		}
+		pages.reset(new VirtualPageManager(layout, cacheSlots, cacheSlots));
+
+		// the border texels take care of filtering, nothing gets filtered across slots
+		format = DDSInternalFormat(file->format, file->srgb);
+		int cacheSize = cacheSlots * layout.PaddedSize();
+		physical = CreateTexture2D(cacheSize, cacheSize, format);
+		SetTextureSampling(physical, GL_CLAMP_TO_EDGE, GL_LINEAR, GL_LINEAR);
+
+		// levels of the indirection texture halve like the page counts do when it's a power of two
+		// large, the pages of a level fill the corner of its mip level
+		indirectionWidth = nextPowerOfTwo(layout.PagesX(0));
+		indirectionHeight = nextPowerOfTwo(layout.PagesY(0));
+		indirection = CreateTexture2D(indirectionWidth, indirectionHeight, GL_RGBA8,
+			MipLevelCount(indirectionWidth, indirectionHeight));
+		SetTextureSampling(indirection, GL_CLAMP_TO_EDGE, GL_NEAREST_MIPMAP_NEAREST, GL_NEAREST);
+		return true;
+	}
+
+	bool IsOpen() const {
+		return file != nullptr;
+	}
+
+	const VirtualPageStats& PageStats() const {
+		return pages->stats;
+	}
+
+	// the feedback target follows the screen size
+	void Resize(int width, int height) {
+		screenWidth = width;
+		screenHeight = height;
+		for (Readback& readback : readbacks) {
+			if (readback.fence)
+				glDeleteSync(readback.fence);
+			glUnmapNamedBuffer(readback.buffer);
+			GLStateCache::Get().DeleteBuffer(readback.buffer);
+		}
+		readbacks.clear();
+		glDeleteFramebuffers(1, &feedbackFramebuffer);
+		glDeleteRenderbuffers(2, feedbackRenderbuffers);
+		createFeedback();
+	}
+
+	// binds the feedback target and sets up the shader, everything using the virtual texture is drawn after this
+	void BeginFeedback(Shader& shader) {
+		glBindFramebuffer(GL_FRAMEBUFFER, feedbackFramebuffer);
+		glViewport(0, 0, feedbackWidth, feedbackHeight);
+		const GLuint clearPage[4] = { INVALID_PAGE, 0, 0, 0 };
+		const GLfloat clearDepth = 1.0f;
+		glClearNamedFramebufferuiv(feedbackFramebuffer, GL_COLOR, 0, clearPage);
+		glClearNamedFramebufferfv(feedbackFramebuffer, GL_DEPTH, 0, &clearDepth);
+
+		shader.use();
+		setUniforms(shader);
+		// derivatives are FEEDBACK_SCALE times larger down here, ask for the level the full screen needs
+		shader.setVec2("vtLevelBias", -log2f((float)FEEDBACK_SCALE), 0.0f);
+	}
+
+	// starts reading the feedback back and goes back to the screen
+	void EndFeedback() {
+		Readback* target = nullptr;
+		for (Readback& readback : readbacks)
+			if (!readback.fence) {
+				target = &readback;
+				break;
+			}
+
+		if (target) {
+			GLStateCache::Get().BindBuffer(GL_PIXEL_PACK_BUFFER, target->buffer);
+			glNamedFramebufferReadBuffer(feedbackFramebuffer, GL_COLOR_ATTACHMENT0);
+			// with a pixel pack buffer bound the pointer argument is an offset into it
+			glReadPixels(0, 0, feedbackWidth, feedbackHeight, GL_RED_INTEGER, GL_UNSIGNED_INT, (void*)0);
+			GLStateCache::Get().BindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+			target->fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+			target->frame = feedbackFrame;
+		}
+		else
+			stats.skippedReadbacks++;
+		feedbackFrame++;
+
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		glViewport(0, 0, screenWidth, screenHeight);
+	}
+
+	// takes the newest finished feedback, starts reading the pages it asks for and uploads up to
+	// maxUploads of the pages that were read. Call once per frame on the GL thread
+	void Update(unsigned int maxUploads = 16) {
+		stats.tilesUploaded = 0;
+		stats.uploadedBytes = 0;
+		if (!file)
+			return;
+
+		processReadbacks();
+
+		// only as many reads in flight as there are workers to keep them short, later feedback may not want them anyway
+		size_t inFlight = (size_t)reading.load();
+		size_t maxReads = std::max<size_t>(pool.Size() * 2, 4);
+		if (inFlight < maxReads)
+			for (PageID page : pages->TakeRequests(maxReads - inFlight))
+				startRead(page);
+
+		vector<LoadedTile> tiles;
+		{
+			lock_guard<mutex> lock(loadedMutex);
+			size_t count = std::min<size_t>(loaded.size(), maxUploads);
+			tiles.assign(make_move_iterator(loaded.begin()), make_move_iterator(loaded.begin() + count));
+			loaded.erase(loaded.begin(), loaded.begin() + count);
+		}
+
+		if (!tiles.empty()) {
+			GLStateCache& state = GLStateCache::Get();
+			// tiles come straight from client memory
+			state.BindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+			glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+			int padded = file->layout.PaddedSize();
+			for (LoadedTile& tile : tiles) {
+				if (!tile.ok) {
+					pages->CancelLoad(tile.page);
+					stats.failedTiles++;
+					continue;
+				}
+				int slot = pages->CompleteLoad(tile.page);
+				if (slot < 0)
+					continue;
+				int x = pages->SlotX(slot) * padded, y = pages->SlotY(slot) * padded;
+				if (DDSIsCompressed(file->format))
+					glCompressedTextureSubImage2D(physical, 0, x, y, padded, padded, format, (GLsizei)tile.data.size(), tile.data.data());
+				else
+					glTextureSubImage2D(physical, 0, x, y, padded, padded, GL_RGBA, GL_UNSIGNED_BYTE, tile.data.data());
+				stats.tilesUploaded++;
+				stats.uploadedBytes += tile.data.size();
+			}
+		}
+
+		if (pages->UpdateIndirection()) {
+			glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+			GLStateCache::Get().BindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+			const VirtualTextureLayout& layout = file->layout;
+			for (int level = 0; level < layout.levels; level++)
+				glTextureSubImage2D(indirection, level, 0, 0, layout.PagesX(level), layout.PagesY(level), GL_RGBA,
+					GL_UNSIGNED_BYTE, pages->IndirectionLevel(level).data());
+		}
+	}
+
+	// binds the page cache and the indirection texture and sets up the shader for sampling them
+	void Bind(Shader& shader, GLuint physicalUnit, GLuint indirectionUnit) {
+		GLStateCache& state = GLStateCache::Get();
+		state.BindTexture(physicalUnit, GL_TEXTURE_2D, physical);
+		state.BindTexture(indirectionUnit, GL_TEXTURE_2D, indirection);
+		shader.use();
+		shader.setInt("vtPhysical", (int)physicalUnit);
+		shader.setInt("vtIndirection", (int)indirectionUnit);
+		setUniforms(shader);
+	}
+
+private:
+	// the feedback target is this many times smaller than the screen on each side
+	static const int FEEDBACK_SCALE = 8;
+	// feedback frames that can be read back at the same time
+	static const int READBACK_COUNT = 3;
+
+	struct Readback {
+		GLuint buffer = 0;
+		const PageID* mapped = nullptr;
+		GLsync fence = nullptr;
+		unsigned long long frame = 0;
+	};
+
+	struct LoadedTile {
+		PageID page;
+		bool ok;
+		vector<unsigned char> data;
+	};
+
+	ThreadPool& pool;
+	int screenWidth, screenHeight;
+	int cacheSlots;
+
+	unique_ptr<VirtualTextureFile> file;
+	unique_ptr<VirtualPageManager> pages;
+	GLenum format = GL_RGBA8;
+	GLuint physical = 0;
+	GLuint indirection = 0;
+	int indirectionWidth = 0, indirectionHeight = 0;
+
+	GLuint feedbackFramebuffer = 0;
+	GLuint feedbackRenderbuffers[2] = { 0, 0 }; // page ids and depth
+	int feedbackWidth = 0, feedbackHeight = 0;
+	vector<Readback> readbacks;
+	unsigned long long feedbackFrame = 0;
+
+	// filled by the workers
+	mutex loadedMutex;
+	vector<LoadedTile> loaded;
+	atomic<int> reading{ 0 };
+
+	static int nextPowerOfTwo(int value) {
+		int power = 1;
+		while (power < value)
+			power <<= 1;
+		return power;
+	}
+
+	void createFeedback() {
+		feedbackWidth = std::max(1, (screenWidth + FEEDBACK_SCALE - 1) / FEEDBACK_SCALE);
+		feedbackHeight = std::max(1, (screenHeight + FEEDBACK_SCALE - 1) / FEEDBACK_SCALE);
+
+		glCreateRenderbuffers(2, feedbackRenderbuffers);
+		glNamedRenderbufferStorage(feedbackRenderbuffers[0], GL_R32UI, feedbackWidth, feedbackHeight);
+		glNamedRenderbufferStorage(feedbackRenderbuffers[1], GL_DEPTH_COMPONENT24, feedbackWidth, feedbackHeight);
+		glCreateFramebuffers(1, &feedbackFramebuffer);
+		glNamedFramebufferRenderbuffer(feedbackFramebuffer, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, feedbackRenderbuffers[0]);
+		glNamedFramebufferRenderbuffer(feedbackFramebuffer, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, feedbackRenderbuffers[1]);
+		if (glCheckNamedFramebufferStatus(feedbackFramebuffer, GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+			cout << "Virtual texture feedback framebuffer is incomplete" << endl;
+
+		// stays mapped, the CPU reads a buffer once the fence behind its glReadPixels has passed
+		const GLbitfield flags = GL_MAP_READ_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+		GLsizeiptr size = (GLsizeiptr)feedbackWidth * feedbackHeight * sizeof(PageID);
+		readbacks.resize(READBACK_COUNT);
+		for (Readback& readback : readbacks) {
+			readback.buffer = CreateBuffer(size, nullptr, flags);
+			readback.mapped = (const PageID*)glMapNamedBufferRange(readback.buffer, 0, size, flags);
+		}
+	}
+
+	// hands the newest finished readback to the page manager, older finished ones are skipped
+	void processReadbacks() {
+		Readback* newest = nullptr;
+		for (Readback& readback : readbacks) {
+			if (!readback.fence)
+				continue;
+			GLenum result = glClientWaitSync(readback.fence, 0, 0);
+			if (result != GL_ALREADY_SIGNALED && result != GL_CONDITION_SATISFIED)
+				continue;
+			glDeleteSync(readback.fence);
+			readback.fence = nullptr;
+			if (!newest || readback.frame > newest->frame)
+				newest = &readback;
+		}
+		if (!newest)
+			return;
+		pages->ProcessFeedback(newest->mapped, (size_t)feedbackWidth * feedbackHeight);
+		stats.readbacks++;
+	}
+
+	void startRead(PageID page) {
+		reading++;
+		VirtualTextureFile* source = file.get();
+		pool.Submit([this, source, page]() {
+			LoadedTile tile;
+			tile.page = page;
+			tile.ok = source->ReadTile(PageLevel(page), PageX(page), PageY(page), tile.data);
+			{
+				lock_guard<mutex> lock(loadedMutex);
+				loaded.push_back(std::move(tile));
+			}
+			reading--;
+		});
+	}
+
+	void setUniforms(Shader& shader) const {
+		if (!file)
+			return;
+		const VirtualTextureLayout& layout = file->layout;
+		int cacheSize = cacheSlots * layout.PaddedSize();
+		shader.setVec4("vtSize", (float)layout.width, (float)layout.height, (float)layout.tileSize, (float)layout.border);
+		shader.setVec4("vtCache", (float)cacheSize, (float)layout.PaddedSize(), (float)(layout.levels - 1), 0.0f);
+		shader.setVec2("vtLevelBias", 0.0f, 0.0f);
+	}
+};
+
+#endif
@@ -0,0 +1,204 @@
+#ifndef VIRTUAL_TEXTURE_FILE_H
+#define VIRTUAL_TEXTURE_FILE_H
+
+#include <vector>
+#include <string>
+#include <mutex>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <functional>
+
+#include "dds.h"
+#include "mip_generator.h"
+
+// Tiled file format for virtual textures (.vt), written by the TextureCooker and read by VirtualTexture.
+//
+// Every mip level is cut into square pages of tileSize texels. Each tile is stored with a border of
+// repeated neighbouring texels on every side, so bilinear filtering at the page edge never needs
+// another page and the tiles can be placed anywhere in the physical page cache. Tiles are independent
+// blobs in the file's format (RGBA8 or a BC format), so a single one can be read without the rest.
+//
+//     header | tile index (offset and size of every tile, level 0 first, row by row) | tile data
+//
+// Nothing in here needs a GL context.
+
+// page ids (virtual_texture_pages.h and the feedback shader) keep 12 bits for each page coordinate
+// and 4 for the level, the pages of a larger layout would share ids
+const int VT_MAX_PAGES_PER_SIDE = 1 << 12;
+const int VT_MAX_LEVELS = 1 << 4;
+
+// how the pages of a virtual texture are laid out over its levels
+struct VirtualTextureLayout {
+	int width = 0, height = 0; // of level 0, in texels
+	int tileSize = 128; // texels per page side, without the border
+	int border = 4;
+	int levels = 0; // down to the level that fits in a single page
+
+	VirtualTextureLayout() {}
+
+	VirtualTextureLayout(int width, int height, int tileSize, int border)
+		: width(width), height(height), tileSize(tileSize), border(border) {
+		levels = 1;
+		while (PagesX(levels - 1) > 1 || PagesY(levels - 1) > 1)
+			levels++;
+	}
+
+	int LevelWidth(int level) const { return std::max(1, width >> level); }
+	int LevelHeight(int level) const { return std::max(1, height >> level); }
+	int PagesX(int level) const { return (LevelWidth(level) + tileSize - 1) / tileSize; }
+	int PagesY(int level) const { return (LevelHeight(level) + tileSize - 1) / tileSize; }
+	// side of a stored tile, border included
+	int PaddedSize() const { return tileSize + 2 * border; }
+
+	// position of the tile in the index
+	size_t TileIndex(int level, int x, int y) const {
+		size_t index = 0;
+		for (int i = 0; i < level; i++)
+			index += (size_t)PagesX(i) * PagesY(i);
+		return index + (size_t)y * PagesX(level) + x;
+	}
+
+	size_t TileCount() const {
+		return TileIndex(levels, 0, 0);
+	}
+
+	// whether every page has an id of its own
+	bool Addressable() const {
+		return width > 0 && height > 0 && tileSize > 0 && levels <= VT_MAX_LEVELS
+			&& PagesX(0) <= VT_MAX_PAGES_PER_SIDE && PagesY(0) <= VT_MAX_PAGES_PER_SIDE;
+	}
+};
+
+namespace vt_detail {
+
+	const uint32_t MAGIC = 0x58455456; // "VTEX"
+	const uint32_t VERSION = 1;
+
+	struct Header {
+		uint32_t magic, version;
+		uint32_t width, height, tileSize, border, levels;
+		uint32_t format, srgb;
+	};
+
+	struct TileEntry {
+		uint64_t offset;
+		uint32_t size;
+		uint32_t padding;
+	};
+
+	// the padded tile around page (x, y) of the level, edge texels repeat outside the image
+	inline void CutTile(const MipLevel& level, const VirtualTextureLayout& layout, int x, int y, unsigned char* out) {
+		int padded = layout.PaddedSize();
+		int x0 = x * layout.tileSize - layout.border, y0 = y * layout.tileSize - layout.border;
+		for (int ty = 0; ty < padded; ty++) {
+			int sy = std::min(std::max(y0 + ty, 0), level.height - 1);
+			for (int tx = 0; tx < padded; tx++) {
+				int sx = std::min(std::max(x0 + tx, 0), level.width - 1);
+				memcpy(out + ((size_t)ty * padded + tx) * 4, &level.pixels[((size_t)sy * level.width + sx) * 4], 4);
+			}
+		}
+	}
+}
+
+// turns an RGBA8 tile into the bytes stored for it, nullptr stores the RGBA8 as it is
+typedef std::function<std::vector<unsigned char>(const unsigned char* rgba, int width, int height)> TileEncoder;
+
+// cuts every level of an RGBA8 mip chain into tiles and writes them. Levels the chain doesn't have
+// (when the image is smaller than a tile in some direction) are taken from its last level
+inline bool WriteVirtualTexture(const std::string& path, const std::vector<MipLevel>& mips, int tileSize, int border,
+	DDSFormat format, bool srgb, const TileEncoder& encode = nullptr) {
+	using namespace vt_detail;
+	VirtualTextureLayout layout(mips[0].width, mips[0].height, tileSize, border);
+	if (!layout.Addressable())
+		return false;
+
+	Header header;
+	header.magic = MAGIC;
+	header.version = VERSION;
+	header.width = (uint32_t)layout.width;
+	header.height = (uint32_t)layout.height;
+	header.tileSize = (uint32_t)tileSize;
+	header.border = (uint32_t)border;
+	header.levels = (uint32_t)layout.levels;
+	header.format = (uint32_t)format;
+	header.srgb = srgb ? 1 : 0;
+
+	FILE* file = dds_detail::OpenFile(path, "wb");
+	if (!file)
+		return false;
+	std::vector<TileEntry> index(layout.TileCount());
+	bool ok = fwrite(&header, sizeof(header), 1, file) == 1
+		&& fwrite(index.data(), sizeof(TileEntry), index.size(), file) == index.size();
+
+	uint64_t offset = sizeof(header) + index.size() * sizeof(TileEntry);
+	int padded = layout.PaddedSize();
+	std::vector<unsigned char> tile((size_t)padded * padded * 4);
+	for (int level = 0; ok && level < layout.levels; level++) {
+		const MipLevel& source = mips[std::min(level, (int)mips.size() - 1)];
+		for (int y = 0; ok && y < layout.PagesY(level); y++) {
+			for (int x = 0; ok && x < layout.PagesX(level); x++) {
+				CutTile(source, layout, x, y, tile.data());
+				std::vector<unsigned char> encoded = encode ? encode(tile.data(), padded, padded) : tile;
+				TileEntry& entry = index[layout.TileIndex(level, x, y)];
+				entry.offset = offset;
+				entry.size = (uint32_t)encoded.size();
+				entry.padding = 0;
+				ok = fwrite(encoded.data(), 1, encoded.size(), file) == encoded.size();
+				offset += encoded.size();
+			}
+		}
+	}
+
+	// the index only is complete now
+	ok = ok && dds_detail::SeekFile(file, sizeof(header))
+		&& fwrite(index.data(), sizeof(TileEntry), index.size(), file) == index.size();
+	fclose(file);
+	return ok;
+}
+
+// reads single tiles out of a .vt file, ReadTile() can be called from several threads
+class VirtualTextureFile {
+public:
+	VirtualTextureLayout layout;
+	DDSFormat format = DDS_UNKNOWN;
+	bool srgb = false;
+
+	~VirtualTextureFile() {
+		if (file)
+			fclose(file);
+	}
+
+	bool Open(const std::string& path) {
+		using namespace vt_detail;
+		file = dds_detail::OpenFile(path, "rb");
+		if (!file)
+			return false;
+		Header header;
+		if (fread(&header, sizeof(header), 1, file) != 1 || header.magic != MAGIC || header.version != VERSION
+			|| header.tileSize == 0 || header.width == 0 || header.height == 0)
+			return false;
+		layout = VirtualTextureLayout((int)header.width, (int)header.height, (int)header.tileSize, (int)header.border);
+		if (layout.levels != (int)header.levels || !layout.Addressable())
+			return false;
+		format = (DDSFormat)header.format;
+		srgb = header.srgb != 0;
+		index.resize(layout.TileCount());
+		return fread(index.data(), sizeof(TileEntry), index.size(), file) == index.size();
+	}
+
+	bool ReadTile(int level, int x, int y, std::vector<unsigned char>& data) {
+		const vt_detail::TileEntry& entry = index[layout.TileIndex(level, x, y)];
+		data.resize(entry.size);
+		std::lock_guard<std::mutex> lock(mutex);
+		return dds_detail::SeekFile(file, entry.offset) && fread(data.data(), 1, data.size(), file) == data.size();
+	}
+
+private:
+	FILE* file = nullptr;
+	std::vector<vt_detail::TileEntry> index;
+	std::mutex mutex;
+};
+
+#endif
@@ -0,0 +1,235 @@
+#ifndef VIRTUAL_TEXTURE_PAGES_H
+#define VIRTUAL_TEXTURE_PAGES_H
+
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+#include <cstdint>
+#include <algorithm>
+
+#include "virtual_texture_file.h"
+
+using namespace std;
+
+// CPU side of the virtual texturing: decides which pages live in the physical page cache.
+//
+// The feedback pass writes the page every pixel wants, a frame's worth of those ids comes in through
+// ProcessFeedback(). Pages that aren't resident get requested, coarse levels first since they're the
+// fallback for everything below them, then the ones most pixels asked for. A loaded page takes a free
+// slot of the cache or the least recently used one. Pages used this frame and the single page of the
+// last level (the fallback of last resort) are never evicted.
+//
+// The indirection table holds, for every page of every level, the slot of the finest resident page
+// covering it, so the shader always finds something to sample. Nothing in here needs a GL context.
+
+typedef uint32_t PageID;
+
+// also what the feedback pass clears to, pixels that don't show a virtual texture
+const PageID INVALID_PAGE = 0xffffffffu;
+
+// slots per side of the page cache, the indirection entries keep 8 bits for each slot coordinate
+const int VT_MAX_CACHE_SLOTS = 256;
+
+// matches the packing in the feedback shader: x in bits 0-11, y in 12-23, level in 24-27. Layouts
+// that don't fit are rejected by VirtualTextureLayout::Addressable()
+inline PageID MakePageID(int level, int x, int y) {
+	return (uint32_t)x | ((uint32_t)y << 12) | ((uint32_t)level << 24);
+}
+
+inline int PageLevel(PageID page) { return (int)((page >> 24) & 0xf); }
+inline int PageX(PageID page) { return (int)(page & 0xfff); }
+inline int PageY(PageID page) { return (int)((page >> 12) & 0xfff); }
+
+inline PageID ParentPage(PageID page) {
+	return MakePageID(PageLevel(page) + 1, PageX(page) / 2, PageY(page) / 2);
+}
+
+struct VirtualPageStats {
+	unsigned int requested = 0; // different pages in the last feedback
+	unsigned int missing = 0; // of those, not resident yet
+	unsigned int resident = 0;
+	unsigned int loading = 0;
+	unsigned int evicted = 0; // since the start
+	unsigned int dropped = 0; // loads that found no slot to go to, since the start
+};
+
+class VirtualPageManager {
+public:
+	VirtualPageStats stats;
+
+	VirtualPageManager(const VirtualTextureLayout& layout, int slotsX, int slotsY)
+		: layout(layout), slotsX(slotsX), slotsY(slotsY), slots(slotsX * slotsY) {
+		indirection.resize(layout.levels);
+		for (int level = 0; level < layout.levels; level++)
+			indirection[level].assign((size_t)layout.PagesX(level) * layout.PagesY(level), 0);
+	}
+
+	// takes the page ids of one feedback readback, INVALID_PAGE entries are skipped
+	void ProcessFeedback(const PageID* pages, size_t count) {
+		frame++;
+		requestCounts.clear();
+		for (size_t i = 0; i < count; i++) {
+			PageID page = pages[i];
+			if (page == INVALID_PAGE || !isValid(page))
+				continue;
+			requestCounts[page]++;
+		}
+		stats.requested = (unsigned int)requestCounts.size();
+		stats.missing = 0;
+
+		// every requested page needs its ancestors too, they're the fallback while it isn't resident
+		wanted.clear();
+		for (const auto& request : requestCounts) {
+			PageID page = request.first;
+			while (true) {
+				auto resident = residentPages.find(page);
+				if (resident != residentPages.end())
+					slots[resident->second].lastUsed = frame;
+				else {
+					unsigned int& count = wanted[page];
+					count += request.second;
+					if (page == request.first)
+						stats.missing++;
+				}
+				if (PageLevel(page) + 1 >= layout.levels)
+					break;
+				page = ParentPage(page);
+			}
+		}
+		// the last level is always wanted, it's the fallback for the whole texture
+		PageID root = MakePageID(layout.levels - 1, 0, 0);
+		if (!residentPages.count(root))
+			wanted[root]++;
+	}
+
+	// up to maxCount pages to start loading now, most important first. They count as loading
+	// until CompleteLoad() or CancelLoad() is called for them
+	vector<PageID> TakeRequests(size_t maxCount) {
+		candidates.clear();
+		for (const auto& page : wanted)
+			if (!loading.count(page.first) && !residentPages.count(page.first))
+				candidates.push_back(page);
+		sort(candidates.begin(), candidates.end(), [](const pair<PageID, unsigned int>& a, const pair<PageID, unsigned int>& b) {
+			if (PageLevel(a.first) != PageLevel(b.first))
+				return PageLevel(a.first) > PageLevel(b.first);
+			return a.second > b.second;
+		});
+
+		vector<PageID> requests;
+		for (size_t i = 0; i < candidates.size() && requests.size() < maxCount; i++) {
+			requests.push_back(candidates[i].first);
+			loading.insert(candidates[i].first);
+		}
+		stats.loading = (unsigned int)loading.size();
+		return requests;
+	}
+
+	// the page's tile is loaded: returns the slot to copy it into, or -1 when every slot holds a page
+	// still in use (the page is dropped and gets requested again if it's still needed)
+	int CompleteLoad(PageID page) {
+		loading.erase(page);
+		stats.loading = (unsigned int)loading.size();
+		int slot = findSlot();
+		if (slot < 0) {
+			stats.dropped++;
+			return -1;
+		}
+		Slot& target = slots[slot];
+		if (target.page != INVALID_PAGE) {
+			residentPages.erase(target.page);
+			stats.evicted++;
+		}
+		target.page = page;
+		target.lastUsed = frame;
+		residentPages[page] = slot;
+		stats.resident = (unsigned int)residentPages.size();
+		indirectionDirty = true;
+		return slot;
+	}
+
+	// the tile couldn't be read
+	void CancelLoad(PageID page) {
+		loading.erase(page);
+		stats.loading = (unsigned int)loading.size();
+	}
+
+	bool IsResident(PageID page) const {
+		return residentPages.count(page) != 0;
+	}
+
+	int SlotX(int slot) const { return slot % slotsX; }
+	int SlotY(int slot) const { return slot / slotsX; }
+
+	// rebuilds the indirection table if pages came or went, returns whether it changed. Every entry
+	// is packed like an RGBA8 texel: slot x, slot y, level of the page found, 255 where one was found
+	bool UpdateIndirection() {
+		if (!indirectionDirty)
+			return false;
+		indirectionDirty = false;
+		// coarsest level first, so every page can start from what its parent found
+		for (int level = layout.levels - 1; level >= 0; level--) {
+			vector<uint32_t>& table = indirection[level];
+			int pagesX = layout.PagesX(level), pagesY = layout.PagesY(level);
+			for (int y = 0; y < pagesY; y++) {
+				for (int x = 0; x < pagesX; x++) {
+					uint32_t entry = 0;
+					auto resident = residentPages.find(MakePageID(level, x, y));
+					if (resident != residentPages.end())
+						entry = packEntry(resident->second, level);
+					else if (level + 1 < layout.levels)
+						entry = indirection[level + 1][(size_t)(y / 2) * layout.PagesX(level + 1) + x / 2];
+					table[(size_t)y * pagesX + x] = entry;
+				}
+			}
+		}
+		return true;
+	}
+
+	const vector<uint32_t>& IndirectionLevel(int level) const {
+		return indirection[level];
+	}
+
+private:
+	struct Slot {
+		PageID page = INVALID_PAGE;
+		unsigned long long lastUsed = 0;
+	};
+
+	VirtualTextureLayout layout;
+	int slotsX, slotsY;
+	vector<Slot> slots;
+	unordered_map<PageID, int> residentPages; // page to slot
+	unordered_set<PageID> loading;
+	unordered_map<PageID, unsigned int> requestCounts; // pixels asking for each page in the last feedback
+	unordered_map<PageID, unsigned int> wanted; // missing pages and how many pixels need them
+	vector<pair<PageID, unsigned int>> candidates;
+	vector<vector<uint32_t>> indirection; // per level, row by row
+	bool indirectionDirty = true;
+	unsigned long long frame = 0;
+
+	bool isValid(PageID page) const {
+		int level = PageLevel(page);
+		return level < layout.levels && PageX(page) < layout.PagesX(level) && PageY(page) < layout.PagesY(level);
+	}
+
+	uint32_t packEntry(int slot, int level) const {
+		return (uint32_t)SlotX(slot) | ((uint32_t)SlotY(slot) << 8) | ((uint32_t)level << 16) | (0xffu << 24);
+	}
+
+	// a free slot, or the least recently used one that wasn't used this frame and isn't the root page
+	int findSlot() const {
+		int best = -1;
+		for (int i = 0; i < (int)slots.size(); i++) {
+			const Slot& slot = slots[i];
+			if (slot.page == INVALID_PAGE)
+				return i;
+			if (slot.lastUsed == frame || PageLevel(slot.page) == layout.levels - 1)
+				continue;
+			if (best < 0 || slot.lastUsed < slots[best].lastUsed)
+				best = i;
+		}
+		return best;
+	}
+};
+
+#endif
@@ -0,0 +1,200 @@
+#ifndef BC_DECODER_H
+#define BC_DECODER_H
+
+#include <vector>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+
+#include "dds.h"
+#include "bc_encoder.h"
+
+// Decodes what bc_encoder.h writes back to RGBA8, so the cooker can measure the quality it gets
+// without a GPU. BC4 decodes to (r, 0, 0, 255) and BC5 to (r, g, 0, 255) like the samplers do.
+// The BC7 decoder only knows modes 5 (without rotation) and 6, the ones the encoder uses.
+
+namespace bc_detail {
+
+	inline void DecodeBC1Block(const uint8_t* in, uint8_t pixels[16][4], bool alwaysFourColors) {
+		uint16_t c0 = (uint16_t)(in[0] | (in[1] << 8));
+		uint16_t c1 = (uint16_t)(in[2] | (in[3] << 8));
+		uint32_t bits;
+		memcpy(&bits, in + 4, 4);
+
+		int palette[4][4];
+		int a[3], b[3];
+		Unpack565(c0, a);
+		Unpack565(c1, b);
+		for (int k = 0; k < 3; k++) {
+			palette[0][k] = a[k];
+			palette[1][k] = b[k];
+			if (c0 > c1 || alwaysFourColors) {
+				palette[2][k] = (2 * a[k] + b[k] + 1) / 3;
+				palette[3][k] = (a[k] + 2 * b[k] + 1) / 3;
+			}
+			else {
+				palette[2][k] = (a[k] + b[k]) / 2;
+				palette[3][k] = 0;
+			}
+		}
+		for (int p = 0; p < 4; p++)
+			palette[p][3] = 255;
+		if (c0 <= c1 && !alwaysFourColors)
+			palette[3][3] = 0;
+
+		for (int i = 0; i < 16; i++)
+			for (int k = 0; k < 4; k++)
+				pixels[i][k] = (uint8_t)palette[(bits >> (2 * i)) & 3][k];
+	}
+
+	inline void DecodeBC4Block(const uint8_t* in, uint8_t values[16]) {
+		float palette[8][4];
+		BC4Palette(in[0], in[1], palette);
+		uint64_t bits = 0;
+		for (int i = 0; i < 6; i++)
+			bits |= (uint64_t)in[2 + i] << (8 * i);
+		for (int i = 0; i < 16; i++)
+			values[i] = (uint8_t)palette[(bits >> (3 * i)) & 7][0];
+	}
+
+	inline uint32_t GetBits(const uint8_t* in, int& pos, int count) {
+		uint32_t value = 0;
+		for (int i = 0; i < count; i++, pos++)
+			value |= (uint32_t)((in[pos >> 3] >> (pos & 7)) & 1) << i;
+		return value;
+	}
+
+	inline void DecodeBC7Mode5(const uint8_t* in, uint8_t pixels[16][4]) {
+		int pos = 8; // mode and rotation
+		BC7Mode5Endpoints e;
+		for (int k = 0; k < 3; k++) {
+			e.color[0][k] = (int)GetBits(in, pos, 7);
+			e.color[1][k] = (int)GetBits(in, pos, 7);
+		}
+		e.alpha[0] = (int)GetBits(in, pos, 8);
+		e.alpha[1] = (int)GetBits(in, pos, 8);
+
+		float color[4][4], alpha[4][4];
+		BC7Mode5ColorPalette(e, color);
+		BC7Mode5AlphaPalette(e.alpha[0], e.alpha[1], alpha);
+		for (int i = 0; i < 16; i++) {
+			int index = (int)GetBits(in, pos, i == 0 ? 1 : 2);
+			for (int k = 0; k < 3; k++)
+				pixels[i][k] = (uint8_t)color[index][k];
+		}
+		for (int i = 0; i < 16; i++)
+			pixels[i][3] = (uint8_t)alpha[GetBits(in, pos, i == 0 ? 1 : 2)][0];
+	}
+
+	inline void DecodeBC7Block(const uint8_t* in, uint8_t pixels[16][4]) {
+		if ((in[0] & 0xff) == 0x20) {
+			DecodeBC7Mode5(in, pixels);
+			return;
+		}
+		if ((in[0] & 0x7f) != 0x40) {
+			// a mode the encoder never writes, show it in magenta rather than guessing
+			for (int i = 0; i < 16; i++) {
+				pixels[i][0] = 255;
+				pixels[i][1] = 0;
+				pixels[i][2] = 255;
+				pixels[i][3] = 255;
+			}
+			return;
+		}
+		int pos = 7;
+		BC7Endpoints e;
+		for (int k = 0; k < 4; k++) {
+			e.q[0][k] = (int)GetBits(in, pos, 7);
+			e.q[1][k] = (int)GetBits(in, pos, 7);
+		}
+		e.p[0] = (int)GetBits(in, pos, 1);
+		e.p[1] = (int)GetBits(in, pos, 1);
+
+		float palette[16][4];
+		BC7Palette(e, palette);
+		for (int i = 0; i < 16; i++) {
+			int index = (int)GetBits(in, pos, i == 0 ? 3 : 4);
+			for (int k = 0; k < 4; k++)
+				pixels[i][k] = (uint8_t)palette[index][k];
+		}
+	}
+
+	inline void DecodeBlock(DDSFormat format, const uint8_t* in, uint8_t pixels[16][4]) {
+		uint8_t values[16];
+		switch (format) {
+		case DDS_BC1:
+			DecodeBC1Block(in, pixels, false);
+			break;
+		case DDS_BC3:
+			DecodeBC1Block(in + 8, pixels, true);
+			DecodeBC4Block(in, values);
+			for (int i = 0; i < 16; i++)
+				pixels[i][3] = values[i];
+			break;
+		case DDS_BC4:
+			DecodeBC4Block(in, values);
+			for (int i = 0; i < 16; i++) {
+				pixels[i][0] = values[i];
+				pixels[i][1] = pixels[i][2] = 0;
+				pixels[i][3] = 255;
+			}
+			break;
+		case DDS_BC5:
+			DecodeBC4Block(in, values);
+			for (int i = 0; i < 16; i++) {
+				pixels[i][0] = values[i];
+				pixels[i][2] = 0;
+				pixels[i][3] = 255;
+			}
+			DecodeBC4Block(in + 8, values);
+			for (int i = 0; i < 16; i++)
+				pixels[i][1] = values[i];
+			break;
+		case DDS_BC7:
+			DecodeBC7Block(in, pixels);
+			break;
+		default:
+			memset(pixels, 0, 64);
+			break;
+		}
+	}
+}
+
+inline std::vector<unsigned char> DecodeBC(DDSFormat format, const unsigned char* data, int width, int height) {
+	int blocksX = (width + 3) / 4, blocksY = (height + 3) / 4;
+	int blockBytes = DDSBlockBytes(format);
+	std::vector<unsigned char> rgba((size_t)width * height * 4);
+	uint8_t pixels[16][4];
+	for (int by = 0; by < blocksY; by++) {
+		for (int bx = 0; bx < blocksX; bx++) {
+			bc_detail::DecodeBlock(format, data + ((size_t)by * blocksX + bx) * blockBytes, pixels);
+			for (int y = 0; y < 4 && by * 4 + y < height; y++)
+				for (int x = 0; x < 4 && bx * 4 + x < width; x++)
+					memcpy(&rgba[((size_t)(by * 4 + y) * width + bx * 4 + x) * 4], pixels[y * 4 + x], 4);
+		}
+	}
+	return rgba;
+}
+
+// peak signal to noise ratio in dB over the channels set in channelMask (bit 0 = red),
+// 99 for identical images
+inline double ComputePSNR(const unsigned char* a, const unsigned char* b, size_t pixelCount, int channelMask) {
+	double sum = 0.0;
+	size_t samples = 0;
+	for (size_t i = 0; i < pixelCount; i++) {
+		for (int k = 0; k < 4; k++) {
+			if (!(channelMask & (1 << k)))
+				continue;
+			double d = (double)a[i * 4 + k] - (double)b[i * 4 + k];
+			sum += d * d;
+			samples++;
+		}
+	}
+	if (samples == 0 || sum == 0.0)
+		return 99.0;
+	double mse = sum / samples;
+	return 10.0 * log10(255.0 * 255.0 / mse);
+}
+
+#endif
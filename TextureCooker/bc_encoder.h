@@ -0,0 +1,673 @@
+#ifndef BC_ENCODER_H
+#define BC_ENCODER_H
+
+#include <vector>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+#include <emmintrin.h>
+#define BC_ENCODER_SSE
+#endif
+
+#include "dds.h"
+#include "thread_pool.h"
+
+// Block compression encoders for BC1, BC3, BC4, BC5 and BC7.
+//
+// Every format works on 4x4 blocks. The endpoints are placed along the principal axis of the block's
+// colours, the palette between them is built exactly as the GPU decodes it, every pixel picks its
+// closest palette entry and the endpoints are then refit with least squares to the indices that were
+// picked. Picking the closest entry is where nearly all of the time goes, so it runs on four pixels
+// at a time with SSE. Whole images are split into rows of blocks and encoded on a ThreadPool.
+//
+// BC7 only uses modes 6 and 5, both with a single subset. Mode 6 (RGBA endpoints with 7 bits plus a
+// p-bit, 4 bit indices) covers most blocks; mode 5 gives alpha its own endpoints and indices and is
+// tried on blocks whose alpha isn't constant. Without the partitioned modes it won't beat a full
+// mode search on blocks with two distinct colours, but it's fast enough to cook everything on
+// every build.
+
+namespace bc_detail {
+
+	// one block as floats, channel first so SSE can load four pixels of one channel at once
+	struct Block {
+		alignas(16) float c[4][16];
+	};
+
+	// pixels past the right or bottom edge repeat the last column or row
+	inline void LoadBlock(const unsigned char* rgba, int width, int height, int bx, int by, Block& block) {
+		for (int y = 0; y < 4; y++) {
+			int sy = std::min(by * 4 + y, height - 1);
+			for (int x = 0; x < 4; x++) {
+				int sx = std::min(bx * 4 + x, width - 1);
+				const unsigned char* p = rgba + ((size_t)sy * width + sx) * 4;
+				for (int k = 0; k < 4; k++)
+					block.c[k][y * 4 + x] = p[k];
+			}
+		}
+	}
+
+	// picks the closest of paletteSize entries for every pixel, looking at the first channels channels.
+	// Returns the summed squared error
+	inline float FitPalette(const Block& block, int channels, const float (*palette)[4], int paletteSize,
+		uint8_t* indices) {
+		float total = 0.0f;
+#ifdef BC_ENCODER_SSE
+		for (int i = 0; i < 16; i += 4) {
+			__m128 best = _mm_set1_ps(3.0e38f);
+			__m128i bestIndex = _mm_setzero_si128();
+			for (int p = 0; p < paletteSize; p++) {
+				__m128 d = _mm_sub_ps(_mm_load_ps(&block.c[0][i]), _mm_set1_ps(palette[p][0]));
+				__m128 error = _mm_mul_ps(d, d);
+				for (int k = 1; k < channels; k++) {
+					d = _mm_sub_ps(_mm_load_ps(&block.c[k][i]), _mm_set1_ps(palette[p][k]));
+					error = _mm_add_ps(error, _mm_mul_ps(d, d));
+				}
+				__m128i closer = _mm_castps_si128(_mm_cmplt_ps(error, best));
+				bestIndex = _mm_or_si128(_mm_and_si128(closer, _mm_set1_epi32(p)), _mm_andnot_si128(closer, bestIndex));
+				best = _mm_min_ps(error, best);
+			}
+			alignas(16) float errors[4];
+			alignas(16) int32_t picked[4];
+			_mm_store_ps(errors, best);
+			_mm_store_si128((__m128i*)picked, bestIndex);
+			for (int j = 0; j < 4; j++) {
+				indices[i + j] = (uint8_t)picked[j];
+				total += errors[j];
+			}
+		}
+#else
+		for (int i = 0; i < 16; i++) {
+			float best = 3.0e38f;
+			for (int p = 0; p < paletteSize; p++) {
+				float error = 0.0f;
+				for (int k = 0; k < channels; k++) {
+					float d = block.c[k][i] - palette[p][k];
+					error += d * d;
+				}
+				if (error < best) {
+					best = error;
+					indices[i] = (uint8_t)p;
+				}
+			}
+			total += best;
+		}
+#endif
+		return total;
+	}
+
+	// mean and principal axis of the first channels channels, the axis comes from a few power iterations
+	// on the covariance matrix
+	inline void PrincipalAxis(const Block& block, int channels, float mean[4], float axis[4]) {
+		for (int k = 0; k < 4; k++) {
+			mean[k] = 0.0f;
+			axis[k] = 0.0f;
+		}
+		for (int k = 0; k < channels; k++) {
+			for (int i = 0; i < 16; i++)
+				mean[k] += block.c[k][i];
+			mean[k] /= 16.0f;
+		}
+
+		float covariance[4][4] = {};
+		for (int i = 0; i < 16; i++) {
+			for (int a = 0; a < channels; a++) {
+				float da = block.c[a][i] - mean[a];
+				for (int b = a; b < channels; b++)
+					covariance[a][b] += da * (block.c[b][i] - mean[b]);
+			}
+		}
+		for (int a = 0; a < channels; a++)
+			for (int b = 0; b < a; b++)
+				covariance[a][b] = covariance[b][a];
+
+		// start from the channel with the most variance, (1,1,1,1) can be perpendicular to the answer
+		int widest = 0;
+		for (int k = 1; k < channels; k++)
+			if (covariance[k][k] > covariance[widest][widest])
+				widest = k;
+		for (int k = 0; k < channels; k++)
+			axis[k] = covariance[widest][k];
+
+		for (int iteration = 0; iteration < 8; iteration++) {
+			float next[4] = {};
+			float length = 0.0f;
+			for (int a = 0; a < channels; a++) {
+				for (int b = 0; b < channels; b++)
+					next[a] += covariance[a][b] * axis[b];
+				length = std::max(length, fabsf(next[a]));
+			}
+			if (length < 1e-8f)
+				break;
+			for (int k = 0; k < channels; k++)
+				axis[k] = next[k] / length;
+		}
+
+		float length = 0.0f;
+		for (int k = 0; k < channels; k++)
+			length += axis[k] * axis[k];
+		length = sqrtf(length);
+		if (length < 1e-8f) {
+			// flat block, any axis will do
+			for (int k = 0; k < channels; k++)
+				axis[k] = 0.0f;
+			axis[0] = 1.0f;
+			return;
+		}
+		for (int k = 0; k < channels; k++)
+			axis[k] /= length;
+	}
+
+	// the two ends of the block's colours along the principal axis
+	inline void AxisEndpoints(const Block& block, int channels, float low[4], float high[4]) {
+		float mean[4], axis[4];
+		PrincipalAxis(block, channels, mean, axis);
+		float minT = 3.0e38f, maxT = -3.0e38f;
+		for (int i = 0; i < 16; i++) {
+			float t = 0.0f;
+			for (int k = 0; k < channels; k++)
+				t += (block.c[k][i] - mean[k]) * axis[k];
+			minT = std::min(minT, t);
+			maxT = std::max(maxT, t);
+		}
+		for (int k = 0; k < 4; k++) {
+			low[k] = std::min(255.0f, std::max(0.0f, mean[k] + axis[k] * minT));
+			high[k] = std::min(255.0f, std::max(0.0f, mean[k] + axis[k] * maxT));
+		}
+	}
+
+	// least squares endpoints for fixed indices, where weights[index] is how much of high a palette entry
+	// holds. Returns false when every pixel uses the same weight and the system has no unique answer
+	inline bool RefitEndpoints(const Block& block, int channels, const uint8_t* indices, const float* weights,
+		float low[4], float high[4]) {
+		float aa = 0.0f, ab = 0.0f, bb = 0.0f;
+		float ax[4] = {}, bx[4] = {};
+		for (int i = 0; i < 16; i++) {
+			float b = weights[indices[i]];
+			float a = 1.0f - b;
+			aa += a * a;
+			ab += a * b;
+			bb += b * b;
+			for (int k = 0; k < channels; k++) {
+				ax[k] += a * block.c[k][i];
+				bx[k] += b * block.c[k][i];
+			}
+		}
+		float det = aa * bb - ab * ab;
+		if (fabsf(det) < 1e-6f)
+			return false;
+		float inverse = 1.0f / det;
+		for (int k = 0; k < channels; k++) {
+			low[k] = std::min(255.0f, std::max(0.0f, (bb * ax[k] - ab * bx[k]) * inverse));
+			high[k] = std::min(255.0f, std::max(0.0f, (aa * bx[k] - ab * ax[k]) * inverse));
+		}
+		return true;
+	}
+
+	// ---- BC1 ----
+
+	inline uint16_t Pack565(const float c[4]) {
+		int r = (int)(c[0] * 31.0f / 255.0f + 0.5f);
+		int g = (int)(c[1] * 63.0f / 255.0f + 0.5f);
+		int b = (int)(c[2] * 31.0f / 255.0f + 0.5f);
+		return (uint16_t)((r << 11) | (g << 5) | b);
+	}
+
+	inline void Unpack565(uint16_t c, int rgb[3]) {
+		int r = (c >> 11) & 31, g = (c >> 5) & 63, b = c & 31;
+		rgb[0] = (r << 3) | (r >> 2);
+		rgb[1] = (g << 2) | (g >> 4);
+		rgb[2] = (b << 3) | (b >> 2);
+	}
+
+	// the four colour mode palette, in index order: c0, c1, 2/3 c0 + 1/3 c1, 1/3 c0 + 2/3 c1
+	inline void BC1Palette(uint16_t c0, uint16_t c1, float palette[4][4]) {
+		int a[3], b[3];
+		Unpack565(c0, a);
+		Unpack565(c1, b);
+		for (int k = 0; k < 3; k++) {
+			palette[0][k] = (float)a[k];
+			palette[1][k] = (float)b[k];
+			palette[2][k] = (float)((2 * a[k] + b[k] + 1) / 3);
+			palette[3][k] = (float)((a[k] + 2 * b[k] + 1) / 3);
+		}
+		for (int p = 0; p < 4; p++)
+			palette[p][3] = 255.0f;
+	}
+
+	// how much of c1 each index holds, for the least squares refit
+	const float BC1_WEIGHTS[4] = { 0.0f, 1.0f, 1.0f / 3.0f, 2.0f / 3.0f };
+
+	inline float BC1Candidate(const Block& block, uint16_t c0, uint16_t c1, uint8_t* indices) {
+		float palette[4][4];
+		BC1Palette(c0, c1, palette);
+		return FitPalette(block, 3, palette, 4, indices);
+	}
+
+	// 8 bytes: two RGB565 endpoints and 2 bit indices. c0 > c1 selects the four colour mode, which is
+	// the only one used here. BC3 always decodes its colour block that way, whatever the order
+	inline void EncodeBC1Block(const Block& block, uint8_t* out) {
+		float low[4], high[4];
+		AxisEndpoints(block, 3, low, high);
+
+		uint16_t c0 = Pack565(high), c1 = Pack565(low);
+		uint8_t indices[16];
+		float error = BC1Candidate(block, c0, c1, indices);
+
+		for (int iteration = 0; iteration < 2 && error > 0.0f; iteration++) {
+			// RefitEndpoints solves for the colours at weight 0 and weight 1, which are c0 and c1
+			float refitC0[4], refitC1[4];
+			if (!RefitEndpoints(block, 3, indices, BC1_WEIGHTS, refitC0, refitC1))
+				break;
+			uint16_t n0 = Pack565(refitC0), n1 = Pack565(refitC1);
+			if (n0 == c0 && n1 == c1)
+				break;
+			uint8_t candidate[16];
+			float candidateError = BC1Candidate(block, n0, n1, candidate);
+			if (candidateError >= error)
+				break;
+			c0 = n0;
+			c1 = n1;
+			error = candidateError;
+			memcpy(indices, candidate, 16);
+		}
+
+		if (c0 < c1) {
+			// same palette with the endpoints swapped: 0 <-> 1 and 2 <-> 3
+			std::swap(c0, c1);
+			for (int i = 0; i < 16; i++)
+				indices[i] ^= 1;
+		}
+		else if (c0 == c1) {
+			// only the three colour mode exists for equal endpoints, index 0 is still c0 there
+			memset(indices, 0, 16);
+		}
+
+		uint32_t bits = 0;
+		for (int i = 0; i < 16; i++)
+			bits |= (uint32_t)indices[i] << (2 * i);
+		out[0] = (uint8_t)c0;
+		out[1] = (uint8_t)(c0 >> 8);
+		out[2] = (uint8_t)c1;
+		out[3] = (uint8_t)(c1 >> 8);
+		memcpy(out + 4, &bits, 4);
+	}
+
+	// ---- BC4, also the alpha of BC3 and both channels of BC5 ----
+
+	// r0 > r1 gives 8 values spread between them, r0 <= r1 gives 6 values plus exact 0 and 255
+	inline void BC4Palette(int r0, int r1, float palette[8][4]) {
+		palette[0][0] = (float)r0;
+		palette[1][0] = (float)r1;
+		if (r0 > r1) {
+			for (int k = 1; k < 7; k++)
+				palette[k + 1][0] = (float)(((7 - k) * r0 + k * r1 + 3) / 7);
+		}
+		else {
+			for (int k = 1; k < 5; k++)
+				palette[k + 1][0] = (float)(((5 - k) * r0 + k * r1 + 2) / 5);
+			palette[6][0] = 0.0f;
+			palette[7][0] = 255.0f;
+		}
+	}
+
+	inline float BC4Candidate(const Block& block, int r0, int r1, uint8_t* indices) {
+		float palette[8][4];
+		BC4Palette(r0, r1, palette);
+		return FitPalette(block, 1, palette, 8, indices);
+	}
+
+	// 8 bytes: two 8 bit endpoints and 3 bit indices, for channel 0 of block. With only 256 values per
+	// endpoint a small search around the extremes is cheap and beats a refit
+	inline void EncodeBC4Block(const Block& block, uint8_t* out) {
+		float minValue = 255.0f, maxValue = 0.0f;
+		float innerMin = 255.0f, innerMax = 0.0f; // ignoring exact 0 and 255
+		for (int i = 0; i < 16; i++) {
+			float v = block.c[0][i];
+			minValue = std::min(minValue, v);
+			maxValue = std::max(maxValue, v);
+			if (v > 0.0f && v < 255.0f) {
+				innerMin = std::min(innerMin, v);
+				innerMax = std::max(innerMax, v);
+			}
+		}
+
+		int bestR0 = (int)maxValue, bestR1 = (int)maxValue;
+		uint8_t indices[16] = {};
+		float bestError = 0.0f;
+
+		if (minValue != maxValue) {
+			bestError = 3.0e38f;
+			uint8_t candidate[16];
+			int high = (int)(maxValue + 0.5f), low = (int)(minValue + 0.5f);
+			// the 8 value mode with the range pulled in a little from either side
+			for (int dh = 0; dh < 4; dh++) {
+				for (int dl = 0; dl < 4; dl++) {
+					int r0 = high - dh, r1 = low + dl;
+					if (r0 <= r1)
+						continue;
+					float error = BC4Candidate(block, r0, r1, candidate);
+					if (error < bestError) {
+						bestError = error;
+						bestR0 = r0;
+						bestR1 = r1;
+						memcpy(indices, candidate, 16);
+					}
+				}
+			}
+			// the 6 value mode pays off when the block hits 0 or 255 and the rest sits in between
+			if ((minValue == 0.0f || maxValue == 255.0f) && innerMin <= innerMax) {
+				int r0 = (int)(innerMin + 0.5f), r1 = (int)(innerMax + 0.5f);
+				float error = BC4Candidate(block, r0, r1, candidate);
+				if (error < bestError) {
+					bestError = error;
+					bestR0 = r0;
+					bestR1 = r1;
+					memcpy(indices, candidate, 16);
+				}
+			}
+		}
+
+		out[0] = (uint8_t)bestR0;
+		out[1] = (uint8_t)bestR1;
+		uint64_t bits = 0;
+		for (int i = 0; i < 16; i++)
+			bits |= (uint64_t)indices[i] << (3 * i);
+		for (int i = 0; i < 6; i++)
+			out[2 + i] = (uint8_t)(bits >> (8 * i));
+	}
+
+	// moves channel into channel 0 so the BC4 encoder can work on it
+	inline void SelectChannel(const Block& block, int channel, Block& single) {
+		memcpy(single.c[0], block.c[channel], sizeof(single.c[0]));
+	}
+
+	inline void EncodeBC3Block(const Block& block, uint8_t* out) {
+		Block alpha;
+		SelectChannel(block, 3, alpha);
+		EncodeBC4Block(alpha, out);
+		EncodeBC1Block(block, out + 8);
+	}
+
+	inline void EncodeBC5Block(const Block& block, uint8_t* out) {
+		Block channel;
+		SelectChannel(block, 0, channel);
+		EncodeBC4Block(channel, out);
+		SelectChannel(block, 1, channel);
+		EncodeBC4Block(channel, out + 8);
+	}
+
+	// ---- BC7 mode 6 ----
+
+	const int BC7_WEIGHTS4[16] = { 0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64 };
+
+	// the endpoints as stored: 7 bits per channel plus one p-bit shared by the whole endpoint
+	struct BC7Endpoints {
+		int q[2][4];
+		int p[2];
+	};
+
+	inline void BC7Palette(const BC7Endpoints& e, float palette[16][4]) {
+		for (int k = 0; k < 4; k++) {
+			int a = (e.q[0][k] << 1) | e.p[0];
+			int b = (e.q[1][k] << 1) | e.p[1];
+			for (int i = 0; i < 16; i++)
+				palette[i][k] = (float)(((64 - BC7_WEIGHTS4[i]) * a + BC7_WEIGHTS4[i] * b + 32) >> 6);
+		}
+	}
+
+	inline int QuantizeBC7(float value, int pBit) {
+		int q = (int)floorf((value - pBit) * 0.5f + 0.5f);
+		return std::min(127, std::max(0, q));
+	}
+
+	// tries all four p-bit combinations for the given float endpoints and keeps the best
+	inline float BC7Candidate(const Block& block, const float low[4], const float high[4], BC7Endpoints& best,
+		uint8_t* indices) {
+		float bestError = 3.0e38f;
+		uint8_t candidate[16];
+		for (int pBits = 0; pBits < 4; pBits++) {
+			BC7Endpoints e;
+			e.p[0] = pBits & 1;
+			e.p[1] = pBits >> 1;
+			for (int k = 0; k < 4; k++) {
+				e.q[0][k] = QuantizeBC7(low[k], e.p[0]);
+				e.q[1][k] = QuantizeBC7(high[k], e.p[1]);
+			}
+			float palette[16][4];
+			BC7Palette(e, palette);
+			float error = FitPalette(block, 4, palette, 16, candidate);
+			if (error < bestError) {
+				bestError = error;
+				best = e;
+				memcpy(indices, candidate, 16);
+			}
+		}
+		return bestError;
+	}
+
+	// writes count bits of value at bit position pos of a 128 bit little endian block
+	inline void PutBits(uint8_t* out, int& pos, uint32_t value, int count) {
+		for (int i = 0; i < count; i++, pos++)
+			out[pos >> 3] |= (uint8_t)(((value >> i) & 1) << (pos & 7));
+	}
+
+	// mode 6 into out, returns the squared error
+	inline float EncodeBC7Mode6(const Block& block, uint8_t* out) {
+		float low[4], high[4];
+		AxisEndpoints(block, 4, low, high);
+
+		BC7Endpoints endpoints;
+		uint8_t indices[16];
+		float error = BC7Candidate(block, low, high, endpoints, indices);
+
+		float weights[16];
+		for (int i = 0; i < 16; i++)
+			weights[i] = BC7_WEIGHTS4[i] / 64.0f;
+		for (int iteration = 0; iteration < 2 && error > 0.0f; iteration++) {
+			if (!RefitEndpoints(block, 4, indices, weights, low, high))
+				break;
+			BC7Endpoints candidate;
+			uint8_t candidateIndices[16];
+			float candidateError = BC7Candidate(block, low, high, candidate, candidateIndices);
+			if (candidateError >= error)
+				break;
+			error = candidateError;
+			endpoints = candidate;
+			memcpy(indices, candidateIndices, 16);
+		}
+
+		// the first index is stored with 3 bits, so its top bit has to be 0. Swapping the endpoints
+		// mirrors the indices and gives the same palette
+		if (indices[0] >= 8) {
+			for (int k = 0; k < 4; k++)
+				std::swap(endpoints.q[0][k], endpoints.q[1][k]);
+			std::swap(endpoints.p[0], endpoints.p[1]);
+			for (int i = 0; i < 16; i++)
+				indices[i] = (uint8_t)(15 - indices[i]);
+		}
+
+		memset(out, 0, 16);
+		int pos = 0;
+		PutBits(out, pos, 1 << 6, 7); // mode 6 is six 0 bits and then a 1
+		for (int k = 0; k < 4; k++) {
+			PutBits(out, pos, endpoints.q[0][k], 7);
+			PutBits(out, pos, endpoints.q[1][k], 7);
+		}
+		PutBits(out, pos, endpoints.p[0], 1);
+		PutBits(out, pos, endpoints.p[1], 1);
+		PutBits(out, pos, indices[0], 3);
+		for (int i = 1; i < 16; i++)
+			PutBits(out, pos, indices[i], 4);
+		return error;
+	}
+
+	// ---- BC7 mode 5, colour and alpha with their own endpoints and indices ----
+
+	const int BC7_WEIGHTS2[4] = { 0, 21, 43, 64 };
+
+	struct BC7Mode5Endpoints {
+		int color[2][3]; // 7 bits
+		int alpha[2]; // 8 bits
+	};
+
+	inline int Expand7(int q) {
+		return (q << 1) | (q >> 6);
+	}
+
+	inline void BC7Mode5ColorPalette(const BC7Mode5Endpoints& e, float palette[4][4]) {
+		for (int k = 0; k < 3; k++) {
+			int a = Expand7(e.color[0][k]), b = Expand7(e.color[1][k]);
+			for (int i = 0; i < 4; i++)
+				palette[i][k] = (float)(((64 - BC7_WEIGHTS2[i]) * a + BC7_WEIGHTS2[i] * b + 32) >> 6);
+		}
+	}
+
+	inline void BC7Mode5AlphaPalette(int a, int b, float palette[4][4]) {
+		for (int i = 0; i < 4; i++)
+			palette[i][0] = (float)(((64 - BC7_WEIGHTS2[i]) * a + BC7_WEIGHTS2[i] * b + 32) >> 6);
+	}
+
+	inline float BC7Mode5Color(const Block& block, const float low[4], const float high[4], BC7Mode5Endpoints& e,
+		uint8_t* indices) {
+		for (int k = 0; k < 3; k++) {
+			e.color[0][k] = std::min(127, (int)(low[k] * 127.0f / 255.0f + 0.5f));
+			e.color[1][k] = std::min(127, (int)(high[k] * 127.0f / 255.0f + 0.5f));
+		}
+		float palette[4][4];
+		BC7Mode5ColorPalette(e, palette);
+		return FitPalette(block, 3, palette, 4, indices);
+	}
+
+	// Used for blocks whose alpha doesn't follow the colour. Only rotation 0 (alpha in alpha) is tried
+	inline float EncodeBC7Mode5(const Block& block, uint8_t* out) {
+		BC7Mode5Endpoints endpoints;
+		uint8_t colorIndices[16], alphaIndices[16];
+
+		float low[4], high[4];
+		AxisEndpoints(block, 3, low, high);
+		float colorError = BC7Mode5Color(block, low, high, endpoints, colorIndices);
+		float weights[4];
+		for (int i = 0; i < 4; i++)
+			weights[i] = BC7_WEIGHTS2[i] / 64.0f;
+		if (colorError > 0.0f && RefitEndpoints(block, 3, colorIndices, weights, low, high)) {
+			BC7Mode5Endpoints candidate;
+			uint8_t candidateIndices[16];
+			float candidateError = BC7Mode5Color(block, low, high, candidate, candidateIndices);
+			if (candidateError < colorError) {
+				colorError = candidateError;
+				memcpy(endpoints.color, candidate.color, sizeof(endpoints.color));
+				memcpy(colorIndices, candidateIndices, 16);
+			}
+		}
+
+		// alpha endpoints are 8 bit, search a little inside the range like BC4 does
+		Block alpha;
+		SelectChannel(block, 3, alpha);
+		float minAlpha = 255.0f, maxAlpha = 0.0f;
+		for (int i = 0; i < 16; i++) {
+			minAlpha = std::min(minAlpha, alpha.c[0][i]);
+			maxAlpha = std::max(maxAlpha, alpha.c[0][i]);
+		}
+		float alphaError = 3.0e38f;
+		uint8_t candidate[16];
+		for (int dh = 0; dh < 3; dh++) {
+			for (int dl = 0; dl < 3; dl++) {
+				int a = (int)minAlpha + dl, b = (int)maxAlpha - dh;
+				if (b < a)
+					continue;
+				float palette[4][4];
+				BC7Mode5AlphaPalette(a, b, palette);
+				float error = FitPalette(alpha, 1, palette, 4, candidate);
+				if (error < alphaError) {
+					alphaError = error;
+					endpoints.alpha[0] = a;
+					endpoints.alpha[1] = b;
+					memcpy(alphaIndices, candidate, 16);
+				}
+			}
+		}
+
+		// both anchor indices have an implicit 0 top bit
+		if (colorIndices[0] >= 2) {
+			for (int k = 0; k < 3; k++)
+				std::swap(endpoints.color[0][k], endpoints.color[1][k]);
+			for (int i = 0; i < 16; i++)
+				colorIndices[i] = (uint8_t)(3 - colorIndices[i]);
+		}
+		if (alphaIndices[0] >= 2) {
+			std::swap(endpoints.alpha[0], endpoints.alpha[1]);
+			for (int i = 0; i < 16; i++)
+				alphaIndices[i] = (uint8_t)(3 - alphaIndices[i]);
+		}
+
+		memset(out, 0, 16);
+		int pos = 0;
+		PutBits(out, pos, 1 << 5, 6); // mode 5
+		PutBits(out, pos, 0, 2); // rotation
+		for (int k = 0; k < 3; k++) {
+			PutBits(out, pos, endpoints.color[0][k], 7);
+			PutBits(out, pos, endpoints.color[1][k], 7);
+		}
+		PutBits(out, pos, endpoints.alpha[0], 8);
+		PutBits(out, pos, endpoints.alpha[1], 8);
+		for (int i = 0; i < 16; i++)
+			PutBits(out, pos, colorIndices[i], i == 0 ? 1 : 2);
+		for (int i = 0; i < 16; i++)
+			PutBits(out, pos, alphaIndices[i], i == 0 ? 1 : 2);
+		return colorError + alphaError;
+	}
+
+	inline void EncodeBC7Block(const Block& block, uint8_t* out) {
+		float error = EncodeBC7Mode6(block, out);
+		bool opaque = true;
+		for (int i = 0; i < 16; i++)
+			opaque = opaque && block.c[3][i] == 255.0f;
+		if (opaque || error == 0.0f)
+			return;
+
+		uint8_t mode5[16];
+		if (EncodeBC7Mode5(block, mode5) < error)
+			memcpy(out, mode5, 16);
+	}
+
+	inline void EncodeBlock(DDSFormat format, const Block& block, uint8_t* out) {
+		switch (format) {
+		case DDS_BC1: EncodeBC1Block(block, out); break;
+		case DDS_BC3: EncodeBC3Block(block, out); break;
+		case DDS_BC4: EncodeBC4Block(block, out); break;
+		case DDS_BC5: EncodeBC5Block(block, out); break;
+		case DDS_BC7: EncodeBC7Block(block, out); break;
+		default: break;
+		}
+	}
+}
+
+// compresses an RGBA8 image, any size, into format. BC4 keeps red, BC5 red and green.
+// With a pool the rows of blocks are spread over its threads
+inline std::vector<unsigned char> EncodeBC(DDSFormat format, const unsigned char* rgba, int width, int height,
+	ThreadPool* pool = nullptr) {
+	int blocksX = (width + 3) / 4, blocksY = (height + 3) / 4;
+	int blockBytes = DDSBlockBytes(format);
+	std::vector<unsigned char> out((size_t)blocksX * blocksY * blockBytes);
+
+	auto encodeRows = [&](size_t begin, size_t end) {
+		bc_detail::Block block;
+		for (size_t by = begin; by < end; by++) {
+			for (int bx = 0; bx < blocksX; bx++) {
+				bc_detail::LoadBlock(rgba, width, height, bx, (int)by, block);
+				bc_detail::EncodeBlock(format, block, &out[(by * blocksX + bx) * blockBytes]);
+			}
+		}
+	};
+
+	if (pool)
+		pool->ParallelFor(blocksY, encodeRows);
+	else
+		encodeRows(0, blocksY);
+	return out;
+}
+
+#endif
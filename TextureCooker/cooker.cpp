@@ -0,0 +1,683 @@
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <map>
+
+#include "dds.h"
+#include "virtual_texture_file.h"
+#include "virtual_texture_pages.h"
+#include "texture_streaming.h"
+#include "thread_pool.h"
+#include "mip_generator.h"
+#include "bc_encoder.h"
+#include "bc_decoder.h"
+
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb_image.h"
+
+using namespace std;
+
+// Offline texture cooker: decodes an image with stb_image, builds its mip chain on the CPU, block
+// compresses every level and writes them to a DDS file the engine's TextureManager loads as is.
+// With --virtual the levels are cut into pages instead and written as a .vt file for VirtualTexture.
+//
+//     TextureCooker <input> <output.dds> [options]
+//     TextureCooker <input> <output.vt> --virtual [options]
+//     TextureCooker <input> --report [options]
+//     TextureCooker --bench-decode <images...>
+//     TextureCooker --self-test
+//
+//     --format bc1|bc3|bc4|bc5|bc7|rgba8   default bc7
+//     --srgb       mark the texture as sRGB colour data
+//     --no-mips    only the full size level
+//     --mip-filter box|triangle|kaiser|lanczos   default kaiser
+//     --linear     the texture holds data, not sRGB colour: filter mips without decoding to linear light.
+//                  BC4 and BC5 are always treated like this
+//     --clamp      the texture doesn't tile, mip filtering clamps at the edges instead of wrapping
+//     --no-flip    keep the image's row order, by default rows are flipped for OpenGL like the engine does
+//     --threads N  worker threads, 0 (default) is one per hardware thread
+//     --report     print PSNR and throughput. Without an output file every format is measured
+//     --bench-mips time mip generation for every filter and SIMD path, in MPixels/s per core
+//     --virtual    write a tiled virtual texture, always with mips
+//     --tile-size N  texels per page side of a virtual texture, default 128
+//     --bench-decode time stb_image on every image given, plain and fast PNG paths, in MB/s of decoded pixels
+//     --self-test  check decoding into the caller's buffer, the .vt files, the virtual texture page
+//                  manager and the streamed mip level choice without a GL context, the exit code is 1
+//                  if anything is wrong
+
+struct CookOptions {
+	string input, output;
+	DDSFormat format = DDS_BC7;
+	bool formatGiven = false;
+	bool srgb = false;
+	bool mips = true;
+	MipFilter mipFilter = MIP_FILTER_KAISER;
+	bool linear = false;
+	bool clamp = false;
+	bool benchMips = false;
+	bool benchDecode = false;
+	bool selfTest = false;
+	vector<string> paths; // as given: input and output, or the images of --bench-decode
+	bool flip = true;
+	bool report = false;
+	bool virtualTexture = false;
+	int tileSize = 128;
+	unsigned int threads = 0;
+};
+
+// texels repeated around every page of a virtual texture, enough for bilinear and a little anisotropy
+static const int VIRTUAL_TILE_BORDER = 4;
+
+static const char* formatName(DDSFormat format) {
+	switch (format) {
+	case DDS_RGBA8: return "rgba8";
+	case DDS_BC1: return "bc1";
+	case DDS_BC3: return "bc3";
+	case DDS_BC4: return "bc4";
+	case DDS_BC5: return "bc5";
+	case DDS_BC7: return "bc7";
+	default: return "unknown";
+	}
+}
+
+static DDSFormat parseFormat(const string& name) {
+	const DDSFormat formats[] = { DDS_RGBA8, DDS_BC1, DDS_BC3, DDS_BC4, DDS_BC5, DDS_BC7 };
+	for (DDSFormat format : formats)
+		if (name == formatName(format))
+			return format;
+	return DDS_UNKNOWN;
+}
+
+// channels a format keeps, for the PSNR
+static int channelMask(DDSFormat format) {
+	switch (format) {
+	case DDS_BC1: return 0x7;
+	case DDS_BC4: return 0x1;
+	case DDS_BC5: return 0x3;
+	default: return 0xf;
+	}
+}
+
+static double elapsedMs(chrono::high_resolution_clock::time_point start) {
+	return chrono::duration<double, milli>(chrono::high_resolution_clock::now() - start).count();
+}
+
+static const char* filterName(MipFilter filter) {
+	switch (filter) {
+	case MIP_FILTER_BOX: return "box";
+	case MIP_FILTER_LANCZOS: return "lanczos";
+	case MIP_FILTER_TRIANGLE: return "triangle";
+	default: return "kaiser";
+	}
+}
+
+static const char* simdName(MipSimd simd) {
+	switch (simd) {
+	case MIP_SIMD_SCALAR: return "scalar";
+	case MIP_SIMD_SSE: return "sse";
+	case MIP_SIMD_AVX2: return "avx2";
+	default: return "auto";
+	}
+}
+
+static MipSettings mipSettings(const CookOptions& options) {
+	MipSettings settings;
+	settings.filter = options.mipFilter;
+	settings.srgb = !options.linear && options.format != DDS_BC4 && options.format != DDS_BC5;
+	settings.wrap = !options.clamp;
+	return settings;
+}
+
+static vector<MipLevel> buildMipChain(const MipLevel& base, const CookOptions& options, ThreadPool* pool) {
+	if (!options.mips)
+		return vector<MipLevel>(1, base);
+	return GenerateMips(base.pixels.data(), base.width, base.height, 4, mipSettings(options), pool);
+}
+
+// times every filter on every SIMD path. The single thread runs give the per core rate
+static void benchMips(const MipLevel& base, const CookOptions& options, ThreadPool* pool) {
+	const MipFilter filters[] = { MIP_FILTER_BOX, MIP_FILTER_TRIANGLE, MIP_FILTER_KAISER, MIP_FILTER_LANCZOS };
+	const MipSimd paths[] = { MIP_SIMD_SCALAR, MIP_SIMD_SSE, MIP_SIMD_AVX2 };
+	unsigned int threads = pool ? pool->Size() + 1 : 1;
+
+	for (MipFilter filter : filters) {
+		for (MipSimd simd : paths) {
+			MipSettings settings = mipSettings(options);
+			settings.filter = filter;
+			settings.simd = simd;
+			if (mip_detail::ResolveSimd(simd) != simd)
+				continue;
+
+			// best of a few runs, the first one also pays for page faults
+			double single = 1e30, all = 1e30;
+			for (int run = 0; run < 3; run++) {
+				auto start = chrono::high_resolution_clock::now();
+				GenerateMips(base.pixels.data(), base.width, base.height, 4, settings);
+				single = min(single, elapsedMs(start));
+				if (pool) {
+					start = chrono::high_resolution_clock::now();
+					GenerateMips(base.pixels.data(), base.width, base.height, 4, settings, pool);
+					all = min(all, elapsedMs(start));
+				}
+			}
+
+			double megapixels = (double)base.width * base.height / 1e6;
+			cout << setw(8) << filterName(filter) << setw(8) << simdName(simd)
+				<< fixed << setprecision(1) << "  1 thread " << setw(7) << single << " ms " << setw(7)
+				<< megapixels / (single / 1000.0) << " MPixels/s";
+			if (pool)
+				cout << "   " << threads << " threads " << setw(7) << all << " ms " << setw(7)
+					<< megapixels / (all / 1000.0) / threads << " MPixels/s per core";
+			cout << endl;
+		}
+	}
+}
+
+// decodes every image with the plain and the fast PNG paths of stb_image, other formats take the
+// same path both times. Best of a few runs from memory, so the disk isn't part of it
+static void benchDecode(const vector<string>& inputs) {
+	double totalMegabytes = 0.0, totalPlain = 0.0, totalFast = 0.0;
+	for (const string& input : inputs) {
+		vector<unsigned char> file = ReadFileBytes(input);
+		int width = 0, height = 0, channels = 0;
+		double best[2] = { 1e30, 1e30 };
+		bool ok = !file.empty();
+		for (int fast = 0; fast < 2 && ok; fast++) {
+			stbi_set_png_fast_decode(fast);
+			for (int run = 0; run < 3 && ok; run++) {
+				auto start = chrono::high_resolution_clock::now();
+				unsigned char* pixels = stbi_load_from_memory(file.data(), (int)file.size(), &width, &height, &channels, 0);
+				best[fast] = min(best[fast], elapsedMs(start));
+				ok = pixels != nullptr;
+				stbi_image_free(pixels);
+			}
+		}
+		stbi_set_png_fast_decode(1);
+		if (!ok) {
+			cout << "Failed to load " << input << ": " << (file.empty() ? "can't read the file" : stbi_failure_reason()) << endl;
+			continue;
+		}
+
+		double megabytes = (double)width * height * channels / 1e6;
+		totalMegabytes += megabytes;
+		totalPlain += best[0];
+		totalFast += best[1];
+		cout << input << ": " << width << "x" << height << "x" << channels
+			<< fixed << setprecision(1) << "  plain " << setw(7) << best[0] << " ms " << setw(7) << megabytes / (best[0] / 1000.0) << " MB/s"
+			<< "  fast " << setw(7) << best[1] << " ms " << setw(7) << megabytes / (best[1] / 1000.0) << " MB/s"
+			<< setprecision(2) << "  " << best[0] / best[1] << "x" << endl;
+	}
+	if (totalFast > 0.0)
+		cout << "all: " << fixed << setprecision(1) << totalMegabytes << " MB  plain " << totalMegabytes / (totalPlain / 1000.0)
+			<< " MB/s  fast " << totalMegabytes / (totalFast / 1000.0) << " MB/s  " << setprecision(2) << totalPlain / totalFast << "x" << endl;
+}
+
+static vector<unsigned char> encodeLevel(DDSFormat format, const MipLevel& level, ThreadPool* pool) {
+	if (format == DDS_RGBA8)
+		return level.pixels;
+	return EncodeBC(format, level.pixels.data(), level.width, level.height, pool);
+}
+
+// encodes the whole chain in memory and prints quality and speed for format
+static void reportFormat(DDSFormat format, const vector<MipLevel>& chain, ThreadPool* pool) {
+	size_t pixels = 0, sourceBytes = 0, encodedBytes = 0;
+	vector<vector<unsigned char>> levels;
+	auto start = chrono::high_resolution_clock::now();
+	for (const MipLevel& level : chain) {
+		levels.push_back(encodeLevel(format, level, pool));
+		pixels += (size_t)level.width * level.height;
+		sourceBytes += level.pixels.size();
+		encodedBytes += levels.back().size();
+	}
+	double ms = elapsedMs(start);
+
+	const MipLevel& base = chain[0];
+	double psnr = 99.0;
+	if (format != DDS_RGBA8) {
+		vector<unsigned char> decoded = DecodeBC(format, levels[0].data(), base.width, base.height);
+		psnr = ComputePSNR(base.pixels.data(), decoded.data(), (size_t)base.width * base.height, channelMask(format));
+	}
+
+	cout << setw(6) << formatName(format)
+		<< "  psnr " << fixed << setprecision(2) << setw(6) << psnr << " dB"
+		<< "  " << setprecision(1) << setw(8) << ms << " ms"
+		<< "  " << setw(7) << (ms > 0.0 ? pixels / (ms * 1000.0) : 0.0) << " MPixels/s"
+		<< "  " << setw(8) << encodedBytes / 1024 << " KB"
+		<< "  " << setprecision(1) << (double)sourceBytes / encodedBytes << ":1" << endl;
+}
+
+// lets stb_image decode the restart intervals of a JPEG on the pool
+static void jpegParallelFor(void* user, int count, void (*body)(void* context, int index), void* context) {
+	static_cast<ThreadPool*>(user)->ParallelFor((size_t)count, [body, context](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; i++)
+			body(context, (int)i);
+	});
+}
+
+// prints what failed, the self test goes on with the other checks
+static bool check(bool condition, const char* what) {
+	if (!condition)
+		cout << "  FAILED: " << what << endl;
+	return condition;
+}
+
+// a 13x6 CMYK JPEG with an Adobe marker, made with Pillow
+static const unsigned char CMYK_JPEG[] = {
+	0xff, 0xd8, 0xff, 0xee, 0x00, 0x0e, 0x41, 0x64, 0x6f, 0x62, 0x65, 0x00, 0x64, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0xdb, 0x00, 0x43, 0x00, 0x02,
+	0x01, 0x01, 0x01, 0x01, 0x01, 0x02, 0x01, 0x01, 0x01, 0x02, 0x02, 0x02, 0x02, 0x02, 0x04, 0x03, 0x02, 0x02, 0x02, 0x02, 0x05, 0x04, 0x04, 0x03,
+	0x04, 0x06, 0x05, 0x06, 0x06, 0x06, 0x05, 0x06, 0x06, 0x06, 0x07, 0x09, 0x08, 0x06, 0x07, 0x09, 0x07, 0x06, 0x06, 0x08, 0x0b, 0x08, 0x09, 0x0a,
+	0x0a, 0x0a, 0x0a, 0x0a, 0x06, 0x08, 0x0b, 0x0c, 0x0b, 0x0a, 0x0c, 0x09, 0x0a, 0x0a, 0x0a, 0xff, 0xc0, 0x00, 0x14, 0x08, 0x00, 0x06, 0x00, 0x0d,
+	0x04, 0x43, 0x11, 0x00, 0x4d, 0x11, 0x00, 0x59, 0x11, 0x00, 0x4b, 0x11, 0x00, 0xff, 0xc4, 0x00, 0x1f, 0x00, 0x00, 0x01, 0x05, 0x01, 0x01, 0x01,
+	0x01, 0x01, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0xff, 0xc4,
+	0x00, 0xb5, 0x10, 0x00, 0x02, 0x01, 0x03, 0x03, 0x02, 0x04, 0x03, 0x05, 0x05, 0x04, 0x04, 0x00, 0x00, 0x01, 0x7d, 0x01, 0x02, 0x03, 0x00, 0x04,
+	0x11, 0x05, 0x12, 0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07, 0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xa1, 0x08, 0x23, 0x42, 0xb1, 0xc1, 0x15,
+	0x52, 0xd1, 0xf0, 0x24, 0x33, 0x62, 0x72, 0x82, 0x09, 0x0a, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x25, 0x26, 0x27, 0x28, 0x29, 0x2a, 0x34, 0x35, 0x36,
+	0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66,
+	0x67, 0x68, 0x69, 0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95,
+	0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2,
+	0xc3, 0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe1, 0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7,
+	0xe8, 0xe9, 0xea, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8, 0xf9, 0xfa, 0xff, 0xda, 0x00, 0x0e, 0x04, 0x43, 0x00, 0x4d, 0x00, 0x59, 0x00,
+	0x4b, 0x00, 0x00, 0x3f, 0x00, 0xfb, 0xcb, 0xfe, 0x0a, 0xb5, 0xff, 0x00, 0x31, 0x2f, 0xf8, 0x1d, 0x58, 0xff, 0x00, 0x88, 0x8e, 0xfe, 0x3f, 0x7f,
+	0xcf, 0x0d, 0x53, 0xff, 0x00, 0x02, 0x17, 0xff, 0x00, 0x8a, 0xaf, 0xaf, 0xbf, 0x6d, 0xbf, 0xda, 0xaf, 0xc4, 0xdf, 0xe9, 0x7f, 0x2c, 0xdf, 0xc5,
+	0xfc, 0x43, 0xfc, 0x6b, 0xf4, 0xfb, 0xe2, 0xdf, 0xfc, 0xb5, 0xfc, 0x6b, 0xf9, 0xd8, 0xfd, 0xb4, 0x3f, 0xe4, 0xaa, 0xbf, 0xfc, 0x0f, 0xf9, 0x8a,
+	0x3f, 0xe2, 0x23, 0xbf, 0x8f, 0xdf, 0xf3, 0xc3, 0x54, 0xff, 0x00, 0xc0, 0x85, 0xff, 0x00, 0xe2, 0xab, 0xf2, 0x8f, 0xf6, 0x83, 0xfd, 0xaa, 0xfc,
+	0x4d, 0xff, 0x00, 0x09, 0xb3, 0x7c, 0xb3, 0x7f, 0x17, 0xf1, 0x0f, 0x51, 0xef, 0x5f, 0x37, 0x78, 0xdf, 0xfe, 0x42, 0xc7, 0xf1, 0xaf, 0xff, 0xd9,
+};
+
+// decodes straight into a buffer of exactly the image's size for every channel count and checks
+// nothing is written past it and the pixels match a plain decode
+static bool selfTestDecode() {
+	bool ok = true;
+	const int GUARD = 16;
+	for (int channels = 1; channels <= 4; channels++) {
+		int width, height, fileChannels;
+		if (!check(stbi_info_from_memory(CMYK_JPEG, (int)sizeof(CMYK_JPEG), &width, &height, &fileChannels) != 0,
+			"read the size of the CMYK JPEG"))
+			return false;
+		size_t size = (size_t)width * height * channels;
+		vector<unsigned char> buffer(size + GUARD, 0xab);
+		unsigned char* direct = stbi_load_from_memory_into(CMYK_JPEG, (int)sizeof(CMYK_JPEG), buffer.data(), size,
+			&width, &height, &fileChannels, channels);
+		unsigned char* plain = stbi_load_from_memory(CMYK_JPEG, (int)sizeof(CMYK_JPEG), &width, &height, &fileChannels, channels);
+		bool decoded = check(direct == buffer.data() && plain, "decode the CMYK JPEG into the caller's buffer");
+		size_t overwritten = 0;
+		for (size_t i = size; i < buffer.size(); i++)
+			overwritten += buffer[i] != 0xab;
+		ok = decoded && check(overwritten == 0, "nothing is written past the caller's buffer")
+			&& check(memcmp(buffer.data(), plain, size) == 0, "the pixels match a plain decode") && ok;
+		cout << "  CMYK JPEG " << width << "x" << height << " into " << channels << " channels: "
+			<< overwritten << " bytes written past the buffer" << endl;
+		stbi_image_free(plain);
+	}
+	return ok;
+}
+
+// writes a small virtual texture in RGBA8 and BC1 and reads every tile back
+static bool selfTestVirtualTextureFile() {
+	const int TILE_SIZE = 32;
+	MipLevel base;
+	base.width = 150;
+	base.height = 70;
+	base.pixels.resize((size_t)base.width * base.height * 4);
+	for (int y = 0; y < base.height; y++)
+		for (int x = 0; x < base.width; x++) {
+			unsigned char* pixel = &base.pixels[((size_t)y * base.width + x) * 4];
+			pixel[0] = (unsigned char)(x * 255 / base.width);
+			pixel[1] = (unsigned char)(y * 255 / base.height);
+			pixel[2] = (unsigned char)((x / 8 + y / 8) % 2 * 255);
+			pixel[3] = 255;
+		}
+	MipSettings settings;
+	settings.filter = MIP_FILTER_BOX;
+	vector<MipLevel> chain = GenerateMips(base.pixels.data(), base.width, base.height, 4, settings);
+
+	bool ok = true;
+	const DDSFormat formats[] = { DDS_RGBA8, DDS_BC1 };
+	for (DDSFormat format : formats) {
+		TileEncoder encode = nullptr;
+		if (format != DDS_RGBA8)
+			encode = [format](const unsigned char* rgba, int width, int height) {
+				return EncodeBC(format, rgba, width, height);
+			};
+		const string path = "self_test.vt";
+		if (!check(WriteVirtualTexture(path, chain, TILE_SIZE, VIRTUAL_TILE_BORDER, format, true, encode), "write the .vt file"))
+			return false;
+
+		VirtualTextureFile file;
+		bool opened = check(file.Open(path), "open the .vt file");
+		VirtualTextureLayout expected(base.width, base.height, TILE_SIZE, VIRTUAL_TILE_BORDER);
+		opened = opened && check(file.layout.width == base.width && file.layout.height == base.height
+			&& file.layout.tileSize == TILE_SIZE && file.layout.border == VIRTUAL_TILE_BORDER
+			&& file.layout.levels == expected.levels && file.format == format && file.srgb, "header read back as written");
+
+		// every tile is what the layout says it should be, the levels past the chain repeat its last one
+		int padded = expected.PaddedSize();
+		vector<unsigned char> tile((size_t)padded * padded * 4), read;
+		size_t wrong = 0;
+		for (int level = 0; opened && level < expected.levels; level++)
+			for (int y = 0; y < expected.PagesY(level); y++)
+				for (int x = 0; x < expected.PagesX(level); x++) {
+					vt_detail::CutTile(chain[std::min(level, (int)chain.size() - 1)], expected, x, y, tile.data());
+					vector<unsigned char> stored = encode ? encode(tile.data(), padded, padded) : tile;
+					wrong += !file.ReadTile(level, x, y, read) || read != stored;
+				}
+		ok = opened && check(wrong == 0, "every tile reads back as written") && ok;
+		cout << "  .vt round trip " << formatName(format) << ": " << expected.levels << " levels, "
+			<< expected.TileCount() << " tiles, " << wrong << " wrong" << endl;
+		remove(path.c_str());
+	}
+	return ok;
+}
+
+// feeds the page manager made up feedback and checks what it requests, evicts and points the
+// indirection table at
+static bool selfTestVirtualPages() {
+	// 512x512 in pages of 128: 4x4 pages, 2x2, then the root
+	VirtualTextureLayout layout(512, 512, 128, VIRTUAL_TILE_BORDER);
+	PageID root = MakePageID(2, 0, 0);
+	bool ok = check(layout.levels == 3, "a 512x512 texture in 128 pages has 3 levels");
+	// page ids keep 12 bits for each page coordinate
+	VirtualTextureLayout widest(VT_MAX_PAGES_PER_SIDE * 128, 128, 128, VIRTUAL_TILE_BORDER);
+	VirtualTextureLayout tooWide(VT_MAX_PAGES_PER_SIDE * 128 + 1, 128, 128, VIRTUAL_TILE_BORDER);
+	ok = check(widest.Addressable() && !tooWide.Addressable(), "layouts with more pages per side than a page id holds are rejected") && ok;
+
+	// coarse levels first, then the pages more pixels asked for
+	{
+		VirtualPageManager pages(layout, 4, 4);
+		vector<PageID> feedback(100, INVALID_PAGE);
+		fill(feedback.begin(), feedback.begin() + 50, MakePageID(0, 0, 0));
+		fill(feedback.begin() + 50, feedback.begin() + 80, MakePageID(0, 3, 3));
+		fill(feedback.begin() + 80, feedback.begin() + 90, MakePageID(1, 1, 0));
+		pages.ProcessFeedback(feedback.data(), feedback.size());
+		vector<PageID> requests = pages.TakeRequests(16);
+		vector<PageID> expected = { root, MakePageID(1, 0, 0), MakePageID(1, 1, 1), MakePageID(1, 1, 0),
+			MakePageID(0, 0, 0), MakePageID(0, 3, 3) };
+		ok = check(requests == expected, "requests come coarsest level first, then by the pixels asking") && ok;
+		ok = check(pages.TakeRequests(16).empty(), "pages being loaded aren't requested again") && ok;
+	}
+
+	// four slots: the root and the pages used this frame stay, the least recently used other page goes
+	{
+		VirtualPageManager pages(layout, 2, 2);
+		map<PageID, int> slots;
+		auto load = [&](PageID page) {
+			pages.TakeRequests(16);
+			int slot = pages.CompleteLoad(page);
+			if (slot >= 0)
+				slots[page] = slot;
+			return slot;
+		};
+
+		PageID a = MakePageID(0, 0, 0), parentA = ParentPage(a);
+		pages.ProcessFeedback(&a, 1);
+		load(root);
+		load(parentA);
+		load(a);
+		PageID b = MakePageID(0, 3, 3), parentB = ParentPage(b);
+		pages.ProcessFeedback(&b, 1);
+		load(parentB);
+		// every slot is taken, a and its parent weren't used this frame
+		ok = check(load(b) >= 0, "a page used last frame makes room") && ok;
+		ok = check(pages.IsResident(root) && pages.IsResident(b) && pages.IsResident(parentB),
+			"the root and the pages used this frame stay resident") && ok;
+		ok = check(pages.IsResident(a) != pages.IsResident(parentA) && pages.stats.evicted == 1,
+			"exactly one of the pages from last frame is evicted") && ok;
+
+		// now everything but the root is in use, a new page has nowhere to go
+		PageID used[] = { b, pages.IsResident(a) ? a : parentA };
+		pages.ProcessFeedback(used, 2);
+		PageID c = MakePageID(0, 2, 0);
+		ok = check(load(c) < 0 && pages.stats.dropped == 1, "a load is dropped when every slot is in use") && ok;
+		ok = check(pages.IsResident(root) && pages.IsResident(used[0]) && pages.IsResident(used[1]),
+			"dropping a load evicts nothing") && ok;
+
+		// a page that isn't resident shows its closest resident ancestor
+		ok = check(pages.UpdateIndirection(), "the indirection table changed") && ok;
+		size_t wrong = 0;
+		for (int level = 0; level < layout.levels; level++)
+			for (int y = 0; y < layout.PagesY(level); y++)
+				for (int x = 0; x < layout.PagesX(level); x++) {
+					PageID page = MakePageID(level, x, y);
+					while (!pages.IsResident(page) && PageLevel(page) + 1 < layout.levels)
+						page = ParentPage(page);
+					uint32_t expected = 0;
+					if (pages.IsResident(page)) {
+						int slot = slots[page];
+						expected = (uint32_t)pages.SlotX(slot) | ((uint32_t)pages.SlotY(slot) << 8)
+							| ((uint32_t)PageLevel(page) << 16) | (0xffu << 24);
+					}
+					wrong += pages.IndirectionLevel(level)[(size_t)y * layout.PagesX(level) + x] != expected;
+				}
+		ok = check(wrong == 0, "every indirection entry points at the closest resident page") && ok;
+		ok = check(!pages.UpdateIndirection(), "the table isn't rebuilt when nothing changed") && ok;
+		cout << "  page manager: " << pages.stats.resident << " resident, " << pages.stats.evicted << " evicted, "
+			<< pages.stats.dropped << " dropped, " << wrong << " wrong indirection entries" << endl;
+	}
+	return ok;
+}
+
+// the level DesiredMipLevel() picks against levels worked out by hand
+static bool selfTestStreamingLevels() {
+	// 90 degrees and 512 pixels high: 256 / distance pixels per world unit. A 1024 texture at one UV unit
+	// per world unit has 1024 texels per unit, level n halves that, so level floor(log2(4 * distance))
+	StreamingView view;
+	view.position = vec3(0.0f);
+	view.fovY = radians(90.0f);
+	view.screenHeight = 512;
+	auto levelAt = [&view](float distance, float radius, int width, int height, float uvDensity) {
+		BoundingSphere sphere;
+		sphere.center = vec3(0.0f, 0.0f, -(distance + radius));
+		sphere.radius = radius;
+		// both sizes used have 11 levels
+		return DesiredMipLevel(width, height, 11, uvDensity, sphere, view);
+	};
+	bool ok = check(levelAt(0.25f, 1.0f, 1024, 1024, 1.0f) == 0, "one texel per pixel is level 0");
+	ok = check(levelAt(1.0f, 1.0f, 1024, 1024, 1.0f) == 2, "4 texels per pixel is level 2") && ok;
+	ok = check(levelAt(3.0f, 0.5f, 1024, 1024, 1.0f) == 3, "12 texels per pixel rounds down to level 3") && ok;
+	ok = check(levelAt(8.0f, 2.0f, 1024, 1024, 1.0f) == 5, "the distance is to the sphere, not its centre") && ok;
+	ok = check(levelAt(1.0f, 1.0f, 1024, 1024, 4.0f) == 4, "4 UV units per world unit need 2 levels more") && ok;
+	ok = check(levelAt(1.0f, 1.0f, 256, 1024, 1.0f) == 2, "the larger side counts") && ok;
+	ok = check(levelAt(1000.0f, 1.0f, 1024, 1024, 1.0f) == 10, "far away stops at the last level") && ok;
+	ok = check(levelAt(-0.5f, 1.0f, 1024, 1024, 1.0f) == 0, "inside the sphere needs the full size") && ok;
+	ok = check(levelAt(1.0f, 1.0f, 1024, 1024, 0.0f) == 10, "no UV density only needs the last level") && ok;
+	cout << "  mip level choice: " << (ok ? "9 of 9" : "not all 9") << " cases as worked out by hand" << endl;
+	return ok;
+}
+
+static bool selfTest() {
+	cout << "Decoding into the caller's buffer" << endl;
+	bool ok = selfTestDecode();
+	cout << "Virtual textures" << endl;
+	ok = selfTestVirtualTextureFile() && ok;
+	ok = selfTestVirtualPages() && ok;
+	cout << "Texture streaming" << endl;
+	ok = selfTestStreamingLevels() && ok;
+	cout << (ok ? "All checks passed" : "Some checks FAILED") << endl;
+	return ok;
+}
+
+static bool parseArguments(int argc, char** argv, CookOptions& options) {
+	for (int i = 1; i < argc; i++) {
+		string arg = argv[i];
+		if (arg == "--format" && i + 1 < argc) {
+			options.format = parseFormat(argv[++i]);
+			options.formatGiven = true;
+			if (options.format == DDS_UNKNOWN) {
+				cout << "Unknown format " << argv[i] << endl;
+				return false;
+			}
+		}
+		else if (arg == "--srgb")
+			options.srgb = true;
+		else if (arg == "--no-mips")
+			options.mips = false;
+		else if (arg == "--mip-filter" && i + 1 < argc) {
+			string filter = argv[++i];
+			if (filter == "box")
+				options.mipFilter = MIP_FILTER_BOX;
+			else if (filter == "triangle")
+				options.mipFilter = MIP_FILTER_TRIANGLE;
+			else if (filter == "kaiser")
+				options.mipFilter = MIP_FILTER_KAISER;
+			else if (filter == "lanczos")
+				options.mipFilter = MIP_FILTER_LANCZOS;
+			else {
+				cout << "Unknown mip filter " << filter << endl;
+				return false;
+			}
+		}
+		else if (arg == "--linear")
+			options.linear = true;
+		else if (arg == "--clamp")
+			options.clamp = true;
+		else if (arg == "--bench-mips")
+			options.benchMips = true;
+		else if (arg == "--bench-decode")
+			options.benchDecode = true;
+		else if (arg == "--self-test")
+			options.selfTest = true;
+		else if (arg == "--no-flip")
+			options.flip = false;
+		else if (arg == "--report")
+			options.report = true;
+		else if (arg == "--virtual")
+			options.virtualTexture = true;
+		else if (arg == "--tile-size" && i + 1 < argc) {
+			options.tileSize = atoi(argv[++i]);
+			// block compressed pages have to be whole blocks, border included
+			if (options.tileSize < 8 || options.tileSize % 4 != 0) {
+				cout << "Tile size has to be a multiple of 4, at least 8" << endl;
+				return false;
+			}
+		}
+		else if (arg == "--threads" && i + 1 < argc)
+			options.threads = (unsigned int)atoi(argv[++i]);
+		else if (arg.size() > 2 && arg.compare(0, 2, "--") == 0) {
+			cout << "Unknown option " << arg << endl;
+			return false;
+		}
+		else
+			options.paths.push_back(arg);
+	}
+	if (options.selfTest)
+		return options.paths.empty();
+	if (options.benchDecode)
+		return !options.paths.empty();
+	if (options.paths.size() > 2)
+		return false;
+	if (options.paths.size() > 0)
+		options.input = options.paths[0];
+	if (options.paths.size() > 1)
+		options.output = options.paths[1];
+	return !options.input.empty() && (!options.output.empty() || options.report || options.benchMips);
+}
+
+int main(int argc, char** argv) {
+	CookOptions options;
+	if (!parseArguments(argc, argv, options)) {
+		cout << "usage: TextureCooker <input> <output.dds> [--format bc1|bc3|bc4|bc5|bc7|rgba8] [--srgb] [--no-mips]"
+			<< " [--mip-filter box|triangle|kaiser|lanczos] [--linear] [--clamp] [--no-flip] [--threads N] [--report] [--bench-mips]"
+			<< " [--virtual] [--tile-size N]"
+			<< endl << "       TextureCooker --bench-decode <images...>"
+			<< endl << "       TextureCooker --self-test" << endl;
+		return 1;
+	}
+
+	if (options.selfTest)
+		return selfTest() ? 0 : 1;
+
+	// the pool's workers plus this thread share the blocks of every level, one thread needs no pool
+	unique_ptr<ThreadPool> workers;
+	if (options.threads != 1)
+		workers.reset(new ThreadPool(options.threads > 1 ? options.threads - 1 : 0));
+	ThreadPool* pool = workers.get();
+	if (pool)
+		stbi_set_jpeg_parallel_for(jpegParallelFor, pool);
+
+	if (options.benchDecode) {
+		benchDecode(options.paths);
+		return 0;
+	}
+
+	// decoded from memory, only then can stb_image split JPEGs with restart markers across threads
+	MipLevel base;
+	stbi_set_flip_vertically_on_load(options.flip);
+	vector<unsigned char> file = ReadFileBytes(options.input);
+	int channels;
+	unsigned char* pixels = file.empty() ? nullptr
+		: stbi_load_from_memory(file.data(), (int)file.size(), &base.width, &base.height, &channels, 4);
+	if (!pixels) {
+		cout << "Failed to load " << options.input << ": " << (file.empty() ? "can't read the file" : stbi_failure_reason()) << endl;
+		return 1;
+	}
+	base.pixels.assign(pixels, pixels + (size_t)base.width * base.height * 4);
+	stbi_image_free(pixels);
+
+	if (options.benchMips) {
+		cout << options.input << ": " << base.width << "x" << base.height << ", full mip chain" << endl;
+		benchMips(base, options, pool);
+		if (!options.report && options.output.empty())
+			return 0;
+	}
+
+	// every level of a virtual texture has its own pages
+	if (options.virtualTexture) {
+		VirtualTextureLayout layout(base.width, base.height, options.tileSize, VIRTUAL_TILE_BORDER);
+		if (!layout.Addressable()) {
+			cout << "A " << base.width << "x" << base.height << " virtual texture with " << options.tileSize << "x" << options.tileSize
+				<< " pages has more than " << VT_MAX_PAGES_PER_SIDE << " pages per side, use a bigger --tile-size" << endl;
+			return 1;
+		}
+		options.mips = true;
+	}
+	vector<MipLevel> chain = buildMipChain(base, options, pool);
+
+	if (options.report) {
+		cout << options.input << ": " << base.width << "x" << base.height << ", " << chain.size() << " levels, "
+			<< (pool ? pool->Size() + 1 : 1) << " threads" << endl;
+		if (options.output.empty() && !options.formatGiven) {
+			const DDSFormat formats[] = { DDS_BC1, DDS_BC3, DDS_BC4, DDS_BC5, DDS_BC7 };
+			for (DDSFormat format : formats)
+				reportFormat(format, chain, pool);
+			return 0;
+		}
+		reportFormat(options.format, chain, pool);
+		if (options.output.empty())
+			return 0;
+	}
+
+	// BC4 and BC5 hold data rather than colour, there's no sRGB variant of them
+	bool srgb = options.srgb && options.format != DDS_BC4 && options.format != DDS_BC5;
+
+	if (options.virtualTexture) {
+		VirtualTextureLayout layout(base.width, base.height, options.tileSize, VIRTUAL_TILE_BORDER);
+		TileEncoder encode = nullptr;
+		if (options.format != DDS_RGBA8)
+			encode = [&options, pool](const unsigned char* rgba, int width, int height) {
+				return EncodeBC(options.format, rgba, width, height, pool);
+			};
+		if (!WriteVirtualTexture(options.output, chain, options.tileSize, VIRTUAL_TILE_BORDER, options.format, srgb, encode)) {
+			cout << "Failed to write " << options.output << endl;
+			return 1;
+		}
+		cout << "Wrote " << options.output << " (" << formatName(options.format) << ", " << layout.levels << " levels, "
+			<< layout.TileCount() << " pages of " << options.tileSize << "x" << options.tileSize << ")" << endl;
+		return 0;
+	}
+
+	vector<vector<unsigned char>> levels;
+	for (const MipLevel& level : chain)
+		levels.push_back(encodeLevel(options.format, level, pool));
+
+	if (!WriteDDS(options.output, options.format, srgb, base.width, base.height, levels)) {
+		cout << "Failed to write " << options.output << endl;
+		return 1;
+	}
+	cout << "Wrote " << options.output << " (" << formatName(options.format) << ", " << levels.size() << " levels)" << endl;
+	return 0;
+}